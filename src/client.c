@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -9,39 +10,119 @@
 
 
 
-int accept_client(struct client *client, int sockfd, int flags) {
+int accept_conn(int sockfd, struct sockaddr *sa, int flags) {
     socklen_t len = sizeof(struct sockaddr);
-    memset(&client->sa, 0, len);
-    client->connfd = accept(sockfd, &client->sa, &len);
-
-    if (client->connfd == -1) {
-        printf("Unable to accept client, reason: %s\n", strerror(errno));
+    int connfd;
+
+    memset(sa, 0, len);
+#ifdef __linux__
+    connfd = accept4(sockfd, sa, &len, flags);
+#elif __APPLE__
+    connfd = accept(sockfd, sa, &len);
+#endif
+
+    if (connfd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            printf("Unable to accept client, reason: %s\n", strerror(errno));
+        }
         return -1;
     }
 
-    if (fcntl(client->connfd, F_SETFL, flags) == -1) {
+#ifdef __APPLE__
+    if (((flags & SOCK_NONBLOCK) &&
+                fcntl(connfd, F_SETFL, O_NONBLOCK) == -1) ||
+            ((flags & SOCK_CLOEXEC) &&
+                fcntl(connfd, F_SETFD, FD_CLOEXEC) == -1)) {
         printf("Unable to set file flags, reason: %s\n", strerror(errno));
+        close(connfd);
         return -1;
     }
+#endif
+
+    vprintf("Connected to client of type %hx, len %d\n", sa->sa_family, len);
+    return connfd;
+}
 
-    vprintf("Connected to client of type %hx, len %d\n",
-            client->sa.sa_family, len);
+void init_client(struct client *client, int connfd, const struct sockaddr *sa) {
+    client->connfd = connfd;
+    client->want = CLIENT_READ;
+    client->armed = 0;
+    client->pending_read = 0;
+    client->peer_counted = 0;
+    client->phase = CLIENT_PHASE_LINE;
+    client->events = 0;
+    client->n_pipelined = 0;
+    client->phase_bytes = 0;
+    memcpy(&client->sa, sa, sizeof(struct sockaddr));
 
     http_clear(&client->http);
-    dmsg_init(&client->log);
+    dmsg_init_buf(&client->log, client->log_first, sizeof(client->log_first));
+
+#ifdef __linux__
+    memset(&client->ur, 0, sizeof(client->ur));
+#endif
+}
+
+int accept_client(struct client *client, int sockfd, int flags) {
+    struct sockaddr sa;
+    int connfd = accept_conn(sockfd, &sa, flags);
+
+    if (connfd == -1) {
+        return -1;
+    }
+
+    init_client(client, connfd, &sa);
     return 0;
 }
 
+/*
+ * parses the requests which were pipelined behind the last one queued (or
+ * the one in client->http if none are), for as long as they have been
+ * received in full and there is room for them in the queue
+ */
+static void parse_pipelined(struct client *client) {
+    struct http *last, *next;
+    size_t remaining;
+
+    while (client->n_pipelined < CLIENT_PIPELINE_DEPTH &&
+            (remaining = dmsg_remaining(&client->log)) > 0) {
+        last = (client->n_pipelined == 0) ? &client->http :
+            &client->pipeline[client->n_pipelined - 1];
+        if (!http_keep_alive(last)) {
+            // the connection is closed after the last one, so nothing
+            // after it will be responded to
+            break;
+        }
+
+        next = &client->pipeline[client->n_pipelined];
+        http_clear(next);
+        if (http_parse(next, &client->log) == HTTP_NOT_DONE) {
+            // only part of the request has arrived, so it is left to be
+            // parsed from the start once it is the next to be responded to
+            http_close(next);
+            dmsg_seek(&client->log,
+                    -((ssize_t) (remaining - dmsg_remaining(&client->log))),
+                    SEEK_CUR);
+            break;
+        }
+        client->n_pipelined++;
+    }
+}
+
 /*
  * attempts to parse what has been read of the client's request. If the
- * request was fully read, then READ_COMPLETE is returned. Otherwise,
- * READ_INCOMPLETE or READ_ERR is returned
+ * request was fully read, then READ_COMPLETE is returned, after queueing any
+ * requests pipelined behind it. Otherwise, READ_INCOMPLETE or READ_ERR is
+ * returned
  */
 static int parse_request(struct client *client) {
     int ret = http_parse(&client->http, &client->log);
 
-    return (ret == HTTP_DONE || ret == HTTP_ERR) ? READ_COMPLETE :
-        READ_INCOMPLETE;
+    if (ret == HTTP_DONE || ret == HTTP_ERR) {
+        parse_pipelined(client);
+        return READ_COMPLETE;
+    }
+    return READ_INCOMPLETE;
 }
 
 int receive_bytes(struct client *client) {
@@ -56,7 +137,15 @@ int receive_bytes(struct client *client) {
     return parse_request(client);
 }
 
-#include <stdlib.h>
+int receive_buf(struct client *client, const void *buf, size_t len) {
+    if (len == 0) {
+        // the connection was closed by the peer
+        return READ_COMPLETE;
+    }
+
+    dmsg_append(&client->log, (void *) buf, len);
+    return parse_request(client);
+}
 
 int receive_bytes_n(struct client *client, size_t max) {
     ssize_t n_read = dmsg_read_n(&client->log, client->connfd, max);
@@ -71,14 +160,38 @@ int receive_bytes_n(struct client *client, size_t max) {
 }
 
 int send_bytes(struct client *client) {
-    int ret = http_respond(&client->http, client->connfd);
+    int ret = http_respond(&client->http, client->connfd,
+            client->n_pipelined > 0);
 
     return (ret == HTTP_ERR || ret == HTTP_CLOSE) ? CLIENT_CLOSE_CONNECTION :
         (ret == HTTP_KEEP_ALIVE) ? CLIENT_KEEP_ALIVE : WRITE_INCOMPLETE;
 }
 
+int next_request(struct client *client) {
+    if (client->n_pipelined == 0) {
+        // anything received after the last request is parsed as it would be
+        // had it only just been read
+        return parse_request(client);
+    }
+
+    client->http = client->pipeline[0];
+    client->n_pipelined--;
+    memmove(&client->pipeline[0], &client->pipeline[1],
+            client->n_pipelined * sizeof(struct http));
+    // make room for more, if any more were held back by the queue being full
+    parse_pipelined(client);
+    return READ_COMPLETE;
+}
+
 int close_client(struct client *client) {
     dmsg_free(&client->log);
+    http_close(&client->http);
+    for (unsigned i = 0; i < client->n_pipelined; i++) {
+        http_close(&client->pipeline[i]);
+    }
+#ifdef __linux__
+    free(client->ur.buf);
+#endif
     close(client->connfd);
     return 0;
 }
@@ -6,6 +6,7 @@
 
 #include "dmsg.h"
 #include "http.h"
+#include "twheel.h"
 
 
 #define READ_COMPLETE 1
@@ -16,33 +17,169 @@
 #define CLIENT_KEEP_ALIVE 5
 
 
+/* directions a client connection may be waiting on in its event loop */
+#define CLIENT_READ 0x1
+#define CLIENT_WRITE 0x2
+
+/* further events a client may have pending in loops shared by several
+ * threads, or with SERVER_WORK_STEALING */
+
+// the peer closed its end of the connection
+#define CLIENT_HANGUP 0x4
+// the client's timer was taken out of the wheel of its loop while another
+// thread was handling the client, which must then check its deadline and put
+// the timer back itself
+#define CLIENT_TIMER 0x8
+// a thread is handling the client, or has it queued to be handled
+#define CLIENT_BUSY 0x10
+
+
+/* phases of a connection, each of which has a deadline of its own */
+
+// waiting for the request line, either of the first request or of a request
+// of which some part has arrived
+#define CLIENT_PHASE_LINE 0
+// waiting for the rest of the headers of a request
+#define CLIENT_PHASE_HEADERS 1
+// receiving the body of a request
+#define CLIENT_PHASE_BODY 2
+// sending a response
+#define CLIENT_PHASE_SENDING 3
+// keep-alive connection waiting for its next request
+#define CLIENT_PHASE_IDLE 4
+
+#define CLIENT_N_PHASES 5
+
+
+// most requests of a connection which are parsed ahead of the one being
+// responded to, out of what has already been received. Any beyond this are
+// parsed once the queue has room again
+#define CLIENT_PIPELINE_DEPTH 8
+
+
+#ifndef SOCK_NONBLOCK
+// MacOS has no accept4, so these are emulated with fcntl by accept_conn
+#define SOCK_NONBLOCK 0x800
+#define SOCK_CLOEXEC 0x80000
+#endif
+
+
+// defined in server.h
+struct ev_loop;
+
 struct client {
-    // construct for doubly-linked list of clients
-    struct {
-        struct client *next, *prev;
-    };
+    // expiration timer of this client in the timing wheel of its loop
+    struct tw_node timer;
 
     struct http http;
+    // pipelined requests received in full behind the one in http, in the
+    // order in which they are to be responded to
+    struct http pipeline[CLIENT_PIPELINE_DEPTH];
+    // the event loop this client was accepted by, in which the client's
+    // connection fd is registered
+    struct ev_loop *loop;
 
     // file descriptor returned by accept syscall
     int connfd;
 
-    // the time after which this client connection is no longer guaranteed
-    // to be kept alive
-    struct timespec expires;
+    // the direction the client is waiting on, CLIENT_READ while receiving a
+    // request and CLIENT_WRITE while sending the response
+    unsigned char want;
+    // directions the connection is currently armed for in the event queue
+    // of its loop. One-shot registrations are disarmed each time they fire
+    unsigned char armed;
+    // set if the connection became readable while the response was still
+    // being sent, with edge-triggered registration only. The client must
+    // then read as soon as the response is done, as it will not be told again
+    unsigned char pending_read;
+    // set if the connection was counted against the per-address limits of
+    // the server, and so must be released from them once closed
+    unsigned char peer_counted;
+    // the CLIENT_PHASE_* the connection was in when its deadline was last
+    // updated
+    unsigned char phase;
+    // with SERVER_WORK_STEALING, the events which arrived for the client and
+    // have yet to be handled, as CLIENT_READ, CLIENT_WRITE, CLIENT_HANGUP and
+    // CLIENT_TIMER bits, along with CLIENT_BUSY while some thread owns the
+    // client. Whoever sets CLIENT_BUSY is the only thread which may touch
+    // the client until it is cleared
+    unsigned char events;
+    // number of requests in pipeline
+    unsigned char n_pipelined;
+
+    // the tick of its loop's clock after which this client connection is no
+    // longer guaranteed to be kept alive. This may be later than the time the
+    // timer is armed for, in which case the timer is pushed back when it goes
+    // off, so that renewing the timeout never needs to touch the wheel
+    uint64_t deadline;
+    // the tick at which the current phase began. A request line and the
+    // headers after it are timed from the same start, when the first byte of
+    // the request arrived (or the connection was accepted)
+    uint64_t phase_start;
+    // number of bytes received or sent in the current phase
+    unsigned long phase_bytes;
+
+    // next in the list of clients disconnected by threads which stole them
+    // from their loop, which only the thread of the loop may free
+    struct client *next_freed;
 
     // sockaddr struct associated with server
     struct sockaddr sa;
 
     // log of all data received from this client
     struct dmsg_list log;
+    // first node of the log, kept inline so that setting up a connection does
+    // not allocate anything beyond the client itself
+    char log_first[DEFAULT_DMSG_NODE_SIZE];
+
+#ifdef __linux__
+    // state of a client whose loop is driven by io_uring, unused with epoll
+    struct {
+        // the part of the response currently being sent, allocated with the
+        // first response to this client
+        char *buf;
+        // if not NULL, a whole response kept in memory by the file cache,
+        // which is sent in place of buf
+        const char *data;
+        // number of bytes in buf (or data), and how many of those have been
+        // sent
+        unsigned len, sent;
+        // number of operations submitted for this client which have not yet
+        // completed
+        unsigned short inflight;
+        // set once the client has been disconnected, after which it is freed
+        // when its last operation completes
+        unsigned short closing;
+        // set while the client waits on its loop's list of starved clients
+        // for a receive buffer, with next_starved the next on the list
+        unsigned short starved;
+        struct client *next_starved;
+    } ur;
+#endif
 };
 
 
 /*
- * attempts to connect to a client with the accept system call.
- * The flags argument passed to this function is forwarded to
- * fcntl (i.e. to allow fd to be set to nonblocking)
+ * accepts a connection on the listening socket sockfd, storing the address
+ * of the peer in sa. The flags argument may contain SOCK_NONBLOCK and
+ * SOCK_CLOEXEC, which are set on the new connection by the same syscall on
+ * Linux (with accept4)
+ *
+ * returns the connection fd on success, or -1 with errno set on failure. If
+ * there are no pending connections on a nonblocking socket, errno is set to
+ * EAGAIN and nothing is printed
+ */
+int accept_conn(int sockfd, struct sockaddr *sa, int flags);
+
+/*
+ * initializes the client struct for a connection just returned by
+ * accept_conn, so it is ready to receive data
+ */
+void init_client(struct client *client, int connfd, const struct sockaddr *sa);
+
+/*
+ * attempts to connect to a client with accept_conn, forwarding flags to it,
+ * and initializes the client struct for the connection
  *
  * upon successful connection, the client struct is fully initialized
  * and ready to receive data, and 0 is returned. On error, -1 is
@@ -63,6 +200,15 @@ int accept_client(struct client *client, int sockfd, int flags);
  */
 int receive_bytes(struct client *client);
 
+/*
+ * same as receive_bytes, except the data has already been read from the
+ * connection (for example by io_uring into a buffer of its own), and is
+ * copied into the client's dmsg_list
+ *
+ * returns the same status codes as receive_bytes
+ */
+int receive_buf(struct client *client, const void *buf, size_t len);
+
 /*
  * same as receive_data, except it only attempts to read up to max
  * bytes, stopping either when that limit is reached or EOF is reached
@@ -88,6 +234,45 @@ int receive_bytes_n(struct client *client, size_t max);
  */
 int send_bytes(struct client *client);
 
+/*
+ * moves on to the next request of a keep-alive connection once the response
+ * to the last one has been sent. Pipelined requests which were received
+ * along with earlier ones are taken in order, without waiting to hear from
+ * the socket again
+ *
+ * returns READ_COMPLETE if the next request has been received in full, so
+ * that it can be responded to, and READ_INCOMPLETE otherwise
+ */
+int next_request(struct client *client);
+
+/*
+ * gives the CLIENT_PHASE_* the connection is in, going by how far its
+ * current request has got
+ */
+static __inline int client_phase(struct client *client) {
+    switch (http_state(&client->http)) {
+    case REQUEST:
+        return (client->log.len > 0 && dmsg_remaining(&client->log) == 0) ?
+            CLIENT_PHASE_IDLE : CLIENT_PHASE_LINE;
+    case HEADERS:
+        return CLIENT_PHASE_HEADERS;
+    case BODY:
+        return CLIENT_PHASE_BODY;
+    default:
+        return CLIENT_PHASE_SENDING;
+    }
+}
+
+/*
+ * true if the client is a keep-alive connection sitting between requests:
+ * it has been served at least one request, and has neither sent any part of
+ * another nor has anything left to be sent to it
+ */
+static __inline int client_idle(struct client *client) {
+    return client->log.len > 0 && dmsg_remaining(&client->log) == 0 &&
+        client->n_pipelined == 0 && http_idle(&client->http);
+}
+
 /*
  * closes connection fd associated with this client and frees all memory
  * resources associated with it
@@ -28,14 +28,24 @@ int dmsg_init(dmsg_list *list) {
     return dmsg_init2(list, DEFAULT_DMSG_NODE_SIZE);
 }
 
-int dmsg_init2(dmsg_list *list, unsigned int init_node_size) {
-    int ret;
-
+/*
+ * checks that init_node_size is a valid size for the first node of a list
+ */
+static int dmsg_check_node_size(unsigned int init_node_size) {
     if (init_node_size == 0 || init_node_size & (init_node_size - 1)) {
         printf("Initial node size of dmsg list must be a power of 2, but "
                 "got %u\n", init_node_size);
         return DMSG_INIT_FAIL;
     }
+    return 0;
+}
+
+int dmsg_init2(dmsg_list *list, unsigned int init_node_size) {
+    int ret;
+
+    if ((ret = dmsg_check_node_size(init_node_size)) != 0) {
+        return ret;
+    }
 
     __builtin_memset(list, 0, offsetof(dmsg_list, _init_node_size));
     list->_init_node_size = init_node_size;
@@ -47,8 +57,26 @@ int dmsg_init2(dmsg_list *list, unsigned int init_node_size) {
     return 0;
 }
 
+int dmsg_init_buf(dmsg_list *list, void *buf, unsigned int init_node_size) {
+    int ret;
+
+    if ((ret = dmsg_check_node_size(init_node_size)) != 0) {
+        return ret;
+    }
+
+    __builtin_memset(list, 0, offsetof(dmsg_list, _init_node_size));
+    list->_init_node_size = init_node_size;
+    list->_user_first = 1;
+
+    list->list[0].msg = buf;
+    list->list[0].size = 0;
+    list->alloc_size = 1;
+    list->list_size = 1;
+    return 0;
+}
+
 void dmsg_free(dmsg_list *list) {
-    for (unsigned int i = 0; i < list->alloc_size; i++) {
+    for (unsigned int i = list->_user_first; i < list->alloc_size; i++) {
         free(list->list[i].msg);
     }
 }
@@ -424,6 +452,63 @@ size_t dmsg_getline(dmsg_list *list, char *buf, size_t bufsize) {
     return msg_len;
 }
 
+char* dmsg_peek(const dmsg_list *list, size_t *len) {
+    return dmsg_peek_at(list, 0, len);
+}
+
+char* dmsg_peek_at(const dmsg_list *list, size_t off, size_t *len) {
+    unsigned int idx, init_node_size = list->_init_node_size;
+    size_t node_start;
+
+    off += list->_offset;
+    if (off >= list->len) {
+        *len = 0;
+        return NULL;
+    }
+
+    idx = dmsg_offset_idx(init_node_size, off);
+    node_start = dmsg_size(init_node_size, idx);
+    *len = min(dmsg_size(init_node_size, idx + 1), list->len) - off;
+    return ((char*) list->list[idx].msg) + (off - node_start);
+}
+
+int dmsg_view_at(const dmsg_list *list, size_t off, size_t len,
+        dmsg_view *view) {
+    unsigned int init_node_size = list->_init_node_size;
+
+    off += list->_offset;
+    if (off + len > list->len) {
+        return DMSG_SEEK_OVERFLOW;
+    }
+
+    view->node = dmsg_offset_idx(init_node_size, off);
+    view->off = off - dmsg_size(init_node_size, view->node);
+    view->len = len;
+    return 0;
+}
+
+const char* dmsg_view_data(const dmsg_list *list, const dmsg_view *view,
+        char *buf) {
+    unsigned int idx = view->node;
+    size_t rem = dmsg_node_size(list->_init_node_size, idx) - view->off;
+    const char *msg = ((const char*) list->list[idx].msg) + view->off;
+    size_t copied, len;
+
+    if (view->len <= rem) {
+        // the common case, the whole view lies in one node
+        return msg;
+    }
+
+    // otherwise piece the view together from each of the nodes it spans
+    memcpy(buf, msg, rem);
+    for (copied = rem; copied < view->len; copied += len) {
+        idx++;
+        len = min(dmsg_node_size(list->_init_node_size, idx),
+                view->len - copied);
+        memcpy(buf + copied, list->list[idx].msg, len);
+    }
+    return buf;
+}
 
 void dmsg_consolidate(dmsg_list *list) {
     list->_cutoff_offset = list->_offset;
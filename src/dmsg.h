@@ -54,6 +54,23 @@ typedef union dmsg_node {
 
 typedef size_t dmsg_off_t;
 
+
+/*
+ * a run of bytes in a dmsg_list, given by the node its first byte lies in and
+ * where in that node, so that it can be looked at in place rather than copied
+ * out
+ */
+typedef struct dmsg_view {
+    // index of the node holding the first byte
+    unsigned short node;
+    // offset of the first byte in that node
+    size_t off;
+    // number of bytes, which run on into the following nodes if they do not
+    // all fit in the first
+    size_t len;
+} dmsg_view;
+
+
 /*
  * structure for storage of dynamically generated
  * variable-sized data streams, in which each node
@@ -88,6 +105,10 @@ typedef struct dmsg_list {
     // number of dmsg_nodes containing data/offset index
     unsigned short list_size;
 
+    // set if the buffer of the first dmsg_node was supplied by the user
+    // (with dmsg_init_buf), in which case it is not freed with the list
+    unsigned short _user_first;
+
     /* 
      * size of the first dmsg_node message,
      * each subsequent dmsg_node's size is
@@ -119,6 +140,16 @@ int dmsg_init(dmsg_list*);
  */
 int dmsg_init2(dmsg_list*, unsigned int init_node_size);
 
+/*
+ * initializes a dmsg_list whose first node is the given buffer of
+ * init_node_size bytes instead of a heap-allocated one, so that creating the
+ * list does not allocate. The buffer must outlive the list, and is not freed
+ * by dmsg_free
+ *
+ * returns 0 on success, nonzero on failure
+ */
+int dmsg_init_buf(dmsg_list*, void *buf, unsigned int init_node_size);
+
 /*
  * cleans up the memory occupied by the dmsg_list
  */
@@ -221,6 +252,38 @@ int dmsg_seek(dmsg_list*, ssize_t offset, int whence);
  */
 size_t dmsg_getline(dmsg_list*, char *buf, size_t bufsize);
 
+/*
+ * gives a pointer to the data after the offset pointer, in place in the node
+ * holding it, and sets *len to the number of bytes of data which follow it
+ * in that same node. The offset pointer is not moved
+ *
+ * returns NULL, with *len set to 0, if all of the data has been read
+ */
+char* dmsg_peek(const dmsg_list*, size_t *len);
+
+/*
+ * same as dmsg_peek, but for the data starting off bytes after the offset
+ * pointer
+ */
+char* dmsg_peek_at(const dmsg_list*, size_t off, size_t *len);
+
+/*
+ * makes a view of the len bytes starting off bytes after the offset pointer,
+ * without moving it
+ *
+ * returns 0 on success and DMSG_SEEK_OVERFLOW if those bytes run past the
+ * end of the list
+ */
+int dmsg_view_at(const dmsg_list*, size_t off, size_t len, dmsg_view*);
+
+/*
+ * gives a pointer to the bytes of the view, which are not null-terminated.
+ * This points into the list itself if they all lie in one node, and only if
+ * they span more than one are they copied into buf, which must be able to hold
+ * all of them
+ */
+const char* dmsg_view_data(const dmsg_list*, const dmsg_view*, char *buf);
+
 
 /*
  * cuts off all data in the list before the offset pointer, potentially moving
@@ -230,4 +293,12 @@ size_t dmsg_getline(dmsg_list*, char *buf, size_t bufsize);
  */
 void dmsg_consolidate(dmsg_list*);
 
+/*
+ * gives the number of bytes in the list after the offset pointer, which have
+ * not yet been read by the stream-like operations
+ */
+static __inline size_t dmsg_remaining(const dmsg_list *list) {
+    return list->len - list->_offset;
+}
+
 #endif /* _DMSG_H */
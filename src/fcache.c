@@ -0,0 +1,414 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+
+#include "fcache.h"
+
+
+// hit counters of the sets, of lookups which found the path, and which found
+// it with data attached
+#define FC_HITS 0
+#define FC_DATA_HITS 1
+
+#ifdef __linux__
+// everything which could change what a file in a watched directory is, or
+// whether it is there at all
+#define FC_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+        IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | \
+        IN_MOVED_TO)
+#endif
+
+
+/*
+ * gives the way of the set holding the len bytes at path, or -1 if it is not
+ * cached
+ */
+static __inline int fc_find(struct sa_set *set, uint32_t hash,
+        const char *path, size_t len) {
+    struct fc_file *f;
+
+    for (int i = 0; i < SA_WAYS; i++) {
+        f = (struct fc_file *) set->entries[i];
+        if (f != NULL && set->hashes[i] == hash &&
+                memcmp(f->path, path, len) == 0 && f->path[len] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * true if the file named name is f or one of its variants, i.e. f's name
+ * followed by an extension
+ */
+static __inline int fc_names(const struct fc_file *f, const char *name) {
+    const char *f_name = f->path + f->name_off;
+    size_t len = strlen(f_name);
+
+    return strncmp(f_name, name, len) == 0 &&
+        (name[len] == '\0' || name[len] == '.');
+}
+
+/*
+ * drops the entries of files named name, or of which name is a variant, in
+ * the directory watched by wd, or every entry of that directory if name is
+ * NULL, or every entry if wd is -1
+ */
+static void fc_invalidate(struct fcache *cache, int wd, const char *name) {
+    struct fc_file *dropped[SA_WAYS], *f;
+    struct sa_set *set;
+    int n;
+
+    for (unsigned s = 0; s <= cache->table.set_mask; s++) {
+        set = &cache->table.sets[s];
+        n = 0;
+        sa_lock(set);
+        for (int i = 0; i < SA_WAYS; i++) {
+            f = (struct fc_file *) set->entries[i];
+            if (f != NULL && (wd == -1 || (f->wd == wd && (name == NULL ||
+                            fc_names(f, name))))) {
+                dropped[n++] = f;
+                set->entries[i] = NULL;
+            }
+        }
+        sa_unlock(set);
+
+        // the files are closed outside of the lock
+        for (int i = 0; i < n; i++) {
+            fc_release(dropped[i]);
+        }
+        __atomic_fetch_add(&cache->n_invalidations, n, __ATOMIC_RELAXED);
+    }
+}
+
+#ifdef __linux__
+/*
+ * reads the events of the cache's inotify instance until cancelled by
+ * fc_free, dropping the entries of the files they are for
+ */
+static void* fc_watch(void *arg) {
+    struct fcache *cache = (struct fcache *) arg;
+    char buf[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+
+    // only cancelled while waiting for events, and never with files to close
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (1) {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        n = read(cache->ifd, buf, sizeof(buf));
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "file cache watcher stopped, reason: %s\n",
+                    strerror(errno));
+            return NULL;
+        }
+
+        for (char *p = buf; p < buf + n;
+                p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            // a file being opened now may have been opened before this change
+            __atomic_fetch_add(&cache->gen, 1, __ATOMIC_SEQ_CST);
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, so anything may have changed
+                fc_invalidate(cache, -1, NULL);
+            }
+            else if (ev->len == 0) {
+                // the directory itself was removed or is no longer watched
+                fc_invalidate(cache, ev->wd, NULL);
+            }
+            else {
+                fc_invalidate(cache, ev->wd, ev->name);
+            }
+        }
+    }
+}
+#endif
+
+
+int fc_init(struct fcache *cache, const char *root, unsigned n_entries,
+        size_t max_data) {
+    memset(cache, 0, sizeof(struct fcache));
+    cache->ifd = -1;
+    cache->root = root;
+    cache->max_data = max_data;
+
+#ifdef __linux__
+    if (sa_init(&cache->table, n_entries) != 0) {
+        fprintf(stderr, "Unable to malloc file cache of %u entries\n",
+                n_entries);
+        return -1;
+    }
+
+    cache->ifd = inotify_init1(IN_CLOEXEC);
+    if (cache->ifd == -1) {
+        fprintf(stderr, "Unable to create inotify instance, reason: %s\n",
+                strerror(errno));
+        sa_free(&cache->table);
+        return -1;
+    }
+    if (pthread_create(&cache->watcher, NULL, &fc_watch, cache) != 0) {
+        fprintf(stderr, "Unable to start file cache watcher\n");
+        close(cache->ifd);
+        sa_free(&cache->table);
+        return -1;
+    }
+#else
+    // changes to the files could not be seen, so they are never cached
+    (void) n_entries;
+#endif
+    return 0;
+}
+
+void fc_free(struct fcache *cache) {
+    if (cache->table.sets == NULL) {
+        return;
+    }
+
+    pthread_cancel(cache->watcher);
+    pthread_join(cache->watcher, NULL);
+    close(cache->ifd);
+    cache->ifd = -1;
+
+    fc_invalidate(cache, -1, NULL);
+    sa_free(&cache->table);
+}
+
+
+struct fc_file* fc_lookup(struct fcache *cache, const char *path,
+        size_t len) {
+    struct sa_set *set;
+    struct fc_file *f = NULL;
+    uint32_t hash = sa_hash(path, len);
+    int way;
+
+    set = sa_lock_set(&cache->table, hash);
+    set->clock++;
+    way = fc_find(set, hash, path, len);
+    if (way != -1) {
+        f = (struct fc_file *) set->entries[way];
+        set->last_use[way] = set->clock;
+        __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+        set->hits[FC_HITS]++;
+        if (__atomic_load_n(&f->data, __ATOMIC_RELAXED) != NULL) {
+            set->hits[FC_DATA_HITS]++;
+        }
+    }
+    sa_unlock(set);
+
+    if (f == NULL) {
+        // only counted here, as a miss costs an open anyway
+        __atomic_fetch_add(&cache->n_misses, 1, __ATOMIC_RELAXED);
+    }
+    return f;
+}
+
+/*
+ * puts the newly opened file f in the cache, unless it may have changed since
+ * gen was read or another thread has cached it in the meantime
+ */
+static void fc_insert(struct fcache *cache, struct fc_file *f, unsigned gen) {
+    struct sa_set *set;
+    struct fc_file *victim;
+
+    set = sa_lock_set(&cache->table, f->hash);
+    if (__atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE) != gen ||
+            fc_find(set, f->hash, f->path, strlen(f->path)) != -1) {
+        sa_unlock(set);
+        return;
+    }
+
+    // the cache holds a reference of its own
+    f->refs++;
+    victim = (struct fc_file *) sa_put(set, sa_victim(set), f, f->hash);
+    sa_unlock(set);
+
+    if (victim != NULL) {
+        fc_release(victim);
+        __atomic_fetch_add(&cache->n_evictions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+struct fc_file* fc_open(struct fcache *cache, const char *path, size_t len,
+        unsigned tag) {
+    char fullpath[PATH_MAX];
+    size_t root_len = strlen(cache->root);
+    struct fc_file *f;
+    unsigned gen;
+    char *dir_end;
+    int fd, wd = -1;
+#ifdef __linux__
+    struct stat64 st;
+#elif __APPLE__
+    struct stat st;
+#endif
+
+    if (root_len + len >= sizeof(fullpath)) {
+        return NULL;
+    }
+    memcpy(fullpath, cache->root, root_len);
+    memcpy(fullpath + root_len, path, len);
+    fullpath[root_len + len] = '\0';
+
+    f = (struct fc_file *) malloc(sizeof(struct fc_file) + len + 1);
+    if (f == NULL) {
+        fprintf(stderr, "Unable to malloc file cache entry for %s\n",
+                fullpath);
+        return NULL;
+    }
+    memcpy(f->path, path, len);
+    f->path[len] = '\0';
+    f->hash = sa_hash(path, len);
+    dir_end = strrchr(f->path, '/');
+    f->name_off = dir_end + 1 - f->path;
+    f->refs = 1;
+    f->size = 0;
+    f->mtime.tv_sec = f->mtime.tv_nsec = 0;
+    f->dev = 0;
+    f->ino = 0;
+    f->tag = tag;
+    f->reserved = 0;
+    f->variants = 0;
+    f->data = NULL;
+    f->data_len = 0;
+    f->data_tag = 0;
+    f->cache = cache;
+
+    gen = __atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE);
+
+#ifdef __linux__
+    // the directory is watched before the file is opened, so that any change
+    // made to it after it was opened is seen
+    fullpath[root_len + (dir_end - f->path)] = '\0';
+    wd = inotify_add_watch(cache->ifd, fullpath, FC_EVENTS);
+    fullpath[root_len + (dir_end - f->path)] = '/';
+#endif
+
+    // open the file in read-only mode, do not follow symlinks
+    fd = open(fullpath, O_RDONLY | O_NOFOLLOW
+#ifdef __linux__
+                                              | O_LARGEFILE
+#endif
+            );
+    if (fd == -1) {
+        if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP &&
+                errno != EACCES && errno != ENAMETOOLONG) {
+            // not something to remember about the file
+            free(f);
+            return NULL;
+        }
+    }
+#ifdef __linux__
+    else if (fstat64(fd, &st) != 0) {
+#elif __APPLE__
+    else if (fstat(fd, &st) != 0) {
+#endif
+        fprintf(stderr, "could not stat file, reason: %s", strerror(errno));
+        close(fd);
+        free(f);
+        return NULL;
+    }
+    else if (!S_ISREG(st.st_mode)) {
+        // not allowed to open anything besides regular files
+        close(fd);
+        fd = -1;
+    }
+    else {
+        f->size = st.st_size;
+#ifdef __linux__
+        f->mtime = st.st_mtim;
+#elif __APPLE__
+        f->mtime = st.st_mtimespec;
+#endif
+        f->dev = st.st_dev;
+        f->ino = st.st_ino;
+    }
+    f->fd = fd;
+    f->wd = wd;
+
+    if (wd != -1) {
+        // otherwise changes to the file could not be seen
+        fc_insert(cache, f, gen);
+    }
+    return f;
+}
+
+/*
+ * frees the len bytes of data at data, giving them back to the budget
+ */
+static void fc_free_data(struct fcache *cache, char *data, size_t len) {
+    free(data);
+    __atomic_sub_fetch(&cache->n_data, len, __ATOMIC_RELAXED);
+}
+
+void fc_release(struct fc_file *file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (file->fd != -1) {
+            close(file->fd);
+        }
+        if (file->data != NULL) {
+            fc_free_data(file->cache, (char *) file->data, file->data_len);
+        }
+        free(file);
+    }
+}
+
+
+char* fc_reserve(struct fcache *cache, struct fc_file *file, size_t len) {
+    char *data;
+
+    if (__atomic_exchange_n(&file->reserved, 1, __ATOMIC_RELAXED)) {
+        // another request got here first
+        return NULL;
+    }
+    if (__atomic_add_fetch(&cache->n_data, len, __ATOMIC_RELAXED) >
+            cache->max_data) {
+        __atomic_sub_fetch(&cache->n_data, len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->n_refused, 1, __ATOMIC_RELAXED);
+        // the file may fit once others have left the cache
+        __atomic_store_n(&file->reserved, 0, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    data = (char *) malloc(len);
+    if (data == NULL) {
+        fprintf(stderr, "Unable to malloc %lu bytes for %s\n", len,
+                file->path);
+        __atomic_sub_fetch(&cache->n_data, len, __ATOMIC_RELAXED);
+        __atomic_store_n(&file->reserved, 0, __ATOMIC_RELAXED);
+    }
+    return data;
+}
+
+void fc_attach(struct fc_file *file, char *data, size_t len, unsigned tag) {
+    file->data_len = len;
+    file->data_tag = tag;
+    __atomic_store_n(&file->data, data, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&file->cache->n_attached, 1, __ATOMIC_RELAXED);
+}
+
+void fc_unreserve(struct fc_file *file, char *data, size_t len) {
+    fc_free_data(file->cache, data, len);
+    __atomic_store_n(&file->reserved, 0, __ATOMIC_RELAXED);
+}
+
+void fc_stats(const struct fcache *cache, unsigned long *n_hits,
+        unsigned long *n_data_hits) {
+    *n_hits = sa_hits(&cache->table, FC_HITS);
+    *n_data_hits = sa_hits(&cache->table, FC_DATA_HITS);
+}
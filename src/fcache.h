@@ -0,0 +1,208 @@
+/*
+ * Open file cache
+ *
+ * Maps the paths of requested files, relative to the directory being served,
+ * to a file descriptor opened on them along with their size, modification
+ * time and a tag given by the caller (the MIME type, for the http parser).
+ * The descriptors are shared between every request for the same file, and
+ * are only closed once the file has left the cache and the last request
+ * using it is done with it. Files which could not be served (missing, or not
+ * regular files) are cached too, with no descriptor, so repeated requests for
+ * them do not go to the filesystem either. The caller may keep data of its own
+ * in memory with a file (a whole response, for the http parser), up to a
+ * budget shared by the cache, which is freed along with the file.
+ *
+ * The entries are kept in a set-associative table (see setassoc.h), keyed by
+ * the hash of their path.
+ *
+ * The directory of each cached file is watched with inotify, and a thread
+ * started by fc_init drops an entry as soon as its file is created, written
+ * to, has its attributes changed, or is deleted or renamed. Files named like
+ * a cached file with another extension added (its variants, such as a
+ * compressed copy) count as part of it, so a change to one of them drops the
+ * cached file's entry too. Changes to the directories above it are not seen.
+ * Without inotify (on MacOS) nothing is cached
+ */
+#ifndef _FCACHE_H
+#define _FCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "setassoc.h"
+#include "util.h"
+
+
+struct fc_file {
+    // open read-only descriptor of the file, or -1 if it can't be served
+    int fd;
+    // number of references held, one by the cache while the file is in it,
+    // and one by each request using it
+    unsigned refs;
+
+    // the size of the file in bytes and the time it was last modified
+    int64_t size;
+    struct timespec mtime;
+    // the device and inode of the file, which with its size and mtime tell
+    // apart every version of it
+    dev_t dev;
+    ino_t ino;
+
+    // given to fc_open when the file was cached
+    unsigned tag;
+    // set while data reserved with fc_reserve is being attached to the file,
+    // and once it is
+    unsigned char reserved;
+    // for the caller to note which variants of the file it has looked for
+    // and found, which stays true for as long as the file is in the cache
+    unsigned variants;
+
+    // data attached to the file with fc_attach, or NULL. It is read with
+    // fc_data
+    const char *data;
+    size_t data_len;
+    // given to fc_attach with the data, to tell what it is
+    unsigned data_tag;
+    // the cache the file was opened by
+    struct fcache *cache;
+
+    // inotify watch descriptor of the directory of the file
+    int wd;
+    uint32_t hash;
+    // offset of the file's name in path, past the last '/'
+    unsigned name_off;
+    // path of the file relative to the root, null-terminated
+    char path[];
+};
+
+struct fcache {
+    // of fc_files, whose sets count the lookups which found the path, and
+    // which found it with data attached. The sets are NULL if nothing is
+    // cached
+    struct sa_table table;
+
+    // directory the cached paths are relative to
+    const char *root;
+
+    // inotify instance the directories are watched with, and the thread
+    // reading its events
+    int ifd;
+    pthread_t watcher;
+    // incremented before each change seen by the watcher is applied, so a
+    // file opened while one was seen is not cached with what it was before
+    unsigned gen;
+
+    // number of bytes of data which may be attached to files, and how many
+    // are
+    size_t max_data;
+    size_t n_data;
+
+    // number of lookups which did not find the path
+    unsigned long n_misses;
+    // number of times data was attached, and was refused for going over the
+    // budget
+    unsigned long n_attached;
+    unsigned long n_refused;
+    // number of entries dropped to make room for another, and because their
+    // file changed
+    unsigned long n_evictions;
+    unsigned long n_invalidations;
+};
+
+
+/*
+ * initializes a cache of at least n_entries files under the directory root,
+ * which must outlive it, with up to max_data bytes of data attached to them,
+ * and starts the thread watching for changes to them
+ *
+ * returns 0 on success and -1 on failure
+ */
+int fc_init(struct fcache *cache, const char *root, unsigned n_entries,
+        size_t max_data);
+
+/*
+ * stops the watcher and drops every entry of the cache. Files still
+ * referenced are closed once they are released. It is safe to free a zeroed
+ * cache
+ */
+void fc_free(struct fcache *cache);
+
+/*
+ * looks up the len bytes at path, which start with a '/'
+ *
+ * returns the cached file with a reference taken, to be given back with
+ * fc_release, or NULL if it is not cached
+ */
+struct fc_file* fc_lookup(struct fcache *cache, const char *path, size_t len);
+
+/*
+ * opens the len bytes at path, which start with a '/', and stats the file,
+ * caching it with the given tag. If it is not a regular file, or does not
+ * exist, the returned file has an fd of -1
+ *
+ * returns the file with a reference taken, to be given back with fc_release,
+ * or NULL if it could not be opened for any other reason (e.g. out of file
+ * descriptors), in which case nothing is cached
+ */
+struct fc_file* fc_open(struct fcache *cache, const char *path, size_t len,
+        unsigned tag);
+
+/*
+ * takes another reference to a file which is already referenced, to be given
+ * back with fc_release
+ */
+static __inline void fc_ref(struct fc_file *file) {
+    __atomic_fetch_add(&file->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * gives back a reference taken by fc_lookup, fc_open or fc_ref, closing the
+ * file if it was the last one
+ */
+void fc_release(struct fc_file *file);
+
+/*
+ * allocates len bytes for data to be attached to the file, which is only done
+ * if no data is attached to it or reserved for it, and only if they fit in the
+ * budget of the cache. The buffer is then given to either fc_attach or
+ * fc_unreserve. A file refused for the budget may be tried again later
+ *
+ * returns the buffer, or NULL if no data is to be attached
+ */
+char* fc_reserve(struct fcache *cache, struct fc_file *file, size_t len);
+
+/*
+ * attaches the len bytes reserved at data to the file, along with a tag
+ * telling what they are, after which they may be read with fc_data by anyone
+ * holding a reference
+ */
+void fc_attach(struct fc_file *file, char *data, size_t len, unsigned tag);
+
+/*
+ * frees data of len bytes reserved for the file which is not to be attached,
+ * so that data may be reserved for it again
+ */
+void fc_unreserve(struct fc_file *file, char *data, size_t len);
+
+/*
+ * gives the data attached to the file, setting *len to its length and *tag to
+ * its tag, or NULL if none is
+ */
+static __inline const char* fc_data(const struct fc_file *file, size_t *len,
+        unsigned *tag) {
+    const char *data = __atomic_load_n(&file->data, __ATOMIC_ACQUIRE);
+
+    *len = file->data_len;
+    *tag = file->data_tag;
+    return data;
+}
+
+/*
+ * sums the hits of fc_lookup, and those which found data attached
+ */
+void fc_stats(const struct fcache *cache, unsigned long *n_hits,
+        unsigned long *n_data_hits);
+
+#endif /* _FCACHE_H */
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handoff.h"
+
+
+int hq_init(struct handoff_queue *q, unsigned long capacity) {
+    unsigned long n_slots = 1;
+
+    memset(q, 0, sizeof(struct handoff_queue));
+
+    while (n_slots < capacity) {
+        n_slots <<= 1;
+    }
+    if (posix_memalign((void **) &q->slots, CACHE_LINE,
+                n_slots * sizeof(struct hq_slot)) != 0) {
+        fprintf(stderr, "Unable to malloc handoff queue of %lu slots\n",
+                n_slots);
+        q->slots = NULL;
+        return -1;
+    }
+    for (unsigned long i = 0; i < n_slots; i++) {
+        q->slots[i].seq = i;
+    }
+    q->mask = n_slots - 1;
+    return 0;
+}
+
+void hq_free(struct handoff_queue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+
+int hq_push(struct handoff_queue *q, int connfd, int arg,
+        const struct sockaddr *sa) {
+    struct hq_slot *slot;
+    unsigned long pos, seq;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            // the slot is free, so try to claim it. On failure, pos is
+            // updated to the current tail
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if ((long) (seq - pos) < 0) {
+            // the slot still holds the connection pushed one lap ago
+            return -1;
+        }
+        else {
+            // another producer claimed this position first
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->connfd = connfd;
+    slot->arg = arg;
+    memcpy(&slot->sa, sa, sizeof(struct sockaddr));
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int hq_pop(struct handoff_queue *q, int *arg, struct sockaddr *sa) {
+    unsigned long pos = q->head;
+    struct hq_slot *slot = &q->slots[pos & q->mask];
+    int connfd;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+        // either empty, or the producer of this position has not yet
+        // published it
+        return -1;
+    }
+
+    connfd = slot->connfd;
+    *arg = slot->arg;
+    memcpy(sa, &slot->sa, sizeof(struct sockaddr));
+    // hand the slot back to the producer of its next lap
+    __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&q->head, pos + 1, __ATOMIC_RELAXED);
+    return connfd;
+}
@@ -0,0 +1,91 @@
+/*
+ * Connection handoff queue
+ *
+ * A bounded, lock-free queue of accepted connections, which any number of
+ * threads may push onto and a single thread pops from. Each slot carries a
+ * sequence number telling whose turn it is to use it: a producer claims a
+ * position with a single compare-and-swap on the tail, fills in the slot
+ * and then publishes it by advancing the slot's sequence number, and the
+ * consumer takes slots in order once they have been published, handing
+ * each back to the producers by advancing its sequence number once more.
+ * Nothing is allocated once the queue has been initialized.
+ *
+ * The tail, written to by the producers, and the head, written to by the
+ * consumer, are kept on separate cache lines
+ */
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <sys/socket.h>
+
+#include "util.h"
+
+
+struct hq_slot {
+    // equal to the position of the slot once it may be claimed by the
+    // producer of that position, and to that position + 1 once the
+    // connection in it has been published
+    unsigned long seq;
+
+    int connfd;
+    // passed along with the connection, for the consumer to interpret
+    int arg;
+    // address of the peer, as given by accept
+    struct sockaddr sa;
+};
+
+struct handoff_queue {
+    struct hq_slot *slots;
+    // number of slots - 1, the number of slots being a power of 2
+    unsigned long mask;
+
+    // next position to be claimed by a producer
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+
+    // next position to be taken by the consumer
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE)));
+
+
+/*
+ * initializes a queue with room for at least capacity connections
+ *
+ * returns 0 on success and -1 on failure
+ */
+int hq_init(struct handoff_queue *q, unsigned long capacity);
+
+/*
+ * frees the memory held by the queue, without closing the connections still
+ * in it. It is safe to free a zeroed queue
+ */
+void hq_free(struct handoff_queue *q);
+
+/*
+ * pushes a connection onto the queue, which may be done by any thread
+ *
+ * returns 0 on success and -1 if the queue is full
+ */
+int hq_push(struct handoff_queue *q, int connfd, int arg,
+        const struct sockaddr *sa);
+
+/*
+ * pops the oldest connection published to the queue, storing its arg and
+ * the address of its peer in arg and sa. Only one thread may pop from a
+ * queue
+ *
+ * returns the connection's fd, or -1 if there is none
+ */
+int hq_pop(struct handoff_queue *q, int *arg, struct sockaddr *sa);
+
+/*
+ * gives the number of connections in the queue, which may be off by the
+ * pushes and pops in progress
+ */
+static __inline unsigned long hq_size(struct handoff_queue *q) {
+    unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    return (tail > head) ? tail - head : 0;
+}
+
+#endif /* _HANDOFF_H */
@@ -6,13 +6,13 @@
 #include <unistd.h>
 #ifdef __linux__
 #include <sys/sendfile.h>
-#elif __APPLE__
-#include <sys/socket.h>
 #endif
+#include <sys/socket.h>
 #include <sys/stat.h>
 
 #include "hashmap.h"
 #include "http.h"
+#include "scan.h"
 #include "util.h"
 #include "vprint.h"
 
@@ -33,13 +33,25 @@
 #define HTTP_MALFORMED_OPTION 4
 
 
-// maximum size of header field that can be sent
+#ifndef MSG_MORE
+// MacOS has no MSG_MORE, so the headers are always sent right away
+#define MSG_MORE 0
+#endif
+
+
+// maximum size of header field that can be sent, which is also the longest
+// any line of a request may be, including its '\n'
 #define MAX_HEADER_SIZE 8192
-// size of buffer to hold each line from request
-// (max method size (7)) + SP + URI + SP + (max version size (8)) + LF
-#define MAX_LINE (8 + MAX_URI_SIZE + 10)
 // maximum allowable size of URI
 #define MAX_URI_SIZE 256
+// number of lines of a request split by each scan, which covers the headers
+// browsers typically send
+#define SCAN_BATCH 16
+
+
+// true if the len bytes at s are the string literal lit
+#define TOKEN_IS(s, len, lit) \
+    ((len) == sizeof(lit) - 1 && memcmp((s), (lit), sizeof(lit) - 1) == 0)
 
 
 // to be used whenever no resource is requested, just the default page of the
@@ -47,12 +59,58 @@
 static char default_page[] = "/index.html";
 
 
+// the content codings of the precompressed copies of files which may be sent
+// in their place, indexed by ENC_*: the extension added to the name of a file
+// to get its copy, and the name of the coding
+static const struct encoding {
+    const char *ext;
+    const char *name;
+} encodings[] = {
+    [ENC_IDENTITY] = { "", NULL },
+    [ENC_GZIP] = { ".gz", "gzip" },
+    [ENC_BR] = { ".br", "br" },
+    // only made on the fly, so never looked for
+    [ENC_DEFLATE] = { NULL, "deflate" }
+};
+
+// length of the extensions of the precompressed copies
+#define ENC_EXT_LEN 3
 
-void http_close(struct http *h) {
-    if (h->fd != -1) {
+// set in the variants of a file cache entry once its precompressed copies
+// have been looked for, along with (1 << ENC_*) for each that was found
+#define VARIANTS_FOUND 0x1
+
+
+// the requested files kept open, if any
+static struct fcache files;
+// the copies of them compressed on the fly, if any
+static struct zcache compressed;
+// size of the largest file whose whole response is kept in memory by the file
+// cache, or 0 for none
+static size_t max_response_size;
+
+
+/*
+ * closes the requested file, or gives it back to the file cache if it came
+ * from there
+ */
+static __inline void release_file(struct http *h) {
+    if (h->zfile != NULL) {
+        zc_release(h->zfile);
+        h->zfile = NULL;
+    }
+    if (h->file != NULL) {
+        fc_release(h->file);
+        h->file = NULL;
+    }
+    else if (h->fd != -1) {
         close(h->fd);
     }
     h->fd = -1;
+}
+
+void http_close(struct http *h) {
+    release_file(h);
     http_clear(h);
 }
 
@@ -93,6 +151,7 @@ static const char * const msgs[] = {
     "415 Unsupported Media Type",
     "416 Requested Range Not Satisfiable",
     "417 Expectation Failed",
+    "429 Too Many Requests",
     "500 Internal Server Error",
     "501 Not Implemented",
     "502 Bad Gateway",
@@ -122,13 +181,8 @@ static const char * const method_opts[] = {
 // -------------------- static globals --------------------
 
 
-#define LOCKED 0
-#define UNLOCKED 1
-
-// locks access to http_header for parsing, as pattern_match is not thread-
-// safe
-static volatile int http_header_lock;
-
+// only ever read once initialized, so every thread may match against it at
+// once
 static token_t *http_header;
 
 struct http_header_match {
@@ -150,20 +204,6 @@ struct http_header_match {
 static hashmap extensions;
 
 
-static __inline void acq_http_header_lock() {
-    int unlocked = UNLOCKED;
-    // spin until unlocked
-    while (!__atomic_compare_exchange_n(&http_header_lock, &unlocked,
-                LOCKED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
-        unlocked = UNLOCKED;
-    }
-}
-
-static __inline void rel_http_header_lock() {
-    http_header_lock = UNLOCKED;
-}
-
-
 // align with indices in type vector of struct mime_type, 22 types, so need
 // 5 bytes
 enum {
@@ -268,8 +308,10 @@ static void init_extensions() {
 }
 
 
-int http_init() {
-    http_header_lock = UNLOCKED;
+int http_init(unsigned n_cached_files, size_t max_response_size_,
+        size_t max_response_bytes, int compress_level,
+        size_t min_compress_size, size_t max_compressed_bytes) {
+    scan_init();
     http_header = bnf_parsef("grammars/http_header.bnf");
     if (http_header == NULL) {
         fprintf(stderr, P_RED "http initialization failed\n" P_RESET);
@@ -277,14 +319,60 @@ int http_init() {
     }
     init_extensions();
 
+    max_response_size = max_response_size_;
+    if (n_cached_files > 0 && fc_init(&files, PUBLIC_FILE_SRC, n_cached_files,
+                max_response_bytes) != 0) {
+        pattern_free(http_header);
+        hash_free(&extensions);
+        return -1;
+    }
+    if (files.table.sets != NULL && compress_level > 0 &&
+            zc_init(&compressed, n_cached_files, max_compressed_bytes,
+                compress_level, min_compress_size, COMPRESS_INLINE_SIZE) != 0) {
+        fc_free(&files);
+        pattern_free(http_header);
+        hash_free(&extensions);
+        return -1;
+    }
+
     return 0;
 }
 
 void http_exit() {
+    zc_free(&compressed);
+    fc_free(&files);
     pattern_free(http_header);
     hash_free(&extensions);
 }
 
+void http_print_stats() {
+    unsigned long n_hits, n_data_hits;
+
+    if (files.table.sets != NULL) {
+        fc_stats(&files, &n_hits, &n_data_hits);
+        printf("\tfile cache: %lu hits, %lu misses, %lu evicted, "
+               "%lu invalidated\n", n_hits, files.n_misses, files.n_evictions,
+               files.n_invalidations);
+        if (max_response_size > 0) {
+            printf("\tresponses in memory: %lu hits, %lu kept, %lu refused, "
+                   "%lu of %lu KB used\n", n_data_hits, files.n_attached,
+                   files.n_refused, files.n_data / 1024,
+                   files.max_data / 1024);
+        }
+    }
+    if (compressed.table.sets != NULL) {
+        printf("\tcompressed on the fly: %lu hits, %lu misses, %lu compressed "
+               "(%lu in the background, %lu KB to %lu KB), %lu incompressible, "
+               "%lu refused, %lu dropped, %lu of %lu KB used\n",
+               zc_hits(&compressed), compressed.n_misses,
+               compressed.n_compressed, compressed.n_deferred,
+               compressed.bytes_in / 1024, compressed.bytes_out / 1024,
+               compressed.n_incompressible, compressed.n_refused,
+               compressed.n_dropped, compressed.n_bytes / 1024,
+               compressed.max_bytes / 1024);
+    }
+}
+
 
 
 
@@ -345,23 +433,54 @@ static __inline char get_status(struct http *p) {
 
 
 /*
- * given a file extension, returns the index associated with the associated
- * MIME type, to be stored in the http struct
+ * given the len bytes of a null-terminated URI, returns the index of the MIME
+ * type associated with its file extension
  */
-static __inline void set_mime_type(struct http *p, const char* ext) {
-    void* ret = str_hash_get(&extensions, ext);
-    unsigned type;
+static __inline unsigned uri_mime_type(const char *uri, size_t uri_len) {
+    const char *ext = (const char*) memrchr(uri, '.', uri_len);
+    void* ret;
+
+    if (ext == NULL) {
+        // no extension, set ext to the end of uri, i.e. ""
+        ext = uri + uri_len;
+    }
+    else {
+        // skip the dot
+        ext++;
+    }
 
     vprintf("mime type: %s\n", ext);
 
+    ret = str_hash_get(&extensions, ext);
     if (ret == NULL) {
         // not a recognizes extension
-        type = default_mime_type;
+        return default_mime_type;
     }
-    else {
-        type = (size_t) ret;
+    return (size_t) ret;
+}
+
+/*
+ * true if files of the MIME type given by uri_mime_type are text, which is
+ * worth compressing
+ */
+static __inline int compressible(unsigned type) {
+    switch (type) {
+    case css:
+    case csv:
+    case html:
+    case js:
+    case json:
+    case xml:
+        return 1;
+    default:
+        return 0;
     }
+}
 
+/*
+ * stores the index of a MIME type given by uri_mime_type in the http struct
+ */
+static __inline void set_mime_type(struct http *p, unsigned type) {
     p->status |= type << MIME_TYPE_OFFSET;
 }
 
@@ -384,14 +503,37 @@ static __inline int keep_alive(struct http *p) {
     return (p->status & KEEP_ALIVE) != 0;
 }
 
+static __inline void set_encoding(struct http *p, unsigned enc) {
+    p->status |= enc << ENCODING_OFFSET;
+}
+
+static __inline unsigned get_encoding(struct http *p) {
+    return (p->status >> ENCODING_OFFSET) & ((1U << ENCODING_BITS) - 1);
+}
+
+/*
+ * identifies the headers of a successful response, which are the same for
+ * every request with the same tag, so that a response kept in memory is only
+ * sent to requests it was built for
+ */
+static __inline unsigned response_tag(struct http *p) {
+    unsigned type = (p->status >> MIME_TYPE_OFFSET) &
+        ((1U << MIME_TYPE_BITS) - 1);
+
+    return type | get_encoding(p) << MIME_TYPE_BITS |
+        ((p->status & VARY_ENCODING) != 0) << (MIME_TYPE_BITS + ENCODING_BITS);
+}
+
 
 
 /*
- * parse method out of string and update state variable of the http struct
+ * parse method out of the len bytes at method and update state variable of
+ * the http struct
  *
  * returns 0 on success and -1 on failure
  */
-static __inline int parse_method(struct http *p, char *method) {
+static __inline int parse_method(struct http *p, const char *method,
+        size_t len) {
     // all of the first characters are different, except for POST and PUT
     int idx;
     switch (method[0]) {
@@ -421,7 +563,8 @@ static __inline int parse_method(struct http *p, char *method) {
     }
     // need to right shift by 4 because they occupy the upper 4
     // bits of a char
-    if (strcmp(method, method_opts[idx >> 4]) != 0) {
+    const char *opt = method_opts[idx >> 4];
+    if (len != strlen(opt) || memcmp(method, opt, len) != 0) {
         return -1;
     }
     set_method(p, idx);
@@ -459,20 +602,252 @@ static int fd_verify(struct http *p) {
 }
 
 
-static __inline int parse_uri(struct http *p, char *buf) {
+/*
+ * reads the whole of a small file of the file cache into memory, behind the
+ * headers of the response to p, so that the response can be sent from there.
+ * Only the first request for the file does this, and only if the cache has
+ * the room
+ */
+static void cache_response(struct http *p) {
+    struct fc_file *f = p->file;
+    char header[512], *data;
+    int header_len;
+
+    header_len = http_response_header(p, header, sizeof(header));
+    if (header_len >= (int) sizeof(header)) {
+        return;
+    }
+
+    // the body is read from p->fd, which may be a compressed copy of f
+    data = fc_reserve(&files, f, header_len + p->file_size);
+    if (data == NULL) {
+        return;
+    }
+    memcpy(data, header, header_len);
+    if (pread(p->fd, data + header_len, p->file_size, 0) != p->file_size) {
+        // the file was cut short since it was opened, and is about to be
+        // dropped from the cache anyway
+        fc_unreserve(f, data, header_len + p->file_size);
+        return;
+    }
+    fc_attach(f, data, header_len + p->file_size, response_tag(p));
+}
+
+/*
+ * opens the precompressed copy of the file f in the given coding through the
+ * file cache
+ *
+ * returns the copy, with an fd of -1 if there is none, or NULL if it could
+ * not be opened
+ */
+static struct fc_file* open_variant(struct fc_file *f, unsigned enc) {
+    char path[sizeof(default_page) + MAX_URI_SIZE + ENC_EXT_LEN];
+    size_t len = strlen(f->path);
+    struct fc_file *v;
+
+    memcpy(path, f->path, len);
+    memcpy(path + len, encodings[enc].ext, ENC_EXT_LEN + 1);
+    len += ENC_EXT_LEN;
+
+    v = fc_lookup(&files, path, len);
+    if (v == NULL) {
+        v = fc_open(&files, path, len, uri_mime_type(path, len));
+    }
+    return v;
+}
+
+/*
+ * gives the variants of f, looking for its precompressed copies if that has
+ * not yet been done since it was cached. As a change to a copy drops f from
+ * the cache, they are only looked for once, and the copies which don't exist
+ * are cached too, so even that costs no syscalls after the first time
+ */
+static unsigned find_variants(struct fc_file *f) {
+    unsigned variants = __atomic_load_n(&f->variants, __ATOMIC_RELAXED);
+    struct fc_file *v;
+
+    if (variants & VARIANTS_FOUND) {
+        return variants;
+    }
+
+    variants = VARIANTS_FOUND;
+    for (unsigned enc = ENC_GZIP; enc <= ENC_BR; enc++) {
+        v = open_variant(f, enc);
+        if (v != NULL) {
+            if (v->fd != -1) {
+                variants |= 1U << enc;
+            }
+            fc_release(v);
+        }
+    }
+    __atomic_or_fetch(&f->variants, variants, __ATOMIC_RELAXED);
+    return variants;
+}
+
+/*
+ * sends the requested file compressed on the fly in its place, if it is of a
+ * type worth compressing and the client accepts gzip or deflate, preferring
+ * gzip. Until a large file has been compressed in the background it is sent
+ * as it is
+ */
+static void compress_file(struct http *p) {
+    struct zc_file *z;
+    unsigned enc;
+
+    if (compressed.table.sets == NULL || !compressible(p->file->tag) ||
+            p->file->size < (int64_t) compressed.min_size) {
+        return;
+    }
+    // whether or not this client gets it compressed, others may
+    p->status |= VARY_ENCODING;
+
+    if (p->status & ACCEPT_GZIP) {
+        enc = ENC_GZIP;
+    }
+    else if (p->status & ACCEPT_DEFLATE) {
+        enc = ENC_DEFLATE;
+    }
+    else {
+        return;
+    }
+
+    z = zc_get(&compressed, p->file, (enc == ENC_GZIP) ? ZC_GZIP : ZC_DEFLATE);
+    if (z == NULL) {
+        return;
+    }
+    // the file stays referenced too, as it is what the response is kept in
+    // memory with
+    p->zfile = z;
+    p->fd = z->fd;
+    p->file_size = z->size;
+    p->offset = 0;
+    set_encoding(p, enc);
+}
+
+/*
+ * sends a precompressed copy of the requested file in its place, if the
+ * client accepts its coding, preferring br to gzip, or else compresses it on
+ * the fly
+ */
+static void negotiate_encoding(struct http *p) {
+    static const unsigned prefs[] = { ENC_BR, ENC_GZIP };
+    static const int accept[] = { [ENC_GZIP] = ACCEPT_GZIP,
+        [ENC_BR] = ACCEPT_BR };
+    unsigned variants, enc;
+    struct fc_file *v;
+
+    variants = find_variants(p->file);
+    if (variants == VARIANTS_FOUND) {
+        // there are no copies
+        compress_file(p);
+        return;
+    }
+    p->status |= VARY_ENCODING;
+
+    for (int i = 0; i < sizeof(prefs) / sizeof(prefs[0]); i++) {
+        enc = prefs[i];
+        if (!(variants & (1U << enc)) || !(p->status & accept[enc])) {
+            continue;
+        }
+
+        v = open_variant(p->file, enc);
+        if (v == NULL || v->fd == -1) {
+            // removed since it was looked for, and f is about to be dropped
+            if (v != NULL) {
+                fc_release(v);
+            }
+            continue;
+        }
+
+        // the copy is sent with the MIME type of the original
+        fc_release(p->file);
+        p->file = v;
+        p->fd = v->fd;
+        p->file_size = v->size;
+        p->offset = 0;
+        set_encoding(p, enc);
+        return;
+    }
+    compress_file(p);
+}
+
+/*
+ * readies the response to a request which has been parsed in full, now that
+ * all of its headers are known. Only files from the file cache have their
+ * precompressed copies looked for, are compressed, or are kept in memory
+ */
+static void prepare_response(struct http *p) {
+    if (p->file == NULL) {
+        return;
+    }
+
+    negotiate_encoding(p);
+
+    if (p->file_size <= max_response_size &&
+            !__atomic_load_n(&p->file->reserved, __ATOMIC_RELAXED)) {
+        cache_response(p);
+    }
+}
+
+
+/*
+ * takes the file named by the len bytes at uri from the file cache, opening
+ * and caching it if it is not already there, so that p->fd, p->file_size and
+ * the MIME type are all set without going to the filesystem
+ *
+ * returns 0 on success and -1 if the file can't be served
+ */
+static int open_cached(struct http *p, const char *uri, size_t uri_len) {
+    struct fc_file *f = fc_lookup(&files, uri, uri_len);
+
+    if (f == NULL) {
+        f = fc_open(&files, uri, uri_len, uri_mime_type(uri, uri_len));
+        if (f == NULL) {
+            vprintf("could not open %s\n", uri);
+            return -1;
+        }
+    }
+    if (f->fd == -1) {
+        // no such file, or not a regular file
+        fc_release(f);
+        return -1;
+    }
+
+    p->file = f;
+    p->fd = f->fd;
+    p->file_size = f->size;
+    p->offset = 0;
+    set_mime_type(p, f->tag);
+    return 0;
+}
+
+
+/*
+ * matches the len bytes of the request-uri at uri, of no more than
+ * MAX_URI_SIZE bytes, and opens the file it names, which is left in p->fd,
+ * with its file cache entry in p->file if the cache is in use
+ *
+ * returns 0 on success and -1 on failure
+ */
+static __inline int parse_uri(struct http *p, const char *req_uri,
+        size_t req_uri_len) {
 
     struct http_header_match match;
+    // the request-uri is matched as a string, so it needs a null-terminator,
+    // which can't be written in place in the request
+    char buf[MAX_URI_SIZE + 1];
+
+    memcpy(buf, req_uri, req_uri_len);
+    buf[req_uri_len] = '\0';
 
-    acq_http_header_lock();
     int ret = pattern_match(http_header, buf,
             sizeof(struct http_header_match) / sizeof(match_t),
             (match_t*) &match);
-    rel_http_header_lock();
 
     vprintf("URI: %s\n", buf);
 
-    if (ret == MATCH_FAIL) {
-        // badly formatted uri
+    if (ret != 0) {
+        // badly formatted uri, or out of memory for matching it
         p->fd = -1;
         vprintf("match fail\n");
         return -1;
@@ -494,13 +869,7 @@ static __inline int parse_uri(struct http *p, char *buf) {
     const char* uri = &buf[match.abs_uri.so];
     size_t uri_len = match.abs_uri.eo - match.abs_uri.so;
 
-    // null-terminate uri, but save what was previously there so it can be
-    // restored
-    char tmp = buf[match.abs_uri.eo];
-
-    int use_default_page = (strcmp(uri, "/") == 0);
-
-    if (use_default_page) {
+    if (strcmp(uri, "/") == 0) {
         uri = default_page;
         uri_len = sizeof(default_page) - 1;
     }
@@ -509,27 +878,17 @@ static __inline int parse_uri(struct http *p, char *buf) {
     }
 
 
-    // first use URI to set MIME type in http struct
-    const char *ext = (const char*) memrchr(uri, '.', uri_len);
-    if (ext == NULL) {
-        // no extension, set ext to the end of uri, i.e. ""
-        ext = uri + uri_len;
+    if (files.table.sets != NULL) {
+        return open_cached(p, uri, uri_len);
     }
-    else {
-        // skip the dot
-        ext++;
-    }
-    set_mime_type(p, ext);
+
+    // first use URI to set MIME type in http struct
+    set_mime_type(p, uri_mime_type(uri, uri_len));
 
 
     char fullpath[sizeof(PUBLIC_FILE_SRC) + MAX_URI_SIZE];
     sprintf(fullpath, PUBLIC_FILE_SRC "%s", uri);
 
-    if (!use_default_page) {
-        // restore
-        buf[match.abs_uri.eo] = tmp;
-    }
-
     // open the file in read-only mode, do not follow symlinks
     p->fd = open(fullpath, O_RDONLY | O_NOFOLLOW
 #ifdef __linux__
@@ -549,12 +908,14 @@ static __inline int parse_uri(struct http *p, char *buf) {
 }
 
 /*
- * parse HTTP version out of string, returning 0 on success and -1 on failure
+ * parse HTTP version out of the len bytes at buf, returning 0 on success and
+ * -1 on failure
  */
-static __inline int parse_version(struct http *p, char *buf) {
+static __inline int parse_version(struct http *p, const char *buf,
+        size_t len) {
     // in a match, really only the last character differentiates the version,
     // between HTTP/1.0 and HTTP/1.1
-    if (strncmp(buf, "HTTP/1.", 7) != 0) {
+    if (len < 8 || memcmp(buf, "HTTP/1.", 7) != 0) {
         return -1;
     }
     if (buf[7] != '0' && buf[7] != '1') {
@@ -565,6 +926,102 @@ static __inline int parse_version(struct http *p, char *buf) {
 }
 
 
+/*
+ * gives a pointer to the len bytes which are off bytes into line, which is at
+ * the offset pointer of req. They are looked at in place in the node holding
+ * them, and are only copied into buf (of MAX_HEADER_SIZE bytes) if they span
+ * more than one node
+ */
+static __inline const char* line_token(const dmsg_list *req,
+        const struct scan_line *line, size_t off, size_t len, char *buf) {
+    dmsg_view view;
+
+    if (line->data != NULL) {
+        // the common case, the whole line lies in one node
+        return line->data + off;
+    }
+    dmsg_view_at(req, off, len, &view);
+    return dmsg_view_data(req, &view, buf);
+}
+
+
+/*
+ * true if the parameters of a coding in an Accept-Encoding header, from s up
+ * to end, give it a q of 0, meaning it is not accepted
+ */
+static __inline int zero_qvalue(const char *s, const char *end) {
+    while (s < end && (*s == ';' || *s == ' ' || *s == '\t')) {
+        s++;
+    }
+    if (end - s < 3 || (*s != 'q' && *s != 'Q') || s[1] != '=') {
+        return 0;
+    }
+    for (s += 2; s < end && (*s == '0' || *s == '.'); s++);
+    return s == end || *s == ' ' || *s == '\t';
+}
+
+/*
+ * notes which of the codings files may be sent in are accepted by the len
+ * bytes at val of an Accept-Encoding header, which is a list like
+ *
+ *      gzip, deflate;q=0.5, br;q=0
+ *
+ * in which codings with a q of 0 are not accepted, and * stands for any
+ * coding not listed
+ */
+static void parse_accept_encoding(struct http *p, const char *val,
+        size_t len) {
+    const char *end = val + len, *tok_end, *params;
+    int listed = 0, accepted = 0, any = 0, flag;
+    size_t tok_len;
+
+    while (val < end) {
+        tok_end = (const char*) memchr(val, ',', end - val);
+        if (tok_end == NULL) {
+            tok_end = end;
+        }
+        while (val < tok_end && (*val == ' ' || *val == '\t')) {
+            val++;
+        }
+        params = (const char*) memchr(val, ';', tok_end - val);
+        if (params == NULL) {
+            params = tok_end;
+        }
+        for (tok_len = params - val; tok_len > 0 &&
+                (val[tok_len - 1] == ' ' || val[tok_len - 1] == '\t');
+                tok_len--);
+
+        if (TOKEN_IS(val, tok_len, "gzip") || TOKEN_IS(val, tok_len, "x-gzip")) {
+            flag = ACCEPT_GZIP;
+        }
+        else if (TOKEN_IS(val, tok_len, "br")) {
+            flag = ACCEPT_BR;
+        }
+        else if (TOKEN_IS(val, tok_len, "deflate")) {
+            flag = ACCEPT_DEFLATE;
+        }
+        else if (TOKEN_IS(val, tok_len, "*")) {
+            any = !zero_qvalue(params, tok_end);
+            flag = 0;
+        }
+        else {
+            flag = 0;
+        }
+
+        listed |= flag;
+        if (!zero_qvalue(params, tok_end)) {
+            accepted |= flag;
+        }
+        val = tok_end + 1;
+    }
+
+    if (any) {
+        accepted |= (ACCEPT_GZIP | ACCEPT_BR | ACCEPT_DEFLATE) & ~listed;
+    }
+    p->status |= accepted;
+}
+
+
 /*
  * parse HTTP option, which is expected to be of the form
  *
@@ -572,179 +1029,335 @@ static __inline int parse_version(struct http *p, char *buf) {
  *
  * and the options which are not ignored are as follows:
  */
-static __inline int parse_option(struct http *p, char *buf, ssize_t buf_len) {
+static __inline int parse_option(struct http *p, const dmsg_list *req,
+        const struct scan_line *line, char *buf) {
+
+    // lines used to be parsed as strings, which ended at the first null
+    // byte, and the same is still done here
+    size_t str_len = (line->nul == -1) ? line->len : (size_t) line->nul;
 
-    if (strcmp(buf, "\r") == 0) {
+    if (str_len == 1 && *line_token(req, line, 0, 1, buf) == '\r') {
         // empty line indicates end of header options
         set_state(p, RESPONSE);
         set_status(p, ok);
         return HTTP_END_OF_OPTIONS;
     }
-    if (buf_len == 1) {
+    if (line->len == 0) {
         // empty line without carriage return is invalid
         return HTTP_MALFORMED_OPTION;
     }
 
-    if (buf[buf_len - 2] != '\r') {
-        // each option line must end with "\r\n", and the '\n' is set to the
-        // null-terminator by dmsg_getline, so we expect a carriage return at
-        // the end of the buffer
+    if (*line_token(req, line, line->len - 1, 1, buf) != '\r') {
+        // each option line must end with "\r\n"
         return HTTP_MALFORMED_OPTION;
     }
-    // set carriage return at EOL to null-terminator
-    buf[buf_len - 2] = '\0';
+    // the option ends at the carriage return
+    str_len = MIN(str_len, line->len - 1);
 
-    char *optval = strchr(buf, ':');
-    if (optval == NULL) {
+    if (line->colon == -1 || (size_t) line->colon >= str_len) {
         // option missing ':' after option name
         return HTTP_MALFORMED_OPTION;
     }
-    if (*(optval + 1) != ' ') {
+    if (*line_token(req, line, line->colon + 1, 1, buf) != ' ') {
         // must be a space immediately proceeding the ':'
         return HTTP_MALFORMED_OPTION;
     }
-    // null-terminate the option name
-    *optval = '\0';
 
-    // now set optval to lie at the beginning of the option value
-    optval += 2;
+    size_t name_len = line->colon;
+    size_t optval_len = str_len - (line->colon + 2);
+    const char *name = line_token(req, line, 0, name_len, buf);
 
-    if (strcmp(buf, "Connection") == 0) {
-        if (strcmp(optval, "keep-alive") == 0) {
+    if (TOKEN_IS(name, name_len, "Connection")) {
+        if (TOKEN_IS(line_token(req, line, line->colon + 2, optval_len,
+                        buf), optval_len, "keep-alive")) {
             set_keep_alive(p);
         }
     }
+    else if (TOKEN_IS(name, name_len, "Accept-Encoding")) {
+        parse_accept_encoding(p, line_token(req, line, line->colon + 2,
+                    optval_len, buf), optval_len);
+    }
     return 0;
 }
 
 
-int http_parse(struct http *p, dmsg_list *req) {
-    char *req_path = NULL;
-    char *method, *version;
-    char *tmp, buf[MAX_LINE];
-    ssize_t len;
-
-    char state = get_state(p);
-
-    while ((len = dmsg_getline(req, buf, sizeof(buf))) > 0) {
-        switch (state) {
-        case REQUEST:
-            if (errno == DMSG_PARTIAL_READ) {
-                // request header was too long
-               set_state(p, RESPONSE);
-               set_status(p, req_uri_too_large);
-               return HTTP_ERR;
-            }
+/*
+ * parses the request line at the offset pointer of req, using buf (of
+ * MAX_HEADER_SIZE bytes) for any token which spans more than one node
+ *
+ * returns HTTP_NOT_DONE on success, after which the headers follow, and
+ * HTTP_ERR on failure, with the status to respond with set
+ */
+static int parse_request_line(struct http *p, const dmsg_list *req,
+        const struct scan_line *line, char *buf) {
+    size_t uri_len;
 
-            http_clear(p);
+    http_clear(p);
 
-#define TEST_BAD_FORMAT \
-            if (tmp == NULL) { \
-                set_state(p, RESPONSE); \
-                set_status(p, bad_request); \
-                return HTTP_ERR; \
-            }
+    if (line->sp2 == -1 || (line->nul != -1 && line->nul < line->sp2)) {
+        // the method and the URI must each be followed by a space
+        set_state(p, RESPONSE);
+        set_status(p, bad_request);
+        return HTTP_ERR;
+    }
 
-            tmp = buf;
-            method = tmp;
+    if (parse_method(p, line_token(req, line, 0, line->sp1, buf),
+                line->sp1) != 0) {
+        // bad request method
+        set_state(p, RESPONSE);
+        set_status(p, bad_request);
+        return HTTP_ERR;
+    }
+    uri_len = line->sp2 - line->sp1 - 1;
+    if (uri_len > MAX_URI_SIZE) {
+        // longer than the path of any file which could be served
+        set_state(p, RESPONSE);
+        set_status(p, req_uri_too_large);
+        return HTTP_ERR;
+    }
+    if (parse_uri(p, line_token(req, line, line->sp1 + 1, uri_len, buf),
+                uri_len) != 0) {
+        // the URI was not properly formatted
+        set_state(p, RESPONSE);
+        set_status(p, not_found);
+        return HTTP_ERR;
+    }
+    if (p->file == NULL && fd_verify(p) != 0) {
+        // don't have permission to open this file, however we want
+        // to mask it as not_found, otherwise internals of our
+        // filesystem could be probed with many GET requests
+        set_state(p, RESPONSE);
+        set_status(p, not_found);
+        return HTTP_ERR;
+    }
+    if (parse_version(p, line_token(req, line, line->sp2 + 1,
+                    line->len - line->sp2 - 1, buf),
+                line->len - line->sp2 - 1) != 0) {
+        // not HTTP/1.0 or HTTP/1.1
+        release_file(p);
+        set_state(p, RESPONSE);
+        set_status(p, http_version_not_supported);
+        return HTTP_ERR;
+    }
+    return HTTP_NOT_DONE;
+}
 
-            tmp = strchr(method, ' ');
-            TEST_BAD_FORMAT;
-            *tmp = '\0';
-            req_path = tmp + 1;
 
-            tmp = strchr(req_path, ' ');
-            TEST_BAD_FORMAT;
-            *tmp = '\0';
-            version = tmp + 1;
+int http_parse(struct http *p, dmsg_list *req) {
+    struct scan_line lines[SCAN_BATCH], *line;
+    // only used for tokens which span more than one node of req
+    char buf[MAX_HEADER_SIZE];
+    int ret, n, i;
 
-#undef TEST_BAD_FORMAT
+    char state = get_state(p);
 
-            if (parse_method(p, method) != 0) {
-                // bad request method
-                set_state(p, RESPONSE);
-                set_status(p, bad_request);
-                return HTTP_ERR;
+    while (1) {
+        n = scan_dmsg_lines(req, MAX_HEADER_SIZE, lines, SCAN_BATCH);
+        if (n == 0) {
+            if (lines[0].len < MAX_HEADER_SIZE) {
+                // the rest of the line has not been received yet
+                break;
             }
-            if (parse_uri(p, req_path) != 0) {
-                // the URI was not properly formatted
+            // no '\n' in the first MAX_HEADER_SIZE bytes, so skip past them
+            dmsg_seek(req, lines[0].len, SEEK_CUR);
+
+            if (state == REQUEST) {
+                // request header was too long
                 set_state(p, RESPONSE);
-                set_status(p, not_found);
+                set_status(p, req_uri_too_large);
                 return HTTP_ERR;
             }
-            if (fd_verify(p) != 0) {
-                // don't have permission to open this file, however we want
-                // to mask it as not_found, otherwise internals of our
-                // filesystem could be probed with many GET requests
+            if (state == HEADERS) {
+                release_file(p);
                 set_state(p, RESPONSE);
-                set_status(p, not_found);
+                set_status(p, bad_request);
                 return HTTP_ERR;
             }
-            if (parse_version(p, version) != 0) {
-                // not HTTP/1.0 or HTTP/1.1
-                close(p->fd);
-                p->fd = -1;
-                set_state(p, RESPONSE);
-                set_status(p, http_version_not_supported);
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            line = &lines[i];
+
+            switch (state) {
+            case REQUEST:
+                ret = parse_request_line(p, req, line, buf);
+                state = HEADERS;
+                break;
+            case HEADERS:
+                if (parse_option(p, req, line, buf) == HTTP_END_OF_OPTIONS) {
+                    prepare_response(p);
+                    ret = HTTP_DONE;
+                }
+                else {
+                    ret = HTTP_NOT_DONE;
+                }
+                break;
+            case RESPONSE:
+                // should not have called parse if in response state
                 return HTTP_ERR;
+            case BODY:
+            default:
+                ret = HTTP_NOT_DONE;
+                break;
             }
-            state = HEADERS;
-            break;
-        case HEADERS:
-            if (parse_option(p, buf, len) == HTTP_END_OF_OPTIONS) {
-                set_state(p, RESPONSE);
-                return HTTP_DONE;
+
+            // the tokens of the line are done with, so move past it, which
+            // is where the next line's offsets are from
+            dmsg_seek(req, line->len + 1, SEEK_CUR);
+            if (ret != HTTP_NOT_DONE) {
+                return ret;
             }
-            break;
-        case BODY:
-            break;
-        case RESPONSE:
-            // should not have called parse if in response state
-            return HTTP_ERR;
         }
     }
 
+    // remember how far we got, so parsing resumes in the same state once
+    // more of the request has arrived
+    set_state(p, state);
     return HTTP_NOT_DONE;
 }
 
 
-int http_respond(struct http *p, int fd) {
-    char buf[MAX_HEADER_SIZE];
-    int ret, len;
-    off64_t rem;
-    size_t read;
+int http_keep_alive(struct http *p) {
+    return keep_alive(p);
+}
 
-    switch (get_state(p)) {
-        case RESPONSE:
-            // need to write response headers to the socket. Note: these will
-            // always fit in the socket's kernel buffer if the polling
-            // mechanisms only call subsequent writes after the buffer has
-            // been entirely cleared (linux socket buffer size is 16KB by
-            // default, and OSX's is 32KB)
-
-            len = snprintf(buf, sizeof(buf),
-                    "HTTP/1.1 %s\r\n"
+int http_idle(struct http *p) {
+    return get_state(p) == REQUEST;
+}
+
+int http_state(struct http *p) {
+    return get_state(p);
+}
+
+int http_response_header(struct http *p, char *buf, size_t bufsize) {
+    unsigned enc = get_encoding(p);
+
+    return snprintf(buf, bufsize,
+            "HTTP/1.1 %s\r\n"
 #ifdef __APPLE__
-                    "Content-Length: %llu\r\n"
+            "Content-Length: %llu\r\n"
 #elif __linux__
-                    "Content-Length: %lu\r\n"
+            "Content-Length: %lu\r\n"
 #endif
-                    "Content-Type: %s\r\n"
-                    "\r\n",
-                    get_status_str((unsigned) get_status(p)), p->file_size,
-                    get_mime_type(p));
+            "Content-Type: %s\r\n"
+            "%s%s%s"
+            "%s"
+            "%s"
+            "\r\n",
+            get_status_str((unsigned) get_status(p)), p->file_size,
+            get_mime_type(p),
+            (enc != ENC_IDENTITY) ? "Content-Encoding: " : "",
+            (enc != ENC_IDENTITY) ? encodings[enc].name : "",
+            (enc != ENC_IDENTITY) ? "\r\n" : "",
+            (p->status & VARY_ENCODING) ? "Vary: Accept-Encoding\r\n" : "",
+            (get_status(p) == too_many_requests) ?
+                "Retry-After: 1\r\nConnection: close\r\n" : "");
+}
 
-            ret = write(fd, buf, len);
+const char* http_cached_response(struct http *p, size_t *len) {
+    const char *data;
+    unsigned tag;
 
-            if (ret == -1 && errno == EPIPE) {
-                // then the client connection was closed on the read end
-                set_state(p, REQUEST);
-                return HTTP_CLOSE;
-            }
+    if (p->file == NULL || get_status(p) != ok) {
+        return NULL;
+    }
+    data = fc_data(p->file, len, &tag);
+    // the response in memory may have been built for a request with other
+    // headers, such as one for the precompressed copy itself
+    return (tag == response_tag(p)) ? data : NULL;
+}
 
-            if (p->fd == -1) {
-                // then we have sent all we need to, can reset the state
-                break;
+int http_response_sent(struct http *p) {
+    int _keep_alive = keep_alive(p);
+    http_close(p);
+    set_state(p, REQUEST);
+    return _keep_alive ? HTTP_KEEP_ALIVE : HTTP_CLOSE;
+}
+
+void http_reject(struct http *p, enum status status) {
+    http_close(p);
+    p->file_size = 0;
+    p->offset = 0;
+    set_state(p, RESPONSE);
+    set_status(p, status);
+    set_mime_type(p, default_mime_type);
+}
+
+int http_respond(struct http *p, int fd, int more) {
+    char buf[MAX_HEADER_SIZE];
+    const char *data;
+    int ret, len, flags;
+    size_t data_len;
+    off64_t rem;
+    size_t read;
+
+    switch (get_state(p)) {
+        case RESPONSE:
+            // need to write response headers to the socket. If the socket's
+            // buffer fills up before they are all through, how many were
+            // sent is kept in p->header_sent, and the rest follow once it is
+            // writable again
+
+            data = http_cached_response(p, &data_len);
+            if (data != NULL) {
+                // the headers and the file are both in memory, so the whole
+                // response goes out in one send, or what is left of it if
+                // the socket's buffer filled up within the headers last time
+                ret = send(fd, data + p->header_sent,
+                        data_len - p->header_sent, more ? MSG_MORE : 0);
+                if (ret == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return HTTP_NOT_DONE;
+                    }
+                    set_state(p, REQUEST);
+                    return HTTP_CLOSE;
+                }
+
+                len = data_len - p->file_size;
+                if (p->header_sent + ret < len) {
+                    p->header_sent += ret;
+                    return HTTP_NOT_DONE;
+                }
+                // whatever of the file did not fit in the socket's buffer
+                // behind the headers is sent from the file
+                p->offset = p->header_sent + ret - len;
+                p->header_sent = len;
+                if (p->offset == p->file_size) {
+                    break;
+                }
+            }
+            else {
+                len = http_response_header(p, buf, sizeof(buf));
+
+                // hold the headers back if anything follows them, either the
+                // file or another response, so they don't go out in a packet
+                // of their own. The last part of a sendfile pushes them out
+                flags = (more || (p->fd != -1 && p->file_size > 0)) ?
+                    MSG_MORE : 0;
+                // the socket's buffer may have been filled by the file of the
+                // response before this one, in which case the headers go out
+                // over several calls, rendered the same way each time
+                ret = send(fd, buf + p->header_sent, len - p->header_sent,
+                        flags);
+
+                if (ret == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return HTTP_NOT_DONE;
+                    }
+                    // then the client connection was closed on the read end
+                    set_state(p, REQUEST);
+                    return HTTP_CLOSE;
+                }
+                p->header_sent += ret;
+                if (p->header_sent < len) {
+                    return HTTP_NOT_DONE;
+                }
+
+                if (p->fd == -1) {
+                    // then we have sent all we need to, can reset the state
+                    break;
+                }
             }
             set_state(p, SENDING_FILE);
         case SENDING_FILE:
@@ -774,10 +1387,7 @@ int http_respond(struct http *p, int fd) {
             return HTTP_ERR;
     }
 
-    int _keep_alive = keep_alive(p);
-    http_close(p);
-    set_state(p, REQUEST);
-    return _keep_alive ? HTTP_KEEP_ALIVE : HTTP_CLOSE;
+    return http_response_sent(p);
 }
 
 
@@ -4,6 +4,8 @@
 #include <string.h>
 
 #include "dmsg.h"
+#include "fcache.h"
+#include "zcache.h"
 
 #ifdef __APPLE__
 
@@ -52,7 +54,7 @@ typedef off_t off64_t;
 
 /* response status-codes */
 
-// 39 states, requre 6 bits
+// 42 states, requre 6 bits
 enum status {
     none = 0,
     cont,
@@ -89,6 +91,7 @@ enum status {
     unsupported_media_type,
     req_range_not_satisfiable,
     expectation_failed,
+    too_many_requests,
     internal_server_err,
     not_implemented,
     bad_gateway,
@@ -107,6 +110,17 @@ enum status {
 // keep-alive
 #define KEEP_ALIVE 0x80000
 
+// content codings the client accepts, in which precompressed or compressed
+// copies of the requested file may be sent
+#define ACCEPT_GZIP 0x100000
+#define ACCEPT_BR   0x200000
+// deflate is only ever made on the fly, as there are no precompressed copies
+// in it
+#define ACCEPT_DEFLATE 0x2000000
+
+// the response would differ for a client which accepted other codings
+#define VARY_ENCODING 0x1000000
+
 // method
 #define OPTIONS 0x00
 #define GET     0x10
@@ -124,6 +138,34 @@ enum status {
 // offset in status bitvector
 #define MIME_TYPE_OFFSET 14
 
+// content coding of the response, which is sent from a precompressed or
+// compressed copy of the requested file if it is not ENC_IDENTITY
+#define ENC_IDENTITY 0
+#define ENC_GZIP     1
+#define ENC_BR       2
+#define ENC_DEFLATE  3
+// number of bits taken by the content coding
+#define ENCODING_BITS   2
+// offset in status bitvector
+#define ENCODING_OFFSET 22
+
+
+// number of files kept open in the file cache by default
+#define DEFAULT_CACHED_FILES 1024
+// by default, size of the largest file whose whole response is kept in
+// memory, and how many kilobytes of responses are
+#define DEFAULT_MAX_RESPONSE_SIZE 16384
+#define DEFAULT_RESPONSE_CACHE_KB 32768
+// by default, the zlib level files are compressed with on the fly (0 for not
+// at all), the size of the smallest file which is, and how many kilobytes of
+// compressed files are kept
+#define DEFAULT_COMPRESS_LEVEL 0
+#define DEFAULT_MIN_COMPRESS_SIZE 256
+#define DEFAULT_COMPRESS_CACHE_KB 32768
+// size of the largest file compressed while its request waits, larger ones
+// being sent as they are until they have been compressed in the background
+#define COMPRESS_INLINE_SIZE 65536
+
 struct http {
     /*
      * bitpacking all states in status variable:
@@ -133,9 +175,14 @@ struct http {
      *  S - status
      *  T - MIME type of requested file
      *  A - keep-alive (1 = yes, 0 = no)
+     *  G - gzip accepted
+     *  B - br accepted
+     *  E - content coding of the response
+     *  Y - response varies with accepted codings
+     *  D - deflate accepted
      *
      * | msb                         lsb |
-     * ________ ____ATTT TTSSSSSS MMMMFFFV
+     * ______DY EEBGATTT TTSSSSSS MMMMFFFV
      *
      */
     int status;
@@ -145,30 +192,57 @@ struct http {
     // its value is undefined and should not be read
     int fd;
 
+    // the file cache entry fd belongs to, if it came from the cache, in which
+    // case fd is shared with other requests and must not be closed
+    struct fc_file *file;
+    // the compressed copy of the file fd belongs to, if the file is sent
+    // compressed on the fly, in which case fd is shared too
+    struct zc_file *zfile;
+
     // the size of the requested file, in bytes
     off64_t file_size;
 
     // number of bytes of data that have already been transmitted across the
     // connection
     off64_t offset;
+    // number of bytes of the status line and headers of the response which
+    // have been sent, for when the socket's buffer fills up before all of
+    // them are through
+    int header_sent;
 };
 
 /*
  * to be called once per process, initializes all global data used by the http
- * parser
+ * parser. Up to n_cached_files of the requested files are kept open in a
+ * cache, or none if it is 0, and the whole response to files of up to
+ * max_response_size bytes is kept in memory, taking up to max_response_bytes
+ * in all. Files of compressible types of at least min_compress_size bytes are
+ * sent gzip or deflate compressed at compress_level to clients accepting it,
+ * unless it is 0, with up to max_compressed_bytes of the compressed copies
+ * kept. Only files of the cache are ever compressed
  */
-int http_init();
+int http_init(unsigned n_cached_files, size_t max_response_size,
+        size_t max_response_bytes, int compress_level,
+        size_t min_compress_size, size_t max_compressed_bytes);
 
 /*
  * to be called once per process, inverse of http_init
  */
 void http_exit();
 
+/*
+ * prints how well the file cache has done
+ */
+void http_print_stats();
+
 
 
 static __inline void http_clear(struct http *h) {
     h->status = 0;
     h->fd = -1;
+    h->file = NULL;
+    h->zfile = NULL;
+    h->header_sent = 0;
 }
 
 /*
@@ -193,13 +267,74 @@ void http_close(struct http *h);
 int http_parse(struct http *p, dmsg_list *req);
 
 /*
- * writes an appropriate response to the socket file descriptor provided
+ * true if the http struct is waiting for the first line of a new request,
+ * i.e. it is neither in the middle of parsing a request nor responding to one
+ */
+int http_idle(struct http *p);
+
+/*
+ * gives the state of the request FSM (REQUEST, HEADERS, BODY, RESPONSE or
+ * SENDING_FILE)
+ */
+int http_state(struct http *p);
+
+/*
+ * true if the connection is to stay open once the response to the request
+ * parsed into p has been sent, so that it may send more requests
+ */
+int http_keep_alive(struct http *p);
+
+/*
+ * writes an appropriate response to the socket file descriptor provided.
+ * more is set if the response to another request is queued to be sent right
+ * after this one, in which case the headers are held back to go out in the
+ * same packets as what follows them
  *
  * return values:
  *  0 on success
  *  -1 on failure (i.e. socket closed)
  */
-int http_respond(struct http *p, int fd);
+int http_respond(struct http *p, int fd, int more);
+
+/*
+ * for servers which send the response themselves rather than through
+ * http_respond: renders the status line and headers of the response to a
+ * fully parsed request into buf, after which the file p->fd (if not -1) is
+ * to be sent from p->offset up to p->file_size, advancing p->offset
+ *
+ * returns the length of the headers, which is at least bufsize if they did
+ * not fit
+ */
+int http_response_header(struct http *p, char *buf, size_t bufsize);
+
+/*
+ * for servers which send the response themselves rather than through
+ * http_respond: gives the whole response to a fully parsed request, headers
+ * and file, if the file cache has it in memory, setting *len to its length.
+ * It stays valid until http_response_sent is called. As it holds the whole
+ * file, p->offset is to be set to p->file_size if it is used
+ *
+ * returns NULL if the response is not in memory, in which case it is sent
+ * with http_response_header
+ */
+const char* http_cached_response(struct http *p, size_t *len);
+
+/*
+ * to be called once the whole response rendered by http_response_header has
+ * been sent. Closes the requested file and readies the http struct for the
+ * next request
+ *
+ * returns HTTP_KEEP_ALIVE if the connection is to be kept alive, otherwise
+ * HTTP_CLOSE
+ */
+int http_response_sent(struct http *p);
+
+/*
+ * replaces the response to a request which has been parsed in full, and not
+ * yet answered, with a body-less one of the given status, after which the
+ * connection is closed
+ */
+void http_reject(struct http *p, enum status status);
 
 
 /*
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iptable.h"
+#include "setassoc.h"
+
+// tokens are kept in thousandths, so that rates of less than one request per
+// millisecond still refill a little on every request
+#define IPT_TOKEN 1000LU
+
+// the largest burst whose tokens fit in an entry
+#define IPT_MAX_BURST (UINT32_MAX / IPT_TOKEN)
+
+
+static __inline struct ipt_set* ipt_lock_set(struct ip_table *table,
+        uint32_t addr) {
+    struct ipt_set *set;
+
+    set = &table->sets[sa_set_index(addr * 0x9e3779b1U, table->set_mask)];
+    sa_spin_lock(&set->lock);
+    return set;
+}
+
+static __inline void ipt_unlock_set(struct ipt_set *set) {
+    sa_spin_unlock(&set->lock);
+}
+
+static __inline struct ipt_entry* ipt_find(struct ipt_set *set,
+        uint32_t addr) {
+    for (int i = 0; i < IPT_WAYS; i++) {
+        if (set->entries[i].addr == addr) {
+            return &set->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * adds the tokens earned by the entry since it was last refilled, up to the
+ * burst size
+ */
+static __inline void ipt_refill(struct ip_table *table, struct ipt_entry *e,
+        uint32_t now_ms) {
+    // wraps around correctly as long as the entry was refilled within the
+    // last 49 days
+    uint64_t tokens = e->tokens + ((uint64_t) (now_ms - e->last_ms)) *
+        table->rate;
+
+    e->tokens = (uint32_t) MIN(tokens, table->burst * IPT_TOKEN);
+    e->last_ms = now_ms;
+}
+
+
+int ipt_init(struct ip_table *table, unsigned n_entries, unsigned max_conns,
+        unsigned rate, unsigned burst) {
+    memset(table, 0, sizeof(struct ip_table));
+
+    if (sa_alloc((void **) &table->sets, &table->set_mask,
+                sizeof(struct ipt_set), IPT_WAYS, n_entries) != 0) {
+        fprintf(stderr, "Unable to malloc address table of %u entries\n",
+                n_entries);
+        return -1;
+    }
+
+    table->max_conns = max_conns;
+    table->rate = rate;
+    table->burst = MIN(burst == 0 ? rate : burst, IPT_MAX_BURST);
+    return 0;
+}
+
+void ipt_free(struct ip_table *table) {
+    free(table->sets);
+    table->sets = NULL;
+}
+
+
+int ipt_connect(struct ip_table *table, uint32_t addr, uint32_t now_ms) {
+    struct ipt_set *set;
+    struct ipt_entry *e, *victim = NULL;
+    int ret;
+
+    if (addr == 0) {
+        __atomic_fetch_add(&table->n_untracked, 1, __ATOMIC_RELAXED);
+        return IPT_UNTRACKED;
+    }
+
+    set = ipt_lock_set(table, addr);
+    e = ipt_find(set, addr);
+    if (e == NULL) {
+        // take an unused entry, or else the one idle the longest
+        for (int i = 0; i < IPT_WAYS && (victim == NULL || victim->addr != 0);
+                i++) {
+            e = &set->entries[i];
+            if (e->n_conns == 0 && (victim == NULL || e->addr == 0 ||
+                        now_ms - e->last_ms > now_ms - victim->last_ms)) {
+                victim = e;
+            }
+        }
+        if (victim == NULL) {
+            ipt_unlock_set(set);
+            __atomic_fetch_add(&table->n_untracked, 1, __ATOMIC_RELAXED);
+            return IPT_UNTRACKED;
+        }
+        if (victim->addr != 0) {
+            __atomic_fetch_add(&table->n_evictions, 1, __ATOMIC_RELAXED);
+        }
+
+        e = victim;
+        e->addr = addr;
+        e->n_conns = 0;
+        e->tokens = table->burst * IPT_TOKEN;
+        e->last_ms = now_ms;
+    }
+
+    if (table->max_conns > 0 && e->n_conns >= table->max_conns) {
+        ret = IPT_LIMITED;
+    }
+    else {
+        e->n_conns++;
+        ret = IPT_OK;
+    }
+    ipt_unlock_set(set);
+    return ret;
+}
+
+void ipt_disconnect(struct ip_table *table, uint32_t addr) {
+    struct ipt_set *set;
+    struct ipt_entry *e;
+
+    set = ipt_lock_set(table, addr);
+    e = ipt_find(set, addr);
+    // entries with connections open are never taken over, so it is still
+    // there
+    if (e != NULL && e->n_conns > 0) {
+        e->n_conns--;
+    }
+    ipt_unlock_set(set);
+}
+
+int ipt_request(struct ip_table *table, uint32_t addr, uint32_t now_ms) {
+    struct ipt_set *set;
+    struct ipt_entry *e;
+    int ret = IPT_OK;
+
+    if (table->rate == 0 || addr == 0) {
+        return IPT_OK;
+    }
+
+    set = ipt_lock_set(table, addr);
+    e = ipt_find(set, addr);
+    if (e != NULL) {
+        ipt_refill(table, e, now_ms);
+        if (e->tokens >= IPT_TOKEN) {
+            e->tokens -= IPT_TOKEN;
+        }
+        else {
+            ret = IPT_LIMITED;
+        }
+    }
+    ipt_unlock_set(set);
+    return ret;
+}
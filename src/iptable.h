@@ -0,0 +1,110 @@
+/*
+ * Per-address connection and request rate table
+ *
+ * Tracks, for each IPv4 address with connections open to the server, how
+ * many connections it has open and a token bucket of the requests it may
+ * make. The table has a fixed number of entries, grouped into sets of
+ * IPT_WAYS entries which fit in a cache line along with the spinlock
+ * guarding them, so a lookup touches a single cache line and threads only
+ * contend when their addresses hash to the same set. The entries are kept in
+ * the sets themselves rather than pointed to from an sa_set, which would take
+ * a second cache line on every lookup, but the sets are allocated, indexed
+ * and locked as setassoc.h does its own.
+ *
+ * An address which finds its set full is given the entry of the address in
+ * that set which has gone longest without activity, as long as it has no
+ * connections open. If every entry of the set has connections open, the new
+ * address is not tracked at all, and is not limited
+ */
+#ifndef _IPTABLE_H
+#define _IPTABLE_H
+
+#include <stdint.h>
+
+#include "util.h"
+
+// number of entries in each set
+#define IPT_WAYS 3
+
+// returned by ipt_connect and ipt_request
+#define IPT_OK 0
+#define IPT_LIMITED 1
+// returned by ipt_connect for an address which could not be given an entry
+#define IPT_UNTRACKED 2
+
+
+struct ipt_entry {
+    // IPv4 address in network byte order, or 0 if the entry is unused
+    uint32_t addr;
+    // number of connections currently open from this address
+    uint32_t n_conns;
+    // requests this address may still make, in thousandths of a request
+    uint32_t tokens;
+    // time in milliseconds at which tokens was last refilled
+    uint32_t last_ms;
+};
+
+struct ipt_set {
+    int lock;
+    struct ipt_entry entries[IPT_WAYS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct ip_table {
+    struct ipt_set *sets;
+    // number of sets - 1, the number of sets being a power of 2
+    unsigned set_mask;
+
+    // maximum number of connections open from one address, or 0 for no limit
+    unsigned max_conns;
+    // number of requests per second one address may make on average, and
+    // how many it may make in a burst, or 0 for no limit
+    unsigned rate;
+    unsigned burst;
+
+    // number of times an address took over the entry of another
+    unsigned long n_evictions;
+    // number of connections from addresses which could not be tracked
+    unsigned long n_untracked;
+};
+
+
+/*
+ * initializes a table with room for at least n_entries addresses. Limits of
+ * 0 are not enforced, and a burst of 0 is taken to be one second's worth of
+ * requests
+ *
+ * returns 0 on success and -1 on failure
+ */
+int ipt_init(struct ip_table *table, unsigned n_entries, unsigned max_conns,
+        unsigned rate, unsigned burst);
+
+/*
+ * frees the memory held by the table. It is safe to free a zeroed table
+ */
+void ipt_free(struct ip_table *table);
+
+/*
+ * records a connection opened from addr at time now_ms, in milliseconds
+ *
+ * returns IPT_OK if the connection was counted, IPT_LIMITED if addr already
+ * has max_conns connections open, in which case nothing was counted, or
+ * IPT_UNTRACKED if the address could not be given an entry. Only connections
+ * for which IPT_OK was returned may be passed to ipt_disconnect
+ */
+int ipt_connect(struct ip_table *table, uint32_t addr, uint32_t now_ms);
+
+/*
+ * records that a connection counted by ipt_connect was closed
+ */
+void ipt_disconnect(struct ip_table *table, uint32_t addr);
+
+/*
+ * takes a token from the bucket of addr for a request made at time now_ms
+ *
+ * returns IPT_OK if the request may be served, and IPT_LIMITED if addr has
+ * run out of tokens. Requests from addresses without an entry are never
+ * limited
+ */
+int ipt_request(struct ip_table *table, uint32_t addr, uint32_t now_ms);
+
+#endif /* _IPTABLE_H */
@@ -21,14 +21,16 @@
 
 
 #ifdef DEBUG
-#define OPTSTR "b:hl:np:qt:vV"
+#define OPTSTR "a:A:b:B:c:Cd:D:e:f:F:g:hH:i:k:K:l:L:m:M:nop:P:qrRs:S:t:uvVw:Wx:X:Y:z:Z:"
 #else
-#define OPTSTR "b:hl:p:qt:vV"
+#define OPTSTR "a:A:b:B:c:Cd:D:e:f:F:g:hH:i:k:K:l:L:m:M:op:P:qrRs:S:t:uvVw:Wx:X:Y:z:Z:"
 #endif
 
 
 static struct server server;
 static int nthreads = 0;
+// if set, SIGINT and SIGTERM drain the server rather than closing it outright
+static int drain = 0;
 
 // if not -1, the file descriptor of the open file where all output of this
 // program is dumped
@@ -41,7 +43,92 @@ void usage(const char* program_name) {
            "\t\t\tThe default is %d\n"
            "\t-b backlog\tnumber of connections to backlog in\n"
            "\t\t\tthe listen syscall. The default is %d\n"
+           "\t-a burst\tmaximum number of connections accepted\n"
+           "\t\t\tin one go. The default is %d\n"
            "\t-t n_threads\tnumber of worker threads to create\n"
+           "\t-r\t\trun shared-nothing, giving each worker thread\n"
+           "\t\t\tits own listening socket (with SO_REUSEPORT),\n"
+           "\t\t\tevent queue and client list\n"
+           "\t-u\t\tdrive the event loops with io_uring instead\n"
+           "\t\t\tof epoll (Linux only, implies -r)\n"
+           "\t-A n_acceptors\taccept connections on this many dedicated\n"
+           "\t\t\tthreads, which hand them to the workers, each\n"
+           "\t\t\twith an event loop of its own (not with -u)\n"
+           "\t-C\t\twith -A, hand each connection to the worker\n"
+           "\t\t\twith the fewest connections instead of to\n"
+           "\t\t\teach worker in turn\n"
+           "\t-W\t\tlet idle workers steal connections with events\n"
+           "\t\t\tto be handled from the loops of busy workers\n"
+           "\t\t\t(implies -r unless -A is given, not with -u)\n"
+           "\t-P place\tbind the workers to CPUs, one per CPU (cpu),\n"
+           "\t\t\tper physical core (core) or per last-level\n"
+           "\t\t\tcache (l3), or to a list of CPUs such as\n"
+           "\t\t\t0-3,8. Without -t, one worker is started for\n"
+           "\t\t\teach CPU picked\n"
+           "\t-R\t\tsteer each connection to a worker bound to the\n"
+           "\t\t\tCPU which received it (Linux only, implies -r\n"
+           "\t\t\tunless -A is given, and -P cpu unless -P is\n"
+           "\t\t\tgiven)\n"
+           "\t-B spin_us\tlet idle workers poll for events without\n"
+           "\t\t\tblocking for up to spin_us microseconds before\n"
+           "\t\t\tthey go to sleep. The default is 0\n"
+           "\t-e max_events\tmaximum number of events each worker\n"
+           "\t\t\tharvests per wakeup. The default is %d\n"
+           "\t-g tick_ms\tgranularity of connection timeouts, in\n"
+           "\t\t\tmilliseconds. The default is %d\n"
+           "\t-w n_clients\tnumber of client structs each worker\n"
+           "\t\t\tallocates up front. The default is 0\n"
+           "\t-f n_files\tnumber of requested files kept open, along\n"
+           "\t\t\twith their size and type, or 0 to open them on\n"
+           "\t\t\tevery request. The default is %d\n"
+           "\t-x max_size\tsize in bytes of the largest file whose whole\n"
+           "\t\t\tresponse is kept in memory, or 0 for none.\n"
+           "\t\t\tThe default is %d\n"
+           "\t-X cache_kb\tkilobytes of responses kept in memory. The\n"
+           "\t\t\tdefault is %d\n"
+           "\t-z level\tsend text files (html, css, js, json, xml,\n"
+           "\t\t\tcsv) gzip or deflate compressed at this zlib\n"
+           "\t\t\tlevel (1-9) to clients accepting it, or 0 for\n"
+           "\t\t\tnever. Needs -f. The default is %d\n"
+           "\t-Z min_size\tsize in bytes of the smallest file compressed\n"
+           "\t\t\tunder -z. The default is %d\n"
+           "\t-Y cache_kb\tkilobytes of compressed files kept under -z.\n"
+           "\t\t\tThe default is %d\n"
+           "\t-d drain_ms\ton SIGINT or SIGTERM, stop accepting and let\n"
+           "\t\t\tthe requests in progress finish for up to\n"
+           "\t\t\tdrain_ms milliseconds before shutting down.\n"
+           "\t\t\tWithout this, the server shuts down right away\n"
+           "\t-D defer_s\tonly accept connections once they have sent\n"
+           "\t\t\tdata, or after defer_s seconds, and read the\n"
+           "\t\t\tfirst request right away (Linux only)\n"
+           "\t-F qlen\t\taccept TCP Fast Open connections, with up to\n"
+           "\t\t\tqlen waiting to be accepted, and read the\n"
+           "\t\t\tfirst request right away. 0 uses the default\n"
+           "\t\t\tof %d\n"
+           "\t-c max_conns\tmaximum number of concurrent connections.\n"
+           "\t\t\tThe default is no limit\n"
+           "\t-m max_kb\tmaximum number of kilobytes received from\n"
+           "\t\t\tclients held in memory. The default is no limit\n"
+           "\t-o\t\tonce at a limit, answer new connections with\n"
+           "\t\t\t503 instead of leaving them in the backlog\n"
+           "\t-i max_conns\tmaximum number of concurrent connections from\n"
+           "\t\t\tone IP address. The default is no limit\n"
+           "\t-s rate\t\tmaximum number of requests per second from\n"
+           "\t\t\tone IP address. The default is no limit\n"
+           "\t-k burst\tnumber of requests one IP address may make\n"
+           "\t\t\tat once under -s. The default is the rate\n"
+           "\t-L line_ms\ttime a request has to send its request line,\n"
+           "\t\t\tin milliseconds. The default is %d\n"
+           "\t-H headers_ms\ttime a request has to send all of its\n"
+           "\t\t\theaders, in milliseconds. The default is %d\n"
+           "\t-K idle_ms\ttime a keep-alive connection is kept open\n"
+           "\t\t\tbetween requests, in milliseconds. The default\n"
+           "\t\t\tis %d\n"
+           "\t-S stall_ms\ttime a response may go without progress, in\n"
+           "\t\t\tmilliseconds. The default is %d\n"
+           "\t-M min_rate\tminimum average rate of responses past their\n"
+           "\t\t\tfirst stall_ms, in bytes per second, or 0 for\n"
+           "\t\t\tnone. The default is %d\n"
            "\n"
            "\t-q\t\trun in quiet mode, which only prints errors\n"
            "\t\t\t(note: to optimize out prints, #define QUIET\n"
@@ -52,7 +139,15 @@ void usage(const char* program_name) {
            "\t-l out_file\tlogs all output of the server in supplied file\n"
            "\n"
            "\t-h\t\tdisplay this message\n",
-           program_name, DEFAULT_PORT, DEFAULT_BACKLOG);
+           program_name, DEFAULT_PORT, DEFAULT_BACKLOG, DEFAULT_ACCEPT_BURST,
+           DEFAULT_MAX_EVENTS,
+           DEFAULT_TIMER_TICK_MS, DEFAULT_CACHED_FILES,
+           DEFAULT_MAX_RESPONSE_SIZE, DEFAULT_RESPONSE_CACHE_KB,
+           DEFAULT_COMPRESS_LEVEL, DEFAULT_MIN_COMPRESS_SIZE,
+           DEFAULT_COMPRESS_CACHE_KB,
+           DEFAULT_FASTOPEN_QLEN,
+           DEFAULT_REQUEST_LINE_MS, DEFAULT_HEADERS_MS,
+           DEFAULT_IDLE_MS, DEFAULT_STALL_MS, DEFAULT_MIN_RATE);
 
     exit(1);
 }
@@ -62,11 +157,46 @@ void close_handler(int signum);
 
 
 int init(struct server *server, int argc, char *argv[]) {
-    int c, port, backlog, ret;
+    int c, port, backlog, accept_burst, max_events, tick_ms, prewarm,
+        drain_ms, request_line_ms, headers_ms, idle_ms, stall_ms, defer_accept,
+        fastopen_qlen, n_acceptors, handoff_policy, placement, busy_poll_us,
+        n_cached_files, compress_level, flags, ret;
+    long max_clients, max_kb, peer_max_conns, peer_rate, peer_burst, min_rate,
+         max_response_size, response_cache_kb, min_compress_size,
+         compress_cache_kb;
     char* endptr;
+    const char *cpu_list = NULL;
 
     port = DEFAULT_PORT;
     backlog = DEFAULT_BACKLOG;
+    accept_burst = DEFAULT_ACCEPT_BURST;
+    max_events = DEFAULT_MAX_EVENTS;
+    tick_ms = DEFAULT_TIMER_TICK_MS;
+    prewarm = 0;
+    placement = TOPO_PLACE_NONE;
+    busy_poll_us = 0;
+    drain_ms = DEFAULT_DRAIN_MS;
+    request_line_ms = DEFAULT_REQUEST_LINE_MS;
+    headers_ms = DEFAULT_HEADERS_MS;
+    idle_ms = DEFAULT_IDLE_MS;
+    stall_ms = DEFAULT_STALL_MS;
+    min_rate = DEFAULT_MIN_RATE;
+    defer_accept = 0;
+    fastopen_qlen = 0;
+    n_acceptors = DEFAULT_N_ACCEPTORS;
+    handoff_policy = HANDOFF_ROUND_ROBIN;
+    max_clients = 0;
+    max_kb = 0;
+    peer_max_conns = 0;
+    peer_rate = 0;
+    peer_burst = 0;
+    n_cached_files = DEFAULT_CACHED_FILES;
+    max_response_size = DEFAULT_MAX_RESPONSE_SIZE;
+    response_cache_kb = DEFAULT_RESPONSE_CACHE_KB;
+    compress_level = DEFAULT_COMPRESS_LEVEL;
+    min_compress_size = DEFAULT_MIN_COMPRESS_SIZE;
+    compress_cache_kb = DEFAULT_COMPRESS_CACHE_KB;
+    flags = 0;
 
 #define NUM_OPT \
     strtol(optarg, &endptr, 0);                 \
@@ -76,24 +206,212 @@ int init(struct server *server, int argc, char *argv[]) {
 
     while ((c = getopt(argc, argv, OPTSTR)) != -1) {
         switch (c) {
+        case 'a':
+            accept_burst = NUM_OPT;
+            if (accept_burst <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'A':
+            n_acceptors = NUM_OPT;
+            if (n_acceptors <= 0) {
+                usage(argv[0]);
+            }
+            flags |= SERVER_ACCEPTOR_THREADS;
+            break;
         case 'b':
             backlog = NUM_OPT;
             break;
+        case 'B':
+            busy_poll_us = NUM_OPT;
+            if (busy_poll_us < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            max_clients = NUM_OPT;
+            if (max_clients < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'C':
+            handoff_policy = HANDOFF_LEAST_CONNS;
+            break;
+        case 'd':
+            drain_ms = NUM_OPT;
+            if (drain_ms < 0) {
+                usage(argv[0]);
+            }
+            drain = 1;
+            break;
+        case 'D':
+            defer_accept = NUM_OPT;
+            if (defer_accept <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            max_events = NUM_OPT;
+            if (max_events <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'g':
+            tick_ms = NUM_OPT;
+            if (tick_ms <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'f':
+            n_cached_files = NUM_OPT;
+            if (n_cached_files < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'F':
+            fastopen_qlen = NUM_OPT;
+            if (fastopen_qlen < 0) {
+                usage(argv[0]);
+            }
+            if (fastopen_qlen == 0) {
+                fastopen_qlen = DEFAULT_FASTOPEN_QLEN;
+            }
+            break;
+        case 'H':
+            headers_ms = NUM_OPT;
+            if (headers_ms <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'i':
+            peer_max_conns = NUM_OPT;
+            if (peer_max_conns < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            peer_burst = NUM_OPT;
+            if (peer_burst < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'K':
+            idle_ms = NUM_OPT;
+            if (idle_ms <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            request_line_ms = NUM_OPT;
+            if (request_line_ms <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            max_kb = NUM_OPT;
+            if (max_kb < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'M':
+            min_rate = NUM_OPT;
+            if (min_rate < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            flags |= SERVER_SHED_OVERLOAD;
+            break;
         case 'p':
             port = NUM_OPT;
             break;
+        case 'P':
+            if (strcmp(optarg, "cpu") == 0) {
+                placement = TOPO_PLACE_CPUS;
+            }
+            else if (strcmp(optarg, "core") == 0) {
+                placement = TOPO_PLACE_CORES;
+            }
+            else if (strcmp(optarg, "l3") == 0) {
+                placement = TOPO_PLACE_L3;
+            }
+            else {
+                placement = TOPO_PLACE_LIST;
+                cpu_list = optarg;
+            }
+            break;
         case 'q':
             vlevel = V0;
             break;
+        case 'r':
+            flags |= SERVER_SHARED_NOTHING;
+            break;
+        case 'R':
+            flags |= SERVER_CPU_STEERING;
+            break;
+        case 's':
+            peer_rate = NUM_OPT;
+            if (peer_rate < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'S':
+            stall_ms = NUM_OPT;
+            if (stall_ms <= 0) {
+                usage(argv[0]);
+            }
+            break;
         case 't':
             nthreads = NUM_OPT;
             break;
+        case 'u':
+            flags |= SERVER_IO_URING;
+            break;
         case 'v':
             vlevel = V1;
             break;
         case 'V':
             vlevel = V2;
             break;
+        case 'w':
+            prewarm = NUM_OPT;
+            if (prewarm < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'W':
+            flags |= SERVER_WORK_STEALING;
+            break;
+        case 'x':
+            max_response_size = NUM_OPT;
+            if (max_response_size < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'X':
+            response_cache_kb = NUM_OPT;
+            if (response_cache_kb < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'Y':
+            compress_cache_kb = NUM_OPT;
+            if (compress_cache_kb < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'z':
+            compress_level = NUM_OPT;
+            if (compress_level < 0 || compress_level > 9) {
+                usage(argv[0]);
+            }
+            break;
+        case 'Z':
+            min_compress_size = NUM_OPT;
+            if (min_compress_size < 0) {
+                usage(argv[0]);
+            }
+            break;
         case 'l':
             output_fd = open(optarg, O_RDWR | O_TRUNC | O_CREAT | O_SYNC, 0644);
             if (output_fd == -1) {
@@ -112,16 +430,41 @@ int init(struct server *server, int argc, char *argv[]) {
 
 #undef NUM_OPT
 
-    if ((ret = init_server3(server, port, backlog)) != 0) {
+    if ((ret = init_server4(server, port, backlog, flags)) != 0) {
         printf("Failed to initialize server\n");
         return ret;
     }
+    server->accept_burst = accept_burst;
+    server->max_events = max_events;
+    server->timer_tick_ms = tick_ms;
+    server->prewarm_clients = prewarm;
+    server->drain_ms = drain_ms;
+    server->request_line_ms = request_line_ms;
+    server->headers_ms = headers_ms;
+    server->idle_ms = idle_ms;
+    server->stall_ms = stall_ms;
+    server->min_rate = min_rate;
+    server->defer_accept = defer_accept;
+    server->fastopen_qlen = fastopen_qlen;
+    server->n_acceptors = n_acceptors;
+    server->handoff_policy = handoff_policy;
+    server->busy_poll_us = busy_poll_us;
+    server->placement = placement;
+    server->cpu_list = cpu_list;
+    server->max_clients = max_clients;
+    server->max_buffered = max_kb * 1024;
+    server->peer_max_conns = peer_max_conns;
+    server->peer_rate = peer_rate;
+    server->peer_burst = peer_burst;
 
     signal(SIGINT, close_handler);
+    signal(SIGTERM, close_handler);
     signal(SIGUSR2, close_handler);
 
     // initialize const globals in http processor
-    if (http_init() != 0) {
+    if (http_init(n_cached_files, max_response_size,
+                response_cache_kb * 1024, compress_level, min_compress_size,
+                compress_cache_kb * 1024) != 0) {
         return 1;
     }
 
@@ -129,6 +472,15 @@ int init(struct server *server, int argc, char *argv[]) {
 }
 
 void close_handler(int signum) {
+    if (drain) {
+        // the server is closed by main once run_server returns, and any
+        // further signals are ignored while it drains
+        if (!server.draining) {
+            drain_server(&server);
+        }
+        return;
+    }
+
     close_server(&server);
 
     // clean up memory used by http processor
@@ -165,10 +517,18 @@ int main(int argc, char *argv[]) {
     print_server_params(&server);
 
     if (nthreads == 0) {
-        run_server(&server);
+        ret = run_server(&server);
     }
     else {
-        run_server2(&server, nthreads);
+        ret = run_server2(&server, nthreads);
+    }
+
+    if (ret == 0 && server.draining) {
+        // this thread's loop has drained, so wait for the rest
+        close_server(&server);
+        http_exit();
+        fflush(stdout);
+        fflush(stderr);
     }
 
     if (output_fd != -1) {
@@ -89,8 +89,21 @@ struct thread_info {
     void *arg;
     int flags;
     int thread_id;
+    // the CPU the thread is bound to, or -1 if it is not bound to any
+    int cpu;
 };
 
+/*
+ * gives the CPU thread thread_id is to be bound to, or -1 if none
+ */
+static int thread_cpu(struct mt_context *context, int thread_id,
+        int options) {
+    if (context->cpus != NULL) {
+        return context->cpus[thread_id % context->n_cpus];
+    }
+    return (options & MT_PARTITION) ? thread_id : -1;
+}
+
 static void* thread_init(void* data) {
     struct thread_info *info = (struct thread_info *) data;
     void *(*start_routine) (void *) = info->start_routine;
@@ -99,8 +112,8 @@ static void* thread_init(void* data) {
         .thread_id = info->thread_id
     };
 
-    if (info->flags & MT_PARTITION) {
-        pthread_setaffinity(pthread_self(), arg.thread_id);
+    if (info->cpu != -1) {
+        pthread_setaffinity(pthread_self(), info->cpu);
     }
 
     free(info);
@@ -123,7 +136,7 @@ int init_mt_context(struct mt_context *context, size_t n_threads,
     cpu_set_t cpu_aff;
 #endif
 
-    if (options & MT_PARTITION) {
+    if ((options & MT_PARTITION) && context->cpus == NULL) {
         ncpus = get_n_cpus();
         if (n_threads != ncpus) {
             fprintf(stderr, "Number of threads (%lu) must equal number of "
@@ -158,11 +171,16 @@ int init_mt_context(struct mt_context *context, size_t n_threads,
         ti->arg = arg;
         ti->flags = options;
         ti->thread_id = ((int) i) + 1;
+        ti->cpu = thread_cpu(context, ti->thread_id, options);
 
 #ifdef __linux__
-        CPU_ZERO(&cpu_aff);
-        CPU_SET(ti->thread_id, &cpu_aff);
-        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu_aff);
+        if (ti->cpu != -1) {
+            // so the thread never runs anywhere else, even before it gets to
+            // thread_init
+            CPU_ZERO(&cpu_aff);
+            CPU_SET(ti->cpu, &cpu_aff);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu_aff);
+        }
 #endif
 
         if ((err = pthread_create(&threads[i], &attr,
@@ -190,10 +208,8 @@ int init_mt_context(struct mt_context *context, size_t n_threads,
     ti->arg = arg;
     ti->flags = options;
     ti->thread_id = 0;
+    ti->cpu = thread_cpu(context, 0, options);
 
-#ifdef __linux__
-    pthread_setaffinity(pthread_self(), 0);
-#endif
     thread_init(ti);
     return 0;
 }
@@ -4,6 +4,12 @@
 struct mt_context {
     pthread_t *threads;
     size_t n_threads;
+
+    // if set before init_mt_context is called, thread i is bound to CPU
+    // cpus[i % n_cpus], whatever the options. The array is owned by the
+    // caller
+    const int *cpus;
+    size_t n_cpus;
 };
 
 
@@ -47,7 +53,9 @@ static __inline void clear_mt_context(struct mt_context *context) {
  *  MT_PARTITION: sets the CPU affinities of each thread so that they are
  *      evenly distributed across the available processors. Note: if this
  *      flag is set, then n_threads must equal the number of logical cpus
- *      on this machine (get_n_cpus() in util.h)
+ *      on this machine (get_n_cpus() in util.h), unless the CPUs have been
+ *      given in context->cpus. Without either,
+ *      the threads are not bound to any CPU
  *  MT_SYNC_BARRIER: only begins execution of each thread once every thread
  *      has been successfully created. Can be used to ensure that if the
  *      initialization fails, none of the threads will have done any processing
@@ -84,62 +84,177 @@ token_t* pattern_deep_copy(token_t *token) {
 
 
 
+void match_ctx_init(match_ctx_t *ctx) {
+    ctx->counts = ctx->inline_counts;
+    ctx->n_counts = 0;
+    ctx->capacity = MATCH_CTX_INLINE;
+    ctx->present = 0;
+    ctx->nomem = 0;
+}
+
+void match_ctx_free(match_ctx_t *ctx) {
+    if (ctx->counts != ctx->inline_counts) {
+        free(ctx->counts);
+    }
+    match_ctx_init(ctx);
+}
+
+/*
+ * gives the bit of the token in the present mask of a context
+ */
+static __inline uint64_t present_bit(token_t *patt) {
+    return 1LU << ((((uintptr_t) patt) * 0x9e3779b97f4a7c15LU) >> 58);
+}
+
+/*
+ * gives the index of the token's repetition count in the context, or -1 if
+ * it has not been repeated on the current path
+ */
+static __inline int find_rep_count(match_ctx_t *ctx, token_t *patt) {
+    if (!(ctx->present & present_bit(patt))) {
+        return -1;
+    }
+    // the token being repeated is most likely the one repeated last
+    for (int i = ((int) ctx->n_counts) - 1; i >= 0; i--) {
+        if (ctx->counts[i].token == patt) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * doubles the room for repetition counts in the context
+ *
+ * returns 0 on success and -1 if the context is out of memory
+ */
+static int grow_rep_counts(match_ctx_t *ctx) {
+    struct rep_count *counts;
+
+    if (ctx->counts == ctx->inline_counts) {
+        counts = (struct rep_count *) malloc(2 * ctx->capacity *
+                sizeof(struct rep_count));
+        if (counts != NULL) {
+            memcpy(counts, ctx->counts,
+                    ctx->n_counts * sizeof(struct rep_count));
+        }
+    }
+    else {
+        counts = (struct rep_count *) realloc(ctx->counts,
+                2 * ctx->capacity * sizeof(struct rep_count));
+    }
+    if (counts == NULL) {
+        ctx->nomem = 1;
+        return -1;
+    }
+    ctx->counts = counts;
+    ctx->capacity *= 2;
+    return 0;
+}
+
+/*
+ * adds a repetition count of 1 for the token to the end of the context
+ *
+ * returns its index, or -1 if the context is out of memory
+ */
+static __inline int push_rep_count(match_ctx_t *ctx, token_t *patt) {
+    if (ctx->n_counts == ctx->capacity && grow_rep_counts(ctx) == -1) {
+        return -1;
+    }
+    ctx->counts[ctx->n_counts].token = patt;
+    ctx->counts[ctx->n_counts].count = 1;
+    ctx->present |= present_bit(patt);
+    return ctx->n_counts++;
+}
+
+
 /*
  * attempts to match as much of the given token as possible to the given
  * buffer, with offset being the index of the first character in buf in the
  * main string being matched, used only to calculate capturing group offsets
  *
+ * idx is the index of the token's repetition count in ctx, or -1 if it has
+ * none. Every change made to the repetition counts in ctx is undone before
+ * returning, so the index of a count stays valid across recursive calls, and
+ * is passed along when the token is matched again right away
+ *
  * returns the size of the region captured by the passed in token "patt", or
  * -1 on failure
  *
  * TODO pass in min + max (so loops in loops can work) and capturing (so don't
  * capture one group multiple times)
  */
-static int _pattern_match(token_t *patt, char *buf, int offset,
-        size_t n_matches, match_t matches[]) {
-
-    int ret = -1;
+static int _pattern_match_at(match_ctx_t *ctx, token_t *patt, int idx,
+        char *buf, int offset, size_t n_matches, match_t matches[]);
 
+static __inline int _pattern_match(match_ctx_t *ctx, token_t *patt,
+        char *buf, int offset, size_t n_matches, match_t matches[]) {
     if (patt == NULL) {
         return (*buf == '\0') ? 0 : -1;
     }
+    return _pattern_match_at(ctx, patt, find_rep_count(ctx, patt), buf,
+            offset, n_matches, matches);
+}
+
+static int _pattern_match_at(match_ctx_t *ctx, token_t *patt, int idx,
+        char *buf, int offset, size_t n_matches, match_t matches[]) {
+
+    int ret = -1;
 
     int captures = token_captures(patt);
 
     // count number of times a pattern was found
     literal *lit;
 
-    // use the tmp field of the token to count number of uses
-    // FIXME make this thread safe!
-#define rep_count tmp
-
-    int count = patt->rep_count;
+    int count = (idx == -1) ? 0 : ctx->counts[idx].count;
+    // the counts are only ever pushed and popped in order, so the mask can be
+    // put back as it was once this token's count is popped
+    uint64_t present = ctx->present;
 
     if (patt->max == -1 || patt->max > count) {
         // if we can match this pattern more, try to do so
-        patt->rep_count++;
+        // a token already on the path keeps its count where it is, even
+        // if it has since been started over at 0
+        int pushed = (idx == -1);
+        if (pushed) {
+            if ((idx = push_rep_count(ctx, patt)) == -1) {
+                return -1;
+            }
+        }
+        else {
+            ctx->counts[idx].count++;
+        }
 
         switch (token_type(patt)) {
             case TYPE_CC:
                 if (cc_is_match(&patt->node->cc, *buf)) {
-                    ret = _pattern_match(patt, buf + 1, offset + 1,
-                            n_matches, matches);
+                    ret = _pattern_match_at(ctx, patt, idx, buf + 1,
+                            offset + 1, n_matches, matches);
                 }
                 break;
             case TYPE_LITERAL:
                 lit = &patt->node->lit;
                 if (strncmp(buf, lit->word, lit->length) == 0) {
-                    ret = _pattern_match(patt, buf + lit->length,
-                            offset + lit->length, n_matches, matches);
+                    ret = _pattern_match_at(ctx, patt, idx,
+                            buf + lit->length, offset + lit->length,
+                            n_matches, matches);
                 }
                 break;
             case TYPE_TOKEN:
-                ret = _pattern_match(&patt->node->token, buf, offset,
+                ret = _pattern_match(ctx, &patt->node->token, buf, offset,
                         n_matches, matches);
                 break;
         }
 
-        patt->rep_count--;
+        if (pushed) {
+            // the count was pushed onto the end above
+            ctx->n_counts--;
+            ctx->present = present;
+            idx = -1;
+        }
+        else {
+            ctx->counts[idx].count--;
+        }
     }
     if (ret == -1) {
         // clear out the entry in matches that we will be writing the address
@@ -152,10 +267,15 @@ static int _pattern_match(token_t *patt, char *buf, int offset,
     }
     if (ret == -1 && count >= patt->min) {
         // if matching more did not work, see if only matching up to
-        // this point works
-        patt->rep_count = 0;
-        ret = _pattern_match(patt->next, buf, offset, n_matches, matches);
-        patt->rep_count = count;
+        // this point works, which starts the count of this token over
+        if (idx != -1) {
+            ctx->counts[idx].count = 0;
+        }
+        ret = _pattern_match(ctx, patt->next, buf, offset, n_matches,
+                matches);
+        if (idx != -1) {
+            ctx->counts[idx].count = count;
+        }
     }
 
     if (ret != -1 && captures && count == 0) {
@@ -176,7 +296,7 @@ static int _pattern_match(token_t *patt, char *buf, int offset,
 
         // first put n_matches back and set this group to not capturing,
         // as we are not using it
-        ret = _pattern_match(patt->alt, buf, offset, n_matches, matches);
+        ret = _pattern_match(ctx, patt->alt, buf, offset, n_matches, matches);
     }
     if (ret == -1 && captures && patt->match_idx < n_matches) {
         // if still no success, then this path was unsuccessful, so if we were
@@ -187,17 +307,34 @@ static int _pattern_match(token_t *patt, char *buf, int offset,
     return ret;
 }
 
-int pattern_match(token_t *patt, char *buf, size_t n_matches,
-        match_t matches[]) {
+int pattern_match_ctx(match_ctx_t *ctx, token_t *patt, char *buf,
+        size_t n_matches, match_t matches[]) {
 
     memset(matches, -1, n_matches * sizeof(match_t));
-    int ret = _pattern_match(patt, buf, 0, n_matches, matches);
+    ctx->n_counts = 0;
+    ctx->present = 0;
+    ctx->nomem = 0;
+    int ret = _pattern_match(ctx, patt, buf, 0, n_matches, matches);
+    if (ctx->nomem) {
+        return MATCH_NOMEM;
+    }
     if (ret < 0) {
         return MATCH_FAIL;
     }
     return 0;
 }
 
+int pattern_match(token_t *patt, char *buf, size_t n_matches,
+        match_t matches[]) {
+    match_ctx_t ctx;
+    int ret;
+
+    match_ctx_init(&ctx);
+    ret = pattern_match_ctx(&ctx, patt, buf, n_matches, matches);
+    match_ctx_free(&ctx);
+    return ret;
+}
+
 
 
 void _pattern_free(token_t *token) {
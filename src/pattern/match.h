@@ -113,6 +113,7 @@
 
 // failure codes
 #define MATCH_FAIL 1
+#define MATCH_NOMEM 2
 
 // char codes 0-255
 #define NUM_CHARS 128
@@ -215,6 +216,38 @@ typedef struct {
 } match_t;
 
 
+// number of repetition counts a match context holds before it has to malloc
+// room for more
+#define MATCH_CTX_INLINE 32
+
+/*
+ * the state of a match in progress, which is the number of times each token
+ * currently being matched has been repeated so far. Only tokens which have
+ * been repeated at least once are kept, which at any point are those nested
+ * within each other on the current path through the pattern, so there are
+ * few of them, and they are searched from the most recently repeated
+ *
+ * a pattern is never written to while being matched, so any number of
+ * threads may match the same pattern at once, each with a context of its own
+ */
+typedef struct match_ctx {
+    struct rep_count {
+        token_t *token;
+        int count;
+    } *counts;
+    unsigned n_counts;
+    unsigned capacity;
+    // one bit for each token in counts, picked by a hash of its address, so
+    // that looking up a token which is not in counts (the common case) can
+    // usually skip searching them
+    uint64_t present;
+    // set if room for more counts could not be malloced, failing the match
+    int nomem;
+
+    struct rep_count inline_counts[MATCH_CTX_INLINE];
+} match_ctx_t;
+
+
 
 // -------------------- pattern struct construction --------------------
 
@@ -269,15 +302,36 @@ token_t* pattern_deep_copy(token_t*);
 
 // -------------------- pattern matching ops -------------------
 
+/*
+ * initializes an empty match context, which can be used for any number of
+ * matches, one at a time
+ */
+void match_ctx_init(match_ctx_t *ctx);
+
+/*
+ * frees the memory held by a match context
+ */
+void match_ctx_free(match_ctx_t *ctx);
+
 /*
  * attempts to match the supplied string to the given pattern. A token will
  * continue matching until a failing condition is met, after which it
  * backtracks and tries matching to alternatives (or's in bnf form)
  *
+ * the state of the match is kept in ctx, which must not be in use by any
+ * other match, while the pattern is only read
+ *
  * return values:
  *  0: success
  *  MATCH_FAIL: no match found
- *  MATCH_OVERFLOW: more capturing groups were found than n_matches
+ *  MATCH_NOMEM: the context ran out of memory
+ */
+int pattern_match_ctx(match_ctx_t *ctx, token_t *patt, char *buf,
+        size_t n_matches, match_t matches[]);
+
+/*
+ * same as pattern_match_ctx, with a context of its own on the stack, so it
+ * is safe to call from any number of threads at once
  */
 int pattern_match(token_t *patt, char *buf, size_t n_matches,
         match_t matches[]);
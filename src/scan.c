@@ -0,0 +1,570 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+#include "scan.h"
+#include "util.h"
+
+
+// for the helpers of the vectorized scanners, which must be inlined into
+// each of them to be compiled for its instruction set, rather than called
+// with the upper halves of the AVX registers in use
+#define SCAN_INLINE __inline __attribute__((always_inline))
+
+
+/*
+ * where a scan is up to, which is carried from one block of bytes to the
+ * next, and from one line to the next
+ */
+struct scan_state {
+    // where the lines found are written, how many of them there is room for,
+    // and how many have been found so far
+    struct scan_line *lines;
+    int max_lines;
+    int n_lines;
+
+    // the bytes being scanned and their offset in the scan, with SIZE_MAX
+    // before any have been
+    const char *buf;
+    size_t buf_pos;
+
+    // offset of the start of the line being scanned, and of the delimiters
+    // found in it so far, all from the start of the scan, or -1
+    size_t start;
+    int sp1, sp2, colon, nul;
+    // all ones while that delimiter is still of interest, which stops being
+    // the case once the first two spaces, first colon or first NUL of the line
+    // have been found, so that blocks with only those in them are skipped
+    uint32_t want_sp, want_col, want_nul;
+};
+
+/*
+ * scans the len bytes at buf, which lie pos bytes into the scan, for the
+ * lines of the scan. Each version works on a copy of the state in locals,
+ * which the lines it writes can't alias, and hands it back once done
+ *
+ * returns 1 once the scan is done, and 0 if all len bytes were scanned and the
+ * scan goes on past them
+ */
+typedef int (*scan_fn)(const char *buf, size_t pos, size_t len,
+        struct scan_state *s);
+
+
+static __inline void scan_state_init(struct scan_state *s,
+        struct scan_line *lines, int max_lines) {
+    s->lines = lines;
+    s->max_lines = max_lines;
+    s->n_lines = 0;
+    s->buf = NULL;
+    s->buf_pos = SIZE_MAX;
+    s->start = 0;
+    s->sp1 = s->sp2 = s->colon = s->nul = -1;
+    s->want_sp = s->want_col = s->want_nul = 0xffffffff;
+}
+
+/*
+ * fills in line with the line being scanned, taking it to end at offset end
+ */
+static SCAN_INLINE void scan_state_save(const struct scan_state *s,
+        struct scan_line *line, size_t end) {
+    int start = (int) s->start;
+
+    line->len = end - s->start;
+    // a line which started in bytes scanned before these is in pieces
+    line->data = (s->start >= s->buf_pos) ?
+        s->buf + (s->start - s->buf_pos) : NULL;
+    line->sp1 = (s->sp1 == -1) ? -1 : s->sp1 - start;
+    line->sp2 = (s->sp2 == -1) ? -1 : s->sp2 - start;
+    line->colon = (s->colon == -1) ? -1 : s->colon - start;
+    line->nul = (s->nul == -1) ? -1 : s->nul - start;
+}
+
+/*
+ * ends the line being scanned at the '\n' at offset pos, and starts the next
+ * one right after it
+ *
+ * returns 1 once the scan is done, which is when as many lines as were asked
+ * for have been found, or after a blank line, which ends the headers of a
+ * request
+ */
+static SCAN_INLINE int scan_newline(struct scan_state *s, size_t pos) {
+    struct scan_line *line = &s->lines[s->n_lines++];
+
+    scan_state_save(s, line, pos);
+    s->start = pos + 1;
+    s->sp1 = s->sp2 = s->colon = s->nul = -1;
+    s->want_sp = s->want_col = s->want_nul = 0xffffffff;
+    return s->n_lines == s->max_lines || line->len <= 1;
+}
+
+
+/*
+ * scans the bytes of buf one at a time
+ */
+static int scan_scalar(const char *buf, size_t pos, size_t len,
+        struct scan_state *state) {
+    struct scan_state st = *state, *s = &st;
+    int ret = 0;
+    size_t i;
+
+    st.buf = buf;
+    st.buf_pos = pos;
+    for (i = 0; i < len; i++) {
+        char c = buf[i];
+
+        if (c > ':') {
+            // letters, which most bytes are
+            continue;
+        }
+        if (c == '\n') {
+            if (scan_newline(s, pos + i)) {
+                ret = 1;
+                break;
+            }
+        }
+        else if (c == ' ') {
+            if (s->sp1 == -1) {
+                s->sp1 = (int) (pos + i);
+            }
+            else if (s->sp2 == -1) {
+                s->sp2 = (int) (pos + i);
+                s->want_sp = 0;
+            }
+        }
+        else if (c == ':' && s->colon == -1) {
+            s->colon = (int) (pos + i);
+            s->want_col = 0;
+        }
+        else if (c == '\0' && s->nul == -1) {
+            s->nul = (int) (pos + i);
+            s->want_nul = 0;
+        }
+    }
+    *state = st;
+    return ret;
+}
+
+
+/*
+ * gives the first c from p up to end, or end if there is none
+ */
+static SCAN_INLINE const char* scan_next(const char *p, const char *end,
+        char c) {
+    const char *r = memchr(p, c, end - p);
+
+    return (r == NULL) ? end : r;
+}
+
+/*
+ * finds the end of each line with memchr, and each delimiter with memchr of
+ * its own. Where the next of each delimiter lies is kept from one line to the
+ * next, so each is searched for from where the last one was found, not once
+ * for every line, and the bytes between them are only looked at once
+ */
+static int scan_memchr(const char *buf, size_t pos, size_t len,
+        struct scan_state *state) {
+    struct scan_state st = *state, *s = &st;
+    const char *p = buf, *end = buf + len, *nl, *line_end;
+    // the next of each delimiter, or NULL until it is first looked for
+    const char *sp = NULL, *col = NULL, *nul = NULL;
+    int ret = 0;
+
+    st.buf = buf;
+    st.buf_pos = pos;
+    while (p < end) {
+        nl = memchr(p, '\n', end - p);
+        line_end = (nl == NULL) ? end : nl;
+
+        if (s->sp2 == -1) {
+            if (sp == NULL || sp < p) {
+                sp = scan_next(p, end, ' ');
+            }
+            if (sp < line_end && s->sp1 == -1) {
+                s->sp1 = (int) (pos + (sp - buf));
+                sp = scan_next(sp + 1, end, ' ');
+            }
+            if (sp < line_end) {
+                s->sp2 = (int) (pos + (sp - buf));
+                s->want_sp = 0;
+            }
+        }
+        if (s->colon == -1) {
+            if (col == NULL || col < p) {
+                col = scan_next(p, end, ':');
+            }
+            if (col < line_end) {
+                s->colon = (int) (pos + (col - buf));
+                s->want_col = 0;
+            }
+        }
+        if (s->nul == -1) {
+            if (nul == NULL || nul < p) {
+                nul = scan_next(p, end, '\0');
+            }
+            if (nul < line_end) {
+                s->nul = (int) (pos + (nul - buf));
+                s->want_nul = 0;
+            }
+        }
+
+        if (nl == NULL) {
+            break;
+        }
+        if (scan_newline(s, pos + (nl - buf))) {
+            ret = 1;
+            break;
+        }
+        p = nl + 1;
+    }
+    *state = st;
+    return ret;
+}
+
+
+/*
+ * records the delimiters still of interest in a block of bytes at offset pos
+ * of the scan, each given as a bitmask with bit i set if byte pos + i is one,
+ * which all lie in the line being scanned
+ */
+static SCAN_INLINE void scan_delims(struct scan_state *s, size_t pos,
+        uint32_t sp, uint32_t col, uint32_t nul) {
+    sp &= s->want_sp;
+    if (sp != 0) {
+        if (s->sp1 == -1) {
+            s->sp1 = (int) (pos + __builtin_ctz(sp));
+            sp &= sp - 1;
+        }
+        if (sp != 0) {
+            s->sp2 = (int) (pos + __builtin_ctz(sp));
+            s->want_sp = 0;
+        }
+    }
+    col &= s->want_col;
+    if (col != 0) {
+        s->colon = (int) (pos + __builtin_ctz(col));
+        s->want_col = 0;
+    }
+    nul &= s->want_nul;
+    if (nul != 0) {
+        s->nul = (int) (pos + __builtin_ctz(nul));
+        s->want_nul = 0;
+    }
+}
+
+/*
+ * records the delimiters of a block of bytes at offset pos of the scan, in
+ * the same form as scan_delims, ending a line at each '\n' in it
+ *
+ * returns 1 once the scan is done, and 0 otherwise
+ */
+static SCAN_INLINE int scan_block(struct scan_state *s, size_t pos,
+        uint32_t nl, uint32_t sp, uint32_t col, uint32_t nul) {
+    uint32_t first, done;
+
+    while (nl != 0) {
+        first = nl & -nl;
+        // only the delimiters before the '\n' are part of the line it ends
+        done = first - 1;
+        scan_delims(s, pos, sp & done, col & done, nul & done);
+        if (scan_newline(s, pos + __builtin_ctz(nl))) {
+            return 1;
+        }
+        done |= first;
+        nl &= ~done;
+        sp &= ~done;
+        col &= ~done;
+        nul &= ~done;
+    }
+    scan_delims(s, pos, sp, col, nul);
+    return 0;
+}
+
+
+// the compiler's own 16 byte vectors, which it turns into the SIMD
+// instructions of whichever CPU it builds for, such as NEON on ARM
+typedef char scan_v16 __attribute__((vector_size(16)));
+
+/*
+ * gives a bitmask with bit i set if bit b of byte i of the word w is set
+ */
+static SCAN_INLINE uint32_t scan_word_mask(uint64_t w, int b) {
+    return (uint32_t) ((((w >> b) & 0x0101010101010101ull) *
+                0x0102040810204080ull) >> 56);
+}
+
+/*
+ * scans the bytes of buf 16 at a time with the compiler's generic vectors,
+ * for CPUs the scanner has no version of its own for. The blocks are laid out
+ * as in scan_sse2
+ */
+static int scan_vector(const char *buf, size_t pos, size_t len,
+        struct scan_state *state) {
+    const scan_v16 nl = {
+        '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n',
+        '\n', '\n', '\n', '\n', '\n', '\n', '\n', '\n'
+    };
+    const scan_v16 sp = nl ^ ('\n' ^ ' ');
+    const scan_v16 col = nl ^ ('\n' ^ ':');
+    const scan_v16 zero = nl ^ '\n';
+    struct scan_state st, *s = &st;
+    uint32_t keep = 0xffff;
+    uint64_t w[2];
+    scan_v16 v, code;
+    size_t i, base;
+    unsigned char want;
+    int ret = 0;
+
+    if (len < 16) {
+        return scan_scalar(buf, pos, len, state);
+    }
+    st = *state;
+    st.buf = buf;
+    st.buf_pos = pos;
+
+    for (i = 0; i < len; i = base + 16) {
+        base = i;
+        if (i + 16 > len) {
+            base = len - 16;
+            keep <<= i - base;
+        }
+
+        // there is no cheap way to turn a comparison into a bitmask, so the
+        // four are merged into one vector, with a bit of each byte for each
+        // delimiter, which only has to be taken apart when it is of interest
+        memcpy(&v, buf + base, sizeof(v));
+        code = ((v == nl) & 1) | ((v == sp) & 2) | ((v == col) & 4) |
+            ((v == zero) & 8);
+        want = 1 | (s->want_sp & 2) | (s->want_col & 4) | (s->want_nul & 8);
+
+        memcpy(w, &code, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w[0] = __builtin_bswap64(w[0]);
+        w[1] = __builtin_bswap64(w[1]);
+#endif
+        if (((w[0] | w[1]) & (0x0101010101010101ull * want)) == 0) {
+            continue;
+        }
+        if (scan_block(s, pos + base,
+                    (scan_word_mask(w[0], 0) | scan_word_mask(w[1], 0) << 8) &
+                        keep,
+                    (scan_word_mask(w[0], 1) | scan_word_mask(w[1], 1) << 8) &
+                        keep,
+                    (scan_word_mask(w[0], 2) | scan_word_mask(w[1], 2) << 8) &
+                        keep,
+                    (scan_word_mask(w[0], 3) | scan_word_mask(w[1], 3) << 8) &
+                        keep)) {
+            ret = 1;
+            break;
+        }
+    }
+    *state = st;
+    return ret;
+}
+
+
+#ifdef SCAN_X86
+
+/*
+ * scans the bytes of buf 16 at a time. The last block ends at len,
+ * overlapping the one before it, so that only ranges shorter than one block
+ * are scanned one byte at a time
+ */
+__attribute__((target("sse2")))
+static int scan_sse2(const char *buf, size_t pos, size_t len,
+        struct scan_state *state) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i col = _mm_set1_epi8(':');
+    const __m128i zero = _mm_setzero_si128();
+    struct scan_state st, *s = &st;
+    uint32_t keep = 0xffff;
+    size_t i, base;
+    int ret = 0;
+
+    if (len < 16) {
+        return scan_scalar(buf, pos, len, state);
+    }
+    st = *state;
+    st.buf = buf;
+    st.buf_pos = pos;
+
+    for (i = 0; i < len; i = base + 16) {
+        base = i;
+        if (i + 16 > len) {
+            // leave out the bytes already scanned
+            base = len - 16;
+            keep <<= i - base;
+        }
+
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + base));
+        uint32_t m_nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) & keep;
+        uint32_t m_sp = _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)) & keep;
+        uint32_t m_col = _mm_movemask_epi8(_mm_cmpeq_epi8(v, col)) & keep;
+        uint32_t m_nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & keep;
+
+        if ((m_nl | (m_sp & s->want_sp) | (m_col & s->want_col) |
+                    (m_nul & s->want_nul)) == 0) {
+            // the common case, no delimiters of interest at all
+            continue;
+        }
+        if (scan_block(s, pos + base, m_nl, m_sp, m_col, m_nul)) {
+            ret = 1;
+            break;
+        }
+    }
+    *state = st;
+    return ret;
+}
+
+/*
+ * the same, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+static int scan_avx2(const char *buf, size_t pos, size_t len,
+        struct scan_state *state) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i col = _mm256_set1_epi8(':');
+    const __m256i zero = _mm256_setzero_si256();
+    struct scan_state st, *s = &st;
+    uint32_t keep = 0xffffffff;
+    size_t i, base;
+    int ret = 0;
+
+    if (len < 32) {
+        // one or two blocks of 16
+        return scan_sse2(buf, pos, len, state);
+    }
+    st = *state;
+    st.buf = buf;
+    st.buf_pos = pos;
+
+    for (i = 0; i < len; i = base + 32) {
+        base = i;
+        if (i + 32 > len) {
+            base = len - 32;
+            keep <<= i - base;
+        }
+
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + base));
+        uint32_t m_nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)) & keep;
+        uint32_t m_sp = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp)) & keep;
+        uint32_t m_col = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, col)) &
+            keep;
+        uint32_t m_nul = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) &
+            keep;
+
+        if ((m_nl | (m_sp & s->want_sp) | (m_col & s->want_col) |
+                    (m_nul & s->want_nul)) == 0) {
+            continue;
+        }
+        if (scan_block(s, pos + base, m_nl, m_sp, m_col, m_nul)) {
+            ret = 1;
+            break;
+        }
+    }
+    *state = st;
+    return ret;
+}
+
+#endif /* SCAN_X86 */
+
+
+#ifdef __SSE2__
+static scan_fn scan = &scan_sse2;
+static int scan_version = SCAN_SSE2;
+#else
+static scan_fn scan = &scan_memchr;
+static int scan_version = SCAN_MEMCHR;
+#endif
+
+
+void scan_init() {
+    // the widest version the CPU has, the vector versions being compiled for
+    // their instruction set whatever the build targets. Elsewhere memchr,
+    // which the C library has tuned for the CPU, does as well as the generic
+    // vectors when optimized, and better when not
+    if (scan_set_impl(SCAN_AVX2) != 0 && scan_set_impl(SCAN_SSE2) != 0) {
+        scan_set_impl(SCAN_MEMCHR);
+    }
+}
+
+int scan_set_impl(int impl) {
+    switch (impl) {
+    case SCAN_SCALAR:
+        scan = &scan_scalar;
+        break;
+    case SCAN_MEMCHR:
+        scan = &scan_memchr;
+        break;
+    case SCAN_VECTOR:
+        scan = &scan_vector;
+        break;
+#ifdef SCAN_X86
+    case SCAN_SSE2:
+        if (!__builtin_cpu_supports("sse2")) {
+            return -1;
+        }
+        scan = &scan_sse2;
+        break;
+    case SCAN_AVX2:
+        if (!__builtin_cpu_supports("avx2")) {
+            return -1;
+        }
+        scan = &scan_avx2;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    scan_version = impl;
+    return 0;
+}
+
+int scan_get_impl() {
+    return scan_version;
+}
+
+int scan_lines(const char *buf, size_t len, struct scan_line *lines, int n) {
+    struct scan_state s;
+
+    scan_state_init(&s, lines, n);
+    if (!scan(buf, 0, len, &s) && s.n_lines < n) {
+        scan_state_save(&s, &lines[s.n_lines], len);
+    }
+    return s.n_lines;
+}
+
+int scan_line(const char *buf, size_t len, struct scan_line *line) {
+    return (scan_lines(buf, len, line, 1) == 1) ? 0 : -1;
+}
+
+int scan_dmsg_lines(const dmsg_list *list, size_t max,
+        struct scan_line *lines, int n) {
+    struct scan_state s;
+    const char *data;
+    size_t len, off = 0;
+
+    scan_state_init(&s, lines, n);
+    // each node is scanned once, with the lines and delimiters found so far
+    // carried over from the one before it
+    while (off < max && (data = dmsg_peek_at(list, off, &len)) != NULL) {
+        len = MIN(len, max - off);
+        if (scan(data, off, len, &s)) {
+            return s.n_lines;
+        }
+        off += len;
+    }
+    if (s.n_lines < n) {
+        scan_state_save(&s, &lines[s.n_lines], off);
+    }
+    return s.n_lines;
+}
+
+int scan_dmsg_line(const dmsg_list *list, size_t max, struct scan_line *line) {
+    return (scan_dmsg_lines(list, max, line, 1) == 1) ? 0 : -1;
+}
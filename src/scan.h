@@ -0,0 +1,126 @@
+/*
+ * Line scanner
+ *
+ * Splits the lines of an HTTP request in a single pass over their bytes,
+ * finding the '\n' which ends each line along with the spaces and colon which
+ * separate its fields, so that a whole request can be tokenized at once. The
+ * bytes are compared against every delimiter 32 (with AVX2) or 16 (with SSE2,
+ * or the compiler's generic vectors elsewhere) at a time, giving a bitmask of
+ * where each of them lies, so most of a line is skipped over without looking
+ * at single bytes. There is also a byte at a time scalar version, and one
+ * which looks for each delimiter with the C library's memchr, which is
+ * vectorized on most machines.
+ *
+ * Which version is used is decided once by scan_init, from the instruction
+ * sets the CPU has
+ */
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+
+#include "dmsg.h"
+
+
+/* versions of the scanner */
+
+// one byte at a time
+#define SCAN_SCALAR 0
+// 16 bytes at a time with SSE2
+#define SCAN_SSE2 1
+// 32 bytes at a time with AVX2
+#define SCAN_AVX2 2
+// with memchr, once for each delimiter
+#define SCAN_MEMCHR 3
+// 16 bytes at a time with the compiler's generic vectors
+#define SCAN_VECTOR 4
+
+#define SCAN_N_IMPLS 5
+
+
+/*
+ * the delimiters found in a line, each given by its offset from the start of
+ * the line, or -1 if the line has none
+ */
+struct scan_line {
+    // offset of the '\n' ending the line, which is the length of the line
+    // without it, or the number of bytes scanned if no '\n' was found
+    size_t len;
+    // the bytes of the line in place, or NULL if it runs from one node of a
+    // dmsg_list into the next
+    const char *data;
+
+    // first two spaces, which end the method and URI of a request line
+    int sp1;
+    int sp2;
+    // first colon, which ends the name of a header
+    int colon;
+    // first NUL byte, past which the line is not looked at when it is treated
+    // as a string
+    int nul;
+};
+
+
+/*
+ * picks the widest version of the scanner the CPU supports: AVX2, then SSE2,
+ * and the memchr one on machines other than x86. Until it is called, the SSE2
+ * version is used on x86-64, and otherwise the memchr one
+ */
+void scan_init();
+
+/*
+ * forces the use of one of the SCAN_* versions of the scanner, for testing
+ *
+ * returns 0 on success and -1 if the CPU does not support it
+ */
+int scan_set_impl(int impl);
+
+/*
+ * gives the version of the scanner in use
+ */
+int scan_get_impl();
+
+/*
+ * splits the lines at the start of the len bytes of buf in one pass, filling
+ * in where the delimiters of each are, until n (at least 1) lines have been
+ * found or a blank line (of at most one byte, the '\r') has ended the headers
+ * of a request. The offsets of the delimiters of each line are given from the
+ * start of that line, which is one past the '\n' ending the one before it
+ *
+ * returns the number of lines found which end in a '\n'. If fewer than n were
+ * found without reaching a blank line, the next entry of lines is the
+ * unfinished line after them, whose len is the number of its bytes in buf
+ */
+int scan_lines(const char *buf, size_t len, struct scan_line *lines, int n);
+
+/*
+ * scans at most len bytes of buf up to the first '\n', filling in where the
+ * delimiters before it are
+ *
+ * returns 0 if a '\n' was found and -1 if not, in which case the delimiters
+ * are those of all len bytes
+ */
+int scan_line(const char *buf, size_t len, struct scan_line *line);
+
+/*
+ * splits the lines starting at the offset pointer of list the same way as
+ * scan_lines, looking at no more than max bytes, without moving the offset
+ * pointer. Each node the lines lie in is scanned in place, once, and a line
+ * may run from one node into the next
+ *
+ * returns the same as scan_lines
+ */
+int scan_dmsg_lines(const dmsg_list *list, size_t max,
+        struct scan_line *lines, int n);
+
+/*
+ * scans the line starting at the offset pointer of list, looking at no more
+ * than max bytes, without moving the offset pointer. The offsets of the
+ * delimiters are given from the offset pointer
+ *
+ * returns 0 if a '\n' was found and -1 if not, in which case line->len is the
+ * number of bytes scanned
+ */
+int scan_dmsg_line(const dmsg_list *list, size_t max, struct scan_line *line);
+
+#endif /* _SCAN_H */
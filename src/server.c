@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
@@ -7,6 +8,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -17,8 +19,14 @@
 
 #elif __linux__
 #define QUEUE_T "epoll"
+#include <sched.h>
+#include <linux/filter.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/timerfd.h>
+
+#include "uring.h"
 #endif
 
 #include "client.h"
@@ -35,6 +43,18 @@
 // for connections which are not clients, only the connfd field will be used
 typedef struct client epoll_data_ptr_t;
 
+#ifndef EPIOCSPARAMS
+// the busy poll parameters of an epoll instance, from linux/eventpoll.h as of
+// Linux 6.9, which older headers lack
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
 #endif
 
 // maximum number of bytes read from a connection in one pass of the main
@@ -42,16 +62,16 @@ typedef struct client epoll_data_ptr_t;
 #define MAX_READ_SIZE 4096
 
 
-// the system clock to use for connection expiration
+// the system clock to use for the periodic timer
 #define TIMER_CLOCK CLOCK_MONOTONIC
 
-// the default number of seconds to wait without having received any data from
-// a connection before killing the connection
-#define DEFAULT_CONNECTION_TIMEOUT 5
-
-// the number of seconds to wait between successive interrupts by the timer file
-// descriptor, which is responsible for closing connections that have timed out
-#define TIMEOUT_CLEANUP_FREQUENCY 5
+// the clock read on each wakeup to drive connection expiration. A coarse clock
+// is plenty for timeouts measured in ticks, and is much cheaper to read
+#ifdef CLOCK_MONOTONIC_COARSE
+#define COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define COARSE_CLOCK CLOCK_MONOTONIC
+#endif
 
 
 #define LOCKED 0
@@ -59,651 +79,3668 @@ typedef struct client epoll_data_ptr_t;
 
 
 /*
- * locks the list lock with the passed in value, usually the thread id
+ * locks one of the spinlocks of the event loop, if the loop is shared between
+ * threads or its clients may be stolen
  */
-static __inline void acq_list_lock(struct server *server) {
+static __inline void acq_loop_lock(struct ev_loop *loop, int *lock) {
     int unlocked = UNLOCKED;
+
+    if (!loop->shared && !loop->stealing) {
+        return;
+    }
     // spin until unlocked
-    while (!__atomic_compare_exchange_n(&server->client_list_lock, &unlocked,
+    while (!__atomic_compare_exchange_n(lock, &unlocked,
                 LOCKED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
         unlocked = UNLOCKED;
     }
 }
 
-static __inline void rel_list_lock(struct server *server) {
-    server->client_list_lock = UNLOCKED;
+static __inline void rel_loop_lock(struct ev_loop *loop, int *lock) {
+    if (loop->shared || loop->stealing) {
+        __atomic_store_n(lock, UNLOCKED, __ATOMIC_RELEASE);
+    }
 }
 
-
-// adds client to beginning of list
-static void list_insert(struct server *server, struct client *client) {
-    client->next = server->client_list.first;
-    client->prev = server->client_list.first->prev;
-    server->client_list.first->prev = client;
-    server->client_list.first = client;
+static __inline void acq_timers_lock(struct ev_loop *loop) {
+    acq_loop_lock(loop, &loop->timers_lock);
 }
 
-static void list_remove(struct client *client) {
-    client->next->prev = client->prev;
-    client->prev->next = client->next;
+static __inline void rel_timers_lock(struct ev_loop *loop) {
+    rel_loop_lock(loop, &loop->timers_lock);
 }
 
-#define server_as_client_node(server_ptr) \
-    ((struct client *) (((char*) (server_ptr)) \
-            + offsetof(struct server, client_list) \
-            - offsetof(struct client, next)))
 
+#define timer_client(node_ptr) \
+    ((struct client *) (((char*) (node_ptr)) - offsetof(struct client, timer)))
 
-#define list_for_each(server_ptr, client_var) \
-    for ((client_var) = (server_ptr)->client_list.first; \
-            (client_var) != server_as_client_node(server_ptr); \
-            (client_var) = (client_var)->next)
 
+/*
+ * refreshes the cached clock of the loop, to be called each time a thread
+ * returns from waiting on the loop
+ */
+static void loop_update_time(struct ev_loop *loop) {
+    struct timespec t;
+
+    clock_gettime(COARSE_CLOCK, &t);
+    __atomic_store_n(&loop->now,
+            (t.tv_sec * 1000LU + t.tv_nsec / 1000000) / loop->tick_ms,
+            __ATOMIC_RELAXED);
+}
 
 /*
- * sets the expiration timer on this client, to be called after a complete
- * request has been parsed or on initialization of a connection
+ * gives the tick by which the client must have finished its current phase,
+ * or made more progress in it
  */
-static void set_expiration_timer(struct client *client) {
-    clock_gettime(TIMER_CLOCK, &client->expires);
-    client->expires.tv_sec += DEFAULT_CONNECTION_TIMEOUT;
+static uint64_t client_deadline(struct client *client, uint64_t now) {
+    struct ev_loop *loop = client->loop;
+    uint64_t deadline;
+
+    switch (client->phase) {
+    case CLIENT_PHASE_LINE:
+        return client->phase_start + loop->timeout_ticks.request_line;
+    case CLIENT_PHASE_HEADERS:
+        return client->phase_start + loop->timeout_ticks.headers;
+    case CLIENT_PHASE_IDLE:
+        return client->phase_start + loop->timeout_ticks.idle;
+    default:
+        // bodies and responses may take as long as they need, as long as
+        // they keep making progress
+        deadline = now + loop->timeout_ticks.stall;
+        if (loop->min_rate > 0) {
+            // and, past their first stall timeout, do not fall behind the
+            // minimum rate
+            deadline = MIN(deadline, client->phase_start +
+                    loop->timeout_ticks.stall + client->phase_bytes * 1000 /
+                    (loop->min_rate * loop->tick_ms));
+        }
+        return deadline;
+    }
 }
 
 
 /*
- * removes the client from the client list and reinserts them at the back, and
- * updates their expiration time
+ * arms the expiration timer of a newly accepted client
  */
-static void renew_client_timeout(struct server *server, struct client *client) {
-    // we either need to respond to the request or wait to receive more data
-    // from it, so we update the expiration time of this connection and move it
-    // to the back of the client list
-    acq_list_lock(server);
-    list_remove(client);
-    list_insert(server, client);
-    
-    // renew the timeout of the connection
-    set_expiration_timer(client);
-    rel_list_lock(server);
-}
+static void set_expiration_timer(struct client *client) {
+    struct ev_loop *loop = client->loop;
 
+    client->phase_start = __atomic_load_n(&loop->now, __ATOMIC_RELAXED);
+    client->deadline = client_deadline(client, client->phase_start);
+    tw_node_init(&client->timer);
 
+    acq_timers_lock(loop);
+    tw_arm(&loop->timers, &client->timer, client->deadline);
+    rel_timers_lock(loop);
+}
 
 
-static int connect_server(struct server *server);
+/*
+ * moves the deadline of the client after n_bytes were received from or sent
+ * to it, which may have moved it to another phase. The timer itself is left
+ * where it is in the wheel, and is moved to a later deadline only once it
+ * goes off, so this only takes a lock when the deadline moves earlier
+ */
+static void renew_client_timeout(struct client *client, size_t n_bytes) {
+    struct ev_loop *loop = client->loop;
+    uint64_t now = __atomic_load_n(&loop->now, __ATOMIC_RELAXED), deadline;
+    int phase = client_phase(client);
+
+    if (phase != client->phase) {
+        // the request line and headers share a start, that of the request
+        if (client->phase != CLIENT_PHASE_LINE ||
+                phase != CLIENT_PHASE_HEADERS) {
+            client->phase_start = now;
+        }
+        client->phase = phase;
+        client->phase_bytes = 0;
+    }
+    else if (phase == CLIENT_PHASE_LINE || phase == CLIENT_PHASE_HEADERS ||
+            phase == CLIENT_PHASE_IDLE) {
+        // trickling in more of a request buys it no more time
+        return;
+    }
+    else if (n_bytes == 0) {
+        return;
+    }
+    else {
+        client->phase_bytes += n_bytes;
+    }
 
-int init_server(struct server *server, int port) {
-    return init_server3(server, port, DEFAULT_BACKLOG);
+    deadline = client_deadline(client, now);
+    __atomic_store_n(&client->deadline, deadline, __ATOMIC_RELAXED);
+
+    if (deadline < __atomic_load_n(&client->timer.expires, __ATOMIC_RELAXED)) {
+        acq_timers_lock(loop);
+        if (tw_armed(&client->timer)) {
+            tw_arm(&loop->timers, &client->timer, deadline);
+        }
+        rel_timers_lock(loop);
+    }
 }
 
-int init_server3(struct server *server, int port, int backlog) {
-    int ret = 0;
-    sigset_t sigpipe;
 
-    memset(&server->in, 0, sizeof(server->in));
+// sent to connections accepted while the server is overloaded, with
+// SERVER_SHED_OVERLOAD
+static const char overload_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
 
-    server->in.sin_family = AF_INET;
-    server->in.sin_addr.s_addr = INADDR_ANY;
+// sent to connections and requests over the per-address limits
+static const char too_many_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
 
-    server->backlog = backlog;
-    server->in.sin_port = htons(port);
+/*
+ * true if the server is at its limit of concurrent connections or of bytes
+ * buffered
+ */
+static __inline int server_overloaded(struct server *server) {
+    return (server->max_clients > 0 &&
+            __atomic_load_n(&server->n_clients, __ATOMIC_RELAXED) >=
+                server->max_clients) ||
+        (server->max_buffered > 0 &&
+            __atomic_load_n(&server->n_buffered, __ATOMIC_RELAXED) >=
+                server->max_buffered);
+}
 
-    server->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+/*
+ * true once usage is back below the low-water marks of both limits
+ */
+static __inline int server_relieved(struct server *server) {
+    return (server->max_clients == 0 ||
+            __atomic_load_n(&server->n_clients, __ATOMIC_RELAXED) <=
+                LOW_WATER_MARK(server->max_clients)) &&
+        (server->max_buffered == 0 ||
+            __atomic_load_n(&server->n_buffered, __ATOMIC_RELAXED) <=
+                LOW_WATER_MARK(server->max_buffered));
+}
 
-    server->qfd =
-#ifdef __APPLE__
-                  kqueue();
-#elif __linux__
-                  epoll_create1(0);
-#endif
-    if (server->qfd < 0) {
-        fprintf(stderr, "Unable to initialize " QUEUE_T ", reason: %s\n",
-                strerror(errno));
-        ret = -1;
-    }
+static void resume_accept(struct server *server, struct ev_loop *loop);
 
-    server->running = 1;
+/*
+ * counts a newly accepted client of the loop against the limits of the server
+ */
+static __inline void count_client(struct server *server,
+        struct ev_loop *loop) {
+    __atomic_fetch_add(&server->n_clients, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&loop->n_clients, 1, __ATOMIC_RELAXED);
+}
 
-#ifdef __linux__
-    // create a timer file descriptor which is to be placed into the queue.
-    // It will be responsible for waking up a thread to check the client list
-    // and close connections that have timed out periodically
-    server->timerfd = timerfd_create(TIMER_CLOCK, TFD_NONBLOCK);
+/*
+ * gives the IPv4 address of a peer in network byte order, or 0 if the peer
+ * has no such address
+ */
+static __inline uint32_t peer_addr(const struct sockaddr *sa) {
+    return (sa->sa_family == AF_INET) ?
+        ((const struct sockaddr_in *) sa)->sin_addr.s_addr : 0;
+}
 
-    if (server->timerfd == -1) {
-        fprintf(stderr, "Unable to initialize timerfd, reason: %s\n",
-                strerror(errno));
-        ret = -1;
-    }
-#endif
+/*
+ * gives the time of the loop's clock in milliseconds, which is what the
+ * per-address request rates are measured against
+ */
+static __inline uint32_t peer_time(struct ev_loop *loop) {
+    return (uint32_t) (__atomic_load_n(&loop->now, __ATOMIC_RELAXED) *
+            loop->tick_ms);
+}
 
-    if (pipe(server->term_pipe) == -1) {
-        fprintf(stderr, "Unable to initialize pipe, reason: %s\n",
-                strerror(errno));
-        ret = -1;
+/*
+ * releases a connection from sa counted against the limits of the server by
+ * count_client (and by admit_peer, if peer_counted is set). If that brings
+ * usage back down far enough, the loop resumes accepting
+ */
+static void uncount_connection(struct server *server, struct ev_loop *loop,
+        const struct sockaddr *sa, int peer_counted) {
+    if (peer_counted) {
+        ipt_disconnect(&server->peers, peer_addr(sa));
     }
+    __atomic_fetch_sub(&server->n_clients, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&loop->n_clients, 1, __ATOMIC_RELAXED);
+    resume_accept(server, loop);
+}
 
-    clear_mt_context(&server->mt);
+/*
+ * releases everything the client counted against the limits of the server,
+ * to be called right before it is freed
+ */
+static void uncount_client(struct server *server, struct client *client) {
+    __atomic_fetch_sub(&server->n_buffered, (long) client->log.len,
+            __ATOMIC_RELAXED);
+    uncount_connection(server, client->loop, &client->sa,
+            client->peer_counted);
+}
 
-    // make client_list circularly linked, treat list_head just as any other
-    // list node
-    server->client_list.first = server->client_list.last
-        = server_as_client_node(server);
+/*
+ * answers a connection which is not going to be served with one of the
+ * canned responses above and closes it, without allocating anything for it
+ */
+static void reject_connection(int connfd, const char *response, size_t len) {
+    char discard[1024];
+
+    // read whatever part of the request has already arrived, as closing a
+    // socket with unread data resets the connection, which may throw away
+    // the response before the peer reads it
+    for (int i = 0; i < 4 && read(connfd, discard, sizeof(discard)) > 0; i++);
+    // the response is tiny and the socket's buffer empty, so this can not
+    // block or come up short
+    write(connfd, response, len);
+    close(connfd);
+}
 
-    server->client_list_lock = UNLOCKED;
+/*
+ * answers a connection accepted while the server is overloaded with a 503
+ * and closes it
+ */
+static void shed_connection(struct ev_loop *loop, int connfd) {
+    reject_connection(connfd, overload_response,
+            sizeof(overload_response) - 1);
+    __atomic_fetch_add(&loop->stats.n_shed, 1, __ATOMIC_RELAXED);
+}
 
-    if (connect_server(server) == -1) {
-        ret = -1;
+/*
+ * counts a newly accepted connection from sa against the per-address
+ * connection limit, if there is one. If the peer is already at the limit,
+ * the connection is answered with a 429 and closed
+ *
+ * returns -1 if the connection was closed, and otherwise whether it was
+ * counted, to be stored in the client's peer_counted
+ */
+static int admit_peer(struct server *server, struct ev_loop *loop, int connfd,
+        const struct sockaddr *sa) {
+    if (server->peers.sets == NULL) {
+        return 0;
     }
 
-    if (ret == 0) {
-        // block SIGPIPE signals so writes to a disconnected client don't
-        // terminate the program
-        sigemptyset(&sigpipe);
-        sigaddset(&sigpipe, SIGPIPE);
-        ret = pthread_sigmask(SIG_BLOCK, &sigpipe, NULL) == 0 ? 0 : -1;
+    switch (ipt_connect(&server->peers, peer_addr(sa), peer_time(loop))) {
+    case IPT_OK:
+        return 1;
+    case IPT_LIMITED:
+        reject_connection(connfd, too_many_response,
+                sizeof(too_many_response) - 1);
+        __atomic_fetch_add(&loop->stats.n_peer_refused, 1, __ATOMIC_RELAXED);
+        return -1;
+    default:
+        return 0;
     }
-    
-    if (ret != 0) {
-        close(server->sockfd);
+}
+
+/*
+ * takes a request read in full from the client out of its peer's request
+ * rate. If the peer has exceeded its rate, the request is answered with a 429
+ * in place of its response, which is sent like any other, after which the
+ * connection is closed
+ */
+static void limit_peer_request(struct server *server, struct client *client) {
+    if (!client->peer_counted || ipt_request(&server->peers,
+                peer_addr(&client->sa), peer_time(client->loop)) == IPT_OK) {
+        return;
     }
-    return ret;
+
+    http_reject(&client->http, too_many_requests);
+    __atomic_fetch_add(&client->loop->stats.n_peer_throttled, 1,
+            __ATOMIC_RELAXED);
 }
 
-void print_server_params(struct server *server) {
-    uint16_t port;
 
-    port = ntohs(server->in.sin_port);
 
-    vprintf("Server listening on port: %s:%d\n", get_ip_addr_str(), port);
+
+static int connect_server(struct server *server, struct ev_loop *loop);
+static int read_from(struct server *server, struct client *client, int thread);
+#ifdef __linux__
+static int uring_loop_init(struct server *server, struct ev_loop *loop);
+static void uring_loop_free(struct ev_loop *loop);
+static int uring_arm_accept(struct server *server, struct ev_loop *loop);
+
+/*
+ * gives the registration of the loop's listening socket in its epoll instance
+ */
+static __inline struct epoll_event listen_event(struct ev_loop *loop) {
+    struct epoll_event listen_ev = {
+#ifdef EPOLLEXCLUSIVE
+        .events = EPOLLIN | EPOLLEXCLUSIVE,
+#else
+        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
+#endif
+        // safe as long as the rest of data is never accessed, which it
+        // shouldn't be for the sockfd. Do this so each epolldata object
+        // can be treated as a client object for the purposes of finding out
+        // which file descriptor the event is associated with
+        .data.ptr = ((char*) &loop->sockfd)
+            - offsetof(epoll_data_ptr_t, connfd)
+    };
+    return listen_ev;
 }
+#endif
 
-void close_server(struct server *server) {
-    struct client *client, *next;
-    // TODO this may be called in an interrupt context
-    vprintf("Closing server on fd %d\n", server->sockfd);
+/*
+ * allocates an event loop which accepts connections on sockfd, along with its
+ * event queue and timer. The loop is not yet listening on sockfd, which is
+ * done by connect_server
+ *
+ * returns NULL on failure
+ */
+static struct ev_loop* create_loop(int sockfd) {
+    struct ev_loop *loop;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    // loops are written to constantly by the threads running them, so give
+    // each its own pages, which can then be moved to the NUMA node of the
+    // thread once it is placed
+    if (posix_memalign((void**) &loop, page_size,
+                (sizeof(struct ev_loop) + page_size - 1) & ~(page_size - 1))
+            != 0) {
+        fprintf(stderr, "Unable to malloc event loop\n");
+        return NULL;
+    }
+    memset(loop, 0, sizeof(struct ev_loop));
 
-    if (server->client_list_lock == LOCKED) {
-        // TODO
+    loop->sockfd = sockfd;
+
+    loop->qfd =
+#ifdef __APPLE__
+                kqueue();
+#elif __linux__
+                epoll_create1(0);
+#endif
+    if (loop->qfd < 0) {
+        fprintf(stderr, "Unable to initialize " QUEUE_T ", reason: %s\n",
+                strerror(errno));
+        free(loop);
+        return NULL;
     }
 
-    server->running = 0;
+#ifdef __linux__
+    // create a timer file descriptor which is to be placed into the queue.
+    // It will be responsible for waking up a thread to check the client list
+    // and close connections that have timed out periodically
+    loop->timerfd = timerfd_create(TIMER_CLOCK, TFD_NONBLOCK);
 
-    // write to the term pipe so all threads will be notified that the server
-    // is shutting down
-    write(server->term_write, "x", 1);
+    if (loop->timerfd == -1) {
+        fprintf(stderr, "Unable to initialize timerfd, reason: %s\n",
+                strerror(errno));
+        close(loop->qfd);
+        free(loop);
+        return NULL;
+    }
+    loop->wakefd = -1;
+#endif
 
-    // join with all threads
-    exit_mt_routine(&server->mt);
+    tw_init(&loop->timers, 0);
+    loop->timers_lock = UNLOCKED;
+    loop->accept_lock = UNLOCKED;
+
+    return loop;
+}
+
+/*
+ * disconnects every client of the loop and closes the file descriptors owned
+ * by the loop, then frees it. The listening socket is only closed if
+ * close_sockfd is set
+ */
+static void close_loop(struct ev_loop *loop, int close_sockfd) {
+    struct tw_node *node, *next;
+    struct client *client;
 
     printf("conn list: [");
-    client = server->client_list.first;
-    while (client != server_as_client_node(server)) {
-        next = client->next;
+    for (node = tw_clear(&loop->timers); node != NULL; node = next) {
+        next = node->next;
+        client = timer_client(node);
         printf("%d, ", client->connfd);
 
         write(STDOUT_FILENO, P_CYAN, sizeof(P_CYAN) - 1);
         dmsg_write(&client->log, STDOUT_FILENO);
         write(STDOUT_FILENO, P_RESET, sizeof(P_RESET) - 1);
 
-        if (close_client(client) == 0) {
-            // only free client if close succeeded
-            free(client);
-        }
-        client = next;
+        // the client struct itself is released along with the client slab of
+        // the server
+        close_client(client);
     }
     printf("]\n");
 
-    CHECK(close(server->sockfd));
-    CHECK(close(server->qfd));
+    if (loop->handoff.slots != NULL) {
+        // connections handed to the loop after its thread returned
+        struct sockaddr sa;
+        int connfd, arg;
+        while ((connfd = hq_pop(&loop->handoff, &arg, &sa)) != -1) {
+            close(connfd);
+        }
+        hq_free(&loop->handoff);
+    }
+    wsd_free(&loop->tasks);
+
+    if (close_sockfd) {
+        CHECK(close(loop->sockfd));
+    }
+    CHECK(close(loop->qfd));
 #ifdef __linux__
-    CHECK(close(server->timerfd));
+    CHECK(close(loop->timerfd));
+    if (loop->wakefd != -1) {
+        CHECK(close(loop->wakefd));
+    }
+    if (loop->ur != NULL) {
+        uring_loop_free(loop);
+    }
 #endif
-    CHECK(close(server->term_read));
-    CHECK(close(server->term_write));
-
+    free(loop);
 }
 
-
 /*
- * binds the socket fd and listens on it, then adds the socket fd to
- * the event queue (epoll or kqueue)
- * 
- * returns 0 on success and -1 on failure
+ * creates a socket bound to the server's port, with SO_REUSEPORT set if the
+ * server is running in shared-nothing mode
+ *
+ * returns the socket fd on success and -1 on failure
  */
-static int connect_server(struct server *server) {
+static int bind_socket(struct server *server) {
+    int sockfd, one = 1;
 
-    if (bind(server->sockfd, (struct sockaddr *) &server->in,
-                sizeof(struct sockaddr_in)) == -1) {
-        fprintf(stderr, "Unable to bind socket to port %d, reason %s\n",
-                ntohs(server->in.sin_port), strerror(errno));
-        close_server(server);
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        fprintf(stderr, "Unable to create socket, reason: %s\n",
+                strerror(errno));
         return -1;
     }
 
-    if (listen(server->sockfd, server->backlog) == -1) {
-        fprintf(stderr, "Unable to listen, reason: %s\n", strerror(errno));
-        close_server(server);
+    // accept_connections drains the backlog until accept would block, so the
+    // listening socket must never block
+    if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1) {
+        fprintf(stderr, "Unable to make socket nonblocking, reason: %s\n",
+                strerror(errno));
+        close(sockfd);
         return -1;
     }
 
-#ifdef __linux__
-    // start up the periodic timer
-    struct itimerspec timer = {
-        .it_interval = {
-            .tv_sec = DEFAULT_CONNECTION_TIMEOUT,
-            .tv_nsec = 0
-        },
-        .it_value = {
-            .tv_sec = DEFAULT_CONNECTION_TIMEOUT,
-            .tv_nsec = 0
-        }
-    };
-    if (timerfd_settime(server->timerfd, 0, &timer, NULL) == -1) {
-        fprintf(stderr, "Unable to initialize timer, reason: %s\n",
+    if ((server->flags & SERVER_SHARED_NOTHING) &&
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                sizeof(one)) == -1) {
+        fprintf(stderr, "Unable to set SO_REUSEPORT, reason: %s\n",
                 strerror(errno));
+        close(sockfd);
         return -1;
     }
-#endif
 
-#ifdef __APPLE__
-    struct kevent listen_ev[3];
-    EV_SET(&listen_ev[0], server->sockfd, EVFILT_READ,
-            EV_ADD | EV_DISPATCH, 0, 0, NULL);
-    EV_SET(&listen_ev[1], server->term_read, EVFILT_READ,
-            EV_ADD, 0, 0, NULL);
-    EV_SET(&listen_ev[2], TIMER_IDENT, EVFILT_TIMER,
-            EV_ADD | EV_ENABLE, NOTE_SECONDS, TIMEOUT_CLEANUP_FREQUENCY,
-            NULL);
-    if (kevent(server->qfd, listen_ev, 3, NULL, 0, NULL) == -1) {
-        fprintf(stderr, "Unable to add server sockfd, term pipe read and "
-                "timerfd to " QUEUE_T ", reason: %s\n", strerror(errno));
-        close_server(server);
+    if (bind(sockfd, (struct sockaddr *) &server->in,
+                sizeof(struct sockaddr_in)) == -1) {
+        fprintf(stderr, "Unable to bind socket to port %d, reason %s\n",
+                ntohs(server->in.sin_port), strerror(errno));
+        close(sockfd);
         return -1;
     }
-#elif __linux__
-    int ret;
-
-    struct epoll_event listen_ev = {
-#ifdef EPOLLEXCLUSIVE
-        .events = EPOLLIN | EPOLLEXCLUSIVE,
-#else
-        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
-#endif
-        // safe as long as the rest of data is never accessed, which it
-        // shouldn't be for the sockfd. Do this so each epolldata object
-        // can be treated as a client object for the purposes of finding out
-        // which file descriptor the event is associated with
-        .data.ptr = ((char*) &server->sockfd)
-            - offsetof(epoll_data_ptr_t, connfd)
-    };
-    ret = epoll_ctl(server->qfd, EPOLL_CTL_ADD, server->sockfd, &listen_ev);
-
-    struct epoll_event term_ev = {
-        .events = EPOLLIN,
-        .data.ptr = ((char*) &server->term_read)
-            - offsetof(epoll_data_ptr_t, connfd)
-    };
-    ret = ret == -1 ? ret :
-        epoll_ctl(server->qfd, EPOLL_CTL_ADD, server->term_read, &term_ev);
 
-    struct epoll_event timer_ev = {
-        .events = EPOLLIN | EPOLLET,
-        .data.ptr = ((char*) &server->timerfd)
-            - offsetof(epoll_data_ptr_t, connfd)
-    };
-    ret = ret == -1 ? ret :
-        epoll_ctl(server->qfd, EPOLL_CTL_ADD, server->timerfd, &timer_ev);
+    return sockfd;
+}
 
-    if (ret == -1) {
-        fprintf(stderr, "Unable to add server sockfd, term pipe read or "
-                "timerfd to " QUEUE_T ", reason: %s\n", strerror(errno));
-        return ret;
-    }
-#endif
+int init_server(struct server *server, int port) {
+    return init_server3(server, port, DEFAULT_BACKLOG);
+}
 
-    return 0;
+int init_server3(struct server *server, int port, int backlog) {
+    return init_server4(server, port, backlog, 0);
 }
 
+int init_server4(struct server *server, int port, int backlog, int flags) {
+    int ret = 0, sockfd;
+    sigset_t sigpipe;
+
+    memset(&server->in, 0, sizeof(server->in));
 
+    server->in.sin_family = AF_INET;
+    server->in.sin_addr.s_addr = INADDR_ANY;
 
-static int accept_connection(struct server *server) {
-    struct client *client;
-    int ret;
+    server->backlog = backlog;
+    server->in.sin_port = htons(port);
 
-    if (!server->running) {
+    if ((flags & SERVER_IO_URING) && (flags & SERVER_ACCEPTOR_THREADS)) {
+        fprintf(stderr, "Acceptor threads can not be used with io_uring\n");
         return -1;
     }
-
-    client = (struct client *) malloc(sizeof(struct client));
-    if (client == NULL) {
+    if ((flags & SERVER_IO_URING) && (flags & SERVER_WORK_STEALING)) {
+        fprintf(stderr, "Work stealing can not be used with io_uring\n");
         return -1;
     }
-
-    ret = accept_client(client, server->sockfd, O_NONBLOCK);
-    if (ret == -1) {
-        free(client);
-        return ret;
+    if ((flags & SERVER_WORK_STEALING) &&
+            !(flags & SERVER_ACCEPTOR_THREADS)) {
+        flags |= SERVER_SHARED_NOTHING;
     }
-
-#ifdef __APPLE__
-    struct kevent changelist[2];
-    EV_SET(&changelist[0], client->connfd, EVFILT_READ,
-            EV_ADD | EV_DISPATCH, 0, 0, client);
-    EV_SET(&changelist[1], server->sockfd, EVFILT_READ,
-            EV_ENABLE | EV_DISPATCH, 0, 0, NULL);
-    if (CHECK(kevent(server->qfd, changelist, 2, NULL, 0, NULL)) == -1) {
-        free(client);
+    if (flags & SERVER_CPU_STEERING) {
+#ifdef __linux__
+        if (!(flags & SERVER_ACCEPTOR_THREADS)) {
+            flags |= SERVER_SHARED_NOTHING;
+        }
+#else
+        fprintf(stderr, "Connection steering is only available on Linux\n");
+        return -1;
+#endif
+    }
+    if (flags & SERVER_IO_URING) {
+#ifdef __linux__
+        flags |= SERVER_SHARED_NOTHING;
+#else
+        fprintf(stderr, "io_uring is only available on Linux\n");
+        return -1;
+#endif
+    }
+
+    server->flags = flags;
+    server->running = 1;
+
+    server->max_events = DEFAULT_MAX_EVENTS;
+    server->accept_burst = DEFAULT_ACCEPT_BURST;
+    server->timer_tick_ms = DEFAULT_TIMER_TICK_MS;
+    server->prewarm_clients = 0;
+    server->drain_ms = DEFAULT_DRAIN_MS;
+    server->draining = 0;
+    server->request_line_ms = DEFAULT_REQUEST_LINE_MS;
+    server->headers_ms = DEFAULT_HEADERS_MS;
+    server->idle_ms = DEFAULT_IDLE_MS;
+    server->stall_ms = DEFAULT_STALL_MS;
+    server->min_rate = DEFAULT_MIN_RATE;
+    server->defer_accept = 0;
+    server->fastopen_qlen = 0;
+    server->max_clients = 0;
+    server->max_buffered = 0;
+    server->n_clients = 0;
+    server->n_buffered = 0;
+    server->peer_max_conns = 0;
+    server->peer_rate = 0;
+    server->peer_burst = 0;
+    server->peer_table_size = DEFAULT_PEER_TABLE_SIZE;
+    server->n_acceptors = DEFAULT_N_ACCEPTORS;
+    server->handoff_policy = HANDOFF_ROUND_ROBIN;
+    server->acceptors = NULL;
+    server->n_acceptors_running = 0;
+    server->n_idle = 0;
+    server->busy_poll_us = 0;
+    server->placement = TOPO_PLACE_NONE;
+    server->cpu_list = NULL;
+    memset(&server->topo, 0, sizeof(server->topo));
+    server->cpus = NULL;
+    server->n_cpus = 0;
+    server->cpu_loops = NULL;
+    memset(&server->clients, 0, sizeof(server->clients));
+    memset(&server->peers, 0, sizeof(server->peers));
+
+    clear_mt_context(&server->mt);
+
+    if (pipe(server->term_pipe) == -1) {
+        fprintf(stderr, "Unable to initialize pipe, reason: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    sockfd = bind_socket(server);
+    if (sockfd == -1) {
+        close(server->term_read);
+        close(server->term_write);
+        return -1;
+    }
+
+    server->loops = (struct ev_loop **) malloc(sizeof(struct ev_loop *));
+    if (server->loops == NULL ||
+            (server->loops[0] = create_loop(sockfd)) == NULL) {
+        free(server->loops);
+        close(sockfd);
+        close(server->term_read);
+        close(server->term_write);
+        return -1;
+    }
+    server->n_loops = 1;
+
+    if (connect_server(server, server->loops[0]) == -1) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        // block SIGPIPE signals so writes to a disconnected client don't
+        // terminate the program
+        sigemptyset(&sigpipe);
+        sigaddset(&sigpipe, SIGPIPE);
+        ret = pthread_sigmask(SIG_BLOCK, &sigpipe, NULL) == 0 ? 0 : -1;
+    }
+    
+    if (ret != 0) {
+        close_loop(server->loops[0], 1);
+        free(server->loops);
+        server->n_loops = 0;
+        close(server->term_read);
+        close(server->term_write);
+    }
+    return ret;
+}
+
+void print_server_params(struct server *server) {
+    uint16_t port;
+
+    port = ntohs(server->in.sin_port);
+
+    vprintf("Server listening on port: %s:%d\n", get_ip_addr_str(), port);
+    if (server->flags & SERVER_SHARED_NOTHING) {
+        vprintf("Running shared-nothing, with one listener per worker\n");
+    }
+    if (server->flags & SERVER_IO_URING) {
+        vprintf("Event loops are driven by io_uring\n");
+    }
+    if (server->flags & SERVER_ACCEPTOR_THREADS) {
+        vprintf("Connections are accepted by %d acceptor threads and handed "
+                "to the workers %s\n", server->n_acceptors,
+                (server->handoff_policy == HANDOFF_LEAST_CONNS) ?
+                "with the fewest connections" : "in turn");
+    }
+    if (server->flags & SERVER_WORK_STEALING) {
+        vprintf("Idle workers steal connections from the loops of busy "
+                "ones\n");
+    }
+    if (server->busy_poll_us > 0) {
+        vprintf("Idle workers busy poll for %d us before sleeping\n",
+                server->busy_poll_us);
+    }
+    if (server->flags & SERVER_CPU_STEERING) {
+        vprintf("Connections go to the worker on the CPU which received "
+                "them\n");
+    }
+    switch (server->placement) {
+    case TOPO_PLACE_CPUS:
+        vprintf("Workers are placed one per CPU\n");
+        break;
+    case TOPO_PLACE_CORES:
+        vprintf("Workers are placed one per physical core\n");
+        break;
+    case TOPO_PLACE_L3:
+        vprintf("Workers are placed one per last-level cache\n");
+        break;
+    case TOPO_PLACE_LIST:
+        vprintf("Workers are placed on CPUs %s\n", server->cpu_list);
+        break;
+    }
+}
+
+#ifdef __linux__
+/*
+ * reads the number of times a connection was dropped by the kernel because
+ * a listen backlog was full, counted across the whole network namespace
+ *
+ * returns -1 if the count is unavailable
+ */
+static long read_listen_overflows() {
+    char names[4096], vals[4096], *name, *val, *name_save, *val_save;
+    long ret = -1;
+    FILE *netstat;
+
+    netstat = fopen("/proc/net/netstat", "r");
+    if (netstat == NULL) {
+        return -1;
+    }
+    // the file is made of pairs of lines, the first giving the names of the
+    // fields and the second their values
+    while (fgets(names, sizeof(names), netstat) != NULL &&
+            fgets(vals, sizeof(vals), netstat) != NULL) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        name = strtok_r(names, " \n", &name_save);
+        val = strtok_r(vals, " \n", &val_save);
+        while (name != NULL && val != NULL) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                ret = strtol(val, NULL, 10);
+                break;
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            val = strtok_r(NULL, " \n", &val_save);
+        }
+        break;
+    }
+    fclose(netstat);
+    return ret;
+}
+#endif
+
+double server_avg_batch_size(struct server *server) {
+    unsigned long n_wakeups = 0, n_events = 0;
+
+    for (int i = 0; i < server->n_loops; i++) {
+        n_wakeups += __atomic_load_n(&server->loops[i]->stats.n_wakeups,
+                __ATOMIC_RELAXED);
+        n_events += __atomic_load_n(&server->loops[i]->stats.n_events,
+                __ATOMIC_RELAXED);
+    }
+
+    return (n_wakeups == 0) ? 0 : ((double) n_events) / n_wakeups;
+}
+
+void print_server_stats(struct server *server) {
+    unsigned long n_wakeups = 0, n_events = 0, n_accepted = 0,
+                  n_accept_capped = 0, n_backlog_full = 0, n_requests = 0,
+                  n_pipelined = 0, n_rearms = 0, n_rearms_avoided = 0,
+                  n_chunks = 0,
+                  n_remote_frees = 0, n_drain_closed = 0, n_accept_paused = 0,
+                  n_shed = 0, n_peer_refused = 0, n_peer_throttled = 0,
+                  n_timeouts[CLIENT_N_PHASES] = { 0 }, n_early_requests = 0,
+                  n_handoffs_refused = 0, n_stolen = 0, n_steal_wakeups = 0,
+                  n_local_conns = 0, n_remote_conns = 0, n_steered = 0,
+                  n_spin_wakeups = 0, spin_ns = 0;
+    long n_cut_off = 0;
+    int n_acceptors = (server->acceptors != NULL) ? server->n_acceptors : 0;
+    struct timespec now;
+    double uptime;
+
+    for (int i = 0; i < server->n_loops; i++) {
+        n_wakeups += server->loops[i]->stats.n_wakeups;
+        n_events += server->loops[i]->stats.n_events;
+        n_accepted += server->loops[i]->stats.n_accepted;
+        n_accept_capped += server->loops[i]->stats.n_accept_capped;
+        n_backlog_full += server->loops[i]->stats.n_backlog_full;
+        n_requests += server->loops[i]->stats.n_requests;
+        n_pipelined += server->loops[i]->stats.n_pipelined;
+        n_rearms += server->loops[i]->stats.n_rearms;
+        n_rearms_avoided += server->loops[i]->stats.n_rearms_avoided;
+        n_drain_closed += server->loops[i]->stats.n_drain_closed;
+        n_accept_paused += server->loops[i]->stats.n_accept_paused;
+        n_shed += server->loops[i]->stats.n_shed;
+        n_peer_refused += server->loops[i]->stats.n_peer_refused;
+        n_peer_throttled += server->loops[i]->stats.n_peer_throttled;
+        n_early_requests += server->loops[i]->stats.n_early_requests;
+        n_stolen += server->loops[i]->stats.n_stolen;
+        n_steal_wakeups += server->loops[i]->stats.n_steal_wakeups;
+        n_local_conns += server->loops[i]->stats.n_local_conns;
+        n_remote_conns += server->loops[i]->stats.n_remote_conns;
+        n_spin_wakeups += server->loops[i]->stats.n_spin_wakeups;
+        spin_ns += server->loops[i]->stats.spin_ns;
+        for (int j = 0; j < CLIENT_N_PHASES; j++) {
+            n_timeouts[j] += server->loops[i]->stats.n_timeouts[j];
+        }
+        n_cut_off += server->loops[i]->n_clients;
+    }
+    for (int i = 0; i < n_acceptors; i++) {
+        n_accept_capped += server->acceptors[i].stats.n_accept_capped;
+        n_backlog_full += server->acceptors[i].stats.n_backlog_full;
+        n_accept_paused += server->acceptors[i].stats.n_accept_paused;
+        n_handoffs_refused += server->acceptors[i].stats.n_handoffs_refused;
+        n_steered += server->acceptors[i].stats.n_steered;
+    }
+    for (unsigned i = 0; i < server->clients.n_caches; i++) {
+        n_chunks += server->clients.caches[i].n_chunks;
+        n_remote_frees += server->clients.caches[i].n_remote_frees;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uptime = timespec_diff(&now, &server->start_time);
+
+    printf("Server stats:\n"
+           "\tevent loops: %d\n"
+           "\twakeups: %lu\n"
+           "\tevents: %lu\n"
+           "\taverage batch size: %.2f (max %d)\n"
+           "\taccepted: %lu (%.1f/s)\n"
+           "\taccept bursts capped: %lu (max %d)\n"
+           "\tbacklog found full: %lu (backlog %d)\n"
+           "\trequests: %lu (%lu pipelined)\n"
+           "\tre-arms: %lu (%lu avoided)\n"
+           "\tclient slab: %lu KB in %lu chunks (%lu freed remotely)\n"
+           "\ttimed out: %lu awaiting request line, %lu awaiting headers, "
+           "%lu receiving body, %lu sending, %lu idle\n",
+           server->n_loops, n_wakeups, n_events,
+           server_avg_batch_size(server), server->max_events,
+           n_accepted, (uptime > 0) ? n_accepted / uptime : 0,
+           n_accept_capped, server->accept_burst,
+           n_backlog_full, server->backlog,
+           n_requests, n_pipelined,
+           n_rearms, n_rearms_avoided,
+           n_chunks * (SLAB_CHUNK_SIZE / 1024), n_chunks, n_remote_frees,
+           n_timeouts[CLIENT_PHASE_LINE], n_timeouts[CLIENT_PHASE_HEADERS],
+           n_timeouts[CLIENT_PHASE_BODY], n_timeouts[CLIENT_PHASE_SENDING],
+           n_timeouts[CLIENT_PHASE_IDLE]);
+    if (server->defer_accept > 0 || server->fastopen_qlen > 0) {
+        printf("\trequests read in full right after accept: %lu\n",
+                n_early_requests);
+    }
+    if (n_acceptors > 0) {
+        printf("\tacceptor threads: %d, %lu connections refused with full "
+               "handoff queues (size %d)\n", n_acceptors, n_handoffs_refused,
+               HANDOFF_QUEUE_SIZE);
+    }
+    if (server->flags & SERVER_WORK_STEALING) {
+        printf("\twork stealing: %lu connection events handled by another "
+               "worker, %lu idle workers woken to steal\n", n_stolen,
+               n_steal_wakeups);
+    }
+    if (server->busy_poll_us > 0) {
+        printf("\tbusy polling: %lu of %lu wakeups served without sleeping, "
+               "%.1f ms spent spinning (budget %d us)\n", n_spin_wakeups,
+               n_wakeups, spin_ns / 1000000., server->busy_poll_us);
+    }
+    if (server->cpus != NULL) {
+        printf("\tlocality: %lu of %lu connections arrived on the CPU of "
+               "their worker\n", n_local_conns,
+               n_local_conns + n_remote_conns);
+        if (n_acceptors > 0 && (server->flags & SERVER_CPU_STEERING)) {
+            printf("\t\t%lu steered by the acceptors\n", n_steered);
+        }
+        for (int i = 0; server->n_loops > 1 && i < server->n_loops; i++) {
+            printf("\t\tworker %d (CPU %d): %lu of %lu\n", i,
+                    server->cpus[i % server->n_cpus],
+                    server->loops[i]->stats.n_local_conns,
+                    server->loops[i]->stats.n_local_conns +
+                    server->loops[i]->stats.n_remote_conns);
+        }
+    }
+    if (server->max_clients > 0 || server->max_buffered > 0) {
+        printf("\toverload: accepting paused %lu times, %lu connections shed "
+               "(limits: %ld connections, %ld bytes)\n", n_accept_paused,
+               n_shed, server->max_clients, server->max_buffered);
+    }
+    if (server->peers.sets != NULL) {
+        printf("\tper-address limits: %lu connections refused, %lu requests "
+               "throttled, %lu addresses forgotten, %lu connections untracked "
+               "(limits: %u connections, %u requests/s, burst %u)\n",
+               n_peer_refused, n_peer_throttled, server->peers.n_evictions,
+               server->peers.n_untracked, server->peer_max_conns,
+               server->peer_rate, server->peers.burst);
+    }
+    if (server->draining) {
+        printf("\tdrained: %lu idle connections closed, %ld cut off after "
+               "%d ms\n", n_drain_closed, n_cut_off, server->drain_ms);
+    }
+#ifdef __linux__
+    long listen_overflows = read_listen_overflows();
+    if (server->listen_overflows != -1 && listen_overflows != -1) {
+        printf("\tlisten overflows (system-wide): %ld\n",
+                listen_overflows - server->listen_overflows);
+    }
+#endif
+    http_print_stats();
+}
+
+void drain_server(struct server *server) {
+    server->draining = 1;
+
+    // wake up every loop, which then begins draining
+    write(server->term_write, "x", 1);
+}
+
+static void join_acceptors(struct server *server);
+
+void close_server(struct server *server) {
+    int i;
+    // TODO this may be called in an interrupt context
+    vprintf("Closing server on fd %d\n", server->loops[0]->sockfd);
+
+    server->running = 0;
+
+    // write to the term pipe so all threads will be notified that the server
+    // is shutting down
+    write(server->term_write, "x", 1);
+
+    // join with all threads
+    exit_mt_routine(&server->mt);
+    join_acceptors(server);
+
+    print_server_stats(server);
+
+    for (i = 0; i < server->n_loops; i++) {
+        // in shared mode, there is only one loop, which owns the socket, and
+        // with acceptor threads every loop shares the socket of the first
+        close_loop(server->loops[i],
+                i == 0 || !(server->flags & SERVER_ACCEPTOR_THREADS));
+    }
+    free(server->acceptors);
+    server->acceptors = NULL;
+    free(server->loops);
+    server->n_loops = 0;
+
+    slab_destroy(&server->clients);
+    ipt_free(&server->peers);
+    topo_free(&server->topo);
+    free(server->cpus);
+    server->cpus = NULL;
+    free(server->cpu_loops);
+    server->cpu_loops = NULL;
+
+    CHECK(close(server->term_read));
+    CHECK(close(server->term_write));
+
+}
+
+
+/*
+ * listens on the socket fd of the loop, then adds the socket fd, the term
+ * pipe and the timer to the loop's event queue (epoll or kqueue). The timer
+ * is not started until start_loop is called
+ *
+ * with SERVER_ACCEPTOR_THREADS, the socket is left to the acceptor threads,
+ * and the loop is instead given a handoff queue, along with the means for
+ * the acceptors to wake it up, which takes the socket's place in its queue.
+ * With SERVER_WORK_STEALING, the loop may be woken the same way by the other
+ * workers, when they have work for its thread to steal
+ * 
+ * returns 0 on success and -1 on failure
+ */
+static int connect_server(struct server *server, struct ev_loop *loop) {
+    int acceptors = server->flags & SERVER_ACCEPTOR_THREADS;
+    int wakeable = acceptors || (server->flags & SERVER_WORK_STEALING);
+
+    // with acceptor threads, every loop shares the same socket, and
+    // listening on it again only sets the same backlog
+    if (listen(loop->sockfd, server->backlog) == -1) {
+        fprintf(stderr, "Unable to listen, reason: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (acceptors && hq_init(&loop->handoff, HANDOFF_QUEUE_SIZE) == -1) {
+        return -1;
+    }
+
+#ifdef __APPLE__
+    struct kevent listen_ev[3];
+    int n_evs = 0;
+    if (wakeable) {
+        EV_SET(&listen_ev[n_evs++], HANDOFF_IDENT, EVFILT_USER,
+                EV_ADD | EV_CLEAR, 0, 0, NULL);
+    }
+    if (!acceptors) {
+        EV_SET(&listen_ev[n_evs++], loop->sockfd, EVFILT_READ,
+                EV_ADD | EV_DISPATCH, 0, 0, NULL);
+    }
+    EV_SET(&listen_ev[n_evs++], server->term_read, EVFILT_READ,
+            EV_ADD, 0, 0, NULL);
+    if (kevent(loop->qfd, listen_ev, n_evs, NULL, 0, NULL) == -1) {
+        fprintf(stderr, "Unable to add server sockfd and term pipe read to "
+                QUEUE_T ", reason: %s\n", strerror(errno));
+        return -1;
+    }
+#elif __linux__
+    int ret = 0;
+
+    if (wakeable) {
+        loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wakefd == -1) {
+            fprintf(stderr, "Unable to initialize eventfd, reason: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+        struct epoll_event wake_ev = {
+            .events = EPOLLIN,
+            .data.ptr = ((char*) &loop->wakefd)
+                - offsetof(epoll_data_ptr_t, connfd)
+        };
+        ret = epoll_ctl(loop->qfd, EPOLL_CTL_ADD, loop->wakefd, &wake_ev);
+    }
+    if (!acceptors) {
+        struct epoll_event listen_ev = listen_event(loop);
+        ret = ret == -1 ? ret :
+            epoll_ctl(loop->qfd, EPOLL_CTL_ADD, loop->sockfd, &listen_ev);
+    }
+
+    struct epoll_event term_ev = {
+        .events = EPOLLIN,
+        .data.ptr = ((char*) &server->term_read)
+            - offsetof(epoll_data_ptr_t, connfd)
+    };
+    ret = ret == -1 ? ret :
+        epoll_ctl(loop->qfd, EPOLL_CTL_ADD, server->term_read, &term_ev);
+
+    struct epoll_event timer_ev = {
+        .events = EPOLLIN | EPOLLET,
+        .data.ptr = ((char*) &loop->timerfd)
+            - offsetof(epoll_data_ptr_t, connfd)
+    };
+    ret = ret == -1 ? ret :
+        epoll_ctl(loop->qfd, EPOLL_CTL_ADD, loop->timerfd, &timer_ev);
+
+    if (ret == -1) {
+        fprintf(stderr, "Unable to add server sockfd, term pipe read or "
+                "timerfd to " QUEUE_T ", reason: %s\n", strerror(errno));
+        return ret;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * sets the socket options of the loop's listening socket which may be changed
+ * between init_server and run_server, which the kernel allows on sockets
+ * already listening
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int set_listen_options(struct server *server, struct ev_loop *loop) {
+    if (server->defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        if (setsockopt(loop->sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                    &server->defer_accept, sizeof(int)) == -1) {
+            fprintf(stderr, "Unable to set TCP_DEFER_ACCEPT, reason: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+#else
+        fprintf(stderr, "TCP_DEFER_ACCEPT is only available on Linux\n");
+        return -1;
+#endif
+    }
+
+    if (server->fastopen_qlen > 0) {
+#ifdef TCP_FASTOPEN
+#ifdef __APPLE__
+        // on MacOS the option is only a switch, and the queue length is set
+        // system-wide
+        int qlen = 1;
+#else
+        int qlen = server->fastopen_qlen;
+#endif
+        if (setsockopt(loop->sockfd, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+                    sizeof(int)) == -1) {
+            fprintf(stderr, "Unable to set TCP_FASTOPEN, reason: %s\n",
+                    strerror(errno));
+            return -1;
+        }
+#else
+        fprintf(stderr, "TCP Fast Open is not supported on this system\n");
+        return -1;
+#endif
+    }
+    return 0;
+}
+
+/*
+ * starts the periodic timer of the loop, which goes off once every tick, and
+ * sets the clock of its timing wheel. nthreads is the number of threads which
+ * will be waiting on this loop
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int start_loop(struct server *server, struct ev_loop *loop,
+        int nthreads) {
+    int tick_ms = server->timer_tick_ms;
+
+    if (set_listen_options(server, loop) == -1) {
+        return -1;
+    }
+
+    loop->shared = nthreads > 1;
+    if (server->flags & SERVER_WORK_STEALING) {
+        loop->stealing = 1;
+        // the thread of the loop empties the deque after every wakeup, so it
+        // never holds more than one batch of events
+        if (wsd_init(&loop->tasks, server->max_events) == -1) {
+            return -1;
+        }
+    }
+#ifdef __linux__
+    loop->edge_triggered = !loop->shared;
+#endif
+    loop->tick_ms = tick_ms;
+    loop->timeout_ticks.request_line =
+        (server->request_line_ms + tick_ms - 1) / tick_ms;
+    loop->timeout_ticks.headers = (server->headers_ms + tick_ms - 1) / tick_ms;
+    loop->timeout_ticks.idle = (server->idle_ms + tick_ms - 1) / tick_ms;
+    loop->timeout_ticks.stall = (server->stall_ms + tick_ms - 1) / tick_ms;
+    loop->min_rate = server->min_rate;
+
+    loop_update_time(loop);
+    tw_init(&loop->timers, loop->now);
+
+#ifdef __APPLE__
+    struct kevent timer_ev;
+    // with no unit flags, the timer period is given in milliseconds
+    EV_SET(&timer_ev, TIMER_IDENT, EVFILT_TIMER, EV_ADD | EV_ENABLE, 0,
+            tick_ms, NULL);
+    if (kevent(loop->qfd, &timer_ev, 1, NULL, 0, NULL) == -1) {
+        fprintf(stderr, "Unable to add timer to " QUEUE_T ", reason: %s\n",
+                strerror(errno));
+        return -1;
+    }
+#elif __linux__
+    if (server->flags & SERVER_IO_URING) {
+        // the ring keeps time with timeouts of its own
+        return uring_loop_init(server, loop);
+    }
+
+    struct itimerspec timer = {
+        .it_interval = {
+            .tv_sec = tick_ms / 1000,
+            .tv_nsec = (tick_ms % 1000) * 1000000
+        },
+        .it_value = {
+            .tv_sec = tick_ms / 1000,
+            .tv_nsec = (tick_ms % 1000) * 1000000
+        }
+    };
+    if (timerfd_settime(loop->timerfd, 0, &timer, NULL) == -1) {
+        fprintf(stderr, "Unable to initialize timer, reason: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    if (server->busy_poll_us > 0) {
+        // have the kernel poll the receive queues of the loop's connections
+        // itself while epoll_wait finds nothing, which only helps with NICs
+        // which support it, and only exists since Linux 6.9
+        struct epoll_params params = {
+            .busy_poll_usecs = server->busy_poll_us,
+            .busy_poll_budget = 8
+        };
+        if (ioctl(loop->qfd, EPIOCSPARAMS, &params) == -1) {
+            vprintf("Kernel busy polling is unavailable, reason: %s\n",
+                    strerror(errno));
+        }
+    }
+#endif
+    return 0;
+}
+
+/*
+ * starts every loop of the server, given the total number of threads
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int start_loops(struct server *server, int nthreads) {
+    int i;
+
+    if (server->timer_tick_ms <= 0) {
+        fprintf(stderr, "Timer tick must be positive, but got %d\n",
+                server->timer_tick_ms);
+        return -1;
+    }
+    if (server->request_line_ms <= 0 || server->headers_ms <= 0 ||
+            server->idle_ms <= 0 || server->stall_ms <= 0 ||
+            server->min_rate < 0) {
+        fprintf(stderr, "Connection timeouts must be positive\n");
+        return -1;
+    }
+
+    if (slab_init(&server->clients, sizeof(struct client), nthreads) == -1) {
+        return -1;
+    }
+    if ((server->peer_max_conns > 0 || server->peer_rate > 0) &&
+            ipt_init(&server->peers, server->peer_table_size,
+                server->peer_max_conns, server->peer_rate,
+                server->peer_burst) == -1) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &server->start_time);
+#ifdef __linux__
+    server->listen_overflows = read_listen_overflows();
+#endif
+
+    for (i = 0; i < server->n_loops; i++) {
+        // threads are spread evenly among the loops
+        if (start_loop(server, server->loops[i],
+                    (nthreads + server->n_loops - 1 - i) / server->n_loops)
+                == -1) {
+            return -1;
+        }
+        // thread i waits on loop i % n_loops
+        server->loops[i]->owner = i;
+    }
+    return 0;
+}
+
+/*
+ * creates an event loop for each thread but the first (which uses the loop
+ * created in init_server), each with its own listening socket bound to the
+ * server's port with SO_REUSEPORT, or with SERVER_ACCEPTOR_THREADS sharing
+ * the socket of the first loop
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int create_thread_loops(struct server *server, int nthreads) {
+    struct ev_loop **loops;
+    int sockfd;
+
+    loops = (struct ev_loop **) realloc(server->loops,
+            nthreads * sizeof(struct ev_loop *));
+    if (loops == NULL) {
+        fprintf(stderr, "Unable to malloc space for %d event loops\n",
+                nthreads);
+        return -1;
+    }
+    server->loops = loops;
+
+    while (server->n_loops < nthreads) {
+        // with acceptor threads, the loops share the socket of the first,
+        // which they never accept from themselves
+        sockfd = (server->flags & SERVER_ACCEPTOR_THREADS) ?
+            loops[0]->sockfd : bind_socket(server);
+        if (sockfd == -1) {
+            return -1;
+        }
+        loops[server->n_loops] = create_loop(sockfd);
+        if (loops[server->n_loops] == NULL) {
+            if (sockfd != loops[0]->sockfd) {
+                close(sockfd);
+            }
+            return -1;
+        }
+        server->n_loops++;
+
+        if (connect_server(server, loops[server->n_loops - 1]) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * registers a newly accepted client in the event queue of its loop, and starts
+ * timing the connection out
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int register_client(struct client *client) {
+    struct ev_loop *loop = client->loop;
+    int ret;
+
+    // everything is set up before the client is registered, as in a shared
+    // loop, another thread may be told of its first event, and even
+    // disconnect it, before this returns
+    printf("accepted on fd %d\n", client->connfd);
+    client->armed = CLIENT_READ;
+    set_expiration_timer(client);
+
+#ifdef __APPLE__
+    struct kevent event;
+    EV_SET(&event, client->connfd, EVFILT_READ,
+            EV_ADD | EV_DISPATCH, 0, 0, client);
+    ret = CHECK(kevent(loop->qfd, &event, 1, NULL, 0, NULL));
+#elif __linux__
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP |
+            (loop->edge_triggered ? EPOLLET : EPOLLONESHOT),
+        .data.ptr = client
+    };
+    ret = CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_ADD, client->connfd, &event));
+#endif
+
+    if (ret == -1) {
+        acq_timers_lock(loop);
+        tw_cancel(&loop->timers, &client->timer);
+        rel_timers_lock(loop);
+    }
+    return ret;
+}
+
+/*
+ * true if the accept queue of the loop's listening socket is full
+ */
+static int backlog_full(struct ev_loop *loop) {
+#ifdef __linux__
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    // for listening sockets, tcpi_unacked is the current length of the
+    // accept queue and tcpi_sacked is its maximum length
+    if (getsockopt(loop->sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        return info.tcpi_unacked >= info.tcpi_sacked;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * stops the loop from accepting connections, once the server is overloaded,
+ * until resume_accept is called
+ */
+static void pause_accept(struct server *server, struct ev_loop *loop) {
+    acq_loop_lock(loop, &loop->accept_lock);
+    if (!loop->accept_paused) {
+        loop->accept_paused = 1;
+#ifdef __linux__
+#ifdef EPOLLEXCLUSIVE
+        if (loop->ur == NULL) {
+            // exclusive registrations can not be modified, only removed
+            CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_DEL, loop->sockfd, NULL));
+        }
+#endif
+#endif
+        // otherwise, the listening socket was disarmed when it fired, or the
+        // single-shot accept of an io_uring loop completed, and it is simply
+        // not re-armed
+        __atomic_fetch_add(&loop->stats.n_accept_paused, 1, __ATOMIC_RELAXED);
+    }
+    rel_loop_lock(loop, &loop->accept_lock);
+}
+
+/*
+ * lets a loop which was paused by pause_accept accept connections again, if
+ * usage of the server has dropped below its low-water marks, unless the loop
+ * is draining
+ */
+static void resume_accept(struct server *server, struct ev_loop *loop) {
+    if (!__atomic_load_n(&loop->accept_paused, __ATOMIC_RELAXED) ||
+            !server_relieved(server)) {
+        return;
+    }
+
+    acq_loop_lock(loop, &loop->accept_lock);
+    if (loop->accept_paused && !loop->draining) {
+        loop->accept_paused = 0;
+#ifdef __APPLE__
+        struct kevent listen_ev;
+        EV_SET(&listen_ev, loop->sockfd, EVFILT_READ,
+                EV_ENABLE | EV_DISPATCH, 0, 0, NULL);
+        CHECK(kevent(loop->qfd, &listen_ev, 1, NULL, 0, NULL));
+#elif __linux__
+        if (loop->ur != NULL) {
+            uring_arm_accept(server, loop);
+        }
+        else {
+            struct epoll_event listen_ev = listen_event(loop);
+#ifdef EPOLLEXCLUSIVE
+            CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_ADD, loop->sockfd,
+                        &listen_ev));
+#else
+            CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_MOD, loop->sockfd,
+                        &listen_ev));
+#endif
+        }
+#endif
+        vprintf("Loop on fd %d resumed accepting\n", loop->sockfd);
+    }
+    rel_loop_lock(loop, &loop->accept_lock);
+}
+
+/*
+ * allocates and initializes a client for a connection from sa accepted into
+ * the loop, which has already been counted against the limits of the server
+ *
+ * returns NULL if the client could not be allocated, in which case nothing
+ * has been done with the connection
+ */
+static struct client* new_client(struct server *server, struct ev_loop *loop,
+        int connfd, const struct sockaddr *sa, int peer_counted, int thread) {
+    struct client *client;
+
+    client = (struct client *) slab_alloc(&server->clients, thread);
+    if (client == NULL) {
+        return NULL;
+    }
+    init_client(client, connfd, sa);
+    client->loop = loop;
+    client->peer_counted = peer_counted;
+    return client;
+}
+
+/*
+ * true if connections accepted into the loop are read from right away
+ *
+ * with TCP_DEFER_ACCEPT, connections are only accepted once their first
+ * request has arrived, as are TCP Fast Open connections which sent it with
+ * their SYN, so it is read right away instead of waiting to be told the
+ * connection is readable. Only done when no other thread waits on the loop,
+ * which could otherwise be handed the connection mid-read
+ */
+static __inline int reads_first(struct server *server, struct ev_loop *loop) {
+    return !loop->shared &&
+        (server->defer_accept > 0 || server->fastopen_qlen > 0);
+}
+
+/*
+ * counts whether the connection arrived on the CPU the thread registering it
+ * is bound to, if the threads are bound to CPUs at all
+ */
+static void count_locality(struct server *server, struct ev_loop *loop,
+        int connfd, int thread) {
+#ifdef __linux__
+    socklen_t len = sizeof(int);
+    int cpu;
+
+    if (server->cpus == NULL ||
+            getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 ||
+            cpu < 0) {
+        return;
+    }
+    if (cpu == server->cpus[thread % server->n_cpus]) {
+        __atomic_fetch_add(&loop->stats.n_local_conns, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_add(&loop->stats.n_remote_conns, 1, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+/*
+ * registers a new client in its loop, reading its first request right away
+ * if read_first is set
+ *
+ * returns 0 on success, and -1 if the client could not be registered, in
+ * which case it has been freed
+ */
+static int start_client(struct server *server, struct client *client,
+        int read_first, int thread) {
+    struct ev_loop *loop = client->loop;
+
+    count_locality(server, loop, client->connfd, thread);
+    if (register_client(client) == -1) {
+        uncount_client(server, client);
+        close_client(client);
+        slab_free(&server->clients, thread, client);
+        return -1;
+    }
+
+    if (read_first && read_from(server, client, thread) != READ_INCOMPLETE) {
+        // the client may have been freed by now
+        __atomic_fetch_add(&loop->stats.n_early_requests, 1,
+                __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/*
+ * accepts connections from the backlog of the loop's listening socket until
+ * it is empty or accept_burst connections have been accepted
+ *
+ * returns the number of connections accepted, or -1 if the server is not
+ * running
+ */
+static int accept_connections(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct client *client;
+    struct sockaddr sa;
+    int connfd, n_tries, n_accepted = 0, drained = 0, peer_counted;
+    int read_first = reads_first(server, loop);
+
+    if (!server->running) {
+        return -1;
+    }
+
+    for (n_tries = 0; n_tries < server->accept_burst; n_tries++) {
+        if (server_overloaded(server) &&
+                !(server->flags & SERVER_SHED_OVERLOAD)) {
+            // leave the rest in the backlog until usage drops
+            pause_accept(server, loop);
+            drained = 1;
+            break;
+        }
+
+        connfd = accept_conn(loop->sockfd, &sa, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd == -1) {
+            if (errno == ECONNABORTED || errno == EINTR) {
+                // the connection was reset before it could be accepted
+                continue;
+            }
+            // either the backlog is empty, or we are out of file descriptors
+            // or memory, in which case the remaining connections are left in
+            // the backlog
+            drained = 1;
+            break;
+        }
+
+        if ((server->flags & SERVER_SHED_OVERLOAD) &&
+                server_overloaded(server)) {
+            shed_connection(loop, connfd);
+            continue;
+        }
+        if ((peer_counted = admit_peer(server, loop, connfd, &sa)) == -1) {
+            continue;
+        }
+
+        client = new_client(server, loop, connfd, &sa, peer_counted, thread);
+        if (client == NULL) {
+            if (peer_counted) {
+                ipt_disconnect(&server->peers, peer_addr(&sa));
+            }
+            close(connfd);
+            drained = 1;
+            break;
+        }
+        count_client(server, loop);
+
+        if (start_client(server, client, read_first, thread) == 0) {
+            n_accepted++;
+        }
+    }
+
+    if (!drained) {
+        __atomic_fetch_add(&loop->stats.n_accept_capped, 1, __ATOMIC_RELAXED);
+        if (backlog_full(loop)) {
+            __atomic_fetch_add(&loop->stats.n_backlog_full, 1,
+                    __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&loop->stats.n_accepted, n_accepted, __ATOMIC_RELAXED);
+
+    // rearm the listening socket, unless it was never disarmed or accepting
+    // has been paused
+    if (!__atomic_load_n(&loop->accept_paused, __ATOMIC_RELAXED)) {
+#ifdef __APPLE__
+        struct kevent listen_ev;
+        EV_SET(&listen_ev, loop->sockfd, EVFILT_READ,
+                EV_ENABLE | EV_DISPATCH, 0, 0, NULL);
+        CHECK(kevent(loop->qfd, &listen_ev, 1, NULL, 0, NULL));
+#elif __linux__
+#ifndef EPOLLEXCLUSIVE
+        struct epoll_event listen_ev = listen_event(loop);
+        CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_MOD, loop->sockfd, &listen_ev));
+#endif
+#endif
+    }
+
+    return n_accepted;
+}
+
+
+/*
+ * wakes up the thread waiting on the loop, after connections were pushed onto
+ * its handoff queue or there is work for it to steal, unless it has been
+ * woken already and has not yet woken up
+ */
+static void wake_loop(struct ev_loop *loop) {
+    if (__atomic_exchange_n(&loop->woken, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+#ifdef __APPLE__
+    struct kevent wake_ev;
+    EV_SET(&wake_ev, HANDOFF_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    CHECK(kevent(loop->qfd, &wake_ev, 1, NULL, 0, NULL));
+#elif __linux__
+    uint64_t one = 1;
+    write(loop->wakefd, &one, sizeof(one));
+#endif
+}
+
+/*
+ * to be called by the thread waiting on the loop once it has been woken by
+ * wake_loop, before it looks for what it was woken for, so that anything
+ * handed to the loop from then on wakes it again
+ */
+static void loop_woken(struct ev_loop *loop) {
+#ifdef __linux__
+    uint64_t n_wakes;
+    read(loop->wakefd, &n_wakes, sizeof(n_wakes));
+#endif
+    __atomic_exchange_n(&loop->woken, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/* connection steering */
+
+/*
+ * gives the number of loops whose threads are bound to the CPU of loop
+ * first, the first of them, which are every n_cpus'th loop from it on
+ */
+static __inline int cpu_n_loops(struct server *server, int first) {
+    return (server->n_loops - first + server->n_cpus - 1) / server->n_cpus;
+}
+
+#ifdef __linux__
+/*
+ * attaches a classic BPF program to the SO_REUSEPORT group of the loops'
+ * listening sockets which picks, for each new connection, the socket of a
+ * loop whose thread is bound to the CPU handling the connection's SYN. The
+ * sockets of the group are numbered in the order they started listening,
+ * which is the order of the loops. Among several loops on one CPU, the
+ * connection's receive hash picks one, and connections received on a CPU no
+ * thread is bound to are given an index past the end of the group, which
+ * leaves them to the kernel's usual hash
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int attach_steering_prog(struct server *server) {
+    struct sock_filter *insns, *insn;
+    struct sock_fprog prog;
+    int cpu, first, n_loops, ret;
+
+    insns = (struct sock_filter *) malloc(BPF_MAXINSNS *
+            sizeof(struct sock_filter));
+    if (insns == NULL) {
+        fprintf(stderr, "Unable to malloc steering program\n");
+        return -1;
+    }
+    insn = insns;
+
+    *insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+            SKF_AD_OFF + SKF_AD_CPU);
+    for (first = 0; first < MIN(server->n_cpus, server->n_loops); first++) {
+        cpu = server->cpus[first];
+        if (server->cpu_loops[cpu] != first) {
+            // listed twice, and already steered to its first loop
+            continue;
+        }
+        // room for the longest case and the final return. CPUs past this
+        // point are left to the kernel's hash
+        if (insn - insns + 7 > BPF_MAXINSNS) {
+            break;
+        }
+        n_loops = cpu_n_loops(server, first);
+        // on any other CPU, skip the instructions which pick the loop
+        *insn++ = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                cpu, 0, (n_loops == 1) ? 1 : 5);
+        if (n_loops == 1) {
+            *insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, first);
+            continue;
+        }
+        *insn++ = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                SKF_AD_OFF + SKF_AD_RXHASH);
+        *insn++ = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+                n_loops);
+        *insn++ = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MUL | BPF_K,
+                server->n_cpus);
+        *insn++ = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K,
+                first);
+        *insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+    }
+    *insn++ = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, server->n_loops);
+
+    prog.len = insn - insns;
+    prog.filter = insns;
+    ret = setsockopt(server->loops[0]->sockfd, SOL_SOCKET,
+            SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    if (ret == -1) {
+        fprintf(stderr, "Unable to attach steering program, reason: %s\n",
+                strerror(errno));
+    }
+    free(insns);
+    return ret;
+}
+#endif
+
+/*
+ * maps each CPU to the first loop whose thread is bound to it, and unless
+ * acceptor threads pick the loops themselves, has the kernel steer each
+ * connection to one of them. Thread i waits on loop i and is bound to CPU
+ * cpus[i % n_cpus]
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int steer_connections(struct server *server) {
+    int i;
+
+    server->cpu_loops = (int *) malloc(TOPO_MAX_CPUS * sizeof(int));
+    if (server->cpu_loops == NULL) {
+        fprintf(stderr, "Unable to malloc CPU loop table\n");
+        return -1;
+    }
+    for (i = 0; i < TOPO_MAX_CPUS; i++) {
+        server->cpu_loops[i] = -1;
+    }
+    for (i = MIN(server->n_cpus, server->n_loops) - 1; i >= 0; i--) {
+        server->cpu_loops[server->cpus[i]] = i;
+    }
+
+#ifdef __linux__
+    if (!(server->flags & SERVER_ACCEPTOR_THREADS)) {
+        return attach_steering_prog(server);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * picks a loop whose thread is bound to the CPU which received the
+ * connection, going through them in turn if there are several
+ *
+ * returns NULL if no thread is bound to that CPU, or it is unknown
+ */
+static struct ev_loop* steered_loop(struct server *server,
+        struct acceptor *acc, int connfd) {
+#ifdef __linux__
+    socklen_t len = sizeof(int);
+    int cpu, first;
+
+    if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 ||
+            cpu < 0 || cpu >= TOPO_MAX_CPUS ||
+            (first = server->cpu_loops[cpu]) == -1) {
+        return NULL;
+    }
+    first += server->n_cpus *
+        (acc->stats.n_steered++ % cpu_n_loops(server, first));
+    return server->loops[first];
+#else
+    return NULL;
+#endif
+}
+
+
+/* acceptor threads */
+
+/*
+ * registers every connection an acceptor thread has handed to the loop
+ *
+ * returns the number of connections registered
+ */
+static int take_handoffs(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct client *client;
+    struct sockaddr sa;
+    int connfd, peer_counted, n_taken = 0;
+    int read_first = reads_first(server, loop);
+
+    while ((connfd = hq_pop(&loop->handoff, &peer_counted, &sa)) != -1) {
+        // the acceptor already counted the connection against the limits
+        client = new_client(server, loop, connfd, &sa, peer_counted, thread);
+        if (client == NULL) {
+            uncount_connection(server, loop, &sa, peer_counted);
+            close(connfd);
+            continue;
+        }
+        if (start_client(server, client, read_first, thread) == 0) {
+            n_taken++;
+        }
+    }
+    return n_taken;
+}
+
+/*
+ * picks the loop the acceptor hands its next connection to
+ */
+static struct ev_loop* handoff_target(struct server *server,
+        struct acceptor *acc) {
+    struct ev_loop *loop, *best = NULL;
+    int i, n_loops = server->n_loops;
+
+    if (server->handoff_policy == HANDOFF_ROUND_ROBIN) {
+        loop = server->loops[acc->next_loop];
+        acc->next_loop = (acc->next_loop + 1) % n_loops;
+        return loop;
+    }
+
+    // starting from a different loop each time, so ties are spread evenly
+    for (i = 0; i < n_loops; i++) {
+        loop = server->loops[(acc->next_loop + i) % n_loops];
+        if (best == NULL ||
+                __atomic_load_n(&loop->n_clients, __ATOMIC_RELAXED) <
+                __atomic_load_n(&best->n_clients, __ATOMIC_RELAXED)) {
+            best = loop;
+        }
+    }
+    acc->next_loop = (acc->next_loop + 1) % n_loops;
+    return best;
+}
+
+/*
+ * accepts connections from the backlog of the listening socket until it is
+ * empty or accept_burst connections have been accepted, and hands each to
+ * one of the loops. Admission control is applied here, before a connection
+ * ever reaches a worker
+ *
+ * returns the number of connections handed off
+ */
+static int acceptor_accept(struct server *server, struct acceptor *acc) {
+    struct ev_loop *loop;
+    struct sockaddr sa;
+    int sockfd = server->loops[0]->sockfd;
+    int connfd, n_tries, n_handed = 0, drained = 0, peer_counted;
+
+    for (n_tries = 0; n_tries < server->accept_burst; n_tries++) {
+        if (server_overloaded(server) &&
+                !(server->flags & SERVER_SHED_OVERLOAD)) {
+            // leave the rest in the backlog until usage drops
+            acc->paused = 1;
+            acc->stats.n_accept_paused++;
+            drained = 1;
+            break;
+        }
+
+        connfd = accept_conn(sockfd, &sa, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd == -1) {
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            drained = 1;
+            break;
+        }
+
+        loop = NULL;
+        if (server->flags & SERVER_CPU_STEERING) {
+            loop = steered_loop(server, acc, connfd);
+        }
+        if (loop == NULL) {
+            loop = handoff_target(server, acc);
+        }
+        if ((server->flags & SERVER_SHED_OVERLOAD) &&
+                server_overloaded(server)) {
+            shed_connection(loop, connfd);
+            continue;
+        }
+        if ((peer_counted = admit_peer(server, loop, connfd, &sa)) == -1) {
+            continue;
+        }
+
+        // counted right away, so that the limits and the choice of loop
+        // account for connections still waiting in the queues
+        count_client(server, loop);
+        if (hq_push(&loop->handoff, connfd, peer_counted, &sa) == -1) {
+            // the worker has fallen too far behind
+            uncount_connection(server, loop, &sa, peer_counted);
+            reject_connection(connfd, overload_response,
+                    sizeof(overload_response) - 1);
+            acc->stats.n_handoffs_refused++;
+            continue;
+        }
+        wake_loop(loop);
+        __atomic_fetch_add(&loop->stats.n_accepted, 1, __ATOMIC_RELAXED);
+        n_handed++;
+    }
+
+    if (!drained) {
+        acc->stats.n_accept_capped++;
+        if (backlog_full(server->loops[0])) {
+            acc->stats.n_backlog_full++;
+        }
+    }
+    return n_handed;
+}
+
+/*
+ * main loop of an acceptor thread, which waits on the listening socket and
+ * the term pipe with poll, as it has nothing else to wait on
+ */
+static void* run_acceptor(void *acc_arg) {
+    struct acceptor *acc = (struct acceptor *) acc_arg;
+    struct server *server = acc->server;
+    struct pollfd fds[2];
+    sigset_t signals;
+    int n_fds;
+
+    // leave signals to the worker threads, as close_server joins with this
+    // thread
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    fds[0].fd = server->term_read;
+    fds[0].events = POLLIN;
+    fds[1].fd = server->loops[0]->sockfd;
+    fds[1].events = POLLIN;
+
+    vprintf("acceptor %d begin\n", acc->id);
+
+    while (1) {
+        if (acc->paused && server_relieved(server)) {
+            acc->paused = 0;
+        }
+        // while paused, the listening socket is left alone, and usage is
+        // checked again once every tick
+        n_fds = acc->paused ? 1 : 2;
+        if (poll(fds, n_fds, acc->paused ? server->timer_tick_ms : -1)
+                == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "poll call failed in acceptor %d, reason: "
+                        "%s\n", acc->id, strerror(errno));
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (server->running && server->draining) {
+                // hand off the connections which already made it into the
+                // backlog
+                while (!acc->paused &&
+                        acceptor_accept(server, acc) == server->accept_burst);
+#ifdef __linux__
+                // new connections are refused right away, as in start_drain
+                shutdown(fds[1].fd, SHUT_RD);
+#endif
+            }
+            break;
+        }
+        if (n_fds == 2 && (fds[1].revents & POLLIN)) {
+            acceptor_accept(server, acc);
+        }
+    }
+
+    __atomic_fetch_sub(&server->n_acceptors_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * spawns the acceptor threads of the server
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int start_acceptors(struct server *server) {
+    struct acceptor *acc;
+    int i, err;
+
+    if (server->n_acceptors <= 0) {
+        fprintf(stderr, "Number of acceptor threads must be positive, but "
+                "got %d\n", server->n_acceptors);
+        return -1;
+    }
+    if (posix_memalign((void **) &server->acceptors, CACHE_LINE,
+                server->n_acceptors * sizeof(struct acceptor)) != 0) {
+        fprintf(stderr, "Unable to malloc %d acceptors\n",
+                server->n_acceptors);
+        server->acceptors = NULL;
+        return -1;
+    }
+    memset(server->acceptors, 0,
+            server->n_acceptors * sizeof(struct acceptor));
+
+    for (i = 0; i < server->n_acceptors; i++) {
+        acc = &server->acceptors[i];
+        acc->server = server;
+        acc->id = i;
+        // so acceptors do not all start handing off to the same loop
+        acc->next_loop = i % server->n_loops;
+
+        __atomic_fetch_add(&server->n_acceptors_running, 1, __ATOMIC_RELAXED);
+        if ((err = pthread_create(&acc->thread, NULL, &run_acceptor, acc))
+                != 0) {
+            fprintf(stderr, "Unable to spawn acceptor thread %d, reason: "
+                    "%s\n", i, strerror(err));
+            __atomic_fetch_sub(&server->n_acceptors_running, 1,
+                    __ATOMIC_RELAXED);
+            // only the ones already running are joined
+            server->n_acceptors = i;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * waits for every acceptor thread to return, which they do once they see
+ * the term pipe
+ */
+static void join_acceptors(struct server *server) {
+    if (server->acceptors == NULL) {
+        return;
+    }
+    for (int i = 0; i < server->n_acceptors; i++) {
+        if (pthread_join(server->acceptors[i].thread, NULL) != 0) {
+            fprintf(stderr, "Pthread join failed\n");
+        }
+    }
+}
+
+
+#ifdef __linux__
+
+/* io_uring backend */
+
+// number of submission queue entries of each ring, which bounds how many
+// operations may be queued up between two waits on the ring
+#define URING_ENTRIES 256
+
+// number of receive buffers provided to each ring, each MAX_READ_SIZE bytes.
+// Must be a power of 2
+#define URING_N_BUFS 256
+// buffer group id of the receive buffers
+#define URING_BGID 0
+
+// size of the buffer each client's response is sent from, which holds the
+// response headers followed by as much of the requested file as fits
+#define URING_SEND_BUF_SIZE 16384
+
+// the low bits of the user_data of each submission give the kind of
+// operation it is, and the rest point to the client (or loop) it is for
+#define URING_OP_ACCEPT 1
+#define URING_OP_TIMER  2
+#define URING_OP_TERM   3
+#define URING_OP_CANCEL 4
+#define URING_OP_RECV   5
+#define URING_OP_READ   6
+#define URING_OP_SEND   7
+#define URING_OP_MASK   0x7LU
+
+
+struct uring_loop {
+    struct uring ring;
+
+    // buffers receives are done into
+    struct uring_buf_ring bufs;
+    // clients whose receive failed for every buffer being in use, oldest
+    // first, which are received from again at the end of the wakeup
+    struct client *starved;
+    struct client *starved_tail;
+
+    // period of the expiration timer
+    struct __kernel_timespec tick;
+};
+
+
+/*
+ * takes a submission queue entry for an operation of type op on fd, on
+ * behalf of ptr
+ *
+ * returns NULL if the submission queue is full
+ */
+static struct io_uring_sqe* uring_prep(struct ev_loop *loop, unsigned long op,
+        void *ptr, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ur->ring);
+
+    if (sqe == NULL) {
+        fprintf(stderr, "io_uring submission queue of the loop on fd %d is "
+                "full\n", loop->sockfd);
+        return NULL;
+    }
+    sqe->fd = fd;
+    sqe->user_data = ((unsigned long) ptr) | op;
+    return sqe;
+}
+
+/*
+ * submits a multishot accept on the loop's listening socket, which completes
+ * once for every connection accepted until it is cancelled or fails. When the
+ * server limits its connections, the accept is single-shot instead, as a
+ * multishot accept keeps taking connections off the backlog before their
+ * completions are seen, so the loop could not stop at the limit
+ */
+static int uring_arm_accept(struct server *server, struct ev_loop *loop) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_prep(loop, URING_OP_ACCEPT, loop, loop->sockfd);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    if (server->max_clients == 0 && server->max_buffered == 0) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    return 0;
+}
+
+/*
+ * submits a timeout which completes after one tick of the loop
+ */
+static int uring_arm_timer(struct ev_loop *loop) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_prep(loop, URING_OP_TIMER, loop, -1);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) &loop->ur->tick;
+    sqe->len = 1;
+    return 0;
+}
+
+/*
+ * submits a poll on the read end of the term pipe, which completes once the
+ * server is shut down
+ */
+static int uring_arm_term(struct server *server, struct ev_loop *loop) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_prep(loop, URING_OP_TERM, loop, server->term_read);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+/*
+ * submits a receive on the client's connection into whichever buffer of the
+ * loop's buffer ring is free once data arrives
+ */
+static int uring_recv(struct client *client) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_prep(client->loop, URING_OP_RECV, client, client->connfd);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->len = MAX_READ_SIZE;
+    client->ur.inflight++;
+    return 0;
+}
+
+/*
+ * puts the client at the end of its loop's list of starved clients
+ */
+static void uring_starve(struct client *client) {
+    struct uring_loop *ur = client->loop->ur;
+
+    client->ur.starved = 1;
+    client->ur.next_starved = NULL;
+    if (ur->starved == NULL) {
+        ur->starved = client;
+    }
+    else {
+        ur->starved_tail->ur.next_starved = client;
+    }
+    ur->starved_tail = client;
+}
+
+/*
+ * takes the client off its loop's list of starved clients
+ */
+static void uring_unstarve(struct client *client) {
+    struct uring_loop *ur = client->loop->ur;
+    struct client **next = &ur->starved, *prev = NULL;
+
+    while (*next != client) {
+        prev = *next;
+        next = &prev->ur.next_starved;
+    }
+    *next = client->ur.next_starved;
+    if (ur->starved_tail == client) {
+        ur->starved_tail = prev;
+    }
+    client->ur.next_starved = NULL;
+    client->ur.starved = 0;
+}
+
+/*
+ * submits the next chunk of the client's response. As much of the requested
+ * file as fits after what is left in the send buffer is read into it, and a
+ * send of the buffer is linked to the read, so that both are handed to the
+ * kernel at once. If the read comes up short, the kernel cancels the send
+ */
+static int uring_send_chunk(struct client *client) {
+    struct uring *ring = &client->loop->ur->ring;
+    struct http *h = &client->http;
+    struct io_uring_sqe *sqe;
+    size_t n;
+
+    // the read and the send must go to the kernel in the same submission
+    // for the link between them to hold
+    if (uring_sq_space(ring) < 2 && uring_submit_and_wait(ring, 0) == -1) {
+        return -1;
+    }
+
+    if (h->fd != -1 && h->offset < h->file_size) {
+        n = MIN(h->file_size - h->offset,
+                URING_SEND_BUF_SIZE - client->ur.len);
+        if (n > 0) {
+            sqe = uring_prep(client->loop, URING_OP_READ, client, h->fd);
+            if (sqe == NULL) {
+                return -1;
+            }
+            sqe->opcode = IORING_OP_READ;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->addr = (unsigned long) (client->ur.buf + client->ur.len);
+            sqe->len = n;
+            sqe->off = h->offset;
+            client->ur.inflight++;
+
+            h->offset += n;
+            client->ur.len += n;
+        }
+    }
+
+    sqe = uring_prep(client->loop, URING_OP_SEND, client, client->connfd);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (unsigned long) ((client->ur.data != NULL ? client->ur.data :
+                client->ur.buf) + client->ur.sent);
+    sqe->len = client->ur.len - client->ur.sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    client->ur.inflight++;
+    return 0;
+}
+
+/*
+ * begins responding to the request the client has just finished sending
+ */
+static int uring_respond(struct client *client) {
+    size_t len;
+
+    client->ur.data = http_cached_response(&client->http, &len);
+    if (client->ur.data != NULL) {
+        // sent straight from the file cache, with nothing to read
+        client->ur.len = len;
+        client->ur.sent = 0;
+        client->http.offset = client->http.file_size;
+        return uring_send_chunk(client);
+    }
+
+    if (client->ur.buf == NULL) {
+        client->ur.buf = (char *) malloc(URING_SEND_BUF_SIZE);
+        if (client->ur.buf == NULL) {
+            fprintf(stderr, "Unable to malloc send buffer for client %d\n",
+                    client->connfd);
+            return -1;
+        }
+    }
+
+    client->ur.len = http_response_header(&client->http, client->ur.buf,
+            URING_SEND_BUF_SIZE);
+    client->ur.sent = 0;
+    if (client->ur.len >= URING_SEND_BUF_SIZE) {
+        return -1;
+    }
+    return uring_send_chunk(client);
+}
+
+/*
+ * disconnects a client of a loop driven by io_uring. Operations may still be
+ * in flight for the client, in which case they are cancelled, and the client
+ * is freed by the completion of the last of them
+ */
+static void uring_disconnect(struct server *server, struct client *client,
+        int thread) {
+    struct io_uring_sqe *sqe;
+
+    tw_cancel(&client->loop->timers, &client->timer);
+    if (client->ur.starved) {
+        uring_unstarve(client);
+    }
+
+    if (client->ur.inflight == 0) {
+        uncount_client(server, client);
+        close_client(client);
+        slab_free(&server->clients, thread, client);
+        return;
+    }
+
+    client->ur.closing = 1;
+    sqe = uring_prep(client->loop, URING_OP_CANCEL, NULL, client->connfd);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+}
+
+static int disconnect(struct server *server, struct client *client, int thread);
+
+/*
+ * registers a connection accepted by the loop's io_uring instance
+ */
+static void uring_add_client(struct server *server, struct ev_loop *loop,
+        int connfd, int thread) {
+    struct client *client;
+    struct sockaddr sa;
+    socklen_t sa_len = sizeof(sa);
+    int peer_counted;
+
+    if ((server->flags & SERVER_SHED_OVERLOAD) && server_overloaded(server)) {
+        shed_connection(loop, connfd);
+        return;
+    }
+
+    // multishot accepts do not give the address of the peer, so it is only
+    // looked up when needed for the per-address limits
+    memset(&sa, 0, sizeof(sa));
+    if (server->peers.sets != NULL) {
+        getpeername(connfd, &sa, &sa_len);
+    }
+    if ((peer_counted = admit_peer(server, loop, connfd, &sa)) == -1) {
+        return;
+    }
+
+    client = (struct client *) slab_alloc(&server->clients, thread);
+    if (client == NULL) {
+        if (peer_counted) {
+            ipt_disconnect(&server->peers, peer_addr(&sa));
+        }
+        close(connfd);
+        return;
+    }
+    init_client(client, connfd, &sa);
+    client->loop = loop;
+    client->peer_counted = peer_counted;
+    count_client(server, loop);
+    count_locality(server, loop, connfd, thread);
+    set_expiration_timer(client);
+
+    if (uring_recv(client) == -1) {
+        uring_disconnect(server, client, thread);
+        return;
+    }
+    __atomic_fetch_add(&loop->stats.n_accepted, 1, __ATOMIC_RELAXED);
+
+    if (!(server->flags & SERVER_SHED_OVERLOAD) && server_overloaded(server)) {
+        // leave the rest in the backlog until usage drops
+        pause_accept(server, loop);
+    }
+}
+
+/*
+ * handles a completed accept, registering the new connection in the loop
+ */
+static void uring_accepted(struct server *server, struct ev_loop *loop,
+        int res, unsigned flags, int thread) {
+    if (res >= 0) {
+        uring_add_client(server, loop, res, thread);
+    }
+    else if (res != -ECONNABORTED && !loop->draining) {
+        printf("Unable to accept client, reason: %s\n", strerror(-res));
+    }
+
+    if (!(flags & IORING_CQE_F_MORE) && !loop->draining &&
+            !loop->accept_paused) {
+        // the accept is single-shot, or the multishot accept has stopped,
+        // for example because we ran out of file descriptors, so it has to
+        // be submitted again
+        uring_arm_accept(server, loop);
+    }
+}
+
+/*
+ * handles the completion of an operation submitted for the client
+ */
+static void uring_complete(struct server *server, struct client *client,
+        unsigned long op, int res, unsigned flags, int thread) {
+    struct uring_loop *ur = client->loop->ur;
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    int ret;
+
+    client->ur.inflight--;
+
+    if (client->ur.closing) {
+        if (flags & IORING_CQE_F_BUFFER) {
+            uring_recycle_buf(&ur->bufs, bid);
+        }
+        if (client->ur.inflight == 0) {
+            uncount_client(server, client);
+            close_client(client);
+            slab_free(&server->clients, thread, client);
+        }
+        return;
+    }
+
+    switch (op) {
+    case URING_OP_RECV:
+        if (res == -ENOBUFS) {
+            // every buffer is held by a receive whose completion is still
+            // to be handled, so a receive submitted now would fail straight
+            // away again. They are all back in the ring once this wakeup's
+            // completions have been handled
+            uring_starve(client);
+            ret = 0;
+            break;
+        }
+        if (res <= 0) {
+            // the connection was closed by the client or failed
+            ret = -1;
+            break;
+        }
+        vprintf("Thread %d read from %d\n", thread, client->connfd);
+
+        ret = receive_buf(client, uring_buf(&ur->bufs, bid), res);
+        uring_recycle_buf(&ur->bufs, bid);
+        __atomic_fetch_add(&server->n_buffered, res, __ATOMIC_RELAXED);
+        renew_client_timeout(client, res);
+
+        if (ret == READ_COMPLETE) {
+            __atomic_fetch_add(&client->loop->stats.n_requests, 1,
+                    __ATOMIC_RELAXED);
+            limit_peer_request(server, client);
+            ret = uring_respond(client);
+        }
+        else {
+            ret = uring_recv(client);
+        }
+        break;
+    case URING_OP_READ:
+        // if the read failed, then the send linked to it is cancelled, and
+        // the client is disconnected when that completes
+        ret = 0;
+        break;
+    case URING_OP_SEND:
+        if (res < 0) {
+            ret = -1;
+            break;
+        }
+        vprintf("Thread %d wrote to %d\n", thread, client->connfd);
+
+        client->ur.sent += res;
+        if (client->ur.sent == client->ur.len) {
+            client->ur.sent = client->ur.len = 0;
+            client->ur.data = NULL;
+        }
+
+        if (client->ur.sent < client->ur.len || (client->http.fd != -1 &&
+                    client->http.offset < client->http.file_size)) {
+            ret = uring_send_chunk(client);
+        }
+        else if (http_response_sent(&client->http) != HTTP_KEEP_ALIVE) {
+            ret = -1;
+        }
+        else if (next_request(client) == READ_COMPLETE) {
+            // the next request was pipelined behind the last, and had
+            // already been received
+            __atomic_fetch_add(&client->loop->stats.n_requests, 1,
+                    __ATOMIC_RELAXED);
+            __atomic_fetch_add(&client->loop->stats.n_pipelined, 1,
+                    __ATOMIC_RELAXED);
+            limit_peer_request(server, client);
+            ret = uring_respond(client);
+        }
+        else {
+            // connections are not kept alive once the loop is draining
+            ret = !client->loop->draining ? uring_recv(client) : -1;
+        }
+        renew_client_timeout(client, res);
+        break;
+    default:
+        ret = 0;
+        break;
+    }
+
+    if (ret == -1) {
+        disconnect(server, client, thread);
+    }
+}
+
+/*
+ * submits the receives of the loop's starved clients again, oldest first. The
+ * buffers taken by the receives completed in a wakeup are all recycled by its
+ * end, so the ring is full again, with a buffer for each of up to
+ * URING_N_BUFS of them. Each has data waiting and takes its buffer straight
+ * away, so the rest are left for the next wakeup rather than failing again
+ */
+static void uring_feed_starved(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct client *client;
+
+    for (int i = 0; i < URING_N_BUFS && loop->ur->starved != NULL; i++) {
+        client = loop->ur->starved;
+        uring_unstarve(client);
+        if (uring_recv(client) == -1) {
+            disconnect(server, client, thread);
+        }
+    }
+}
+
+/*
+ * sets up an io_uring instance for the loop, and submits the accept, timer
+ * and term pipe operations which are kept in it for as long as it runs
+ *
+ * returns 0 on success and -1 on failure
+ */
+static int uring_loop_init(struct server *server, struct ev_loop *loop) {
+    struct uring_loop *ur;
+
+    ur = (struct uring_loop *) malloc(sizeof(struct uring_loop));
+    if (ur == NULL) {
+        fprintf(stderr, "Unable to malloc io_uring loop\n");
+        return -1;
+    }
+
+    // with COOP_TASKRUN, completions are only processed when the thread
+    // enters the kernel, instead of interrupting it
+    if (uring_init(&ur->ring, URING_ENTRIES, IORING_SETUP_COOP_TASKRUN)
+            == -1) {
+        free(ur);
+        return -1;
+    }
+    if (uring_setup_buf_ring(&ur->ring, &ur->bufs, URING_BGID, URING_N_BUFS,
+                MAX_READ_SIZE) == -1) {
+        uring_exit(&ur->ring);
+        free(ur);
+        return -1;
+    }
+
+    ur->starved = NULL;
+    ur->starved_tail = NULL;
+    ur->tick.tv_sec = loop->tick_ms / 1000;
+    ur->tick.tv_nsec = (loop->tick_ms % 1000) * 1000000;
+    loop->ur = ur;
+
+    if (uring_arm_accept(server, loop) == -1 || uring_arm_timer(loop) == -1 ||
+            uring_arm_term(server, loop) == -1) {
+        uring_loop_free(loop);
         return -1;
     }
+    return 0;
+}
+
+static void uring_loop_free(struct ev_loop *loop) {
+    uring_free_buf_ring(&loop->ur->ring, &loop->ur->bufs);
+    uring_exit(&loop->ur->ring);
+    free(loop->ur);
+    loop->ur = NULL;
+}
+
+static void close_expired_connections(struct server *server,
+        struct ev_loop *loop, int thread);
+static int loop_drained(struct server *server, struct ev_loop *loop);
+static void start_drain(struct server *server, struct ev_loop *loop,
+        int thread);
+
+/*
+ * the io_uring counterpart of spin_wait, which submits what is pending and
+ * looks for completions without waiting until some have arrived, or until
+ * busy_poll_us microseconds have passed
+ *
+ * returns the number of completions ready, or 0 if none arrived in time
+ */
+static int uring_spin_wait(struct server *server, struct ev_loop *loop) {
+    struct uring *ring = &loop->ur->ring;
+    struct timespec start, now;
+    long budget_ns = server->busy_poll_us * 1000L, spun;
+    int ready;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (uring_submit_and_reap(ring) == -1) {
+            return 0;
+        }
+        ready = uring_peek_cqe(ring) != NULL;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        spun = timespec_diff_ns(&now, &start);
+    } while (!ready && spun < budget_ns);
+
+    __atomic_fetch_add(&loop->stats.spin_ns, spun, __ATOMIC_RELAXED);
+    if (ready) {
+        __atomic_fetch_add(&loop->stats.n_spin_wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return ready;
+}
+
+/*
+ * main loop of a thread whose loop is driven by io_uring. Each wakeup hands
+ * every operation queued up since the last one to the kernel and waits for
+ * completions in the same syscall
+ */
+static void* run_uring(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct uring *ring = &loop->ur->ring;
+    struct io_uring_cqe *cqe;
+    unsigned long data, op;
+    unsigned flags, n_cqes;
+    int res, expired;
+
+    while (1) {
+        // only sleep if no completions arrived while spinning
+        if ((server->busy_poll_us == 0 || uring_spin_wait(server, loop) == 0)
+                && uring_submit_and_wait(ring, 1) == -1 && errno != EINTR) {
+            fprintf(stderr, "io_uring_enter call failed on fd %d, "
+                    "reason: %s\n", ring->fd, strerror(errno));
+            continue;
+        }
+
+        loop_update_time(loop);
+
+        expired = 0;
+        n_cqes = 0;
+        while ((cqe = uring_peek_cqe(ring)) != NULL) {
+            data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(ring);
+            n_cqes++;
+
+            op = data & URING_OP_MASK;
+            switch (op) {
+            case URING_OP_ACCEPT:
+                uring_accepted(server, loop, res, flags, thread);
+                break;
+            case URING_OP_TIMER:
+                uring_arm_timer(loop);
+                expired = 1;
+                break;
+            case URING_OP_TERM:
+                if (server->draining && !loop_drained(server, loop)) {
+                    start_drain(server, loop, thread);
+                    break;
+                }
+                return NULL;
+            case URING_OP_CANCEL:
+                break;
+            default:
+                uring_complete(server,
+                        (struct client *) (data & ~URING_OP_MASK), op, res,
+                        flags, thread);
+                break;
+            }
+        }
+
+        __atomic_fetch_add(&loop->stats.n_wakeups, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&loop->stats.n_events, n_cqes, __ATOMIC_RELAXED);
+
+        if (loop->ur->starved != NULL) {
+            uring_feed_starved(server, loop, thread);
+        }
+
+        if (expired) {
+            close_expired_connections(server, loop, thread);
+        }
+
+        if (loop->draining && loop_drained(server, loop)) {
+            return NULL;
+        }
+    }
+}
+
+#endif /* __linux__ */
+
+
+static void run_client(struct server *server, struct client *client,
+        int thread);
+
+/*
+ * true if more than one thread may get to the clients of the loop, which
+ * must then claim a client before touching it, whether told of its events or
+ * finding its timer expired
+ */
+static __inline int claims_clients(const struct ev_loop *loop) {
+    return loop->shared || loop->stealing;
+}
+
+/*
+ * makes the calling thread the only one which may touch the client, in loops
+ * which claims_clients. Clients of other loops are only ever handled by the
+ * thread waiting on the loop, and this always succeeds
+ *
+ * if another thread owns the client, then its timer is left for that thread
+ * to deal with, as it is expected to have been taken out of the wheel
+ *
+ * returns 1 if the client was claimed, and 0 if another thread owns it
+ */
+static __inline int claim_client(struct server *server,
+        struct client *client) {
+    return !claims_clients(client->loop) ||
+        !(__atomic_fetch_or(&client->events, CLIENT_BUSY | CLIENT_TIMER,
+                    __ATOMIC_ACQ_REL) & CLIENT_BUSY);
+}
+
+/*
+ * lets go of a client claimed with claim_client, whose timer the caller has
+ * dealt with. In a shared loop, the events other threads were told of in the
+ * meantime were left to the caller, and are handled first
+ */
+static __inline void release_client(struct server *server,
+        struct client *client, int thread) {
+    int events = CLIENT_BUSY | CLIENT_TIMER;
+
+    if (claims_clients(client->loop) &&
+            !__atomic_compare_exchange_n(&client->events, &events, 0, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        __atomic_fetch_and(&client->events, ~CLIENT_TIMER, __ATOMIC_RELAXED);
+        run_client(server, client, thread);
+    }
+}
+
+/*
+ * claims the clients of a list of timers just taken out of the loop's wheel,
+ * which must be done before letting go of the timers lock: a client owned by
+ * another thread may be freed as soon as the lock is free, as disconnect
+ * takes it to cancel the timer
+ *
+ * returns the timers of the clients claimed in the same form, the others
+ * being left to the threads owning them
+ */
+static struct tw_node* claim_timers(struct server *server,
+        struct tw_node *node) {
+    struct tw_node *claimed = NULL, *next;
+
+    for (; node != NULL; node = next) {
+        next = node->next;
+        if (claim_client(server, timer_client(node))) {
+            node->next = claimed;
+            claimed = node;
+        }
+    }
+    return claimed;
+}
+
+/*
+ * closes the connection of a client the calling thread claimed without being
+ * told of an event for it
+ *
+ * in a shared loop, another thread may have just been told of an event for
+ * the client and be about to look at it, so the client can't be freed here.
+ * The connection is shut down instead, and the thread which gets the event
+ * this raises disconnects it
+ *
+ * returns 1 if the client was disconnected, and 0 if it is still claimed
+ */
+static int close_claimed(struct server *server, struct client *client,
+        int thread) {
+    if (client->loop->shared) {
+        shutdown(client->connfd, SHUT_RDWR);
+        return 0;
+    }
+    disconnect(server, client, thread);
+    return 1;
+}
+
+/*
+ * leaves a client disconnected by a thread other than that of its loop to be
+ * freed by the thread of the loop, once it is done with its current batch of
+ * events, some of which may be for this client
+ */
+static void defer_free(struct ev_loop *loop, struct client *client) {
+    struct client *head = __atomic_load_n(&loop->freed, __ATOMIC_RELAXED);
+
+    do {
+        client->next_freed = head;
+    } while (!__atomic_compare_exchange_n(&loop->freed, &head, client, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * frees the clients left to the thread of the loop by defer_free
+ */
+static void free_deferred(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct client *client, *next;
+
+    client = __atomic_exchange_n(&loop->freed, NULL, __ATOMIC_ACQUIRE);
+    for (; client != NULL; client = next) {
+        next = client->next_freed;
+        slab_free(&server->clients, thread, client);
+    }
+}
+
+
+static int disconnect(struct server *server, struct client *client, int thread) {
+    int ret;
+    vprintf("Thread %d disconnected %d\n", thread, client->connfd);
+
+    write(STDOUT_FILENO, P_CYAN, sizeof(P_CYAN) - 1);
+    dmsg_write(&client->log, STDOUT_FILENO);
+    write(STDOUT_FILENO, P_RESET, sizeof(P_RESET) - 1);
+
+#ifdef DEBUG
+    char buf[5] = "\0\0\0\0";
+    dmsg_cpy(&client->log, buf, sizeof(buf));
+    buf[4] = '\0';
+#endif
+
+#ifdef __APPLE__
+    struct kevent events[2];
+    EV_SET(&events[0], client->connfd, EVFILT_READ,
+            EV_DELETE, 0, 0, NULL);
+    EV_SET(&events[1], client->connfd, EVFILT_WRITE,
+            EV_DELETE, 0, 0, NULL);
+    ret = CHECK(kevent(client->loop->qfd, events, 2, NULL, 0, NULL) == -1);
+#elif __linux__
+    // connections of io_uring loops are not in the epoll instance
+    ret = (client->loop->ur != NULL) ? 0 :
+        CHECK(epoll_ctl(client->loop->qfd, EPOLL_CTL_DEL, client->connfd, NULL));
+#endif
+
+#ifdef __linux__
+    if (client->loop->ur != NULL) {
+        // the client may only be freed once every operation submitted for it
+        // has completed
+        uring_disconnect(server, client, thread);
+    }
+    else
+#endif
+    if (close_client(client) == 0) {
+        // only free client if close succeeded
+        acq_timers_lock(client->loop);
+        tw_cancel(&client->loop->timers, &client->timer);
+        rel_timers_lock(client->loop);
+        uncount_client(server, client);
+        if (client->loop->stealing && thread != client->loop->owner) {
+            defer_free(client->loop, client);
+        }
+        else {
+            slab_free(&server->clients, thread, client);
+        }
+    }
+    else {
+        printf("Failed to cose client %d\n", client->connfd);
+    }
+
+#ifdef DEBUG
+    if (strcmp(buf, "exit") == 0) {
+        kill(getpid(), SIGUSR2);
+    }
+#endif
+    return ret;
+}
+
+
+/*
+ * true once a draining loop is done, because either none of its connections
+ * are left, and no acceptor thread may hand it any more, or its drain
+ * deadline has passed. Always false until the thread which began draining
+ * the loop is done with start_drain
+ */
+static int loop_drained(struct server *server, struct ev_loop *loop) {
+    uint64_t deadline = __atomic_load_n(&loop->drain_deadline,
+            __ATOMIC_ACQUIRE);
+
+    return deadline != 0 &&
+        ((__atomic_load_n(&loop->n_clients, __ATOMIC_RELAXED) == 0 &&
+          __atomic_load_n(&server->n_acceptors_running, __ATOMIC_ACQUIRE)
+            == 0) ||
+         __atomic_load_n(&loop->now, __ATOMIC_RELAXED) >= deadline);
+}
+
+/*
+ * begins draining the loop after drain_server was called: accepts what is
+ * left in the backlog of the loop's listening socket and then stops
+ * listening on it, and disconnects every idle keep-alive connection. The
+ * rest are closed as soon as their responses have been sent. Of the threads
+ * waiting on a shared loop, only the first to be told of the shutdown does
+ * this. With SERVER_ACCEPTOR_THREADS, the listening socket is left to the
+ * acceptor threads, which drain it themselves
+ */
+static void start_drain(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct tw_node *node, *next;
+    struct client *client;
+    uint64_t deadline;
+    int listening = !(server->flags & SERVER_ACCEPTOR_THREADS);
+
+    if (__atomic_exchange_n(&loop->draining, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    vprintf("Thread %d draining loop on fd %d\n", thread, loop->sockfd);
+
+#ifdef __APPLE__
+    struct kevent events[2];
+
+    if (listening) {
+        // serve the connections which already made it into the backlog
+        while (accept_connections(server, loop, thread) ==
+                server->accept_burst);
+    }
+    acq_loop_lock(loop, &loop->accept_lock);
+    // the term pipe stays readable, so it is kept out of the queue while the
+    // loop drains, or every thread waiting on it would spin
+    EV_SET(&events[0], server->term_read, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&events[1], loop->sockfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    CHECK(kevent(loop->qfd, events, listening ? 2 : 1, NULL, 0, NULL));
+    loop->accept_paused = 1;
+    rel_loop_lock(loop, &loop->accept_lock);
+#elif __linux__
+    if (loop->ur == NULL) {
+        if (listening) {
+            // serve the connections which already made it into the backlog
+            while (accept_connections(server, loop, thread) ==
+                    server->accept_burst);
+            acq_loop_lock(loop, &loop->accept_lock);
+            // fails if accepting was paused with the socket taken out of the
+            // queue
+            epoll_ctl(loop->qfd, EPOLL_CTL_DEL, loop->sockfd, NULL);
+            loop->accept_paused = 1;
+            rel_loop_lock(loop, &loop->accept_lock);
+        }
+        // the term pipe stays readable, so it is kept out of the queue while
+        // the loop drains, or every thread waiting on it would spin
+        CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_DEL, server->term_read, NULL));
+    }
+    if (listening) {
+        // new connections are refused right away instead of waiting in the
+        // backlog until the socket is closed, so load balancers retry them
+        // elsewhere. With io_uring, this also ends the multishot accept
+        shutdown(loop->sockfd, SHUT_RD);
+    }
+#endif
+
+    // take every client out of the wheel to find the idle ones, putting the
+    // rest right back
+    // a client being handled is not idle, and its timer is put back by the
+    // thread handling it
+    acq_timers_lock(loop);
+    node = claim_timers(server, tw_clear(&loop->timers));
+    rel_timers_lock(loop);
+
+    for (; node != NULL; node = next) {
+        next = node->next;
+        client = timer_client(node);
+
+        if (client_idle(client)) {
+            __atomic_fetch_add(&loop->stats.n_drain_closed, 1,
+                    __ATOMIC_RELAXED);
+            if (close_claimed(server, client, thread)) {
+                continue;
+            }
+        }
+        else {
+            acq_timers_lock(loop);
+            tw_arm(&loop->timers, node, node->expires);
+            rel_timers_lock(loop);
+        }
+        release_client(server, client, thread);
+    }
+
+    deadline = __atomic_load_n(&loop->now, __ATOMIC_RELAXED) +
+        (server->drain_ms + loop->tick_ms - 1) / loop->tick_ms;
+    __atomic_store_n(&loop->drain_deadline, MAX(deadline, 1),
+            __ATOMIC_RELEASE);
+}
+
+/*
+ * puts the term pipe back in the queue of a drained loop, so every other
+ * thread waiting on it wakes up and returns as well
+ */
+static void finish_drain(struct server *server, struct ev_loop *loop) {
+#ifdef __APPLE__
+    struct kevent term_ev;
+    EV_SET(&term_ev, server->term_read, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    kevent(loop->qfd, &term_ev, 1, NULL, 0, NULL);
+#elif __linux__
+    struct epoll_event term_ev = {
+        .events = EPOLLIN,
+        .data.ptr = ((char*) &server->term_read)
+            - offsetof(epoll_data_ptr_t, connfd)
+    };
+    // fails with EEXIST if another thread of the loop already did this
+    epoll_ctl(loop->qfd, EPOLL_CTL_ADD, server->term_read, &term_ev);
+#endif
+}
+
+
+/*
+ * arms the client's connection in the event queue of its loop for the
+ * direction the client is waiting on, unless it is armed for it already
+ */
+static void arm_client(struct client *client) {
+    struct ev_loop *loop = client->loop;
+
+    if (client->armed & client->want) {
+        __atomic_fetch_add(&loop->stats.n_rearms_avoided, 1,
+                __ATOMIC_RELAXED);
+        return;
+    }
+
+#ifdef __APPLE__
+    struct kevent event;
+    EV_SET(&event, client->connfd,
+            (client->want == CLIENT_READ) ? EVFILT_READ : EVFILT_WRITE,
+            EV_ADD | EV_ENABLE | EV_DISPATCH, 0, 0, client);
+    CHECK(kevent(loop->qfd, &event, 1, NULL, 0, NULL) == -1);
+    client->armed = client->want;
 #elif __linux__
-#ifndef EPOLLEXCLUSIVE
-    struct epoll_event listen_ev = {
-        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
-        .data.ptr = ((char*) &server->sockfd)
-            - offsetof(epoll_data_ptr_t, connfd)
-    };
-    CHECK(epoll_ctl(server->qfd, EPOLL_CTL_MOD, server->sockfd, &listen_ev));
-#endif
     struct epoll_event event = {
-        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
         .data.ptr = client
     };
-    if (CHECK(epoll_ctl(server->qfd, EPOLL_CTL_ADD, client->connfd, &event))
-            == -1) {
-        free(client);
-        return -1;
+    if (loop->edge_triggered) {
+        // edge-triggered registrations stay armed, so the connection is
+        // left armed for writes from now on, and the spurious write events
+        // this brings while reading are ignored
+        client->armed |= client->want;
+        event.events = EPOLLRDHUP | EPOLLET;
     }
+    else {
+        client->armed = client->want;
+        event.events = EPOLLRDHUP | EPOLLONESHOT;
+    }
+    event.events |= ((client->armed & CLIENT_READ) ? EPOLLIN : 0) |
+        ((client->armed & CLIENT_WRITE) ? EPOLLOUT : 0);
+    CHECK(epoll_ctl(loop->qfd, EPOLL_CTL_MOD, client->connfd, &event));
 #endif
+    __atomic_fetch_add(&loop->stats.n_rearms, 1, __ATOMIC_RELAXED);
+}
 
-    printf("accepted on fd %d\n", client->connfd);
 
-    acq_list_lock(server);
-    // if all succeeded, then add the client to the list of all clients
-    list_insert(server, client);
-    // set their expiration timer while the list lock is acquired so the
-    // timeout values in the client list will be nondecreasing
-    set_expiration_timer(client);
+static int write_to(struct server *server, struct client *client, int thread);
 
-    rel_list_lock(server);
+static int read_from(struct server *server, struct client *client, int thread) {
+    size_t len, start_len = client->log.len;
+    int ret;
 
-    return 0;
+    do {
+        len = client->log.len;
+        ret = receive_bytes_n(client, MAX_READ_SIZE);
+        // with edge-triggered registration, we are only told when more data
+        // arrives, so anything left in the socket has to be read now
+    } while (ret == READ_INCOMPLETE && client->loop->edge_triggered &&
+            client->log.len - len == MAX_READ_SIZE);
+    vprintf("Thread %d read from %d\n", thread, client->connfd);
+
+    __atomic_fetch_add(&server->n_buffered, client->log.len - start_len,
+            __ATOMIC_RELAXED);
+    renew_client_timeout(client, client->log.len - start_len);
+
+    if (ret == READ_COMPLETE) {
+        if (client->loop->edge_triggered &&
+                client->log.len - len == MAX_READ_SIZE) {
+            // there may be more in the socket after this request
+            client->pending_read = 1;
+        }
+        if (client->log.len != len) {
+            // otherwise, this was the connection being closed
+            __atomic_fetch_add(&client->loop->stats.n_requests, 1,
+                    __ATOMIC_RELAXED);
+            limit_peer_request(server, client);
+        }
+        // the socket is almost always writable by now, so rather than
+        // arming the connection for writes and waiting to be told so, try
+        // to respond right away
+        __atomic_fetch_add(&client->loop->stats.n_rearms_avoided, 1,
+                __ATOMIC_RELAXED);
+        client->want = CLIENT_WRITE;
+        return write_to(server, client, thread);
+    }
+
+    // need to rearm the fd for reads on the connection in the queue
+    arm_client(client);
+    return ret;
 }
 
 
-static int disconnect(struct server *server, struct client *client, int thread) {
-    int ret;
-    vprintf("Thread %d disconnected %d\n", thread, client->connfd);
+static int write_to(struct server *server, struct client *client, int thread) {
+    off64_t offset, start_offset;
+    int header_sent, ret;
 
-    write(STDOUT_FILENO, P_CYAN, sizeof(P_CYAN) - 1);
-    dmsg_write(&client->log, STDOUT_FILENO);
-    write(STDOUT_FILENO, P_RESET, sizeof(P_RESET) - 1);
+    while (1) {
+        start_offset = client->http.offset;
+        do {
+            offset = client->http.offset;
+            header_sent = client->http.header_sent;
+            ret = send_bytes(client);
+            // as with reads, if edge-triggered we will only be told once the
+            // socket becomes writable again after it has filled up, which
+            // may happen partway through the headers as well as the file
+        } while (ret == WRITE_INCOMPLETE && client->loop->edge_triggered &&
+                (client->http.offset != offset ||
+                 client->http.header_sent != header_sent));
+        vprintf("Thread %d wrote to %d\n", thread, client->connfd);
+
+        if (ret == CLIENT_CLOSE_CONNECTION) {
+            disconnect(server, client, thread);
+            return ret;
+        }
 
-#ifdef DEBUG
-    char buf[5] = "\0\0\0\0";
-    dmsg_cpy(&client->log, buf, sizeof(buf));
-    buf[4] = '\0';
-#endif
+        // the offset is reset once the response has been sent, in which case
+        // the connection moves on to its next phase anyway
+        renew_client_timeout(client, (client->http.offset > start_offset) ?
+                client->http.offset - start_offset : 0);
 
-#ifdef __APPLE__
-    struct kevent events[2];
-    EV_SET(&events[0], client->connfd, EVFILT_READ,
-            EV_DELETE, 0, 0, NULL);
-    EV_SET(&events[1], client->connfd, EVFILT_WRITE,
-            EV_DELETE, 0, 0, NULL);
-    ret = CHECK(kevent(server->qfd, events, 2, NULL, 0, NULL) == -1);
-#elif __linux__
-    ret = CHECK(epoll_ctl(server->qfd, EPOLL_CTL_DEL, client->connfd, NULL));
-#endif
+        if (ret != CLIENT_KEEP_ALIVE) {
+            break;
+        }
+        client->want = CLIENT_READ;
+
+        if (next_request(client) != READ_COMPLETE) {
+            if (client->pending_read) {
+                // the next request arrived while this response was being
+                // sent
+                client->pending_read = 0;
+                return read_from(server, client, thread);
+            }
+            if (__atomic_load_n(&client->loop->draining, __ATOMIC_RELAXED)) {
+                // connections are not kept alive once the loop is draining
+                disconnect(server, client, thread);
+                return CLIENT_CLOSE_CONNECTION;
+            }
+            break;
+        }
 
-    if (close_client(client) == 0) {
-        // only free client if close succeeded
-        acq_list_lock(server);
-        list_remove(client);
-        rel_list_lock(server);
-        free(client);
-    }
-    else {
-        printf("Failed to cose client %d\n", client->connfd);
+        // the next request was pipelined behind the last, and had already
+        // been received, so respond to it right away
+        __atomic_fetch_add(&client->loop->stats.n_requests, 1,
+                __ATOMIC_RELAXED);
+        __atomic_fetch_add(&client->loop->stats.n_pipelined, 1,
+                __ATOMIC_RELAXED);
+        limit_peer_request(server, client);
+        client->want = CLIENT_WRITE;
     }
+    arm_client(client);
+    return ret;
+}
 
-#ifdef DEBUG
-    if (strcmp(buf, "exit") == 0) {
-        kill(getpid(), SIGUSR2);
+
+/*
+ * closes the connection of a client whose timer went off if its deadline has
+ * passed, as close_claimed does, and otherwise puts its timer back in the
+ * wheel for its deadline
+ *
+ * returns 1 if the client was disconnected, and 0 otherwise
+ */
+static int expire_client(struct server *server, struct client *client,
+        int thread) {
+    struct ev_loop *loop = client->loop;
+    uint64_t now = __atomic_load_n(&loop->now, __ATOMIC_RELAXED);
+    uint64_t deadline = __atomic_load_n(&client->deadline, __ATOMIC_RELAXED);
+
+    if (deadline > now) {
+        // the timeout was renewed since the timer was armed, so push the
+        // timer back to the new deadline
+        acq_timers_lock(loop);
+        tw_arm(&loop->timers, &client->timer, deadline);
+        rel_timers_lock(loop);
+        return 0;
     }
-#endif
-    return ret;
+
+    // if this client expired before the current time, we need to close the
+    // connection with them
+    __atomic_fetch_add(&loop->stats.n_timeouts[client->phase], 1,
+            __ATOMIC_RELAXED);
+    return close_claimed(server, client, thread);
 }
 
+static void close_expired_connections(struct server *server,
+        struct ev_loop *loop, int thread) {
+    struct tw_node *node, *next;
+    struct client *client;
+    uint64_t now;
 
-static int read_from(struct server *server, struct client *client, int thread) {
-    int ret = receive_bytes_n(client, MAX_READ_SIZE);
-    vprintf("Thread %d read from %d\n", thread, client->connfd);
+    now = __atomic_load_n(&loop->now, __ATOMIC_RELAXED);
 
-    if (ret == READ_COMPLETE) {
-        // need to arm the fd for writes on the connection in the queue
-#ifdef __APPLE__
-        struct kevent event;
-        EV_SET(&event, client->connfd, EVFILT_WRITE,
-               EV_ADD | EV_ENABLE | EV_DISPATCH, 0, 0, client);
-        CHECK(kevent(server->qfd, &event, 1, NULL, 0, NULL) == -1);
-#elif __linux__
-        struct epoll_event read_ev = {
-            .events = EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT,
-            .data.ptr = client
-        };
-        CHECK(epoll_ctl(server->qfd, EPOLL_CTL_MOD, client->connfd,
-                    &read_ev));
-#endif
-    }
-    else /* ret == READ_INCOMPLETE */ {
-        // need to rearm the fd for reads on the connection in the queue
-#ifdef __APPLE__
-        struct kevent event;
-        EV_SET(&event, client->connfd, EVFILT_READ,
-               EV_ENABLE | EV_DISPATCH, 0, 0, client);
-        CHECK(kevent(server->qfd, &event, 1, NULL, 0, NULL) == -1);
-#elif __linux__
-        struct epoll_event read_ev = {
-            .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
-            .data.ptr = client
-        };
-        CHECK(epoll_ctl(server->qfd, EPOLL_CTL_MOD, client->connfd,
-                    &read_ev));
-#endif
+    acq_timers_lock(loop);
+    node = claim_timers(server, tw_advance(&loop->timers, now));
+    rel_timers_lock(loop);
+
+    for (; node != NULL; node = next) {
+        // read next first, as disconnect frees the client
+        next = node->next;
+        client = timer_client(node);
+
+        if (!expire_client(server, client, thread)) {
+            release_client(server, client, thread);
+        }
     }
 
-    renew_client_timeout(server, client);
-    return ret;
+    // with some connections gone, the loop may be able to accept again
+    resume_accept(server, loop);
 }
 
 
-static int write_to(struct server *server, struct client *client, int thread) {
-    int ret = send_bytes(client);
-    vprintf("Thread %d wrote to %d\n", thread, client->connfd);
+/*
+ * handles the events which arrived for the client, given as CLIENT_READ,
+ * CLIENT_WRITE and CLIENT_HANGUP bits
+ *
+ * returns the status code of the read or write done, if any, which is
+ * CLIENT_CLOSE_CONNECTION if the client was disconnected
+ */
+static int handle_client(struct server *server, struct client *client,
+        int events, int thread) {
+    int ret = 0;
 
-    if (ret == WRITE_INCOMPLETE) {
-        // need to rearm the fd for writes on the connection in the queue
 #ifdef __APPLE__
-        struct kevent event;
-        EV_SET(&event, client->connfd, EVFILT_WRITE,
-               EV_ENABLE | EV_DISPATCH, 0, 0, client);
-        CHECK(kevent(server->qfd, &event, 1, NULL, 0, NULL) == -1);
+    // EV_DISPATCH disabled the filter which fired
+    client->armed = 0;
 #elif __linux__
-        struct epoll_event read_ev = {
-            .events = EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT,
-            .data.ptr = client
-        };
-        CHECK(epoll_ctl(server->qfd, EPOLL_CTL_MOD, client->connfd,
-                    &read_ev));
-#endif
+    if (!client->loop->edge_triggered) {
+        // the one-shot registration fired and disarmed itself
+        client->armed = 0;
     }
-    else if (ret == CLIENT_KEEP_ALIVE) {
-#ifdef __APPLE__
-        struct kevent event;
-        // remove write event listener
-        //EV_SET(&event[0], client->connfd, EVFILT_WRITE,
-        //       EV_DELETE, 0, 0, client);
-        // add read event listener
-        EV_SET(&event, client->connfd, EVFILT_READ,
-               EV_ADD | EV_ENABLE | EV_DISPATCH, 0, 0, client);
-        CHECK(kevent(server->qfd, &event, 1, NULL, 0, NULL) == -1);
-#elif __linux__
-        struct epoll_event read_ev = {
-            .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
-            .data.ptr = client
-        };
-        CHECK(epoll_ctl(server->qfd, EPOLL_CTL_MOD, client->connfd,
-                    &read_ev));
 #endif
+
+    if ((events & CLIENT_READ) && client->want == CLIENT_WRITE) {
+        // only possible if edge-triggered, the data is read once the
+        // response has been sent
+        client->pending_read = 1;
+    }
+
+    if ((events & CLIENT_READ) && client->want == CLIENT_READ) {
+        ret = read_from(server, client, thread);
     }
-    else /* ret == CLIENT_CLOSE_CONNECTION */ {
+    else if ((events & CLIENT_WRITE) && client->want == CLIENT_WRITE) {
+        ret = write_to(server, client, thread);
+    }
+    // after completing the read/write, check if the read-end of the socket
+    // has been closed. In a shared loop, a client armed again may already
+    // have been handed to another thread along with its next event, which
+    // then finds the end of the stream and disconnects it instead
+    if ((ret == READ_COMPLETE || ret == CLIENT_KEEP_ALIVE) &&
+            (events & CLIENT_HANGUP) &&
+            !(client->loop->shared && client->armed)) {
         disconnect(server, client, thread);
-        return ret;
+        ret = CLIENT_CLOSE_CONNECTION;
     }
-
-    renew_client_timeout(server, client);
     return ret;
 }
 
 
-static void close_expired_connections(struct server *server, int thread) {
-    struct client *client;
-    struct timespec current_time;
+/* work stealing */
 
-    clock_gettime(TIMER_CLOCK, &current_time);
+/*
+ * handles the events of a client owned by the calling thread, including
+ * those which arrive in the meantime, then lets go of it
+ */
+static void run_client(struct server *server, struct client *client,
+        int thread) {
+    int events;
 
-    acq_list_lock(server);
-    for (client = server->client_list.last;
-            client != server_as_client_node(server);
-            // must keep taking from end of list because disconnect removes
-            // the client from the list
-            client = server->client_list.last) {
-        rel_list_lock(server);
+    while (1) {
+        events = __atomic_fetch_and(&client->events, CLIENT_BUSY,
+                __ATOMIC_ACQ_REL);
+        if ((events & (CLIENT_READ | CLIENT_WRITE | CLIENT_HANGUP)) &&
+                handle_client(server, client, events, thread) ==
+                CLIENT_CLOSE_CONNECTION) {
+            return;
+        }
+        if ((events & CLIENT_TIMER) && expire_client(server, client, thread)) {
+            return;
+        }
 
-        if (timespec_after(&current_time, &client->expires)) {
-            // if this client expired before the current time, we need to close
-            // the connection with them
-            disconnect(server, client, thread);
-            acq_list_lock(server);
+        // let go of the client, unless more events arrived for it, after
+        // which the client may be freed at any time
+        events = CLIENT_BUSY;
+        if (__atomic_compare_exchange_n(&client->events, &events, 0, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
         }
-        else {
-            // because the clients are in the list in nonincreasing expiration
-            // time, if one timer expires after the current time, so do all
-            // others before it
-            break;
+    }
+}
+
+/*
+ * queues the client for the events which arrived for it, as CLIENT_* bits, to
+ * be handled once the loop's thread has taken in the rest of its batch of
+ * events, or stolen before then. If another thread owns the client, it is
+ * left to handle the events before letting go of it
+ */
+static void queue_client(struct server *server, struct ev_loop *loop,
+        struct client *client, int events, int thread) {
+    if (__atomic_fetch_or(&client->events, events | CLIENT_BUSY,
+                __ATOMIC_ACQ_REL) & CLIENT_BUSY) {
+        return;
+    }
+    if (wsd_push(&loop->tasks, client) == -1) {
+        // the deque has room for a whole batch, so this is not expected
+        run_client(server, client, thread);
+    }
+}
+
+/*
+ * wakes the thread of another loop which is idle, if any, to steal from this
+ * loop
+ */
+static void wake_idle_peer(struct server *server, struct ev_loop *loop) {
+    struct ev_loop *peer;
+    int i, idle;
+
+    if (__atomic_load_n(&server->n_idle, __ATOMIC_RELAXED) <= 0) {
+        return;
+    }
+    for (i = 1; i < server->n_loops; i++) {
+        peer = server->loops[(loop->owner + i) % server->n_loops];
+        idle = 1;
+        if (__atomic_compare_exchange_n(&peer->idle, &idle, 0, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_fetch_sub(&server->n_idle, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&peer->stats.n_steal_wakeups, 1,
+                    __ATOMIC_RELAXED);
+            wake_loop(peer);
+            return;
+        }
+    }
+}
+
+/*
+ * handles the clients queued on the loop's deque until it is empty, waking
+ * an idle thread to steal whenever more are left behind than the one being
+ * handled
+ */
+static void run_tasks(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct client *client;
+
+    while ((client = (struct client *) wsd_pop(&loop->tasks)) != NULL) {
+        if (wsd_size(&loop->tasks) > 0) {
+            wake_idle_peer(server, loop);
+        }
+        run_client(server, client, thread);
+    }
+}
+
+/*
+ * makes one pass over the other loops, stealing and handling at most one
+ * client from each
+ *
+ * returns the number of clients stolen
+ */
+static int steal_tasks(struct server *server, struct ev_loop *loop,
+        int thread) {
+    struct ev_loop *victim;
+    struct client *client;
+    int i, n_stolen = 0;
+
+    for (i = 1; i < server->n_loops; i++) {
+        victim = server->loops[(loop->owner + i) % server->n_loops];
+        client = (struct client *) wsd_steal(&victim->tasks);
+        if (client != NULL) {
+            vprintf("Thread %d stole %d\n", thread, client->connfd);
+            __atomic_fetch_add(&victim->stats.n_stolen, 1, __ATOMIC_RELAXED);
+            run_client(server, client, thread);
+            n_stolen++;
         }
     }
-    rel_list_lock(server);
+    return n_stolen;
 }
 
 
 
 
-#define SIZE 1024
+/*
+ * polls the loop's event queue without blocking until it has events, or
+ * until busy_poll_us microseconds have passed, rather than sleeping on it
+ * right away, which would cost a wakeup by the scheduler when events arrive
+ *
+ * returns the number of events harvested, 0 if none arrived in time, or -1
+ * on failure
+ */
+static int spin_wait(struct server *server, struct ev_loop *loop,
+#ifdef __APPLE__
+        struct kevent *events,
+#elif __linux__
+        struct epoll_event *events,
+#endif
+        int max_events) {
+    struct timespec start, now;
+    long budget_ns = server->busy_poll_us * 1000L, spun;
+    int n_events;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        n_events =
+#ifdef __APPLE__
+            kevent(loop->qfd, NULL, 0, events, max_events,
+                    &(struct timespec) { 0, 0 });
+#elif __linux__
+            epoll_wait(loop->qfd, events, max_events, 0);
+#endif
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        spun = timespec_diff_ns(&now, &start);
+    } while (n_events == 0 && spun < budget_ns);
+
+    __atomic_fetch_add(&loop->stats.spin_ns, spun, __ATOMIC_RELAXED);
+    if (n_events > 0) {
+        __atomic_fetch_add(&loop->stats.n_spin_wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return n_events;
+}
 
 static void* _run(void *server_arg) {
     struct mt_args *args = (struct mt_args *) server_arg;
     struct server *server = (struct server *) args->arg;
+    struct ev_loop *loop;
     struct client *client;
 #ifdef __APPLE__
-    struct kevent event;
+    struct kevent *events, *event;
 #elif __linux__
-    struct epoll_event event;
+    struct epoll_event *events, *event;
 #endif
-    int ret, fd;
+    int ret, fd, n_events, i, max_events, expired, client_events, timeout;
 
     int thread = args->thread_id;;
 
     vprintf("thread %d begin\n", thread);
 
-    while (1) {
-        if ((ret =
-#ifdef __APPLE__
-                    kevent(server->qfd, NULL, 0, &event, 1, NULL)
-#elif __linux__
-                    epoll_wait(server->qfd, &event, 1, -1)
-#endif
-                    ) == -1) {
-            fprintf(stderr, QUEUE_T " call failed on fd %d, reason: %s\n",
-                    server->qfd, strerror(errno));
-            continue;
+    // in shared mode, every thread waits on the only loop
+    loop = server->loops[thread % server->n_loops];
+
+    if (server->cpus != NULL && server->n_loops > 1 &&
+            loop->owner == thread) {
+        // the loop was allocated by the main thread, so bring it to the
+        // node of the CPU this thread is bound to
+        topo_move_local(&server->topo, loop, sizeof(struct ev_loop));
+        if (loop->tasks.buf != NULL) {
+            topo_move_local(&server->topo, loop->tasks.buf,
+                    (loop->tasks.mask + 1) * sizeof(void *));
         }
-#ifdef __APPLE__
-        fd = event.ident;
-#elif __linux__
-        fd = ((epoll_data_ptr_t *) event.data.ptr)->connfd;
-#endif
-        if (fd == server->term_read) {
-            // TODO allow remaining connections to finish ?
-            return NULL;
+        if (loop->handoff.slots != NULL) {
+            topo_move_local(&server->topo, loop->handoff.slots,
+                    (loop->handoff.mask + 1) * sizeof(struct hq_slot));
         }
-        if (fd == server->sockfd) {
-            if (accept_connection(server) == 0) {
-                vprintf("Thread %d accepting...\n", thread);
+    }
+
+    if (server->prewarm_clients > 0) {
+        // done by the thread itself, so the memory is first touched (and
+        // placed) by the thread which will be using it
+        slab_prewarm(&server->clients, thread, server->prewarm_clients);
+    }
+
+#ifdef __linux__
+    if (loop->ur != NULL) {
+        return run_uring(server, loop, thread);
+    }
+#endif
+
+    max_events = server->max_events;
+    events = malloc(max_events * sizeof(*events));
+    if (events == NULL) {
+        fprintf(stderr, "Thread %d unable to malloc space for %d events\n",
+                thread, max_events);
+        return NULL;
+    }
+
+    while (1) {
+        timeout = -1;
+        if (loop->stealing) {
+            free_deferred(server, loop, thread);
+            if (steal_tasks(server, loop, thread) > 0) {
+                // look for events of our own before stealing any more
+                timeout = 0;
             }
             else {
-                vprintf("Thread %d denied connection\n", thread);
+                // nothing to steal either, so wait until there is
+                __atomic_fetch_add(&server->n_idle, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&loop->idle, 1, __ATOMIC_RELEASE);
             }
         }
-        else if (
+
+        n_events = 0;
+        if (timeout == -1 && server->busy_poll_us > 0) {
+            n_events = spin_wait(server, loop, events, max_events);
+        }
+        if (n_events == 0) {
+            n_events =
 #ifdef __APPLE__
-                 event.filter == EVFILT_TIMER
+                kevent(loop->qfd, NULL, 0, events, max_events,
+                        (timeout == 0) ? &(struct timespec) { 0, 0 } : NULL);
 #elif __linux__
-                 fd == server->timerfd
-#endif
-                 ) {
-#ifdef __linux__
-            // gotta read it so it can be rearmed
-            long ntimeouts;
-            read(fd, &ntimeouts, sizeof(long));
+                epoll_wait(loop->qfd, events, max_events, timeout);
 #endif
-            close_expired_connections(server, thread);
         }
-        else {
+
+        if (loop->stealing &&
+                __atomic_exchange_n(&loop->idle, 0, __ATOMIC_ACQ_REL)) {
+            __atomic_fetch_sub(&server->n_idle, 1, __ATOMIC_RELAXED);
+        }
+        if (n_events == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, QUEUE_T " call failed on fd %d, reason: %s\n",
+                        loop->qfd, strerror(errno));
+            }
+            continue;
+        }
+        if (n_events == 0) {
+            // only when looking for events between steals
+            continue;
+        }
+
+        loop_update_time(loop);
+
+        __atomic_fetch_add(&loop->stats.n_wakeups, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&loop->stats.n_events, n_events,
+                __ATOMIC_RELAXED);
+
+        // the expired connection sweep may disconnect clients whose events
+        // appear later in this batch, so it is deferred until every other
+        // event in the batch has been handled
+        expired = 0;
+
+        for (i = 0; i < n_events; i++) {
+            event = &events[i];
 #ifdef __APPLE__
-            client = (struct client *) event.udata;
+            fd = event->ident;
 #elif __linux__
-            client = (struct client *) event.data.ptr;
+            fd = ((epoll_data_ptr_t *) event->data.ptr)->connfd;
 #endif
-
-            if (
+            if (fd == server->term_read) {
+                if (server->draining && !loop_drained(server, loop)) {
+                    // let the remaining connections finish first
+                    start_drain(server, loop, thread);
+                    continue;
+                }
+                free(events);
+                return NULL;
+            }
+            if (fd == loop->sockfd) {
+                if ((ret = accept_connections(server, loop, thread)) > 0) {
+                    vprintf("Thread %d accepted %d connections\n", thread,
+                            ret);
+                }
+                else {
+                    vprintf("Thread %d denied connection\n", thread);
+                }
+            }
+            else if (
 #ifdef __APPLE__
-                    event.filter == EVFILT_READ
+                     event->filter == EVFILT_USER
 #elif __linux__
-                    event.events & EPOLLIN
+                     fd == loop->wakefd
 #endif
-                    ) {
-                ret = read_from(server, client, thread);
+                     ) {
+                // woken by an acceptor thread which handed the loop
+                // connections, or by another worker with work to steal,
+                // which is done before the next wait
+                loop_woken(loop);
+                if (loop->handoff.slots != NULL) {
+                    ret = take_handoffs(server, loop, thread);
+                    vprintf("Thread %d took %d connections from the "
+                            "acceptors\n", thread, ret);
+                }
             }
             else if (
 #ifdef __APPLE__
-                    event.filter == EVFILT_WRITE
+                     event->filter == EVFILT_TIMER
 #elif __linux__
-                    event.events & EPOLLOUT
+                     fd == loop->timerfd
 #endif
-                    ) {
-                ret = write_to(server, client, thread);
+                     ) {
+#ifdef __linux__
+                // gotta read it so it can be rearmed
+                long ntimeouts;
+                read(fd, &ntimeouts, sizeof(long));
+#endif
+                expired = 1;
             }
-            // after completing the read/write, check if the read-end of the
-            // socket has been closed
-            if (
-                    (ret == READ_COMPLETE || ret == CLIENT_KEEP_ALIVE) &&
+            else {
 #ifdef __APPLE__
-                    event.flags & EV_EOF
+                client = (struct client *) event->udata;
 #elif __linux__
-                    event.events & EPOLLRDHUP
+                client = (struct client *) event->data.ptr;
 #endif
-                    ) {
-                disconnect(server, client, thread);
+
+#ifdef __APPLE__
+                client_events =
+                    ((event->filter == EVFILT_READ) ? CLIENT_READ : 0) |
+                    ((event->filter == EVFILT_WRITE) ? CLIENT_WRITE : 0) |
+                    ((event->flags & EV_EOF) ? CLIENT_HANGUP : 0);
+#elif __linux__
+                client_events =
+                    ((event->events & EPOLLIN) ? CLIENT_READ : 0) |
+                    ((event->events & EPOLLOUT) ? CLIENT_WRITE : 0) |
+                    ((event->events & EPOLLRDHUP) ? CLIENT_HANGUP : 0);
+#endif
+
+                if (loop->stealing) {
+                    // handled once the whole batch has been queued, so that
+                    // what this thread does not get to can be stolen
+                    queue_client(server, loop, client, client_events,
+                            thread);
+                }
+                else if (loop->shared) {
+                    // another thread may have claimed the client to expire
+                    // it, in which case it handles the events as well
+                    if (!(__atomic_fetch_or(&client->events,
+                                    client_events | CLIENT_BUSY,
+                                    __ATOMIC_ACQ_REL) & CLIENT_BUSY)) {
+                        run_client(server, client, thread);
+                    }
+                }
+                else {
+                    handle_client(server, client, client_events, thread);
+                }
             }
         }
+
+        if (loop->stealing) {
+            run_tasks(server, loop, thread);
+        }
+
+        if (expired) {
+            close_expired_connections(server, loop, thread);
+        }
+
+        if (__atomic_load_n(&loop->draining, __ATOMIC_RELAXED) &&
+                loop_drained(server, loop)) {
+            finish_drain(server, loop);
+            free(events);
+            return NULL;
+        }
+    }
+}
+
+/*
+ * picks the CPUs to bind the workers to under the server's placement policy,
+ * and confines the calling thread (and so every thread it goes on to create)
+ * to the set of them
+ *
+ * returns the number of CPUs picked, 0 if the server has no placement policy,
+ * or -1 on failure
+ */
+static int place_threads(struct server *server) {
+    int n;
+
+    if (server->placement == TOPO_PLACE_NONE &&
+            (server->flags & SERVER_CPU_STEERING)) {
+        // there is nothing to steer connections to unless the workers are
+        // bound to CPUs
+        server->placement = TOPO_PLACE_CPUS;
+    }
+    if (server->placement == TOPO_PLACE_NONE) {
+        return 0;
+    }
+    if (topo_discover(&server->topo) == -1) {
+        return -1;
+    }
+    n = topo_place(&server->topo, server->placement, server->cpu_list,
+            &server->cpus);
+    if (n == -1) {
+        return -1;
+    }
+    server->n_cpus = n;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < n; i++) {
+        CPU_SET(server->cpus[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "Unable to set CPU affinity, reason: %s\n",
+                strerror(errno));
+        return -1;
+    }
+#endif
+
+    server->mt.cpus = server->cpus;
+    server->mt.n_cpus = n;
+
+    vprintf("Placing workers on %d of %d CPUs (%d cores, %d last-level "
+            "caches, %d NUMA nodes):", n, server->topo.n_cpus,
+            server->topo.n_cores, server->topo.n_llcs, server->topo.n_nodes);
+    for (int i = 0; i < n; i++) {
+        vprintf(" %d", server->cpus[i]);
     }
+    vprintf("\n");
+    return n;
 }
 
 int run_server(struct server *server) {
+    int nthreads;
+
+    if ((nthreads = place_threads(server)) == -1) {
+        return -1;
+    }
+    if (nthreads == 0) {
+        nthreads = get_n_cpus();
+    }
+
+    if ((server->flags & (SERVER_SHARED_NOTHING | SERVER_ACCEPTOR_THREADS)) &&
+            create_thread_loops(server, nthreads) == -1) {
+        return -1;
+    }
+    if (start_loops(server, nthreads) == -1) {
+        return -1;
+    }
+    if ((server->flags & SERVER_CPU_STEERING) &&
+            steer_connections(server) == -1) {
+        return -1;
+    }
+    if ((server->flags & SERVER_ACCEPTOR_THREADS) &&
+            start_acceptors(server) == -1) {
+        return -1;
+    }
 
-    if (init_mt_context(&server->mt, get_n_cpus(), &_run, server, MT_PARTITION) == -1) {
+    if (init_mt_context(&server->mt, nthreads, &_run, server, MT_PARTITION) == -1) {
         return -1;
     }
 
@@ -711,6 +3748,25 @@ int run_server(struct server *server) {
 }
 
 int run_server2(struct server *server, int nthreads) {
+    if (place_threads(server) == -1) {
+        return -1;
+    }
+    if ((server->flags & (SERVER_SHARED_NOTHING | SERVER_ACCEPTOR_THREADS)) &&
+            create_thread_loops(server, nthreads) == -1) {
+        return -1;
+    }
+    if (start_loops(server, nthreads) == -1) {
+        return -1;
+    }
+    if ((server->flags & SERVER_CPU_STEERING) &&
+            steer_connections(server) == -1) {
+        return -1;
+    }
+    if ((server->flags & SERVER_ACCEPTOR_THREADS) &&
+            start_acceptors(server) == -1) {
+        return -1;
+    }
+
     if (init_mt_context(&server->mt, nthreads, &_run, server, 0) == -1) {
         return -1;
     }
@@ -3,54 +3,485 @@
 #include <sys/socket.h>
 
 #include "client.h"
+#include "handoff.h"
+#include "iptable.h"
 #include "mt.h"
+#include "slab.h"
+#include "topology.h"
+#include "wsdeque.h"
+
+
+// defined in server.c, the io_uring instance of a loop
+struct uring_loop;
 
 #define DEFAULT_BACKLOG 50
 
+// default maximum number of connections accepted from the backlog in one
+// wakeup of a worker
+#define DEFAULT_ACCEPT_BURST 32
+
 #define DEFAULT_PORT 80
 
+// default maximum number of events harvested from the event queue by a single
+// call to epoll_wait/kevent
+#define DEFAULT_MAX_EVENTS 64
+
+// default length of a tick of the connection expiration timers, in
+// milliseconds
+#define DEFAULT_TIMER_TICK_MS 100
+
+// default time drain_server gives the requests in progress to finish, in
+// milliseconds
+#define DEFAULT_DRAIN_MS 10000
+
+// default deadlines of each phase of a connection, in milliseconds (see the
+// timeout fields of struct server)
+#define DEFAULT_REQUEST_LINE_MS 5000
+#define DEFAULT_HEADERS_MS 10000
+#define DEFAULT_IDLE_MS 5000
+#define DEFAULT_STALL_MS 5000
+// default minimum average rate of request bodies and responses, in bytes per
+// second
+#define DEFAULT_MIN_RATE 1024
+
+// default number of addresses tracked by the per-address limits
+#define DEFAULT_PEER_TABLE_SIZE 49152
+
+// default length of the queue of TCP Fast Open requests not yet accepted, if
+// enabled without giving one
+#define DEFAULT_FASTOPEN_QLEN 256
+
+// default number of acceptor threads with SERVER_ACCEPTOR_THREADS
+#define DEFAULT_N_ACCEPTORS 1
+// number of connections which may be waiting in the handoff queue of each
+// worker with SERVER_ACCEPTOR_THREADS, beyond which they are answered with
+// 503 Service Unavailable
+#define HANDOFF_QUEUE_SIZE 1024
+
+
+/* server flags */
+
+// every worker thread owns its own listening socket (bound to the same port
+// with SO_REUSEPORT), its own event queue and its own client list, so that
+// connections are never handled by or shared with another thread
+#define SERVER_SHARED_NOTHING 0x1
+
+// drive every event loop with io_uring (Linux only) instead of epoll. The
+// loops wait for completions of accepts, receives and sends submitted ahead
+// of time rather than for readiness, so a ring is owned by a single thread
+// and this implies SERVER_SHARED_NOTHING
+#define SERVER_IO_URING 0x2
+
+// once the server is at one of its limits (max_clients, max_buffered), keep
+// accepting connections but answer each with 503 Service Unavailable and
+// close it, instead of leaving them in the backlog until usage drops
+#define SERVER_SHED_OVERLOAD 0x4
+
+// connections are accepted by dedicated acceptor threads, which apply the
+// admission limits and hand each connection to one of the worker threads
+// over a lock-free queue. Every worker owns an event loop of its own, which
+// only ever sees the connections handed to it. Not available with
+// SERVER_IO_URING
+#define SERVER_ACCEPTOR_THREADS 0x8
+
+// workers queue the connections with events to be handled on a deque of
+// their own loop, which workers with nothing left to do steal from, so that a
+// worker stuck with a few heavy connections does not hold up the rest of
+// those in its loop. Only meaningful when every worker owns a loop, so this
+// implies SERVER_SHARED_NOTHING unless SERVER_ACCEPTOR_THREADS is given. Not
+// available with SERVER_IO_URING
+#define SERVER_WORK_STEALING 0x10
+
+// each connection goes to a worker bound to the CPU which received its
+// packets, as reported by the kernel, so the connection's socket stays in the
+// caches of that CPU. With SERVER_ACCEPTOR_THREADS the acceptors pick the
+// worker, and otherwise the kernel does, through a BPF program attached to
+// the SO_REUSEPORT group, so this implies SERVER_SHARED_NOTHING unless
+// SERVER_ACCEPTOR_THREADS is given, and binds one worker to each CPU unless
+// a placement policy is set. Linux only
+#define SERVER_CPU_STEERING 0x20
+
+
+/* how acceptor threads pick the worker a connection is handed to */
+
+// each acceptor hands connections to the workers in turn
+#define HANDOFF_ROUND_ROBIN 0
+// connections go to the worker with the fewest connections open
+#define HANDOFF_LEAST_CONNS 1
+
+
+// accepting resumes once usage has dropped back below this fraction of a
+// limit which was reached
+#define LOW_WATER_MARK(limit) ((limit) - (limit) / 8)
+
+
+/*
+ * an event queue along with the listening socket and client connections
+ * registered in it. In the default mode every worker thread waits on one
+ * shared loop, and with SERVER_SHARED_NOTHING each worker thread owns a loop
+ */
+struct ev_loop {
+    // socket fd on which this loop accepts connections
+    int sockfd;
+
+    // file descriptor for the asynchronous polling mechanism used,
+    // which is either epolling (linux) or kqueue (macos)
+    int qfd;
+
+#ifdef __linux__
+    // file descriptor for the periodic timer used for closing timed-out
+    // connections (for linux only)
+    int timerfd;
+
+    // set if the server was started with SERVER_IO_URING, in which case the
+    // loop waits on this instead of qfd and timerfd
+    struct uring_loop *ur;
+
+    // eventfd written to by the acceptor threads to wake the loop once they
+    // have handed it connections, and by the other workers when there is
+    // work to be stolen, or -1 without SERVER_ACCEPTOR_THREADS or
+    // SERVER_WORK_STEALING
+    int wakefd;
+#endif
+
+    // connections handed to this loop by the acceptor threads, which the
+    // thread waiting on the loop registers in it. Only set up with
+    // SERVER_ACCEPTOR_THREADS
+    struct handoff_queue handoff;
+    // set once another thread has woken the loop, until the thread waiting on
+    // it has woken up, so a burst of connections handed to an already woken
+    // loop costs no further syscalls
+    int woken;
+
+    // clients of this loop with events to be handled, with
+    // SERVER_WORK_STEALING. The thread waiting on the loop queues them here
+    // after each wakeup before handling them, and the threads of other loops
+    // steal from here once they have nothing left to do themselves
+    struct ws_deque tasks;
+    // clients of this loop which were disconnected by the threads that stole
+    // them, for the thread waiting on the loop to free. It may still have
+    // events for them in the batch it is handling
+    struct client *freed;
+    // the thread waiting on the loop, with SERVER_WORK_STEALING
+    int owner;
+    // set while the thread waiting on the loop is asleep with nothing to do,
+    // and so may be woken to steal
+    int idle;
+
+    // timing wheel holding the expiration timer of every client connected
+    // through this loop
+    struct twheel timers;
+    // spinlock on timers, only taken if the loop is shared by multiple threads
+    int timers_lock;
+
+    // set while the listening socket is out of the event queue (or, with
+    // io_uring, has no accept in flight), because the server was overloaded
+    // or the loop is draining
+    int accept_paused;
+    // spinlock on accept_paused and the registration of the listening socket,
+    // only taken if the loop is shared by multiple threads
+    int accept_lock;
+    // set if more than one thread waits on this loop
+    int shared;
+    // set if other threads may steal the clients of this loop, with
+    // SERVER_WORK_STEALING, in which case its spinlocks are taken as if it
+    // were shared
+    int stealing;
+    // set if client connections are registered edge-triggered, which is
+    // only safe when a single thread waits on the loop. Otherwise they are
+    // registered one-shot, so no connection is handled by two threads at
+    // once, and must be re-armed after every event
+    int edge_triggered;
+
+    // the coarse monotonic time in ticks, refreshed each time a thread
+    // returns from waiting on the loop
+    uint64_t now;
+    // length of a tick in milliseconds
+    int tick_ms;
+    // the timeouts of the server, in ticks
+    struct {
+        uint64_t request_line;
+        uint64_t headers;
+        uint64_t idle;
+        uint64_t stall;
+    } timeout_ticks;
+    // the minimum rate of the server, in bytes per second
+    unsigned long min_rate;
+
+    // number of clients connected through this loop which have not yet been
+    // freed
+    int n_clients;
+
+    // set once the loop has begun draining, see drain_server
+    int draining;
+    // the tick after which connections still open on a draining loop are
+    // cut off
+    uint64_t drain_deadline;
+
+    // counters for tuning max_events, each updated atomically by the workers
+    // waiting on this loop
+    struct {
+        // number of times a worker returned from the event queue with events
+        unsigned long n_wakeups;
+        // total number of events harvested over all wakeups
+        unsigned long n_events;
+        // number of connections accepted
+        unsigned long n_accepted;
+        // number of times a worker stopped accepting after accept_burst
+        // connections with more still waiting in the backlog
+        unsigned long n_accept_capped;
+        // number of those times the backlog was full, meaning new
+        // connections may have been dropped by the kernel
+        unsigned long n_backlog_full;
+        // number of requests read in full
+        unsigned long n_requests;
+        // number of those which were pipelined behind an earlier request,
+        // and so were responded to without waiting on the socket
+        unsigned long n_pipelined;
+        // number of times a connection was re-armed in the event queue
+        unsigned long n_rearms;
+        // number of re-arms which were not needed, either because the
+        // connection was still armed for what it was waiting on, or because
+        // the response was sent right away without waiting to be able to
+        unsigned long n_rearms_avoided;
+        // number of idle keep-alive connections closed while draining
+        unsigned long n_drain_closed;
+        // number of times the loop stopped accepting because the server was
+        // overloaded
+        unsigned long n_accept_paused;
+        // number of connections answered with 503 and closed because the
+        // server was overloaded
+        unsigned long n_shed;
+        // number of connections refused because their peer already had
+        // peer_max_conns connections open
+        unsigned long n_peer_refused;
+        // number of requests answered with 429 because their peer exceeded
+        // peer_rate
+        unsigned long n_peer_throttled;
+        // number of connections closed for missing a deadline, by the
+        // CLIENT_PHASE_* they were in
+        unsigned long n_timeouts[CLIENT_N_PHASES];
+        // number of connections whose first request was read in full right
+        // after they were accepted, without waiting on the event queue
+        unsigned long n_early_requests;
+        // number of times a client of this loop was handled by the thread of
+        // another loop which stole it
+        unsigned long n_stolen;
+        // number of times the thread of this loop was woken from idle to
+        // steal
+        unsigned long n_steal_wakeups;
+        // number of connections registered by a worker bound to the CPU
+        // which received them, and by one bound to another CPU, only counted
+        // when the workers are bound to CPUs
+        unsigned long n_local_conns;
+        unsigned long n_remote_conns;
+        // with busy_poll_us set, number of wakeups whose events were found
+        // while spinning, without the thread going to sleep, and the total
+        // time spent spinning, in nanoseconds
+        unsigned long n_spin_wakeups;
+        unsigned long spin_ns;
+    } stats;
+};
+
+
+/*
+ * a thread dedicated to accepting connections with SERVER_ACCEPTOR_THREADS,
+ * which hands each connection it accepts to one of the event loops
+ */
+struct acceptor {
+    struct server *server;
+    pthread_t thread;
+    int id;
+
+    // the loop the next connection is handed to with HANDOFF_ROUND_ROBIN
+    int next_loop;
+    // set while the acceptor has stopped accepting because the server is
+    // overloaded
+    int paused;
+
+    // counters which are only written to by the acceptor itself, with the
+    // same meaning as those of the loops
+    struct {
+        unsigned long n_accept_capped;
+        unsigned long n_backlog_full;
+        unsigned long n_accept_paused;
+        // number of connections answered with 503 because the handoff queue
+        // of the loop they were meant for was full
+        unsigned long n_handoffs_refused;
+        // number of connections handed to a worker bound to the CPU which
+        // received them, with SERVER_CPU_STEERING
+        unsigned long n_steered;
+    } stats;
+} __attribute__((aligned(CACHE_LINE)));
+
 
 struct server {
     struct sockaddr_in in;
 
     struct mt_context mt;
 
-    // list of all connected clients
-    struct {
-        struct client *first, *last;
-    } client_list;
-    // spinlock on client_list
-    int client_list_lock;
+    // event loops of the server. There is always at least one, which owns
+    // the socket bound in init_server, and in SERVER_SHARED_NOTHING mode
+    // run_server creates one more for each additional worker thread
+    struct ev_loop **loops;
+    int n_loops;
 
-    int sockfd;
+    // bitvector of SERVER_* flags, given to init_server4
+    int flags;
 
     // the size of the backlog on the port which
     // the server is listening 
     int backlog;
 
-    // file descriptor for the asynchronous polling mechanism used,
-    // which is either epolling (linux) or kqueue (macos)
-    int qfd;
+    // maximum number of connections a worker accepts from the backlog in one
+    // go. It may be changed between init_server and run_server
+    int accept_burst;
+
+    // maximum number of events a worker harvests from the event queue in one
+    // wakeup. It may be changed between init_server and run_server
+    int max_events;
+
+    // length of a tick of the connection expiration timers in milliseconds,
+    // i.e. the granularity with which idle connections are closed. It may be
+    // changed between init_server and run_server
+    int timer_tick_ms;
+
+    // every client struct is allocated from this slab, with one cache for
+    // each worker thread, so accepting and disconnecting clients never goes
+    // to malloc once the slab has grown large enough
+    struct slab clients;
+
+    // number of client structs each worker thread allocates up front when it
+    // starts, or 0 to only grow the slab as needed. It may be changed between
+    // init_server and run_server
+    int prewarm_clients;
+
+    // how long drain_server lets the responses in progress finish before the
+    // connections still open are cut off, in milliseconds
+    int drain_ms;
+
+    // deadlines of each phase of a connection, in milliseconds. They may be
+    // changed between init_server and run_server:
+    //  request_line_ms - from the first byte of a request (or the connection
+    //      being accepted) until its request line has been received
+    //  headers_ms - from the same start until all of its headers have been
+    //      received
+    //  idle_ms - how long a keep-alive connection may wait for its next
+    //      request
+    //  stall_ms - how long a request body or a response may go without any
+    //      progress
+    int request_line_ms;
+    int headers_ms;
+    int idle_ms;
+    int stall_ms;
+    // minimum average rate of request bodies and responses, in bytes per
+    // second, once they have taken longer than stall_ms, or 0 for no minimum.
+    // It may be changed between init_server and run_server
+    long min_rate;
+
+    // number of seconds the kernel holds a new connection back from accept
+    // until its first data arrives (TCP_DEFER_ACCEPT, Linux only), after
+    // which it is accepted anyway, or 0 to accept connections right away. It
+    // may be changed between init_server and run_server
+    int defer_accept;
+    // maximum number of connections which completed a TCP Fast Open
+    // handshake, sending data with their SYN, waiting to be accepted, or 0 to
+    // not accept TCP Fast Open. It may be changed between init_server and
+    // run_server
+    int fastopen_qlen;
+
+    // maximum number of concurrent connections, or 0 for no limit. It may be
+    // changed between init_server and run_server
+    long max_clients;
+    // maximum number of bytes received from clients held in memory at once,
+    // or 0 for no limit. It may be changed between init_server and run_server
+    long max_buffered;
+
+    // number of acceptor threads with SERVER_ACCEPTOR_THREADS, and the
+    // HANDOFF_* policy by which they pick the loop each connection is handed
+    // to. They may be changed between init_server and run_server
+    int n_acceptors;
+    int handoff_policy;
+    // the acceptor threads, started by run_server
+    struct acceptor *acceptors;
+    // number of acceptor threads which have not yet returned. Loops do not
+    // finish draining until this drops to 0, as the acceptors may still be
+    // handing them what was left in the backlog
+    int n_acceptors_running;
+
+    // number of workers asleep with nothing to do, with SERVER_WORK_STEALING
+    int n_idle;
+
+    // number of microseconds a worker with nothing to do keeps polling its
+    // event queue without blocking before it goes to sleep on it, or 0 to
+    // sleep right away. It may be changed between init_server and run_server
+    int busy_poll_us;
+
+    // the TOPO_PLACE_* policy by which the worker threads are bound to CPUs,
+    // and with TOPO_PLACE_LIST the list of CPUs, as in "0-3,8". They may be
+    // changed between init_server and run_server
+    int placement;
+    const char *cpu_list;
+    // the topology of the CPUs the server may run on, and the CPUs picked
+    // from it for the workers, only set up by run_server if placement is set
+    struct cpu_topology topo;
+    int *cpus;
+    int n_cpus;
+    // with SERVER_CPU_STEERING, the index of the first loop whose thread is
+    // bound to each CPU, or -1 for CPUs no thread is bound to
+    int *cpu_loops;
+
+    // number of connections currently open, over all loops
+    long n_clients;
+    // number of bytes received from clients still held in memory, over all
+    // loops
+    long n_buffered;
+
+    // maximum number of connections open from one address, and number of
+    // requests per second one address may make on average (up to a burst of
+    // peer_burst), or 0 for no limit. They may be changed between
+    // init_server and run_server
+    unsigned peer_max_conns;
+    unsigned peer_rate;
+    unsigned peer_burst;
+    // number of addresses tracked by the per-address limits, beyond which
+    // the address idle the longest is forgotten
+    unsigned peer_table_size;
+
+    // open connections and request tokens of each address, only set up if
+    // one of the per-address limits is set
+    struct ip_table peers;
+
+    // set by drain_server
+    volatile int draining;
+
+    // time at which run_server started the event loops
+    struct timespec start_time;
+
+#ifdef __linux__
+    // system-wide count of connections dropped due to full listen backlogs
+    // when the server was started, or -1 if unavailable
+    long listen_overflows;
+#endif
 
     // set to 1 when running, and set back to 0 when the server is shut down
     // which prevents a thread which may have returned from a blocking system
     // call (like kqueue or epoll) from continuing to operate
     volatile int running;
 
-#ifdef __linux__
-    // file descriptor for the periodic timer used for closing timed-out
-    // connections (for linux only)
-    int timerfd;
-#elif __APPLE__
+#ifdef __APPLE__
     // for mac, register a timer with identifier as given below, whose value
     // is chosen to be a file descriptor we know can not possibly be added
     // to the kqueue in any scenario (as we will never listen to stdout)
 #define TIMER_IDENT STDOUT_FILENO
+    // and the user event acceptor threads trigger to wake a loop they handed
+    // connections to, for the same reason
+#define HANDOFF_IDENT STDERR_FILENO
 #endif
 
-    // this pipe is written to when the server begins shutdown. Each thread
-    // which pulls this off the queue will simply place it back in the queue
-    // and terminate itself gracefully
+    // this pipe is written to when the server begins shutdown. It is
+    // registered in every event loop, and each thread which pulls it off the
+    // queue will leave it in the queue and terminate itself gracefully
     union {
         int term_pipe[2];
         struct {
@@ -67,14 +498,47 @@ struct server {
  */
 int init_server(struct server *server, int port);
 
+/*
+ * constructs the server as in init_server4, with no flags set
+ */
+int init_server3(struct server *server, int port, int backlog);
+
 /*
  * initialize all data structures in the server struct, and construct the
  * socket fd which is to be used for connecting to this server
+ *
+ * flags is a bitvector of the SERVER_* flags above, which select the mode the
+ * server runs in once run_server is called
  */
-int init_server3(struct server *server, int port, int backlog);
+int init_server4(struct server *server, int port, int backlog, int flags);
 
 void print_server_params(struct server *server);
 
+/*
+ * gives the average number of events harvested by a worker per wakeup since
+ * the server was started, or 0 if no events have been received yet
+ */
+double server_avg_batch_size(struct server *server);
+
+/*
+ * prints the counters collected by the workers while the server was running
+ */
+void print_server_stats(struct server *server);
+
+/*
+ * begins a graceful shutdown of the server: every loop stops accepting
+ * connections, closes its idle keep-alive connections right away, and lets
+ * the requests in progress finish for up to drain_ms milliseconds, closing
+ * each connection once its response has been sent. Each worker thread
+ * returns once its loop has no connections left or the deadline has passed,
+ * so run_server returns once the thread it was called from is done, after
+ * which close_server must be called to wait for the rest
+ *
+ * this only sets a flag and writes to the term pipe, so it is safe to call
+ * from a signal handler
+ */
+void drain_server(struct server *server);
+
 /*
  * close the socket fd of the server which was bound to listen, and deallocate
  * memory referenced by the server struct
@@ -91,9 +555,24 @@ void close_server(struct server *server);
  * has been made and is ready to be processed, or a client socket has become
  * available for writing
  *
+ * with placement set, the workers are bound to the CPUs picked by the policy,
+ * one thread for each, and every other thread of the server (such as the
+ * acceptors) is confined to the set of them. Otherwise, thread i is bound to
+ * CPU i
+ *
+ * if the server was initialized with SERVER_SHARED_NOTHING,
+ * SERVER_ACCEPTOR_THREADS or SERVER_WORK_STEALING, then one event loop is
+ * created for each thread before any of them are started, and with
+ * SERVER_ACCEPTOR_THREADS the acceptor threads are started before the workers
+ *
  * returns 0 on success or nonzero on failure
  */
 int run_server(struct server *server);
 
+/*
+ * same as run_server, but with the given number of threads, which are not
+ * bound to CPUs unless placement is set, in which case thread i is bound to
+ * the (i % n)th of the n CPUs picked
+ */
 int run_server2(struct server *server, int nthreads);
 
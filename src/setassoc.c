@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "setassoc.h"
+
+
+int sa_alloc(void **sets, unsigned *set_mask, size_t set_size, unsigned ways,
+        unsigned n_entries) {
+    unsigned n_sets = 1;
+
+    while (n_sets * ways < n_entries) {
+        n_sets <<= 1;
+    }
+    if (posix_memalign(sets, CACHE_LINE, n_sets * set_size) != 0) {
+        *sets = NULL;
+        return -1;
+    }
+    memset(*sets, 0, n_sets * set_size);
+    *set_mask = n_sets - 1;
+    return 0;
+}
+
+int sa_init(struct sa_table *table, unsigned n_entries) {
+    return sa_alloc((void **) &table->sets, &table->set_mask,
+            sizeof(struct sa_set), SA_WAYS, n_entries);
+}
+
+void sa_free(struct sa_table *table) {
+    free(table->sets);
+    table->sets = NULL;
+}
+
+unsigned long sa_hits(const struct sa_table *table, int counter) {
+    unsigned long n_hits = 0;
+
+    for (unsigned s = 0; table->sets != NULL && s <= table->set_mask; s++) {
+        n_hits += table->sets[s].hits[counter];
+    }
+    return n_hits;
+}
@@ -0,0 +1,177 @@
+/*
+ * Set-associative table
+ *
+ * The table behind the file cache and the compressed file cache. Entries are
+ * pointers to objects of the owner's, kept by the hash of their key in sets
+ * of SA_WAYS which fit in a cache line along with the spinlock guarding them,
+ * so a lookup touches a single cache line and threads only contend when their
+ * keys hash to the same set. What the keys are, and how they are compared, is
+ * up to the owner, which locks the set of a hash and looks through its ways
+ * itself.
+ *
+ * Each set keeps a clock which the owner advances on every lookup, and the
+ * time each of its entries was last used by it. An entry which finds its set
+ * full takes the place of the one used longest ago.
+ *
+ * Tables whose entries are small enough to be kept in the set itself, rather
+ * than pointed to, lay out their own sets but size, index and lock them with
+ * sa_alloc, sa_set_index and sa_spin_lock
+ */
+#ifndef _SETASSOC_H
+#define _SETASSOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+// number of entries in each set
+#define SA_WAYS 3
+
+// number of hit counters kept in each set
+#define SA_COUNTERS 2
+
+#define SA_UNLOCKED 0
+#define SA_LOCKED 1
+
+
+struct sa_set {
+    int lock;
+    // incremented on every lookup, to order the entries by last use
+    uint32_t clock;
+    uint32_t hashes[SA_WAYS];
+    uint32_t last_use[SA_WAYS];
+    // the entries, or NULL for unused ways
+    void *entries[SA_WAYS];
+    // counted by the owner under the lock, so that hits don't write to any
+    // cache line but the set's
+    uint32_t hits[SA_COUNTERS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct sa_table {
+    struct sa_set *sets;
+    // number of sets - 1, the number of sets being a power of 2
+    unsigned set_mask;
+};
+
+
+/*
+ * initializes a table with room for at least n_entries entries, all unused
+ *
+ * returns 0 on success and -1 on failure
+ */
+int sa_init(struct sa_table *table, unsigned n_entries);
+
+/*
+ * allocates zeroed, cache-aligned sets of set_size bytes, each holding ways
+ * entries, enough for at least n_entries entries, setting *sets and
+ * *set_mask as sa_init does for an sa_table
+ *
+ * returns 0 on success and -1 on failure
+ */
+int sa_alloc(void **sets, unsigned *set_mask, size_t set_size, unsigned ways,
+        unsigned n_entries);
+
+/*
+ * frees the sets of the table, whose entries must have been dropped by the
+ * owner. It is safe to free a zeroed table
+ */
+void sa_free(struct sa_table *table);
+
+/*
+ * sums the given hit counter over every set
+ */
+unsigned long sa_hits(const struct sa_table *table, int counter);
+
+
+/*
+ * hashes the len bytes at key, with the same one-at-a-time hash as str_hash
+ */
+static __inline uint32_t sa_hash(const void *key, size_t len) {
+    const unsigned char *bytes = (const unsigned char *) key;
+    uint32_t hash = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        hash += bytes[i];
+        hash += hash << 10;
+        hash ^= hash >> 6;
+    }
+    hash += hash << 3;
+    hash ^= hash >> 11;
+    hash += hash << 15;
+    return hash;
+}
+
+/*
+ * gives the index of the set entries with the given hash are kept in, out of
+ * set_mask + 1
+ */
+static __inline unsigned sa_set_index(uint32_t hash, unsigned set_mask) {
+    return (hash ^ (hash >> 16)) & set_mask;
+}
+
+static __inline void sa_spin_lock(int *lock) {
+    int unlocked = SA_UNLOCKED;
+
+    while (!__atomic_compare_exchange_n(lock, &unlocked, SA_LOCKED, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        unlocked = SA_UNLOCKED;
+    }
+}
+
+static __inline void sa_spin_unlock(int *lock) {
+    __atomic_store_n(lock, SA_UNLOCKED, __ATOMIC_RELEASE);
+}
+
+static __inline void sa_lock(struct sa_set *set) {
+    sa_spin_lock(&set->lock);
+}
+
+static __inline void sa_unlock(struct sa_set *set) {
+    sa_spin_unlock(&set->lock);
+}
+
+/*
+ * locks and gives the set entries with the given hash are kept in
+ */
+static __inline struct sa_set* sa_lock_set(struct sa_table *table,
+        uint32_t hash) {
+    struct sa_set *set = &table->sets[sa_set_index(hash, table->set_mask)];
+
+    sa_lock(set);
+    return set;
+}
+
+/*
+ * gives the way of the locked set a new entry should take, an unused one if
+ * there is one, or else the one used longest ago
+ */
+static __inline int sa_victim(const struct sa_set *set) {
+    int way = 0;
+
+    for (int i = 0; i < SA_WAYS && set->entries[way] != NULL; i++) {
+        if (set->entries[i] == NULL || set->clock - set->last_use[i] >
+                set->clock - set->last_use[way]) {
+            way = i;
+        }
+    }
+    return way;
+}
+
+/*
+ * puts entry with the given hash in the given way of the locked set, as just
+ * used
+ *
+ * returns the entry it replaced, or NULL if the way was unused
+ */
+static __inline void* sa_put(struct sa_set *set, int way, void *entry,
+        uint32_t hash) {
+    void *old = set->entries[way];
+
+    set->entries[way] = entry;
+    set->hashes[way] = hash;
+    set->last_use[way] = set->clock;
+    return old;
+}
+
+#endif /* _SETASSOC_H */
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+
+// offset of the first slot of a chunk, past the chunk header
+#define SLAB_HEADER_SIZE \
+    ((sizeof(struct slab_chunk) + CACHE_LINE - 1) & ~(CACHE_LINE - 1LU))
+
+#define slab_next(obj) (*(void **) (obj))
+
+static __inline struct slab_chunk* obj_chunk(void *obj) {
+    return (struct slab_chunk *) (((uintptr_t) obj) & ~(SLAB_CHUNK_SIZE - 1));
+}
+
+
+int slab_init(struct slab *slab, size_t obj_size, unsigned n_threads) {
+    memset(slab, 0, sizeof(struct slab));
+
+    slab->slot_size = (MAX(obj_size, sizeof(void *)) + CACHE_LINE - 1) &
+        ~(CACHE_LINE - 1LU);
+    if (slab->slot_size > SLAB_CHUNK_SIZE - SLAB_HEADER_SIZE) {
+        fprintf(stderr, "Objects of size %lu do not fit in a slab chunk\n",
+                obj_size);
+        return -1;
+    }
+    slab->slots_per_chunk = (SLAB_CHUNK_SIZE - SLAB_HEADER_SIZE) /
+        slab->slot_size;
+
+    if (posix_memalign((void **) &slab->caches, CACHE_LINE,
+                n_threads * sizeof(struct slab_cache)) != 0) {
+        fprintf(stderr, "Unable to malloc %u slab caches\n", n_threads);
+        slab->caches = NULL;
+        return -1;
+    }
+    memset(slab->caches, 0, n_threads * sizeof(struct slab_cache));
+    slab->n_caches = n_threads;
+    return 0;
+}
+
+void slab_destroy(struct slab *slab) {
+    struct slab_chunk *chunk, *next;
+    unsigned i;
+
+    for (i = 0; i < slab->n_caches; i++) {
+        for (chunk = slab->caches[i].chunks; chunk != NULL; chunk = next) {
+            next = chunk->next;
+            free(chunk);
+        }
+    }
+    free(slab->caches);
+    slab->caches = NULL;
+    slab->n_caches = 0;
+}
+
+
+/*
+ * allocates a new chunk to the cache and puts all of its slots on the
+ * cache's free list
+ */
+static int slab_grow(struct slab *slab, struct slab_cache *cache) {
+    struct slab_chunk *chunk;
+    char *slot;
+    size_t i;
+
+    if (posix_memalign((void **) &chunk, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE)
+            != 0) {
+        fprintf(stderr, "Unable to malloc slab chunk\n");
+        return -1;
+    }
+    chunk->owner = cache;
+    chunk->next = cache->chunks;
+    cache->chunks = chunk;
+    cache->n_chunks++;
+
+    // push the slots in reverse so they are handed out in address order
+    slot = ((char *) chunk) + SLAB_HEADER_SIZE +
+        (slab->slots_per_chunk - 1) * slab->slot_size;
+    for (i = 0; i < slab->slots_per_chunk; i++, slot -= slab->slot_size) {
+        slab_next(slot) = cache->free_list;
+        cache->free_list = slot;
+    }
+    return 0;
+}
+
+int slab_prewarm(struct slab *slab, unsigned thread, size_t n) {
+    struct slab_cache *cache = &slab->caches[thread];
+    size_t have = cache->n_chunks * slab->slots_per_chunk;
+
+    for (; have < n; have += slab->slots_per_chunk) {
+        if (slab_grow(slab, cache) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void* slab_alloc(struct slab *slab, unsigned thread) {
+    struct slab_cache *cache = &slab->caches[thread];
+    void *obj;
+
+    if (cache->free_list == NULL) {
+        // take back everything other threads have freed in one go. This is
+        // the only thread which ever pops from the remote list, so taking all
+        // of it at once is safe from ABA
+        cache->free_list = __atomic_exchange_n(&cache->remote_free, NULL,
+                __ATOMIC_ACQUIRE);
+        if (cache->free_list == NULL && slab_grow(slab, cache) != 0) {
+            return NULL;
+        }
+    }
+
+    obj = cache->free_list;
+    cache->free_list = slab_next(obj);
+    cache->n_allocs++;
+    return obj;
+}
+
+void slab_free(struct slab *slab, int thread, void *obj) {
+    struct slab_cache *cache = obj_chunk(obj)->owner;
+    void *head;
+
+    if (thread >= 0 && cache == &slab->caches[thread]) {
+        slab_next(obj) = cache->free_list;
+        cache->free_list = obj;
+        return;
+    }
+
+    head = __atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED);
+    do {
+        slab_next(obj) = head;
+    } while (!__atomic_compare_exchange_n(&cache->remote_free, &head, obj, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&cache->n_remote_frees, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,107 @@
+/*
+ * Slab allocator
+ *
+ * Hands out fixed-size objects carved from large, aligned chunks of memory.
+ * Each thread allocates from its own cache without any locking or atomic
+ * operations. Objects may be freed by any thread: an object freed by a
+ * thread other than the one whose cache it came from is pushed onto that
+ * cache's remote free list with a single atomic operation, and the owning
+ * thread takes all of those back at once when its own free list runs out.
+ *
+ * Memory is only returned to the system when the whole slab is destroyed
+ */
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+
+#include "util.h"
+
+// size of each chunk objects are carved from, which is also its alignment,
+// so the chunk an object belongs to is found by masking its address
+#define SLAB_CHUNK_SIZE (1LU << 16)
+
+
+struct slab_cache;
+
+// header at the start of every chunk
+struct slab_chunk {
+    // the cache this chunk belongs to, whose free lists its objects return to
+    struct slab_cache *owner;
+    // next chunk of the same cache
+    struct slab_chunk *next;
+};
+
+/*
+ * per-thread cache of free objects. Caches are kept on separate cache lines,
+ * and the remote free list is on a cache line of its own, as it is written
+ * to by other threads
+ */
+struct slab_cache {
+    // objects freed to this cache by its own thread, linked through their
+    // first word
+    void *free_list;
+
+    // all chunks allocated by this cache
+    struct slab_chunk *chunks;
+
+    unsigned long n_chunks;
+    unsigned long n_allocs;
+
+    // objects freed to this cache by other threads, linked through their
+    // first word
+    void *remote_free __attribute__((aligned(CACHE_LINE)));
+    unsigned long n_remote_frees;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct slab {
+    // size of each slot, which is the object size rounded up to a multiple of
+    // the cache line size
+    size_t slot_size;
+    // number of slots in each chunk
+    size_t slots_per_chunk;
+
+    unsigned n_caches;
+    struct slab_cache *caches;
+};
+
+
+/*
+ * initializes a slab of objects of obj_size bytes with one cache for each of
+ * n_threads threads, numbered 0 to n_threads - 1. No memory is allocated
+ * for objects until they are first requested
+ *
+ * returns 0 on success and -1 on failure
+ */
+int slab_init(struct slab *slab, size_t obj_size, unsigned n_threads);
+
+/*
+ * frees all memory held by the slab, including any objects not yet freed.
+ * It is safe to destroy a zeroed slab
+ */
+void slab_destroy(struct slab *slab);
+
+/*
+ * allocates enough chunks to the cache of the given thread that at least n
+ * objects may be allocated from it without going to the system. Should be
+ * called from the thread itself, so that the memory is first touched by it
+ *
+ * returns 0 on success and -1 on failure
+ */
+int slab_prewarm(struct slab *slab, unsigned thread, size_t n);
+
+/*
+ * allocates an object from the cache of the given thread, which must be the
+ * calling thread. Slots are aligned to the cache line size
+ *
+ * returns NULL if no more memory could be allocated
+ */
+void* slab_alloc(struct slab *slab, unsigned thread);
+
+/*
+ * frees an object previously allocated from the slab by any thread. thread
+ * is the id of the calling thread, or -1 if it does not own a cache
+ */
+void slab_free(struct slab *slab, int thread, void *obj);
+
+#endif /* _SLAB_H */
@@ -0,0 +1,350 @@
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "topology.h"
+#include "util.h"
+
+
+#ifdef __linux__
+
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu%d"
+
+/*
+ * reads the integer at the start of the sysfs file whose path is given by fmt
+ * and cpu, which for CPU lists is the lowest-numbered CPU in the list
+ *
+ * returns 0 on success and -1 if the file could not be read
+ */
+static int read_sysfs_int(const char *fmt, int cpu, int idx, int *val) {
+    char path[128];
+    FILE *f;
+    int ret;
+
+    snprintf(path, sizeof(path), fmt, cpu, idx);
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    ret = (fscanf(f, "%d", val) == 1) ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+/*
+ * gives the lowest-numbered CPU sharing the last-level cache of cpu, going by
+ * the highest-level data or unified cache sysfs lists for it
+ *
+ * returns -1 if sysfs lists no caches for the CPU
+ */
+static int read_llc(int cpu) {
+    char path[128], type[32];
+    int idx, level, max_level = 0, llc = -1, first;
+    FILE *f;
+
+    for (idx = 0; read_sysfs_int(SYSFS_CPU "/cache/index%d/level", cpu, idx,
+                &level) == 0; idx++) {
+        snprintf(path, sizeof(path), SYSFS_CPU "/cache/index%d/type", cpu,
+                idx);
+        if ((f = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        if (fscanf(f, "%31s", type) != 1 ||
+                strcmp(type, "Instruction") == 0) {
+            fclose(f);
+            continue;
+        }
+        fclose(f);
+
+        if (level > max_level && read_sysfs_int(
+                    SYSFS_CPU "/cache/index%d/shared_cpu_list", cpu, idx,
+                    &first) == 0) {
+            max_level = level;
+            llc = first;
+        }
+    }
+    return llc;
+}
+
+/*
+ * gives the NUMA node of cpu, which sysfs lists as a nodeN entry in the CPU's
+ * directory
+ *
+ * returns -1 if there is none
+ */
+static int read_node(int cpu) {
+    char path[128];
+    struct dirent *ent;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), SYSFS_CPU, cpu);
+    if ((dir = opendir(path)) == NULL) {
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0 &&
+                sscanf(ent->d_name + 4, "%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+#endif /* __linux__ */
+
+
+/*
+ * gives the number of distinct values among the CPUs of the topology of the
+ * int field at offset in struct cpu_info
+ */
+static int count_distinct(const struct cpu_topology *topo, size_t offset) {
+    unsigned char seen[TOPO_MAX_CPUS];
+    int i, val, n = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < topo->n_cpus; i++) {
+        val = *(int *) (((char *) &topo->cpus[i]) + offset);
+        if (val >= 0 && val < TOPO_MAX_CPUS && !seen[val]) {
+            seen[val] = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+int topo_discover(struct cpu_topology *topo) {
+    struct cpu_info *info;
+    int cpu, n_possible;
+
+    memset(topo, 0, sizeof(struct cpu_topology));
+
+#ifdef __linux__
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        fprintf(stderr, "Unable to get CPU affinity, reason: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    n_possible = MIN(CPU_SETSIZE, TOPO_MAX_CPUS);
+#else
+    n_possible = MIN(get_n_cpus(), TOPO_MAX_CPUS);
+#endif
+
+    topo->cpus = (struct cpu_info *) malloc(n_possible *
+            sizeof(struct cpu_info));
+    if (topo->cpus == NULL) {
+        fprintf(stderr, "Unable to malloc CPU topology\n");
+        return -1;
+    }
+
+    for (cpu = 0; cpu < n_possible; cpu++) {
+#ifdef __linux__
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+#endif
+        info = &topo->cpus[topo->n_cpus++];
+        info->cpu = cpu;
+        info->core = cpu;
+        info->llc = -1;
+        info->node = 0;
+#ifdef __linux__
+        int val;
+        if (read_sysfs_int(SYSFS_CPU "/topology/thread_siblings_list", cpu,
+                    0, &val) == 0) {
+            info->core = val;
+        }
+        info->llc = read_llc(cpu);
+        if ((val = read_node(cpu)) != -1) {
+            info->node = val;
+        }
+#endif
+    }
+
+    for (cpu = 0; cpu < topo->n_cpus; cpu++) {
+        if (topo->cpus[cpu].llc == -1) {
+            // without cache information, every CPU shares one cache
+            topo->cpus[cpu].llc = topo->cpus[0].cpu;
+        }
+    }
+
+    topo->n_cores = count_distinct(topo, offsetof(struct cpu_info, core));
+    topo->n_llcs = count_distinct(topo, offsetof(struct cpu_info, llc));
+    topo->n_nodes = count_distinct(topo, offsetof(struct cpu_info, node));
+    return 0;
+}
+
+void topo_free(struct cpu_topology *topo) {
+    free(topo->cpus);
+    topo->cpus = NULL;
+    topo->n_cpus = 0;
+}
+
+
+int topo_parse_list(const char *list, int *cpus, int max) {
+    const char *p = list;
+    char *end;
+    long lo, hi;
+    int n = 0;
+
+    while (1) {
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0 || lo >= TOPO_MAX_CPUS) {
+            return -1;
+        }
+        hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo || hi >= TOPO_MAX_CPUS) {
+                return -1;
+            }
+            p = end;
+        }
+
+        for (; lo <= hi; lo++) {
+            if (n == max) {
+                return -1;
+            }
+            cpus[n++] = (int) lo;
+        }
+
+        if (*p == '\0' || *p == '\n') {
+            return n;
+        }
+        if (*p != ',') {
+            return -1;
+        }
+        p++;
+    }
+}
+
+int topo_place(const struct cpu_topology *topo, int policy, const char *list,
+        int **cpus_ptr) {
+    unsigned char seen[TOPO_MAX_CPUS];
+    struct cpu_info *info;
+    int *cpus, i, n = 0;
+
+    cpus = (int *) malloc(TOPO_MAX_CPUS * sizeof(int));
+    if (cpus == NULL) {
+        fprintf(stderr, "Unable to malloc CPU placement\n");
+        return -1;
+    }
+    memset(seen, 0, sizeof(seen));
+
+    switch (policy) {
+    case TOPO_PLACE_LIST:
+        n = topo_parse_list(list, cpus, TOPO_MAX_CPUS);
+        if (n == -1) {
+            fprintf(stderr, "Malformed CPU list \"%s\"\n", list);
+            free(cpus);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (topo_node(topo, cpus[i]) == -1) {
+                fprintf(stderr, "CPU %d is not available to the server\n",
+                        cpus[i]);
+                free(cpus);
+                return -1;
+            }
+        }
+        break;
+    case TOPO_PLACE_CPUS:
+    case TOPO_PLACE_CORES:
+    case TOPO_PLACE_L3:
+        for (i = 0; i < topo->n_cpus; i++) {
+            info = &topo->cpus[i];
+            if (policy == TOPO_PLACE_CORES) {
+                if (seen[info->core]) {
+                    // an SMT sibling of a CPU already picked
+                    continue;
+                }
+                seen[info->core] = 1;
+            }
+            else if (policy == TOPO_PLACE_L3) {
+                if (seen[info->llc]) {
+                    continue;
+                }
+                seen[info->llc] = 1;
+            }
+            cpus[n++] = info->cpu;
+        }
+        break;
+    default:
+        fprintf(stderr, "Unknown placement policy %d\n", policy);
+        free(cpus);
+        return -1;
+    }
+
+    if (n == 0) {
+        fprintf(stderr, "No CPUs to place threads on\n");
+        free(cpus);
+        return -1;
+    }
+    *cpus_ptr = cpus;
+    return n;
+}
+
+int topo_node(const struct cpu_topology *topo, int cpu) {
+    for (int i = 0; i < topo->n_cpus; i++) {
+        if (topo->cpus[i].cpu == cpu) {
+            return topo->cpus[i].node;
+        }
+    }
+    return -1;
+}
+
+int topo_move_local(const struct cpu_topology *topo, void *addr, size_t len) {
+    if (topo->n_nodes <= 1 || len == 0) {
+        return 0;
+    }
+#ifdef __linux__
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) addr) & ~(page_size - 1);
+    unsigned long i, n_pages;
+    void **pages;
+    int *nodes, *status, node;
+    long ret;
+
+    node = topo_node(topo, sched_getcpu());
+    if (node == -1) {
+        return -1;
+    }
+
+    n_pages = (((uintptr_t) addr) + len - start + page_size - 1) / page_size;
+    pages = (void **) malloc(n_pages * (sizeof(void *) + 2 * sizeof(int)));
+    if (pages == NULL) {
+        return -1;
+    }
+    nodes = (int *) (pages + n_pages);
+    status = nodes + n_pages;
+    for (i = 0; i < n_pages; i++) {
+        pages[i] = (void *) (start + i * page_size);
+        nodes[i] = node;
+    }
+
+    ret = syscall(SYS_move_pages, 0, n_pages, pages, nodes, status,
+            MPOL_MF_MOVE);
+    if (ret == -1) {
+        fprintf(stderr, "Unable to move %lu pages to node %d, reason: %s\n",
+                n_pages, node, strerror(errno));
+    }
+    free(pages);
+    return (ret == -1) ? -1 : 0;
+#else
+    return 0;
+#endif
+}
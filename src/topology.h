@@ -0,0 +1,108 @@
+/*
+ * CPU topology
+ *
+ * Describes the logical CPUs the process may run on, along with the physical
+ * core, last-level cache domain and NUMA node each of them belongs to, as
+ * read from sysfs on Linux. Where sysfs is not available (or says nothing of
+ * a CPU), each CPU is taken to be a core of its own, sharing one cache domain
+ * and one node with every other CPU.
+ *
+ * Cores and cache domains are identified by the lowest-numbered CPU in them,
+ * so they need no numbering of their own
+ */
+#ifndef _TOPOLOGY_H
+#define _TOPOLOGY_H
+
+#include <stddef.h>
+
+
+// CPUs numbered this high or higher are ignored
+#define TOPO_MAX_CPUS 1024
+
+
+/* policies by which topo_place picks the CPUs to place threads on */
+
+// threads are not placed
+#define TOPO_PLACE_NONE 0
+// every logical CPU the process may run on, SMT siblings included
+#define TOPO_PLACE_CPUS 1
+// one CPU of each physical core
+#define TOPO_PLACE_CORES 2
+// one CPU of each last-level cache domain
+#define TOPO_PLACE_L3 3
+// the CPUs of a list given by the user
+#define TOPO_PLACE_LIST 4
+
+
+struct cpu_info {
+    // number of the logical CPU
+    int cpu;
+    // lowest-numbered CPU of the physical core this CPU belongs to
+    int core;
+    // lowest-numbered CPU sharing this CPU's last-level cache
+    int llc;
+    // NUMA node of the CPU
+    int node;
+};
+
+struct cpu_topology {
+    // the CPUs the process may run on, in increasing order
+    struct cpu_info *cpus;
+    int n_cpus;
+
+    // number of distinct cores, last-level caches and nodes among them
+    int n_cores;
+    int n_llcs;
+    int n_nodes;
+};
+
+
+/*
+ * fills in the topology of the CPUs the calling thread may run on
+ *
+ * returns 0 on success and -1 on failure
+ */
+int topo_discover(struct cpu_topology *topo);
+
+/*
+ * frees the memory held by the topology. It is safe to free a zeroed
+ * topology
+ */
+void topo_free(struct cpu_topology *topo);
+
+/*
+ * parses a list of CPUs such as "0-3,8,10-11" into cpus, in the order given,
+ * storing at most max of them
+ *
+ * returns the number of CPUs in the list, or -1 if it is malformed or holds
+ * more than max CPUs
+ */
+int topo_parse_list(const char *list, int *cpus, int max);
+
+/*
+ * picks the CPUs to place threads on under one of the TOPO_PLACE_* policies,
+ * which with TOPO_PLACE_LIST are the CPUs of list, each of which must be in
+ * the topology. The CPUs are stored in a malloced array in *cpus, in the order
+ * threads should be placed on them
+ *
+ * returns the number of CPUs picked, or -1 on failure
+ */
+int topo_place(const struct cpu_topology *topo, int policy, const char *list,
+        int **cpus);
+
+/*
+ * gives the NUMA node of cpu, or -1 if it is not in the topology
+ */
+int topo_node(const struct cpu_topology *topo, int cpu);
+
+/*
+ * moves the pages holding the len bytes at addr to the NUMA node of the CPU
+ * the calling thread is running on, if the topology has more than one node.
+ * Meant to be called by a thread pinned to a CPU, on memory which was
+ * allocated for it by another thread
+ *
+ * returns 0 on success and -1 on failure
+ */
+int topo_move_local(const struct cpu_topology *topo, void *addr, size_t len);
+
+#endif /* _TOPOLOGY_H */
@@ -0,0 +1,193 @@
+#include <stddef.h>
+
+#include "twheel.h"
+
+
+static __inline void slot_init(struct tw_node *head) {
+    head->next = head->prev = head;
+}
+
+static __inline int slot_empty(struct tw_node *head) {
+    return head->next == head;
+}
+
+// adds node to the end of the slot
+static __inline void slot_push(struct tw_node *head, struct tw_node *node) {
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static __inline void node_unlink(struct tw_node *node) {
+    node->next->prev = node->prev;
+    node->prev->next = node->next;
+    node->next = node->prev = NULL;
+}
+
+
+/*
+ * gives the slot which a timer expiring at tick expires belongs in, given
+ * the current tick of the wheel
+ */
+static struct tw_node* wheel_slot(struct twheel *wheel, uint64_t expires) {
+    uint64_t delta;
+    int level;
+
+    if (expires < wheel->now) {
+        // already expired, so put it in the slot processed next
+        expires = wheel->now;
+    }
+    delta = expires - wheel->now;
+    if (delta > TW_MAX_TICKS) {
+        // the timer is put in the furthest slot, and will be placed in the
+        // wheel again after it cascades out of there
+        expires = wheel->now + TW_MAX_TICKS;
+        delta = TW_MAX_TICKS;
+    }
+
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+        if (delta < (1LU << (TW_SLOT_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    return &wheel->slots[level][(expires >> (TW_SLOT_BITS * level)) &
+        TW_SLOT_MASK];
+}
+
+
+void tw_init(struct twheel *wheel, uint64_t now) {
+    int level, i;
+
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        for (i = 0; i < TW_SLOTS; i++) {
+            slot_init(&wheel->slots[level][i]);
+        }
+    }
+}
+
+void tw_arm(struct twheel *wheel, struct tw_node *node, uint64_t expires) {
+    if (tw_armed(node)) {
+        node_unlink(node);
+    }
+    else {
+        wheel->count++;
+    }
+    node->expires = expires;
+    slot_push(wheel_slot(wheel, expires), node);
+}
+
+void tw_cancel(struct twheel *wheel, struct tw_node *node) {
+    if (tw_armed(node)) {
+        node_unlink(node);
+        wheel->count--;
+    }
+}
+
+
+/*
+ * moves every timer in the slot to the slot it now belongs in, given the
+ * current tick of the wheel
+ */
+static void cascade(struct twheel *wheel, struct tw_node *head) {
+    struct tw_node *node, *next;
+
+    if (slot_empty(head)) {
+        return;
+    }
+
+    // detach the list from the head first, as timers may be placed right
+    // back into the same slot
+    node = head->next;
+    head->prev->next = NULL;
+    slot_init(head);
+
+    for (; node != NULL; node = next) {
+        next = node->next;
+        slot_push(wheel_slot(wheel, node->expires), node);
+    }
+}
+
+/*
+ * processes the current tick of the wheel, prepending every timer that
+ * expires on it to the expired list
+ */
+static struct tw_node* tw_tick(struct twheel *wheel, struct tw_node *expired) {
+    struct tw_node *head, *node, *next;
+    uint64_t tick = wheel->now;
+    int level;
+
+    // bring down the timers of each level whose slot begins on this tick,
+    // highest level first so they may fall all the way down to level 0
+    for (level = TW_LEVELS - 1; level > 0; level--) {
+        if ((tick & ((1LU << (TW_SLOT_BITS * level)) - 1)) == 0) {
+            cascade(wheel, &wheel->slots[level]
+                    [(tick >> (TW_SLOT_BITS * level)) & TW_SLOT_MASK]);
+        }
+    }
+
+    head = &wheel->slots[0][tick & TW_SLOT_MASK];
+    if (slot_empty(head)) {
+        return expired;
+    }
+
+    node = head->next;
+    head->prev->next = NULL;
+    slot_init(head);
+
+    for (; node != NULL; node = next) {
+        next = node->next;
+        if (node->expires > tick) {
+            // was clamped to the end of the wheel, so it is not done yet
+            slot_push(wheel_slot(wheel, node->expires), node);
+        }
+        else {
+            node->prev = NULL;
+            node->next = expired;
+            expired = node;
+            wheel->count--;
+        }
+    }
+    return expired;
+}
+
+struct tw_node* tw_advance(struct twheel *wheel, uint64_t now) {
+    struct tw_node *expired = NULL;
+
+    if (wheel->count == 0) {
+        // nothing to expire, so skip right to the end
+        if (now >= wheel->now) {
+            wheel->now = now + 1;
+        }
+        return NULL;
+    }
+
+    while (wheel->now <= now) {
+        expired = tw_tick(wheel, expired);
+        wheel->now++;
+    }
+    return expired;
+}
+
+struct tw_node* tw_clear(struct twheel *wheel) {
+    struct tw_node *expired = NULL, *head, *node, *next;
+    int level, i;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        for (i = 0; i < TW_SLOTS; i++) {
+            head = &wheel->slots[level][i];
+            for (node = head->next; node != head; node = next) {
+                next = node->next;
+                node->prev = NULL;
+                node->next = expired;
+                expired = node;
+            }
+            slot_init(head);
+        }
+    }
+    wheel->count = 0;
+    return expired;
+}
@@ -0,0 +1,101 @@
+/*
+ * Hierarchical timing wheel
+ *
+ * A timing wheel tracks a large number of timers with O(1) insertion and
+ * cancellation. Time is measured in ticks, whose length is up to the user of
+ * the wheel. Level 0 of the wheel has one slot for each of the next
+ * TW_SLOTS ticks, and each slot of level l covers TW_SLOTS times as many ticks
+ * as a slot of level l - 1. Timers in higher levels are cascaded down into
+ * lower levels as the wheel turns, until they reach level 0 and expire.
+ *
+ * The wheel does no locking of its own, it is meant to be owned by a single
+ * event loop
+ */
+#ifndef _TWHEEL_H
+#define _TWHEEL_H
+
+#include <stdint.h>
+
+// log2 of the number of slots in each level of the wheel
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1U << TW_SLOT_BITS)
+#define TW_SLOT_MASK (TW_SLOTS - 1)
+
+#define TW_LEVELS 4
+
+// timers further in the future than this many ticks are clamped to it
+#define TW_MAX_TICKS ((1LU << (TW_SLOT_BITS * TW_LEVELS)) - 1)
+
+
+/*
+ * node of a doubly-linked list of timers, to be embedded in the struct which
+ * is being timed
+ */
+struct tw_node {
+    struct tw_node *next, *prev;
+
+    // tick at which this timer expires
+    uint64_t expires;
+};
+
+struct twheel {
+    // the next tick to be processed, all timers which expire before this
+    // tick have been expired
+    uint64_t now;
+
+    // number of timers armed in the wheel
+    uint64_t count;
+
+    // circularly-linked list heads of each slot in each level
+    struct tw_node slots[TW_LEVELS][TW_SLOTS];
+};
+
+
+/*
+ * initializes an empty timing wheel whose current tick is now
+ */
+void tw_init(struct twheel *wheel, uint64_t now);
+
+/*
+ * clears a timer node so that it is not armed
+ */
+static __inline void tw_node_init(struct tw_node *node) {
+    node->next = node->prev = NULL;
+}
+
+/*
+ * true if the timer is currently in a wheel
+ */
+static __inline int tw_armed(const struct tw_node *node) {
+    return node->prev != NULL;
+}
+
+/*
+ * arms the timer to expire at tick expires. If the timer was already armed,
+ * then it is moved. Timers set to expire before the current tick of the wheel
+ * expire on the next call to tw_advance
+ */
+void tw_arm(struct twheel *wheel, struct tw_node *node, uint64_t expires);
+
+/*
+ * removes the timer from the wheel it is in, if it is armed
+ */
+void tw_cancel(struct twheel *wheel, struct tw_node *node);
+
+/*
+ * advances the wheel up to and including tick now, expiring every timer whose
+ * expiration tick is at most now
+ *
+ * returns the expired timers, which have been removed from the wheel, as a
+ * NULL-terminated singly-linked list through their next fields, or NULL if
+ * none expired. The returned nodes may be freely re-armed by the caller
+ */
+struct tw_node* tw_advance(struct twheel *wheel, uint64_t now);
+
+/*
+ * removes every timer from the wheel and returns them in the same form as
+ * tw_advance
+ */
+struct tw_node* tw_clear(struct twheel *wheel);
+
+#endif /* _TWHEEL_H */
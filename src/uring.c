@@ -0,0 +1,262 @@
+#ifdef __linux__
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+int uring_init(struct uring *ring, unsigned entries, unsigned flags) {
+    struct io_uring_params p;
+    unsigned i;
+    char *sq_ring, *cq_ring;
+
+    memset(ring, 0, sizeof(struct uring));
+
+    memset(&p, 0, sizeof(p));
+    p.flags = flags;
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd == -1 && errno == EINVAL && flags != 0) {
+        // older kernels reject setup flags they do not know about
+        memset(&p, 0, sizeof(p));
+        ring->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (ring->fd == -1) {
+        fprintf(stderr, "Unable to set up io_uring, reason: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    ring->features = p.features;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        // both rings live in the same mapping
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        fprintf(stderr, "Unable to map io_uring submission queue, "
+                "reason: %s\n", strerror(errno));
+        close(ring->fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            fprintf(stderr, "Unable to map io_uring completion queue, "
+                    "reason: %s\n", strerror(errno));
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        fprintf(stderr, "Unable to map io_uring submission queue entries, "
+                "reason: %s\n", strerror(errno));
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    sq_ring = (char *) ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq_ring + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq_ring + p.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *) (sq_ring + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *) (sq_ring + p.sq_off.array);
+
+    cq_ring = (char *) ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ring + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes);
+
+    // sqes are always handed out in order, so the indirection array can be
+    // filled in once and never touched again
+    for (i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+
+    return 0;
+}
+
+void uring_exit(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+
+/*
+ * makes the pending sqes visible to the kernel
+ */
+static void flush_sq(struct uring *ring) {
+    if (ring->sqe_pending > 0) {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sqe_pending,
+                __ATOMIC_RELEASE);
+        ring->sqe_pending = 0;
+    }
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+    unsigned head, next;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    next = *ring->sq_tail + ring->sqe_pending;
+
+    if (next - head >= ring->sq_entries) {
+        // the queue is full, so hand everything in it to the kernel first
+        if (uring_submit_and_wait(ring, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        next = *ring->sq_tail;
+        if (next - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[next & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqe_pending++;
+    return sqe;
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+    unsigned to_submit;
+    int ret;
+
+    flush_sq(ring);
+    // include entries left behind by a previous call which was interrupted
+    // before the kernel consumed them
+    to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head,
+            __ATOMIC_ACQUIRE);
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+                wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret == -1 && errno == EINTR && wait_nr == 0);
+
+    return ret;
+}
+
+int uring_submit_and_reap(struct uring *ring) {
+    unsigned to_submit;
+    int ret;
+
+    flush_sq(ring);
+    to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head,
+            __ATOMIC_ACQUIRE);
+
+    // with IORING_SETUP_COOP_TASKRUN, completions are only posted when the
+    // thread enters the kernel asking for them, even if it waits for none
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, 0,
+                IORING_ENTER_GETEVENTS);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+
+int uring_setup_buf_ring(struct uring *ring, struct uring_buf_ring *br,
+        unsigned short bgid, unsigned n_bufs, unsigned buf_size) {
+    struct io_uring_buf_reg reg;
+    size_t ring_size = n_bufs * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    br->n_bufs = n_bufs;
+    br->buf_size = buf_size;
+    br->bgid = bgid;
+
+    // the ring of buffer descriptors must be page aligned
+    if (posix_memalign((void **) &br->br, sysconf(_SC_PAGESIZE), ring_size)
+            != 0) {
+        fprintf(stderr, "Unable to malloc io_uring buffer ring\n");
+        return -1;
+    }
+    memset(br->br, 0, ring_size);
+
+    br->bufs = (char *) malloc(((size_t) n_bufs) * buf_size);
+    if (br->bufs == NULL) {
+        fprintf(stderr, "Unable to malloc %u io_uring buffers\n", n_bufs);
+        free(br->br);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) br->br;
+    reg.ring_entries = n_bufs;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)
+            == -1) {
+        fprintf(stderr, "Unable to register io_uring buffer ring, "
+                "reason: %s\n", strerror(errno));
+        free(br->bufs);
+        free(br->br);
+        return -1;
+    }
+
+    for (i = 0; i < n_bufs; i++) {
+        uring_recycle_buf(br, i);
+    }
+    return 0;
+}
+
+void uring_free_buf_ring(struct uring *ring, struct uring_buf_ring *br) {
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = br->bgid;
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    free(br->bufs);
+    free(br->br);
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,171 @@
+/*
+ * Minimal io_uring interface
+ *
+ * Thin wrappers around the io_uring_setup/io_uring_enter/io_uring_register
+ * syscalls, so the server does not depend on liburing. A ring is meant to be
+ * owned by a single thread, and none of these functions do any locking.
+ *
+ * Only available on Linux
+ */
+#ifndef _URING_H
+#define _URING_H
+
+#ifdef __linux__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+
+struct uring {
+    // file descriptor returned by io_uring_setup
+    int fd;
+
+    // IORING_FEAT_* bits supported by the kernel
+    unsigned features;
+
+    /* submission queue, shared with the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    // number of sqes handed out by uring_get_sqe which have not yet been
+    // made visible to the kernel
+    unsigned sqe_pending;
+
+    /* completion queue, shared with the kernel */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // mmapped regions, kept to unmap them in uring_exit
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/*
+ * ring of buffers provided to the kernel, from which receives with
+ * IOSQE_BUFFER_SELECT pick the buffer to read into only once data has
+ * arrived, so idle connections do not hold on to a buffer
+ */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    // memory backing all of the buffers, buf_size bytes each
+    char *bufs;
+
+    unsigned n_bufs;
+    unsigned buf_size;
+    unsigned short bgid;
+};
+
+
+/*
+ * sets up an io_uring instance with room for at least the given number of
+ * submission queue entries. flags are IORING_SETUP_* flags, and if the kernel
+ * does not recognize them the ring is set up without any
+ *
+ * returns 0 on success and -1 on failure
+ */
+int uring_init(struct uring *ring, unsigned entries, unsigned flags);
+
+/*
+ * tears down the ring, releasing all memory mapped with the kernel
+ */
+void uring_exit(struct uring *ring);
+
+/*
+ * gives the next free submission queue entry, zeroed, or NULL if the
+ * submission queue is full even after submitting everything pending
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring *ring);
+
+/*
+ * gives the number of submission queue entries which may be taken with
+ * uring_get_sqe before the queue has to be submitted
+ */
+static __inline unsigned uring_sq_space(struct uring *ring) {
+    return ring->sq_entries - (*ring->sq_tail + ring->sqe_pending -
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * submits all pending submission queue entries and waits until at least
+ * wait_nr completions are available, in a single syscall
+ *
+ * returns the number of entries submitted, or -1 with errno set on failure
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+
+/*
+ * submits all pending submission queue entries and has the kernel post the
+ * completions which are ready, without waiting for any more
+ *
+ * returns the number of entries submitted, or -1 with errno set on failure
+ */
+int uring_submit_and_reap(struct uring *ring);
+
+/*
+ * gives the oldest completion queue entry not yet consumed, or NULL if
+ * there are none. The entry must be released with uring_cqe_seen
+ */
+static __inline struct io_uring_cqe* uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/*
+ * releases the completion queue entry returned by uring_peek_cqe back to
+ * the kernel
+ */
+static __inline void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * registers a ring of n_bufs buffers of buf_size bytes each with the ring,
+ * under buffer group id bgid. n_bufs must be a power of 2
+ *
+ * returns 0 on success and -1 on failure
+ */
+int uring_setup_buf_ring(struct uring *ring, struct uring_buf_ring *br,
+        unsigned short bgid, unsigned n_bufs, unsigned buf_size);
+
+/*
+ * unregisters the buffer ring and frees all of its buffers
+ */
+void uring_free_buf_ring(struct uring *ring, struct uring_buf_ring *br);
+
+/*
+ * gives the buffer with the given id
+ */
+static __inline char* uring_buf(struct uring_buf_ring *br, unsigned bid) {
+    return br->bufs + ((size_t) bid) * br->buf_size;
+}
+
+/*
+ * hands a buffer picked by the kernel for a receive back to the buffer ring,
+ * once its contents have been consumed
+ */
+static __inline void uring_recycle_buf(struct uring_buf_ring *br,
+        unsigned bid) {
+    unsigned short tail = br->br->tail;
+    struct io_uring_buf *buf = &br->br->bufs[tail & (br->n_bufs - 1)];
+
+    buf->addr = (unsigned long) uring_buf(br, bid);
+    buf->len = br->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&br->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* __linux__ */
+
+#endif /* _URING_H */
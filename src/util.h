@@ -22,6 +22,11 @@
     })
 
 
+// size of a cache line in bytes, for aligning data written to by different
+// threads
+#define CACHE_LINE 64
+
+
 #define MAX(x, y) ((x) < (y) ? (y) : (x))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
@@ -80,6 +85,13 @@ int get_n_cpus();
 // calculates the number of seconds between t1 and t0 (t1 - t0)
 double timespec_diff(struct timespec *t1, struct timespec *t0);
 
+// calculates the number of nanoseconds between t1 and t0 (t1 - t0)
+static __inline long timespec_diff_ns(struct timespec *t1,
+        struct timespec *t0) {
+    return (t1->tv_sec - t0->tv_sec) * 1000000000L +
+        (t1->tv_nsec - t0->tv_nsec);
+}
+
 // true if timespec t1 occurs after t2
 static __inline int timespec_after(struct timespec *t1, struct timespec *t2) {
     return (t1->tv_sec == t2->tv_sec) ? t1->tv_nsec > t2->tv_nsec :
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wsdeque.h"
+
+
+int wsd_init(struct ws_deque *d, unsigned long capacity) {
+    unsigned long n_slots = 1;
+
+    memset(d, 0, sizeof(struct ws_deque));
+
+    while (n_slots < capacity) {
+        n_slots <<= 1;
+    }
+    if (posix_memalign((void **) &d->buf, CACHE_LINE,
+                n_slots * sizeof(void *)) != 0) {
+        fprintf(stderr, "Unable to malloc deque of %lu slots\n", n_slots);
+        d->buf = NULL;
+        return -1;
+    }
+    d->mask = (long) n_slots - 1;
+    return 0;
+}
+
+void wsd_free(struct ws_deque *d) {
+    free(d->buf);
+    d->buf = NULL;
+}
+
+
+int wsd_push(struct ws_deque *d, void *item) {
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    // the top only ever moves up, so a stale top can only make the deque
+    // look fuller than it is
+    if (bottom - top > d->mask) {
+        return -1;
+    }
+
+    __atomic_store_n(&d->buf[bottom & d->mask], item, __ATOMIC_RELAXED);
+    // publish the item before the thieves can see the new bottom
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void* wsd_pop(struct ws_deque *d) {
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long top;
+    void *item;
+
+    // claim the bottom item before looking at the top, so that a thief
+    // either sees the claim or is seen by the owner
+    __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        // empty
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    item = __atomic_load_n(&d->buf[bottom & d->mask], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // the last item, which a thief may be taking as well. Whoever moves
+        // the top past it gets it
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            item = NULL;
+        }
+        __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+void* wsd_steal(struct ws_deque *d) {
+    long top, bottom;
+    void *item;
+
+    while (1) {
+        top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+        if (top >= bottom) {
+            return NULL;
+        }
+
+        // the slot can not be reused by the owner until the top has moved
+        // past it, which is what the compare-and-swap checks
+        item = __atomic_load_n(&d->buf[top & d->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return item;
+        }
+        // lost the item to the owner or another thief, so try the next
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Work-stealing deque
+ *
+ * A bounded, lock-free Chase-Lev deque of pointers. A single thread, the
+ * owner, pushes onto and pops from the bottom end, as with a stack, while any
+ * number of other threads may steal from the top end, taking the oldest item
+ * first. The owner only contends with thieves over the last item in the
+ * deque, which both sides settle with a compare-and-swap on the top, so
+ * pushes and pops are otherwise plain loads and stores. Nothing is allocated
+ * once the deque has been initialized.
+ *
+ * The top, written to by the thieves, and the bottom, written to by the
+ * owner, are kept on separate cache lines
+ */
+#ifndef _WSDEQUE_H
+#define _WSDEQUE_H
+
+#include "util.h"
+
+
+struct ws_deque {
+    void **buf;
+    // number of slots - 1, the number of slots being a power of 2
+    long mask;
+
+    // position of the next item to be stolen
+    long top __attribute__((aligned(CACHE_LINE)));
+
+    // position the next item is pushed to
+    long bottom __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE)));
+
+
+/*
+ * initializes a deque with room for at least capacity items
+ *
+ * returns 0 on success and -1 on failure
+ */
+int wsd_init(struct ws_deque *d, unsigned long capacity);
+
+/*
+ * frees the memory held by the deque. It is safe to free a zeroed deque
+ */
+void wsd_free(struct ws_deque *d);
+
+/*
+ * pushes item onto the bottom of the deque. Only the owner may push
+ *
+ * returns 0 on success and -1 if the deque is full
+ */
+int wsd_push(struct ws_deque *d, void *item);
+
+/*
+ * pops the item most recently pushed onto the deque. Only the owner may pop
+ *
+ * returns the item, or NULL if the deque is empty
+ */
+void* wsd_pop(struct ws_deque *d);
+
+/*
+ * steals the oldest item in the deque, which may be done by any thread
+ *
+ * returns the item, or NULL if the deque is empty
+ */
+void* wsd_steal(struct ws_deque *d);
+
+/*
+ * gives the number of items in the deque, which may be off by the pushes,
+ * pops and steals in progress
+ */
+static __inline long wsd_size(struct ws_deque *d) {
+    long top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    long bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+
+    return (bottom > top) ? bottom - top : 0;
+}
+
+#endif /* _WSDEQUE_H */
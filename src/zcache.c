@@ -0,0 +1,439 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include <zlib.h>
+
+#include "zcache.h"
+
+
+// hit counter of the sets
+#define ZC_HITS 0
+
+
+static __inline uint32_t zc_hash(dev_t dev, ino_t ino, unsigned format) {
+    uint64_t key[3] = { (uint64_t) dev, (uint64_t) ino, format };
+
+    return sa_hash(key, sizeof(key));
+}
+
+/*
+ * gives the way of the set holding a copy of any version of the file with
+ * the given identity in the given format, or -1 if there is none
+ */
+static __inline int zc_find(struct sa_set *set, uint32_t hash, dev_t dev,
+        ino_t ino, unsigned format) {
+    struct zc_file *z;
+
+    for (int i = 0; i < SA_WAYS; i++) {
+        z = (struct zc_file *) set->entries[i];
+        if (z != NULL && set->hashes[i] == hash && z->dev == dev &&
+                z->ino == ino && z->format == format) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * true if z is a copy of the version of the file f
+ */
+static __inline int zc_is_version(const struct zc_file *z,
+        const struct fc_file *f) {
+    return z->src_size == f->size && z->mtime.tv_sec == f->mtime.tv_sec &&
+        z->mtime.tv_nsec == f->mtime.tv_nsec;
+}
+
+
+/*
+ * creates a file with no name to hold a compressed copy
+ *
+ * returns its descriptor, or -1 on failure
+ */
+static int zc_anon_file() {
+#ifdef __linux__
+    return memfd_create("zcache", MFD_CLOEXEC);
+#elif __APPLE__
+    char path[] = "/tmp/zcache.XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd != -1) {
+        unlink(path);
+    }
+    return fd;
+#endif
+}
+
+/*
+ * compresses the file f into a new anonymous file a chunk at a time, which
+ * becomes the copy z unless f did not get any smaller or the copy does not
+ * fit in the budget, and marks z done either way
+ *
+ * returns 1 if z is to stay in the cache, holding either the copy or the fact
+ * that f does not compress, and 0 if it failed for a reason which may not
+ * hold next time, so f is to be tried again
+ */
+static int zc_compress(struct zcache *cache, struct zc_file *z,
+        const struct fc_file *f) {
+    unsigned char in[ZC_CHUNK], out[ZC_CHUNK];
+    z_stream zs;
+    int64_t off = 0;
+    ssize_t n;
+    size_t len;
+    int fd, flush, ok = 1, keep = 0;
+
+    fd = zc_anon_file();
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create file to compress %s into, "
+                "reason: %s\n", f->path, strerror(errno));
+        goto done;
+    }
+
+    memset(&zs, 0, sizeof(z_stream));
+    // a window of 2^15 bytes, with a gzip header and trailer added to it for
+    // gzip
+    if (deflateInit2(&zs, cache->level, Z_DEFLATED,
+                (z->format == ZC_GZIP) ? 15 + 16 : 15, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Unable to initialize zlib to compress %s\n",
+                f->path);
+        close(fd);
+        fd = -1;
+        goto done;
+    }
+
+    do {
+        n = pread(f->fd, in, MIN((int64_t) sizeof(in), f->size - off), off);
+        if (n < 0 || (n == 0 && off < f->size)) {
+            // truncated under us. The change drops f from the file cache, and
+            // the next version gets a copy of its own
+            ok = 0;
+            break;
+        }
+        off += n;
+        zs.next_in = in;
+        zs.avail_in = n;
+        flush = (off == f->size) ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            deflate(&zs, flush);
+            len = sizeof(out) - zs.avail_out;
+            if (len > 0 && write(fd, out, len) != (ssize_t) len) {
+                fprintf(stderr, "Unable to write compressed %s, reason: %s\n",
+                        f->path, strerror(errno));
+                ok = 0;
+            }
+        } while (ok && zs.avail_out == 0);
+
+        if ((int64_t) zs.total_out >= f->size) {
+            // not worth sending compressed
+            __atomic_fetch_add(&cache->n_incompressible, 1, __ATOMIC_RELAXED);
+            keep = 1;
+            ok = 0;
+        }
+    } while (ok && flush != Z_FINISH);
+    deflateEnd(&zs);
+
+    if (ok && __atomic_add_fetch(&cache->n_bytes, zs.total_out,
+                __ATOMIC_RELAXED) > cache->max_bytes) {
+        __atomic_sub_fetch(&cache->n_bytes, zs.total_out, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->n_refused, 1, __ATOMIC_RELAXED);
+        ok = 0;
+    }
+    if (!ok) {
+        close(fd);
+        fd = -1;
+        goto done;
+    }
+
+    __atomic_fetch_add(&cache->n_compressed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->bytes_in, f->size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->bytes_out, zs.total_out, __ATOMIC_RELAXED);
+    z->size = zs.total_out;
+    keep = 1;
+
+done:
+    z->fd = fd;
+    __atomic_store_n(&z->done, 1, __ATOMIC_RELEASE);
+    return keep;
+}
+
+
+/*
+ * takes z out of the cache, if it is still there
+ */
+static void zc_remove(struct zcache *cache, struct zc_file *z) {
+    struct sa_set *set;
+    int found = 0;
+
+    set = sa_lock_set(&cache->table, z->hash);
+    for (int i = 0; i < SA_WAYS; i++) {
+        if (set->entries[i] == z) {
+            set->entries[i] = NULL;
+            found = 1;
+        }
+    }
+    sa_unlock(set);
+
+    if (found) {
+        zc_release(z);
+    }
+}
+
+/*
+ * compresses the files queued by zc_get until stopped by zc_free
+ */
+static void* zc_compressor(void *arg) {
+    struct zcache *cache = (struct zcache *) arg;
+    struct zc_job job;
+
+    pthread_mutex_lock(&cache->lock);
+    while (1) {
+        while (cache->n_jobs == 0 && !cache->stop) {
+            pthread_cond_wait(&cache->cond, &cache->lock);
+        }
+        if (cache->stop) {
+            break;
+        }
+        job = cache->queue[cache->head];
+        cache->head = (cache->head + 1) % ZC_QUEUE_SIZE;
+        cache->n_jobs--;
+        pthread_mutex_unlock(&cache->lock);
+
+        if (!zc_compress(cache, job.z, job.f)) {
+            zc_remove(cache, job.z);
+        }
+        __atomic_fetch_add(&cache->n_deferred, 1, __ATOMIC_RELAXED);
+        zc_release(job.z);
+        fc_release(job.f);
+
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+/*
+ * queues z to be made from f by the compressor, with references to both
+ *
+ * returns 0 on success and -1 if the queue is full
+ */
+static int zc_enqueue(struct zcache *cache, struct zc_file *z,
+        struct fc_file *f) {
+    struct zc_job *job;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->n_jobs == ZC_QUEUE_SIZE || cache->stop) {
+        pthread_mutex_unlock(&cache->lock);
+        return -1;
+    }
+    job = &cache->queue[(cache->head + cache->n_jobs) % ZC_QUEUE_SIZE];
+    __atomic_fetch_add(&z->refs, 1, __ATOMIC_RELAXED);
+    fc_ref(f);
+    job->z = z;
+    job->f = f;
+    cache->n_jobs++;
+    pthread_cond_signal(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+
+int zc_init(struct zcache *cache, unsigned n_entries, size_t max_bytes,
+        int level, size_t min_size, size_t inline_size) {
+    memset(cache, 0, sizeof(struct zcache));
+    cache->level = level;
+    cache->min_size = min_size;
+    cache->inline_size = inline_size;
+    cache->max_bytes = max_bytes;
+
+    if (sa_init(&cache->table, n_entries) != 0) {
+        fprintf(stderr, "Unable to malloc compressed file cache of %u "
+                "entries\n", n_entries);
+        return -1;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    if (pthread_create(&cache->compressor, NULL, &zc_compressor, cache) != 0) {
+        fprintf(stderr, "Unable to start compressor thread\n");
+        pthread_cond_destroy(&cache->cond);
+        pthread_mutex_destroy(&cache->lock);
+        sa_free(&cache->table);
+        return -1;
+    }
+    return 0;
+}
+
+void zc_free(struct zcache *cache) {
+    struct zc_file *dropped[SA_WAYS];
+    struct sa_set *set;
+    int n;
+
+    if (cache->table.sets == NULL) {
+        return;
+    }
+
+    // the compressor finishes the file it is on first
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    pthread_cond_signal(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->compressor, NULL);
+
+    for (; cache->n_jobs > 0; cache->n_jobs--) {
+        zc_release(cache->queue[cache->head].z);
+        fc_release(cache->queue[cache->head].f);
+        cache->head = (cache->head + 1) % ZC_QUEUE_SIZE;
+    }
+
+    for (unsigned s = 0; s <= cache->table.set_mask; s++) {
+        set = &cache->table.sets[s];
+        n = 0;
+        for (int i = 0; i < SA_WAYS; i++) {
+            if (set->entries[i] != NULL) {
+                dropped[n++] = (struct zc_file *) set->entries[i];
+                set->entries[i] = NULL;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            zc_release(dropped[i]);
+        }
+    }
+
+    pthread_cond_destroy(&cache->cond);
+    pthread_mutex_destroy(&cache->lock);
+    sa_free(&cache->table);
+}
+
+
+/*
+ * puts the copy z in the cache in place of any copy of an older version of
+ * the same file, unless another thread has cached the same version in the
+ * meantime
+ *
+ * returns 1 if z was cached and 0 if not
+ */
+static int zc_insert(struct zcache *cache, struct zc_file *z) {
+    struct sa_set *set;
+    struct zc_file *victim;
+    int way;
+
+    set = sa_lock_set(&cache->table, z->hash);
+    way = zc_find(set, z->hash, z->dev, z->ino, z->format);
+    if (way == -1) {
+        way = sa_victim(set);
+    }
+    else {
+        victim = (struct zc_file *) set->entries[way];
+        if (victim->src_size == z->src_size &&
+                victim->mtime.tv_sec == z->mtime.tv_sec &&
+                victim->mtime.tv_nsec == z->mtime.tv_nsec) {
+            sa_unlock(set);
+            return 0;
+        }
+    }
+
+    // the cache holds a reference of its own
+    __atomic_fetch_add(&z->refs, 1, __ATOMIC_RELAXED);
+    victim = (struct zc_file *) sa_put(set, way, z, z->hash);
+    sa_unlock(set);
+
+    if (victim != NULL) {
+        zc_release(victim);
+    }
+    return 1;
+}
+
+struct zc_file* zc_get(struct zcache *cache, struct fc_file *f,
+        unsigned format) {
+    struct sa_set *set;
+    struct zc_file *z;
+    uint32_t hash;
+    int way;
+
+    if (f->size < (int64_t) cache->min_size) {
+        return NULL;
+    }
+
+    hash = zc_hash(f->dev, f->ino, format);
+    set = sa_lock_set(&cache->table, hash);
+    set->clock++;
+    way = zc_find(set, hash, f->dev, f->ino, format);
+    if (way != -1 && zc_is_version((struct zc_file *) set->entries[way], f)) {
+        z = (struct zc_file *) set->entries[way];
+        set->last_use[way] = set->clock;
+        if (!__atomic_load_n(&z->done, __ATOMIC_ACQUIRE) || z->fd == -1) {
+            // still being compressed, or not worth compressing
+            z = NULL;
+        }
+        else {
+            __atomic_fetch_add(&z->refs, 1, __ATOMIC_RELAXED);
+            set->hits[ZC_HITS]++;
+        }
+        sa_unlock(set);
+        return z;
+    }
+    sa_unlock(set);
+    __atomic_fetch_add(&cache->n_misses, 1, __ATOMIC_RELAXED);
+
+    z = (struct zc_file *) malloc(sizeof(struct zc_file));
+    if (z == NULL) {
+        fprintf(stderr, "Unable to malloc compressed copy of %s\n", f->path);
+        return NULL;
+    }
+    z->fd = -1;
+    z->refs = 1;
+    z->done = 0;
+    z->format = format;
+    z->size = 0;
+    z->dev = f->dev;
+    z->ino = f->ino;
+    z->src_size = f->size;
+    z->mtime = f->mtime;
+    z->hash = hash;
+    z->cache = cache;
+
+    if (f->size <= (int64_t) cache->inline_size) {
+        // small enough to compress right away. The copy is cached even if it
+        // did not compress, so it is not tried again, but not if it only
+        // failed for lack of room
+        if (zc_compress(cache, z, f)) {
+            zc_insert(cache, z);
+        }
+        if (z->fd == -1) {
+            zc_release(z);
+            z = NULL;
+        }
+        return z;
+    }
+
+    // the entry marks the file as being compressed, so it is only queued once
+    if (zc_insert(cache, z) && zc_enqueue(cache, z, f) != 0) {
+        zc_remove(cache, z);
+        __atomic_fetch_add(&cache->n_dropped, 1, __ATOMIC_RELAXED);
+    }
+    zc_release(z);
+    return NULL;
+}
+
+void zc_release(struct zc_file *z) {
+    if (__atomic_sub_fetch(&z->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (z->fd != -1) {
+            close(z->fd);
+            __atomic_sub_fetch(&z->cache->n_bytes, z->size, __ATOMIC_RELAXED);
+        }
+        free(z);
+    }
+}
+
+unsigned long zc_hits(const struct zcache *cache) {
+    return sa_hits(&cache->table, ZC_HITS);
+}
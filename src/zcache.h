@@ -0,0 +1,163 @@
+/*
+ * Compressed file cache
+ *
+ * Keeps gzip or deflate compressed copies of files of the file cache, each in
+ * an anonymous file of its own so that it can be sent like any other file.
+ * Copies are keyed by the identity of the file (its device and inode) and by
+ * its size and modification time, so every version of a file is compressed
+ * only once, however often it is dropped from the file cache and reopened, and
+ * a new version takes the place of the old one's copy. Entries are refcounted
+ * like those of the file cache, so a copy is only closed once the last
+ * response sending it is done.
+ *
+ * Files of up to inline_size bytes are compressed by the caller of zc_get, a
+ * chunk at a time. Larger ones are queued for a thread started by zc_init,
+ * which compresses them the same way while the caller goes on without the
+ * copy, so no event loop waits on them. Files smaller than min_size, and those
+ * which don't get any smaller, are never compressed. The copies share a budget
+ * of bytes, past which new copies are thrown away, leaving nothing cached for
+ * their file so that it is compressed again once there is room.
+ *
+ * The copies are kept in a set-associative table (see setassoc.h), keyed by
+ * the hash of the identity of their file and their format
+ */
+#ifndef _ZCACHE_H
+#define _ZCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "fcache.h"
+#include "setassoc.h"
+#include "util.h"
+
+// number of large files which may wait to be compressed at once
+#define ZC_QUEUE_SIZE 64
+
+// size of the chunks files are read and compressed in
+#define ZC_CHUNK 32768
+
+// formats of the compressed copies
+#define ZC_GZIP    0
+#define ZC_DEFLATE 1
+
+
+struct zc_file {
+    // descriptor of the anonymous file holding the compressed copy, or -1 if
+    // the file is still being compressed or did not compress
+    int fd;
+    // number of references held, one by the cache while the copy is in it,
+    // one by the compressor while compressing it, and one by each request
+    // using it
+    unsigned refs;
+    // set once compression has finished, successfully or not
+    unsigned char done;
+    // ZC_GZIP or ZC_DEFLATE
+    unsigned char format;
+
+    // the size of the copy in bytes
+    int64_t size;
+
+    // identity and version of the file it is a copy of
+    dev_t dev;
+    ino_t ino;
+    int64_t src_size;
+    struct timespec mtime;
+
+    uint32_t hash;
+    // the cache the copy was made by
+    struct zcache *cache;
+};
+
+// a large file waiting for the compressor, whose reference to both it holds
+struct zc_job {
+    struct zc_file *z;
+    struct fc_file *f;
+};
+
+struct zcache {
+    // of zc_files, whose sets count the lookups which found a finished copy
+    struct sa_table table;
+
+    // zlib compression level the copies are made with
+    int level;
+    // size of the smallest file compressed, and of the largest compressed by
+    // the caller of zc_get rather than by the compressor
+    size_t min_size;
+    size_t inline_size;
+
+    // number of bytes of compressed copies which may be kept, and how many are
+    size_t max_bytes;
+    size_t n_bytes;
+
+    // ring of files waiting to be compressed by the compressor thread, all
+    // guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct zc_job queue[ZC_QUEUE_SIZE];
+    unsigned head;
+    unsigned n_jobs;
+    int stop;
+    pthread_t compressor;
+
+    // number of lookups which found no copy of the version asked for
+    unsigned long n_misses;
+    // number of files compressed, and how many of those were compressed by
+    // the compressor
+    unsigned long n_compressed;
+    unsigned long n_deferred;
+    // number of files which did not get smaller, of copies thrown away for
+    // going over the budget, and of large files not compressed for the queue
+    // being full
+    unsigned long n_incompressible;
+    unsigned long n_refused;
+    unsigned long n_dropped;
+    // number of bytes read from files to compress them, and written to copies
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+};
+
+
+/*
+ * initializes a cache of at least n_entries compressed copies, taking up to
+ * max_bytes, made with the zlib compression level (1-9) of files of at least
+ * min_size bytes, and starts the thread compressing those of more than
+ * inline_size bytes
+ *
+ * returns 0 on success and -1 on failure
+ */
+int zc_init(struct zcache *cache, unsigned n_entries, size_t max_bytes,
+        int level, size_t min_size, size_t inline_size);
+
+/*
+ * stops the compressor and drops every copy of the cache. Copies still
+ * referenced are closed once they are released. It is safe to free a zeroed
+ * cache
+ */
+void zc_free(struct zcache *cache);
+
+/*
+ * gives the copy of the version of the file f opened by the file cache
+ * compressed in the given format, compressing it first if it is small, or
+ * else queueing it to be compressed
+ *
+ * returns the copy with a reference taken, to be given back with zc_release,
+ * or NULL if there is none yet, or won't ever be
+ */
+struct zc_file* zc_get(struct zcache *cache, struct fc_file *f,
+        unsigned format);
+
+/*
+ * gives back a reference taken by zc_get, closing the copy if it was the last
+ * one
+ */
+void zc_release(struct zc_file *z);
+
+/*
+ * sums the hits of zc_get
+ */
+unsigned long zc_hits(const struct zcache *cache);
+
+#endif /* _ZCACHE_H */
@@ -10,6 +10,7 @@
 
 #include "../src/vprint.h"
 #include "../src/dmsg.h"
+#include "../src/util.h"
 
 //#define VERBOSE
 #include "t_assert.h"
@@ -135,6 +136,31 @@ int main() {
         
     }
 
+    // test with a user-supplied first node
+    {
+        char msg1[] = "test message 1!";
+        char first[4];
+
+        assert_neq(dmsg_init_buf(&list, first, 3), 0);
+        assert(dmsg_init_buf(&list, first, sizeof(first)), 0);
+
+        assert(list.len, 0);
+        assert(list.list_size, 1);
+        assert((long) list.list[0].msg, (long) first);
+
+        announce(dmsg_append(&list, msg1, sizeof(msg1) - 1));
+        v_ensure(dmsg_print(&list, STDERR_FILENO));
+
+        assert(list.len, sizeof(msg1) - 1);
+        assert(list.list_size, 3);
+        assert(memcmp(msg1, first, sizeof(first)), 0);
+
+        test_write_read(&list);
+
+        // must only free the nodes allocated by the list
+        dmsg_free(&list);
+    }
+
     {
 #define SIZE 1024
         char *msg = (char*) malloc(SIZE + 1);
@@ -459,6 +485,80 @@ int main() {
         }
 #undef SIZE
 
+        // test dmsg_peek
+        for (int i = 2; i <= 8; i *= 2) {
+            assert(dmsg_init2(&list, i), 0);
+            assert(dmsg_append(&list, msg2, sizeof(msg2) - 1), 0);
+
+            char *data;
+            size_t len, off = 0;
+
+            // each peek gives the rest of one node, without moving the
+            // offset pointer
+            assert(dmsg_peek(&list, &len) == list.list[0].msg, 1);
+            assert(len, i);
+            assert(dmsg_peek(&list, &len) == list.list[0].msg, 1);
+
+            while ((data = dmsg_peek(&list, &len)) != NULL) {
+                assert(len > 0, 1);
+                assert(memcmp(data, msg2 + off, len), 0);
+                off += len;
+                assert(dmsg_seek(&list, len, SEEK_CUR), 0);
+            }
+            assert(off, sizeof(msg2) - 1);
+            assert(len, 0);
+
+            // from the middle of a node
+            assert(dmsg_seek(&list, 1, SEEK_SET), 0);
+            data = dmsg_peek(&list, &len);
+            assert(len, i - 1);
+            assert(memcmp(data, msg2 + 1, len), 0);
+
+            dmsg_free(&list);
+        }
+
+        // test dmsg_peek_at and views
+        for (int i = 2; i <= 8; i *= 2) {
+            assert(dmsg_init2(&list, i), 0);
+            assert(dmsg_append(&list, msg2, sizeof(msg2) - 1), 0);
+            assert(dmsg_seek(&list, 1, SEEK_SET), 0);
+
+            char *data, buf[sizeof(msg2)];
+            const char *tok;
+            dmsg_view view;
+            size_t len;
+
+            // peeking at 0 is the same as dmsg_peek
+            assert(dmsg_peek_at(&list, 0, &len) == dmsg_peek(&list, &len), 1);
+
+            // the first byte of the second node
+            data = dmsg_peek_at(&list, i - 1, &len);
+            assert(data == list.list[1].msg, 1);
+            assert(len, MIN(2 * i, sizeof(msg2) - 1 - i));
+            assert(dmsg_peek_at(&list, sizeof(msg2) - 2, &len) == NULL, 1);
+            assert(len, 0);
+
+            // every run of bytes after the offset pointer, which is looked
+            // at in place if it lies in one node
+            for (size_t off = 0; off < sizeof(msg2) - 2; off++) {
+                for (len = 0; off + len <= sizeof(msg2) - 2; len++) {
+                    assert(dmsg_view_at(&list, off, len, &view), 0);
+                    assert(view.len, len);
+                    tok = dmsg_view_data(&list, &view, buf);
+                    assert(memcmp(tok, msg2 + 1 + off, len), 0);
+                    if (tok == buf) {
+                        // only copied when it spans nodes
+                        assert(view.off + len >
+                                ((size_t) i << view.node), 1);
+                    }
+                }
+            }
+            assert(dmsg_view_at(&list, 1, sizeof(msg2) - 2, &view),
+                    DMSG_SEEK_OVERFLOW);
+
+            dmsg_free(&list);
+        }
+
     }
 
     fprintf(stderr, P_GREEN "All dmsg_list tests passed" P_RESET "\n");
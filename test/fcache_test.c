@@ -0,0 +1,271 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "t_assert.h"
+
+#include "../src/fcache.h"
+#include "../src/vprint.h"
+
+
+static char root[] = "/tmp/fcache_test.XXXXXX";
+
+
+static void write_file(const char *path, const char *contents) {
+    char fullpath[sizeof(root) + 64];
+    int fd;
+
+    sprintf(fullpath, "%s%s", root, path);
+    fd = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1, 1);
+    assert(write(fd, contents, strlen(contents)), (ssize_t) strlen(contents));
+    close(fd);
+}
+
+static void remove_file(const char *path) {
+    char fullpath[sizeof(root) + 64];
+
+    sprintf(fullpath, "%s%s", root, path);
+    remove(fullpath);
+}
+
+/*
+ * gives the watcher up to a second to drop path from the cache
+ *
+ * returns 1 if it was dropped and 0 if not
+ */
+static int wait_dropped(struct fcache *cache, const char *path) {
+    struct timespec ts = { 0, 10000000 };
+    struct fc_file *f;
+
+    for (int i = 0; i < 100; i++) {
+        f = fc_lookup(cache, path, strlen(path));
+        if (f == NULL) {
+            return 1;
+        }
+        fc_release(f);
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+/*
+ * waits for the watcher to see no changes for a while, so that a file opened
+ * next is cached
+ */
+static void wait_quiet(struct fcache *cache) {
+    struct timespec ts = { 0, 20000000 };
+    unsigned gen;
+
+    do {
+        gen = __atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE);
+        nanosleep(&ts, NULL);
+    } while (gen != __atomic_load_n(&cache->gen, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * opens path, which is expected not to be cached yet
+ */
+static struct fc_file* open_new(struct fcache *cache, const char *path,
+        unsigned tag) {
+    assert(fc_lookup(cache, path, strlen(path)) == NULL, 1);
+    return fc_open(cache, path, strlen(path), tag);
+}
+
+
+int main(int argc, char *argv[]) {
+    struct fcache cache;
+    struct fc_file *f, *g, *h;
+    unsigned long n_hits, n_data_hits;
+    unsigned tag;
+    const char *data;
+    char *reserved;
+    size_t len;
+    char buf[16];
+    char sub[sizeof(root) + 8];
+
+    assert(mkdtemp(root) != NULL, 1);
+    sprintf(sub, "%s/sub", root);
+    assert(mkdir(sub, 0755), 0);
+
+    write_file("/a.html", "hello");
+    write_file("/sub/b.css", "body {}");
+    write_file("/sub/d.json", "{}");
+    write_file("/new.txt", "new");
+
+    assert(fc_init(&cache, root, 1000, 64), 0);
+    assert((cache.table.set_mask + 1) * SA_WAYS >= 1000, 1);
+    assert(((uintptr_t) cache.table.sets) % CACHE_LINE, 0);
+    assert(sizeof(struct sa_set), CACHE_LINE);
+
+    // opened once, then shared
+    f = open_new(&cache, "/a.html", 7);
+    assert(f != NULL, 1);
+    assert(f->fd != -1, 1);
+    assert(f->size, 5);
+    assert(f->tag, 7);
+    assert(f->refs, 2);
+    g = fc_lookup(&cache, "/a.html", 7);
+    assert(g == f, 1);
+    assert(f->refs, 3);
+    fc_release(g);
+    assert(pread(f->fd, buf, sizeof(buf), 0), 5);
+
+    // only the whole path matches
+    assert(fc_lookup(&cache, "/a.htm", 6) == NULL, 1);
+    assert(fc_lookup(&cache, "/a.html", 6) == NULL, 1);
+
+    // missing files and directories are cached with no descriptor
+    g = open_new(&cache, "/missing.html", 0);
+    assert(g != NULL, 1);
+    assert(g->fd, -1);
+    fc_release(g);
+    g = fc_lookup(&cache, "/missing.html", 13);
+    assert(g != NULL, 1);
+    assert(g->fd, -1);
+    fc_release(g);
+    g = open_new(&cache, "/sub", 0);
+    assert(g->fd, -1);
+    fc_release(g);
+    // as are files in directories which don't exist, though those can't be
+    // watched, so are not kept
+    g = open_new(&cache, "/nodir/c.js", 0);
+    assert(g->fd, -1);
+    fc_release(g);
+    assert(fc_lookup(&cache, "/nodir/c.js", 11) == NULL, 1);
+
+    // creating a missing file drops its entry
+    write_file("/missing.html", "now here");
+    assert(wait_dropped(&cache, "/missing.html"), 1);
+    g = open_new(&cache, "/missing.html", 0);
+    assert(g->fd != -1, 1);
+    assert(g->size, 8);
+    fc_release(g);
+
+    // as does writing to a file, and the requests still holding it can keep
+    // using the old descriptor
+    g = open_new(&cache, "/sub/b.css", 4);
+    assert(g->size, 7);
+    write_file("/sub/b.css", "body { margin: 0; }");
+    assert(wait_dropped(&cache, "/sub/b.css"), 1);
+    assert(g->refs, 1);
+    assert(pread(g->fd, buf, sizeof(buf), 0), sizeof(buf));
+    fc_release(g);
+    g = open_new(&cache, "/sub/b.css", 4);
+    assert(g->size, 19);
+    fc_release(g);
+
+    // and deleting it
+    remove_file("/a.html");
+    assert(wait_dropped(&cache, "/a.html"), 1);
+    fc_release(f);
+    f = open_new(&cache, "/a.html", 7);
+    assert(f->fd, -1);
+    fc_release(f);
+    assert(cache.n_invalidations >= 3, 1);
+
+    // a file named like a cached one with an extension added is one of its
+    // variants, and creating it drops the cached file too
+    f = fc_lookup(&cache, "/sub/b.css", 10);
+    assert(f != NULL, 1);
+    fc_release(f);
+    write_file("/sub/b.css.gz", "gzipped");
+    assert(wait_dropped(&cache, "/sub/b.css"), 1);
+    // but not files which only share a prefix with it
+    wait_quiet(&cache);
+    fc_release(open_new(&cache, "/sub/b.css", 4));
+    write_file("/sub/b.cs", "not a variant");
+    wait_quiet(&cache);
+    f = fc_lookup(&cache, "/sub/b.css", 10);
+    assert(f != NULL, 1);
+    fc_release(f);
+
+    // data is attached by the first to reserve it, and only within budget
+    wait_quiet(&cache);
+    g = open_new(&cache, "/sub/d.json", 4);
+    assert(fc_data(g, &len, &tag) == NULL, 1);
+    reserved = fc_reserve(&cache, g, 40);
+    assert(reserved != NULL, 1);
+    assert(fc_reserve(&cache, g, 40) == NULL, 1);
+    memcpy(reserved, "0123456789012345678901234567890123456789", 40);
+    fc_attach(g, reserved, 40, 3);
+    data = fc_data(g, &len, &tag);
+    assert(data == reserved, 1);
+    assert(len, 40);
+    assert(tag, 3);
+    h = open_new(&cache, "/new.txt", 0);
+    assert(fc_reserve(&cache, h, 40) == NULL, 1);
+    assert(cache.n_refused, 1);
+    f = fc_lookup(&cache, "/sub/d.json", 11);
+    assert(f == g, 1);
+    fc_release(f);
+    fc_release(g);
+
+    fc_stats(&cache, &n_hits, &n_data_hits);
+    assert(n_hits > 0, 1);
+    assert(n_data_hits, 1);
+    assert(cache.n_misses > 0, 1);
+    assert(cache.n_attached, 1);
+
+    // the data is freed along with the file once it changes
+    assert(cache.n_data, 40);
+    remove_file("/sub/d.json");
+    assert(wait_dropped(&cache, "/sub/d.json"), 1);
+    assert(cache.n_data, 0);
+
+    // which makes room for the file refused before, and data given back
+    // unattached may be reserved again
+    reserved = fc_reserve(&cache, h, 40);
+    assert(reserved != NULL, 1);
+    fc_unreserve(h, reserved, 40);
+    assert(cache.n_data, 0);
+    reserved = fc_reserve(&cache, h, 40);
+    assert(reserved != NULL, 1);
+    fc_attach(h, reserved, 40, 0);
+    assert(cache.n_data, 40);
+    assert(cache.n_attached, 2);
+    fc_release(h);
+
+    fc_free(&cache);
+    // freeing twice is harmless
+    fc_free(&cache);
+
+    // with a single set, the least recently used file is evicted
+    write_file("/1", "1");
+    write_file("/2", "2");
+    write_file("/3", "3");
+    write_file("/4", "4");
+    assert(fc_init(&cache, root, SA_WAYS, 0), 0);
+    assert(cache.table.set_mask, 0);
+    fc_release(open_new(&cache, "/1", 0));
+    fc_release(open_new(&cache, "/2", 0));
+    fc_release(open_new(&cache, "/3", 0));
+    fc_release(fc_lookup(&cache, "/1", 2));
+    fc_release(open_new(&cache, "/4", 0));
+    assert(cache.n_evictions, 1);
+    assert(fc_lookup(&cache, "/2", 2) == NULL, 1);
+    f = fc_lookup(&cache, "/1", 2);
+    assert(f != NULL, 1);
+    fc_release(f);
+    fc_free(&cache);
+
+    remove_file("/1");
+    remove_file("/2");
+    remove_file("/3");
+    remove_file("/4");
+    remove_file("/missing.html");
+    remove_file("/new.txt");
+    remove_file("/sub/b.css");
+    remove_file("/sub/b.css.gz");
+    remove_file("/sub/b.cs");
+    rmdir(sub);
+    rmdir(root);
+
+    printf(P_GREEN "All fcache tests passed" P_RESET "\n");
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "t_assert.h"
+
+#include "../src/handoff.h"
+#include "../src/vprint.h"
+
+
+#define N_PRODUCERS 4
+#define N_PER_PRODUCER 20000
+
+static struct handoff_queue queue;
+
+
+/*
+ * pushes N_PER_PRODUCER connections tagged with the producer's id, waiting
+ * whenever the queue is full
+ */
+static void* produce(void *arg) {
+    int id = (int) (intptr_t) arg;
+    struct sockaddr_in sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = (in_port_t) id;
+    for (int i = 0; i < N_PER_PRODUCER; i++) {
+        while (hq_push(&queue, i, id, (struct sockaddr *) &sa) == -1) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+    pthread_t producers[N_PRODUCERS];
+    struct sockaddr_in sa, out;
+    int next[N_PRODUCERS] = { 0 };
+    int i, arg, connfd, n_popped;
+
+    assert(hq_init(&queue, 5), 0);
+    assert(queue.mask, 7);
+    assert(((uintptr_t) &queue.head) - ((uintptr_t) &queue.tail) >=
+            CACHE_LINE, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = 0x0100007f;
+
+    // empty
+    assert(hq_pop(&queue, &arg, (struct sockaddr *) &out), -1);
+    assert(hq_size(&queue), 0);
+
+    // connections come out in the order they were pushed, along with their
+    // arg and address, until the queue is full
+    for (i = 0; i < 8; i++) {
+        sa.sin_port = (in_port_t) i;
+        assert(hq_push(&queue, 10 + i, i & 1, (struct sockaddr *) &sa), 0);
+    }
+    assert(hq_size(&queue), 8);
+    assert(hq_push(&queue, 100, 0, (struct sockaddr *) &sa), -1);
+    for (i = 0; i < 5; i++) {
+        assert(hq_pop(&queue, &arg, (struct sockaddr *) &out), 10 + i);
+        assert(arg, i & 1);
+        assert(out.sin_addr.s_addr, 0x0100007f);
+        assert(out.sin_port, i);
+    }
+
+    // the slots freed by popping are reused on the next lap
+    for (i = 8; i < 13; i++) {
+        assert(hq_push(&queue, 10 + i, 0, (struct sockaddr *) &sa), 0);
+    }
+    assert(hq_push(&queue, 100, 0, (struct sockaddr *) &sa), -1);
+    for (i = 5; i < 13; i++) {
+        assert(hq_pop(&queue, &arg, (struct sockaddr *) &out), 10 + i);
+    }
+    assert(hq_pop(&queue, &arg, (struct sockaddr *) &out), -1);
+    assert(hq_size(&queue), 0);
+
+    hq_free(&queue);
+    // freeing twice is harmless
+    hq_free(&queue);
+
+    // with many producers, every connection is popped exactly once, and
+    // those of each producer in the order they were pushed
+    assert(hq_init(&queue, 64), 0);
+    for (i = 0; i < N_PRODUCERS; i++) {
+        assert(pthread_create(&producers[i], NULL, produce,
+                    (void *) (intptr_t) i), 0);
+    }
+    n_popped = 0;
+    while (n_popped < N_PRODUCERS * N_PER_PRODUCER) {
+        connfd = hq_pop(&queue, &arg, (struct sockaddr *) &out);
+        if (connfd == -1) {
+            sched_yield();
+            continue;
+        }
+        assert(arg >= 0 && arg < N_PRODUCERS, 1);
+        assert(out.sin_port, arg);
+        assert(connfd, next[arg]);
+        next[arg]++;
+        n_popped++;
+    }
+    for (i = 0; i < N_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+        assert(next[i], N_PER_PRODUCER);
+    }
+    assert(hq_pop(&queue, &arg, (struct sockaddr *) &out), -1);
+    hq_free(&queue);
+
+    printf(P_GREEN "All handoff tests passed" P_RESET "\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_assert.h"
+
+#include "../src/iptable.h"
+#include "../src/vprint.h"
+
+
+/*
+ * finds n_addrs distinct addresses which all hash to the same set as addr,
+ * by trying every address after it
+ */
+static void colliding_addrs(struct ip_table *table, uint32_t addr,
+        uint32_t *addrs, int n_addrs) {
+    uint32_t hash = addr * 0x9e3779b1U, h;
+    uint32_t set = (hash ^ (hash >> 16)) & table->set_mask;
+    int n = 0;
+
+    for (uint32_t a = addr + 1; n < n_addrs; a++) {
+        h = a * 0x9e3779b1U;
+        if (((h ^ (h >> 16)) & table->set_mask) == set) {
+            addrs[n++] = a;
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    struct ip_table table;
+    uint32_t addrs[IPT_WAYS + 1];
+    int i;
+
+    assert(ipt_init(&table, 1000, 2, 10, 5), 0);
+    assert((table.set_mask + 1) * IPT_WAYS >= 1000, 1);
+    assert(((uintptr_t) table.sets) % CACHE_LINE, 0);
+    assert(sizeof(struct ipt_set), CACHE_LINE);
+
+    // connection limit
+    assert(ipt_connect(&table, 0x0100007f, 0), IPT_OK);
+    assert(ipt_connect(&table, 0x0100007f, 0), IPT_OK);
+    assert(ipt_connect(&table, 0x0100007f, 0), IPT_LIMITED);
+    ipt_disconnect(&table, 0x0100007f);
+    assert(ipt_connect(&table, 0x0100007f, 0), IPT_OK);
+    assert(ipt_connect(&table, 0x0200007f, 0), IPT_OK);
+
+    // addresses which could not have come from a peer are not tracked
+    assert(ipt_connect(&table, 0, 0), IPT_UNTRACKED);
+    assert(table.n_untracked, 1);
+
+    // a full bucket allows a burst, after which requests are limited to the
+    // rate
+    for (i = 0; i < 5; i++) {
+        assert(ipt_request(&table, 0x0100007f, 1000), IPT_OK);
+    }
+    assert(ipt_request(&table, 0x0100007f, 1000), IPT_LIMITED);
+    // 10 per second is one every 100ms
+    assert(ipt_request(&table, 0x0100007f, 1050), IPT_LIMITED);
+    assert(ipt_request(&table, 0x0100007f, 1100), IPT_OK);
+    assert(ipt_request(&table, 0x0100007f, 1100), IPT_LIMITED);
+    // the bucket never holds more than the burst
+    for (i = 0; i < 5; i++) {
+        assert(ipt_request(&table, 0x0100007f, 100000), IPT_OK);
+    }
+    assert(ipt_request(&table, 0x0100007f, 100000), IPT_LIMITED);
+    // each address has its own bucket
+    assert(ipt_request(&table, 0x0200007f, 100000), IPT_OK);
+    // and addresses without an entry are not limited
+    assert(ipt_request(&table, 0x0300007f, 100000), IPT_OK);
+
+    ipt_free(&table);
+
+    // eviction
+    assert(ipt_init(&table, 1, 0, 1, 1), 0);
+    assert(table.set_mask, 0);
+    colliding_addrs(&table, 1, addrs, IPT_WAYS + 1);
+
+    for (i = 0; i < IPT_WAYS; i++) {
+        assert(ipt_connect(&table, addrs[i], i), IPT_OK);
+    }
+    // every entry has a connection open, so the next address is not tracked
+    assert(ipt_connect(&table, addrs[IPT_WAYS], 10), IPT_UNTRACKED);
+    assert(ipt_request(&table, addrs[IPT_WAYS], 10), IPT_OK);
+    assert(ipt_request(&table, addrs[IPT_WAYS], 10), IPT_OK);
+
+    // once closed, the entry idle the longest is taken over first
+    for (i = 0; i < IPT_WAYS; i++) {
+        ipt_disconnect(&table, addrs[i]);
+    }
+    assert(ipt_request(&table, addrs[0], 20), IPT_OK);
+    assert(ipt_connect(&table, addrs[IPT_WAYS], 30), IPT_OK);
+    assert(table.n_evictions, 1);
+    assert(ipt_request(&table, addrs[0], 30), IPT_LIMITED);
+    assert(ipt_request(&table, addrs[1], 30), IPT_OK);
+    assert(ipt_request(&table, addrs[IPT_WAYS], 30), IPT_OK);
+    assert(ipt_request(&table, addrs[IPT_WAYS], 30), IPT_LIMITED);
+
+    ipt_free(&table);
+    // freeing twice is harmless
+    ipt_free(&table);
+
+    printf(P_GREEN "All iptable tests passed" P_RESET "\n");
+    return 0;
+}
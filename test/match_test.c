@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,6 +14,41 @@
 #include "../src/pattern/match.h"
 
 
+#define N_MATCH_THREADS 4
+#define N_THREAD_MATCHES 2000
+
+
+/*
+ * matches a uri against the http header grammar passed in arg many times,
+ * alternating with a uri that fails to match, and returns the number of
+ * matches which did not turn out as expected
+ */
+static void* match_uris(void *arg) {
+    token_t *patt = (token_t*) arg;
+    match_t matches[6];
+    match_ctx_t ctx;
+    long n_wrong = 0;
+
+    match_ctx_init(&ctx);
+    for (int i = 0; i < N_THREAD_MATCHES; i++) {
+        if (pattern_match_ctx(&ctx, patt,
+                    "http://clayton@www.google.com/some/file/a.txt?var=1",
+                    6, matches) != 0 ||
+                matches[0].so != -1 ||
+                matches[1].so != 0 || matches[1].eo != 4 ||
+                matches[2].so != 29 || matches[2].eo != 45 ||
+                matches[3].so != -1 ||
+                matches[4].so != 7 || matches[4].eo != 29 ||
+                matches[5].so != 46 || matches[5].eo != 51) {
+            n_wrong++;
+        }
+        if (pattern_match(patt, "http://bad uri", 6, matches) != MATCH_FAIL) {
+            n_wrong++;
+        }
+    }
+    match_ctx_free(&ctx);
+    return (void*) n_wrong;
+}
 
 
 int main() {
@@ -853,6 +889,20 @@ int main() {
           //          6, matches), 0);
         assert(tmp_check(ret), 0);
 
+        // many threads matching the same pattern at once
+        pthread_t threads[N_MATCH_THREADS];
+        void *n_wrong;
+
+        for (int i = 0; i < N_MATCH_THREADS; i++) {
+            assert(pthread_create(&threads[i], NULL, match_uris, ret), 0);
+        }
+        for (int i = 0; i < N_MATCH_THREADS; i++) {
+            assert(pthread_join(threads[i], &n_wrong), 0);
+            assert((long) n_wrong, 0);
+        }
+        // the pattern is left untouched
+        assert(tmp_check(ret), 0);
+
         pattern_free(ret);
     }
 
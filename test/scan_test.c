@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "t_assert.h"
+
+#include "../src/dmsg.h"
+#include "../src/scan.h"
+#include "../src/util.h"
+#include "../src/vprint.h"
+
+
+#define MAX_LINE 274
+#define MAX_HEADER_SIZE 8192
+
+// number of times the request is tokenized by each parser in the benchmark,
+// and the number of rounds that is split into
+#define N_BENCH 200000
+#define BENCH_ROUNDS 40
+
+
+// what a browser typically sends
+static char request[] =
+    "GET /some/path/to/a/file.html?with=a&query=string HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+        "Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n";
+
+
+/*
+ * the delimiters of a line found one byte at a time, to check the scanner
+ * against
+ */
+static void reference_scan(const char *buf, size_t len,
+        struct scan_line *line) {
+    size_t i;
+
+    line->sp1 = line->sp2 = line->colon = line->nul = -1;
+    for (i = 0; i < len && buf[i] != '\n'; i++) {
+        if (buf[i] == ' ') {
+            if (line->sp1 == -1) {
+                line->sp1 = i;
+            }
+            else if (line->sp2 == -1) {
+                line->sp2 = i;
+            }
+        }
+        else if (buf[i] == ':' && line->colon == -1) {
+            line->colon = i;
+        }
+        else if (buf[i] == '\0' && line->nul == -1) {
+            line->nul = i;
+        }
+    }
+    line->len = i;
+}
+
+/*
+ * scans random lines with each byte being a delimiter with probability
+ * 1 / sparsity, checking the scanner against reference_scan
+ */
+static void check_random(int sparsity) {
+    static const char delims[] = { '\n', ' ', ':', '\0' };
+    struct scan_line line, expect;
+    char buf[300];
+    size_t len;
+    int i, ret;
+
+    for (int trial = 0; trial < 20000; trial++) {
+        len = rand() % sizeof(buf);
+        for (i = 0; i < (int) len; i++) {
+            buf[i] = (rand() % sparsity == 0) ? delims[rand() % 4] :
+                'a' + rand() % 26;
+        }
+        // scanning from an unaligned address
+        i = rand() % 8;
+        if (i > (int) len) {
+            i = len;
+        }
+
+        reference_scan(buf + i, len - i, &expect);
+        ret = scan_line(buf + i, len - i, &line);
+        assert(ret, (expect.len == len - i) ? -1 : 0);
+        assert(line.len, expect.len);
+        assert(line.sp1, expect.sp1);
+        assert(line.sp2, expect.sp2);
+        assert(line.colon, expect.colon);
+        assert(line.nul, expect.nul);
+    }
+}
+
+/*
+ * checks the ret lines scan_lines or scan_dmsg_lines gave, with room for n,
+ * against reference_scan of the len bytes at buf
+ */
+static void check_lines(const char *buf, size_t len,
+        const struct scan_line *lines, int n, int ret) {
+    struct scan_line expect;
+    size_t off = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        reference_scan(buf + off, len - off, &expect);
+        assert(lines[i].len, expect.len);
+        assert(lines[i].sp1, expect.sp1);
+        assert(lines[i].sp2, expect.sp2);
+        assert(lines[i].colon, expect.colon);
+        assert(lines[i].nul, expect.nul);
+        // only lines which run across nodes are not given in place
+        if (lines[i].data != NULL) {
+            assert(memcmp(lines[i].data, buf + off, expect.len), 0);
+        }
+        if (off + expect.len == len) {
+            // the unfinished line
+            assert(ret, i);
+            return;
+        }
+        off += expect.len + 1;
+        if (expect.len <= 1) {
+            // a blank line ends the scan
+            assert(ret, i + 1);
+            return;
+        }
+    }
+    assert(ret, n);
+}
+
+/*
+ * scans several random lines at once, checking scan_lines against
+ * reference_scan
+ */
+static void check_random_lines(int sparsity) {
+    static const char delims[] = { '\n', ' ', ':', '\0' };
+    struct scan_line lines[8];
+    char buf[300];
+    size_t len;
+    int i, n;
+
+    for (int trial = 0; trial < 20000; trial++) {
+        len = rand() % sizeof(buf);
+        for (i = 0; i < (int) len; i++) {
+            buf[i] = (rand() % sparsity == 0) ? delims[rand() % 4] :
+                'a' + rand() % 26;
+        }
+        n = 1 + rand() % 8;
+        check_lines(buf, len, lines, n, scan_lines(buf, len, lines, n));
+        assert(lines[0].data == buf, 1);
+    }
+}
+
+/*
+ * scans random lines stored across the nodes of a dmsg_list, checking
+ * scan_dmsg_line and scan_dmsg_lines against reference_scan over the same
+ * bytes
+ */
+static void check_random_dmsg(int sparsity) {
+    static const char delims[] = { '\n', ' ', ':', '\0' };
+    struct scan_line line, expect, lines[8];
+    char buf[300];
+    dmsg_list list;
+    size_t len, off, max;
+    int i, n, ret;
+
+    for (int trial = 0; trial < 5000; trial++) {
+        len = rand() % sizeof(buf);
+        for (i = 0; i < (int) len; i++) {
+            buf[i] = (rand() % sparsity == 0) ? delims[rand() % 4] :
+                'a' + rand() % 26;
+        }
+        // small nodes, so lines run across several of them
+        assert(dmsg_init2(&list, 4 << (rand() % 4)), 0);
+        assert(dmsg_append(&list, buf, len), 0);
+
+        off = rand() % 8;
+        if (off > len) {
+            off = len;
+        }
+        assert(dmsg_seek(&list, off, SEEK_SET), 0);
+        max = rand() % (len - off + 1);
+
+        reference_scan(buf + off, max, &expect);
+        ret = scan_dmsg_line(&list, max, &line);
+        assert(ret, (expect.len == max) ? -1 : 0);
+        assert(line.len, expect.len);
+        assert(line.sp1, expect.sp1);
+        assert(line.sp2, expect.sp2);
+        assert(line.colon, expect.colon);
+        assert(line.nul, expect.nul);
+
+        n = 1 + rand() % 8;
+        check_lines(buf + off, max, lines, n,
+                scan_dmsg_lines(&list, max, lines, n));
+
+        dmsg_free(&list);
+    }
+}
+
+
+/*
+ * tokenizes every line of the request in list the way http_parse used to,
+ * copying each one out with dmsg_getline and splitting it with strchr
+ *
+ * returns the number of "Connection: keep-alive" headers found
+ */
+static int tokenize_strchr(dmsg_list *list) {
+    char buf[MAX_LINE], *sp1, *sp2, *colon;
+    int n_keep_alive = 0;
+    size_t len;
+
+    len = dmsg_getline(list, buf, sizeof(buf));
+    sp1 = strchr(buf, ' ');
+    sp2 = strchr(sp1 + 1, ' ');
+    *sp1 = *sp2 = '\0';
+    if (strcmp(buf, "GET") != 0 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+
+    while ((len = dmsg_getline(list, buf, sizeof(buf))) > 0) {
+        if (strcmp(buf, "\r") == 0) {
+            break;
+        }
+        buf[len - 2] = '\0';
+        colon = strchr(buf, ':');
+        *colon = '\0';
+        if (strcmp(buf, "Connection") == 0 &&
+                strcmp(colon + 2, "keep-alive") == 0) {
+            n_keep_alive++;
+        }
+    }
+    return n_keep_alive;
+}
+
+/*
+ * gives the len bytes off bytes into line, which starts at the offset pointer
+ * of list, the way http.c's line_token does
+ */
+static const char* line_token(const dmsg_list *list,
+        const struct scan_line *line, size_t off, size_t len, char *buf) {
+    dmsg_view view;
+
+    if (line->data != NULL) {
+        return line->data + off;
+    }
+    dmsg_view_at(list, off, len, &view);
+    return dmsg_view_data(list, &view, buf);
+}
+
+/*
+ * tokenizes every line of the request in list the way http_parse does,
+ * scanning a batch of lines in place at once and copying only the tokens
+ * which span more than one node
+ *
+ * returns the number of "Connection: keep-alive" headers found
+ */
+static int tokenize_scan(dmsg_list *list) {
+    char buf[MAX_HEADER_SIZE];
+    const char *tok;
+    struct scan_line lines[16], *line;
+    int n_keep_alive = 0, first = 1, n, i;
+
+    while ((n = scan_dmsg_lines(list, MAX_HEADER_SIZE, lines, 16)) > 0) {
+        for (i = 0; i < n; i++) {
+            line = &lines[i];
+            if (first) {
+                tok = line_token(list, line, 0, line->sp1, buf);
+                if (line->sp1 != 3 || memcmp(tok, "GET", 3) != 0) {
+                    return -1;
+                }
+                tok = line_token(list, line, line->sp2 + 1, 7, buf);
+                if (memcmp(tok, "HTTP/1.", 7) != 0) {
+                    return -1;
+                }
+                first = 0;
+            }
+            else if (line->len == 1) {
+                return n_keep_alive;
+            }
+            else if (line->colon == 10 && line->len - 13 == 10) {
+                tok = line_token(list, line, 0, line->len, buf);
+                if (memcmp(tok, "Connection", 10) == 0 &&
+                        memcmp(tok + 12, "keep-alive", 10) == 0) {
+                    n_keep_alive++;
+                }
+            }
+            dmsg_seek(list, line->len + 1, SEEK_CUR);
+        }
+    }
+    return n_keep_alive;
+}
+
+/*
+ * times tokenizing the request N_BENCH times, in BENCH_ROUNDS rounds, returning
+ * the average time taken per request in nanoseconds in the fastest round,
+ * which is the one least disturbed by whatever else the machine was doing
+ */
+static double bench(int (*tokenize)(dmsg_list*), dmsg_list *list) {
+    struct timespec t0, t1;
+    long t, best = -1;
+    int i;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < N_BENCH / BENCH_ROUNDS; i++) {
+            dmsg_seek(list, 0, SEEK_SET);
+            assert(tokenize(list), 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        t = timespec_diff_ns(&t1, &t0);
+        best = (best == -1) ? t : MIN(best, t);
+    }
+    return ((double) best) / (N_BENCH / BENCH_ROUNDS);
+}
+
+
+int main(int argc, char *argv[]) {
+    static const char * const names[] = {
+        "scalar", "SSE2", "AVX2", "memchr", "vector"
+    };
+    struct scan_line line;
+    char first_node[64];
+    dmsg_list list;
+    int impl;
+
+    srand(time(NULL));
+
+    scan_init();
+    printf("using the %s scanner\n", names[scan_get_impl()]);
+
+    for (impl = SCAN_SCALAR; impl < SCAN_N_IMPLS; impl++) {
+        if (scan_set_impl(impl) != 0) {
+            printf("%s scanner not supported\n", names[impl]);
+            continue;
+        }
+        assert(scan_get_impl(), impl);
+
+        // empty
+        assert(scan_line("", 0, &line), -1);
+        assert(line.len, 0);
+        assert(line.sp1, -1);
+
+        // a request line, which is longer than one vector
+        char req[] = "GET /a/long/enough/path/to/a/file.html HTTP/1.1\r\nX";
+        assert(scan_line(req, sizeof(req) - 1, &line), 0);
+        assert(line.len, sizeof(req) - 3);
+        assert(line.sp1, 3);
+        assert(line.sp2, 38);
+        assert(line.colon, -1);
+        assert(line.nul, -1);
+
+        // delimiters after the '\n' are not part of the line
+        char hdr[] = "Connection: keep-alive\r\n: :";
+        assert(scan_line(hdr, sizeof(hdr) - 1, &line), 0);
+        assert(line.len, 23);
+        assert(line.sp1, 11);
+        assert(line.sp2, -1);
+        assert(line.colon, 10);
+
+        // the first '\n' ends the line, even within the first vector
+        assert(scan_line("\r\n\r\n", 4, &line), 0);
+        assert(line.len, 1);
+
+        // only len bytes are looked at
+        assert(scan_line(hdr, 10, &line), -1);
+        assert(line.len, 10);
+        assert(line.colon, -1);
+
+        check_random(2);
+        check_random(16);
+        check_random(100);
+
+        check_random_lines(2);
+        check_random_lines(16);
+        check_random_lines(100);
+
+        // the lines of a request, up to the blank line which ends it
+        struct scan_line lines[16];
+        assert(scan_lines(request, sizeof(request) - 1, lines, 16), 9);
+        assert(lines[0].sp1, 3);
+        assert(lines[1].colon, 4);
+        assert(lines[8].len, 1);
+        // or as many as there is room for
+        assert(scan_lines(request, sizeof(request) - 1, lines, 2), 2);
+        assert(lines[1].len, 22);
+
+        check_random_dmsg(2);
+        check_random_dmsg(16);
+        check_random_dmsg(100);
+    }
+
+    // compare against the old way of splitting the lines, over a request
+    // received into a client's log
+    scan_init();
+    dmsg_init_buf(&list, first_node, sizeof(first_node));
+    assert(dmsg_append(&list, request, sizeof(request) - 1), 0);
+
+    printf("tokenizing a %lu byte request:\n", sizeof(request) - 1);
+    printf("\tdmsg_getline + strchr: %.1f ns\n",
+            bench(&tokenize_strchr, &list));
+    for (impl = SCAN_SCALAR; impl < SCAN_N_IMPLS; impl++) {
+        if (scan_set_impl(impl) == 0) {
+            printf("\t%s scan in place: %.1f ns\n", names[impl],
+                    bench(&tokenize_scan, &list));
+        }
+    }
+    dmsg_free(&list);
+
+    printf(P_GREEN "All scan tests passed" P_RESET "\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_assert.h"
+
+#include "../src/slab.h"
+#include "../src/vprint.h"
+
+
+#define OBJ_SIZE 200
+#define N_OBJS 4096
+
+static void *objs[N_OBJS];
+
+
+struct free_args {
+    struct slab *slab;
+    size_t begin, end;
+};
+
+/*
+ * frees a range of objects allocated by thread 0 from thread 1
+ */
+static void* remote_free_range(void *arg) {
+    struct free_args *args = (struct free_args *) arg;
+    size_t i;
+
+    for (i = args->begin; i < args->end; i++) {
+        slab_free(args->slab, 1, objs[i]);
+    }
+    return NULL;
+}
+
+static int is_obj(void *obj) {
+    size_t i;
+
+    for (i = 0; i < N_OBJS; i++) {
+        if (objs[i] == obj) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    struct slab slab;
+    struct free_args args;
+    pthread_t thread;
+    size_t i, j, n_chunks;
+    void *obj;
+
+    // too big to fit in a chunk
+    assert_neq(slab_init(&slab, SLAB_CHUNK_SIZE, 2), 0);
+
+    assert(slab_init(&slab, OBJ_SIZE, 2), 0);
+    assert(slab.slot_size % CACHE_LINE, 0);
+    assert(slab.slot_size >= OBJ_SIZE, 1);
+    assert(((uintptr_t) &slab.caches[1]) % CACHE_LINE, 0);
+
+    // objects are cache line aligned and never overlap
+    for (i = 0; i < N_OBJS; i++) {
+        objs[i] = slab_alloc(&slab, 0);
+        assert_neq((long) objs[i], (long) NULL);
+        assert(((uintptr_t) objs[i]) % CACHE_LINE, 0);
+        memset(objs[i], (int) (i & 0xff), OBJ_SIZE);
+    }
+    for (i = 0; i < N_OBJS; i++) {
+        for (j = 0; j < OBJ_SIZE; j++) {
+            assert(((unsigned char *) objs[i])[j], i & 0xff);
+        }
+    }
+    assert(slab.caches[0].n_chunks,
+            (N_OBJS + slab.slots_per_chunk - 1) / slab.slots_per_chunk);
+    assert(slab.caches[1].n_chunks, 0);
+    n_chunks = slab.caches[0].n_chunks;
+
+    // objects freed locally are handed right back out
+    slab_free(&slab, 0, objs[7]);
+    assert((long) slab_alloc(&slab, 0), (long) objs[7]);
+
+    // free half of the objects from another thread, which must not make them
+    // available to that thread's own cache
+    args.slab = &slab;
+    args.begin = 0;
+    args.end = N_OBJS / 2;
+    assert(pthread_create(&thread, NULL, remote_free_range, &args), 0);
+    pthread_join(thread, NULL);
+    assert(slab.caches[0].n_remote_frees, N_OBJS / 2);
+    assert((long) slab.caches[0].remote_free != (long) NULL, 1);
+
+    obj = slab_alloc(&slab, 1);
+    assert(is_obj(obj), 0);
+    slab_free(&slab, 1, obj);
+
+    // once its free list runs dry, the owner reclaims all remotely freed
+    // objects before growing. The rest of the last chunk comes first
+    while (slab.caches[0].free_list != NULL) {
+        slab_alloc(&slab, 0);
+    }
+    for (i = 0; i < N_OBJS / 2; i++) {
+        obj = slab_alloc(&slab, 0);
+        assert(is_obj(obj), 1);
+    }
+    assert(slab.caches[0].n_chunks, n_chunks);
+
+    // objects freed by a thread without a cache go back to their owner
+    slab_free(&slab, -1, objs[N_OBJS - 1]);
+    assert((long) slab.caches[0].remote_free, (long) objs[N_OBJS - 1]);
+
+    // pre-warming allocates enough chunks up front
+    slab_prewarm(&slab, 1, 3 * slab.slots_per_chunk + 1);
+    assert(slab.caches[1].n_chunks, 4);
+    for (i = 0; i < 3 * slab.slots_per_chunk; i++) {
+        slab_alloc(&slab, 1);
+    }
+    assert(slab.caches[1].n_chunks, 4);
+    slab_prewarm(&slab, 1, 10);
+    assert(slab.caches[1].n_chunks, 4);
+
+    slab_destroy(&slab);
+    // destroying twice is harmless
+    slab_destroy(&slab);
+
+    printf(P_GREEN "All slab tests passed" P_RESET "\n");
+    return 0;
+}
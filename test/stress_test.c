@@ -22,6 +22,15 @@
 
 #define NUM_CONNECTIONS 128
 
+// port of the server spawned for the keep-alive test
+#define KEEP_ALIVE_PORT "8089"
+// number of keep-alive connections, and of requests sent on each of them
+#define NUM_KEEP_ALIVE 16
+#define REQS_PER_CONNECTION 64
+// number of requests written all at once on one connection, which are then
+// pipelined
+#define NUM_PIPELINED 20
+
 
 volatile int ready;
 volatile int srvpid;
@@ -47,6 +56,182 @@ void sigint(int sig) {
 
 #undef exit
 
+
+/*
+ * sends a keep-alive request for a small file on fd and reads the whole
+ * response
+ *
+ * returns 0 on success and -1 if the response was not 200 OK
+ */
+static int request(int fd) {
+    static const char req[] =
+        "GET /test.txt HTTP/1.1\r\nConnection: keep-alive\r\n\r\n";
+    char buf[4096], *body, *len_hdr;
+    ssize_t n, len = 0;
+
+    if (write(fd, req, sizeof(req) - 1) != sizeof(req) - 1) {
+        return -1;
+    }
+
+    // read until the headers and the Content-Length bytes after them are in
+    while (len < sizeof(buf) - 1) {
+        n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0) {
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+
+        body = strstr(buf, "\r\n\r\n");
+        len_hdr = strstr(buf, "Content-Length: ");
+        if (body != NULL && len_hdr != NULL &&
+                len >= (body + 4 - buf) + strtol(len_hdr + 16, NULL, 10)) {
+            return strncmp(buf, "HTTP/1.1 200", 12) == 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * writes n keep-alive requests for a small file on fd all at once, then reads
+ * the n responses which come back to back
+ *
+ * returns 0 on success and -1 if any response was not 200 OK
+ */
+static int pipelined_requests(int fd, int n) {
+    static const char req[] =
+        "GET /test.txt HTTP/1.1\r\nConnection: keep-alive\r\n\r\n";
+    char reqs[NUM_PIPELINED * sizeof(req)], buf[4096], *body, *len_hdr;
+    ssize_t r, len = 0, resp_len;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(reqs + i * (sizeof(req) - 1), req, sizeof(req) - 1);
+    }
+    if (write(fd, reqs, n * (sizeof(req) - 1)) != n * (sizeof(req) - 1)) {
+        return -1;
+    }
+
+    for (i = 0; i < n; ) {
+        buf[len] = '\0';
+        body = strstr(buf, "\r\n\r\n");
+        len_hdr = strstr(buf, "Content-Length: ");
+        if (body != NULL && len_hdr != NULL && len_hdr < body &&
+                len >= (resp_len = (body + 4 - buf) +
+                    strtol(len_hdr + 16, NULL, 10))) {
+            // a whole response is in, so take it off the front
+            if (strncmp(buf, "HTTP/1.1 200", 12) != 0) {
+                return -1;
+            }
+            memmove(buf, buf + resp_len, len - resp_len);
+            len -= resp_len;
+            i++;
+            continue;
+        }
+
+        r = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (r <= 0) {
+            return -1;
+        }
+        len += r;
+    }
+    return 0;
+}
+
+/*
+ * gives the value of the server stat whose line begins with name, or -1 if
+ * it was not printed
+ */
+static double server_stat(const char *stats, const char *name) {
+    const char *line = strstr(stats, name);
+
+    return (line == NULL) ? -1 : strtod(line + strlen(name), NULL);
+}
+
+/*
+ * runs a server of our own, sends it keep-alive traffic and compares the
+ * number of event queue syscalls it made per request against what it would
+ * have made re-arming each connection after every event
+ */
+static void keep_alive_test(struct sockaddr_in *server) {
+    char *server_args[] = {"./srv", "-q", "-p", KEEP_ALIVE_PORT, NULL};
+    char *env_args[1] = {NULL};
+    char stats[8192], *rearms;
+    int cfds[NUM_KEEP_ALIVE], out[2];
+    double n_requests, n_wakeups, n_rearms, n_avoided, n_pipelined,
+           n_cache_hits, n_memory_hits;
+    ssize_t n, len = 0;
+    size_t i, j;
+
+    assert_neq(pipe(out), -1);
+    if ((srvpid = fork()) == 0) {
+        // capture the stats the server prints when it is shut down
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        execve("./srv", server_args, env_args);
+        return;
+    }
+    close(out[1]);
+    usleep(10000);
+
+    server->sin_port = htons(strtol(KEEP_ALIVE_PORT, NULL, 10));
+    for (i = 0; i < NUM_KEEP_ALIVE; i++) {
+        cfds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        assert_neq(connect(cfds[i], (struct sockaddr*) server,
+                    sizeof(struct sockaddr_in)), -1);
+    }
+    for (j = 0; j < REQS_PER_CONNECTION; j++) {
+        for (i = 0; i < NUM_KEEP_ALIVE; i++) {
+            assert(request(cfds[i]), 0);
+        }
+    }
+    // all but the first of these are read along with an earlier request
+    assert(pipelined_requests(cfds[0], NUM_PIPELINED), 0);
+    for (i = 0; i < NUM_KEEP_ALIVE; i++) {
+        close(cfds[i]);
+    }
+    usleep(10000);
+
+    kill(srvpid, SIGINT);
+    while ((n = read(out[0], stats + len, sizeof(stats) - 1 - len)) > 0) {
+        len += n;
+        if (len == sizeof(stats) - 1) {
+            // the stats come last, after the logs of every client, so only
+            // the end of the output is kept
+            memmove(stats, stats + len / 2, len - len / 2);
+            len -= len / 2;
+        }
+    }
+    stats[len] = '\0';
+    close(out[0]);
+    wait(NULL);
+    srvpid = -1;
+
+    n_requests = server_stat(stats, "requests: ");
+    n_wakeups = server_stat(stats, "wakeups: ");
+    n_rearms = server_stat(stats, "re-arms: ");
+    rearms = strstr(stats, "re-arms: ");
+    n_avoided = (rearms == NULL || strchr(rearms, '(') == NULL) ? -1 :
+        strtod(strchr(rearms, '(') + 1, NULL);
+    assert(n_requests, NUM_KEEP_ALIVE * REQS_PER_CONNECTION + NUM_PIPELINED);
+    n_pipelined = (strchr(strstr(stats, "requests: "), '(') == NULL) ? -1 :
+        strtod(strchr(strstr(stats, "requests: "), '(') + 1, NULL);
+    // some of the pipelined requests may have been read separately
+    assert(n_pipelined > 0 && n_pipelined < NUM_PIPELINED, 1);
+    // the file is only opened for the first request
+    n_cache_hits = server_stat(stats, "file cache: ");
+    assert(n_cache_hits, n_requests - 1);
+    // and sent from memory from then on
+    n_memory_hits = server_stat(stats, "responses in memory: ");
+    assert(n_memory_hits, n_requests - 1);
+
+    printf(P_GREEN "Keep-alive syscalls per request:" P_RESET "\n");
+    printf(P_YELLOW "epoll_wait:" P_RESET " %.2f\n", n_wakeups / n_requests);
+    printf(P_YELLOW "epoll_ctl:" P_RESET " %.2f (%.2f if re-armed after "
+            "every event)\n", n_rearms / n_requests,
+            (n_rearms + n_avoided) / n_requests);
+}
+
 int main(int argc, char *argv[]) {
     struct sockaddr_in server;
     // for timing
@@ -146,6 +331,11 @@ int main(int argc, char *argv[]) {
 
     printf(P_YELLOW "Total time:" P_RESET " %.3fs\n", timespec_diff(&end, &start));
 
+    if (argc == 1) {
+        // only possible to count the syscalls of a server we are running
+        keep_alive_test(&server);
+    }
+
     return 0;
 }
 
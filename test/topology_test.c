@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_assert.h"
+
+#include "../src/topology.h"
+#include "../src/vprint.h"
+
+
+/*
+ * two nodes of two L3 domains each, every L3 domain having two cores of two
+ * SMT siblings, which are numbered the way Linux usually numbers them: CPU i
+ * and CPU i + 8 are siblings
+ */
+static void make_topology(struct cpu_topology *topo) {
+    static struct cpu_info cpus[16];
+    int i, core;
+
+    for (i = 0; i < 16; i++) {
+        core = i % 8;
+        cpus[i].cpu = i;
+        cpus[i].core = core;
+        cpus[i].llc = core & ~1;
+        cpus[i].node = core / 4;
+    }
+    topo->cpus = cpus;
+    topo->n_cpus = 16;
+    topo->n_cores = 8;
+    topo->n_llcs = 4;
+    topo->n_nodes = 2;
+}
+
+
+int main(int argc, char *argv[]) {
+    struct cpu_topology topo;
+    int cpus[16], *placed, n, i;
+
+    // lists
+    assert(topo_parse_list("3", cpus, 16), 1);
+    assert(cpus[0], 3);
+    assert(topo_parse_list("0-3,8,10-11\n", cpus, 16), 7);
+    assert(cpus[0], 0);
+    assert(cpus[3], 3);
+    assert(cpus[4], 8);
+    assert(cpus[6], 11);
+    // the order given is kept
+    assert(topo_parse_list("5,1", cpus, 16), 2);
+    assert(cpus[0], 5);
+    assert(cpus[1], 1);
+
+    assert(topo_parse_list("", cpus, 16), -1);
+    assert(topo_parse_list("1,", cpus, 16), -1);
+    assert(topo_parse_list("3-1", cpus, 16), -1);
+    assert(topo_parse_list("0-x", cpus, 16), -1);
+    assert(topo_parse_list("-1", cpus, 16), -1);
+    assert(topo_parse_list("0 1", cpus, 16), -1);
+    assert(topo_parse_list("0-16", cpus, 16), -1);
+    assert(topo_parse_list("99999", cpus, 16), -1);
+
+    // placement on a made-up topology
+    make_topology(&topo);
+
+    n = topo_place(&topo, TOPO_PLACE_CPUS, NULL, &placed);
+    assert(n, 16);
+    for (i = 0; i < n; i++) {
+        assert(placed[i], i);
+    }
+    free(placed);
+
+    // the SMT siblings are left out
+    n = topo_place(&topo, TOPO_PLACE_CORES, NULL, &placed);
+    assert(n, 8);
+    for (i = 0; i < n; i++) {
+        assert(placed[i], i);
+    }
+    free(placed);
+
+    n = topo_place(&topo, TOPO_PLACE_L3, NULL, &placed);
+    assert(n, 4);
+    for (i = 0; i < n; i++) {
+        assert(placed[i], 2 * i);
+        assert(topo_node(&topo, placed[i]), i / 2);
+    }
+    free(placed);
+
+    n = topo_place(&topo, TOPO_PLACE_LIST, "12-13,4", &placed);
+    assert(n, 3);
+    assert(placed[0], 12);
+    assert(placed[1], 13);
+    assert(placed[2], 4);
+    assert(topo_node(&topo, placed[0]), 1);
+    free(placed);
+
+    // CPUs outside of the topology can not be placed on
+    assert(topo_place(&topo, TOPO_PLACE_LIST, "15-16", &placed), -1);
+    assert(topo_place(&topo, TOPO_PLACE_LIST, "0,", &placed), -1);
+    assert(topo_place(&topo, TOPO_PLACE_NONE, NULL, &placed), -1);
+    assert(topo_node(&topo, 16), -1);
+
+    // the topology of this machine
+    assert(topo_discover(&topo), 0);
+    assert(topo.n_cpus > 0, 1);
+    assert(topo.n_cores > 0 && topo.n_cores <= topo.n_cpus, 1);
+    assert(topo.n_llcs > 0 && topo.n_llcs <= topo.n_cores, 1);
+    assert(topo.n_nodes > 0 && topo.n_nodes <= topo.n_cpus, 1);
+    for (i = 0; i < topo.n_cpus; i++) {
+        assert(topo.cpus[i].core <= topo.cpus[i].cpu, 1);
+        assert(topo_node(&topo, topo.cpus[i].cpu) >= 0, 1);
+    }
+
+    n = topo_place(&topo, TOPO_PLACE_CORES, NULL, &placed);
+    assert(n, topo.n_cores);
+    free(placed);
+    n = topo_place(&topo, TOPO_PLACE_L3, NULL, &placed);
+    assert(n, topo.n_llcs);
+    free(placed);
+
+    // moving memory to the node of this thread's CPU is harmless
+    placed = (int *) malloc(1 << 16);
+    memset(placed, 0, 1 << 16);
+    assert(topo_move_local(&topo, placed, 1 << 16), 0);
+    free(placed);
+
+    topo_free(&topo);
+    topo_free(&topo);
+
+    printf(P_GREEN "All topology tests passed" P_RESET "\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_assert.h"
+
+#include "../src/twheel.h"
+#include "../src/vprint.h"
+
+
+#define N_TIMERS 4096
+
+struct timer {
+    struct tw_node node;
+    // set once the timer has been returned by tw_advance
+    int fired;
+};
+
+static struct timer timers[N_TIMERS];
+
+
+#define node_timer(node_ptr) \
+    ((struct timer *) (((char*) (node_ptr)) - offsetof(struct timer, node)))
+
+
+/*
+ * advances the wheel to now, and checks that exactly those timers which were
+ * armed and due by now have expired
+ */
+static void advance_and_check(struct twheel *wheel, uint64_t now) {
+    struct tw_node *node;
+    struct timer *t;
+    size_t i;
+
+    for (node = tw_advance(wheel, now); node != NULL; node = node->next) {
+        t = node_timer(node);
+        assert(t->fired, 0);
+        assert(node->expires <= now, 1);
+        assert(tw_armed(node), 0);
+        t->fired = 1;
+    }
+
+    for (i = 0; i < N_TIMERS; i++) {
+        if (tw_armed(&timers[i].node)) {
+            // every timer still in the wheel must not be due yet
+            assert(timers[i].node.expires > now, 1);
+        }
+    }
+}
+
+static uint64_t rand_delay() {
+    switch (rand() % 4) {
+    case 0:
+        return rand() % TW_SLOTS;
+    case 1:
+        return rand() % (TW_SLOTS * TW_SLOTS);
+    case 2:
+        return rand() % (TW_MAX_TICKS + 1);
+    default:
+        // beyond the end of the wheel
+        return TW_MAX_TICKS + (rand() % (4 * TW_SLOTS));
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    struct twheel wheel;
+    struct tw_node *node;
+    uint64_t now;
+    size_t i, n;
+
+    srand(0);
+
+    // start at an odd tick so slots do not line up with the start of a level
+    now = 1000003;
+    tw_init(&wheel, now);
+
+    for (i = 0; i < N_TIMERS; i++) {
+        tw_node_init(&timers[i].node);
+        assert(tw_armed(&timers[i].node), 0);
+    }
+
+    // a timer set in the past expires on the next advance
+    tw_arm(&wheel, &timers[0].node, now - 10);
+    assert(wheel.count, 1);
+    node = tw_advance(&wheel, now);
+    assert((long) node, (long) &timers[0].node);
+    assert((long) node->next, (long) NULL);
+    assert(wheel.count, 0);
+
+    // cancelling removes the timer, and cancelling twice is harmless
+    tw_arm(&wheel, &timers[0].node, now + 5);
+    tw_cancel(&wheel, &timers[0].node);
+    tw_cancel(&wheel, &timers[0].node);
+    assert(wheel.count, 0);
+    assert((long) tw_advance(&wheel, now + 100), (long) NULL);
+    now = wheel.now;
+
+    for (i = 0; i < N_TIMERS; i++) {
+        tw_arm(&wheel, &timers[i].node, now + rand_delay());
+    }
+    assert(wheel.count, N_TIMERS);
+
+    for (n = 0; n < 2000; n++) {
+        // randomly move around and cancel some of the timers
+        for (i = 0; i < 16; i++) {
+            struct timer *t = &timers[rand() % N_TIMERS];
+            if (!tw_armed(&t->node)) {
+                continue;
+            }
+            if (rand() % 2) {
+                tw_arm(&wheel, &t->node, now + rand_delay());
+            }
+            else {
+                tw_cancel(&wheel, &t->node);
+                t->fired = 1;
+            }
+        }
+
+        // advance by varying amounts, sometimes one tick at a time and
+        // sometimes across several levels of the wheel
+        switch (rand() % 3) {
+        case 0:
+            now += 1;
+            break;
+        case 1:
+            now += rand() % (TW_SLOTS * TW_SLOTS);
+            break;
+        default:
+            now += rand() % (TW_MAX_TICKS / 64);
+            break;
+        }
+        advance_and_check(&wheel, now);
+    }
+
+    // everything left must expire by the time the wheel has turned past the
+    // furthest timer
+    now += 2 * TW_MAX_TICKS;
+    advance_and_check(&wheel, now);
+    assert(wheel.count, 0);
+
+    for (i = 0; i < N_TIMERS; i++) {
+        assert(timers[i].fired, 1);
+    }
+
+    // clearing returns every armed timer
+    for (i = 0; i < N_TIMERS; i++) {
+        tw_arm(&wheel, &timers[i].node, now + rand_delay());
+    }
+    for (n = 0, node = tw_clear(&wheel); node != NULL; node = node->next) {
+        assert(tw_armed(node), 0);
+        n++;
+    }
+    assert(n, N_TIMERS);
+    assert(wheel.count, 0);
+
+    printf(P_GREEN "All twheel tests passed" P_RESET "\n");
+    return 0;
+}
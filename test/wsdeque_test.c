@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "t_assert.h"
+
+#include "../src/wsdeque.h"
+#include "../src/vprint.h"
+
+
+#define N_THIEVES 3
+#define N_ITEMS 40000
+
+static struct ws_deque deque;
+
+// number of times each item was taken, by the owner or a thief
+static int taken[N_ITEMS];
+// set once the owner has pushed every item
+static int done;
+
+
+#define ITEM(i) ((void *) (intptr_t) ((i) + 1))
+#define ITEM_IDX(item) ((int) (intptr_t) (item) - 1)
+
+
+/*
+ * steals items until the owner is done and the deque is empty
+ */
+static void* steal(void *arg) {
+    void *item;
+
+    while (1) {
+        item = wsd_steal(&deque);
+        if (item != NULL) {
+            __atomic_fetch_add(&taken[ITEM_IDX(item)], 1, __ATOMIC_RELAXED);
+        }
+        else if (__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+    pthread_t thieves[N_THIEVES];
+    void *item;
+    int i;
+
+    assert(wsd_init(&deque, 5), 0);
+    assert(deque.mask, 7);
+    assert(((uintptr_t) &deque.bottom) - ((uintptr_t) &deque.top) >=
+            CACHE_LINE, 1);
+
+    // empty
+    assert(wsd_pop(&deque) == NULL, 1);
+    assert(wsd_steal(&deque) == NULL, 1);
+    assert(wsd_size(&deque), 0);
+
+    // the owner pops the newest item and thieves steal the oldest, until
+    // the deque is full
+    for (i = 0; i < 8; i++) {
+        assert(wsd_push(&deque, ITEM(i)), 0);
+    }
+    assert(wsd_size(&deque), 8);
+    assert(wsd_push(&deque, ITEM(100)), -1);
+    assert(ITEM_IDX(wsd_pop(&deque)), 7);
+    assert(ITEM_IDX(wsd_steal(&deque)), 0);
+    assert(ITEM_IDX(wsd_steal(&deque)), 1);
+    assert(ITEM_IDX(wsd_pop(&deque)), 6);
+    assert(wsd_size(&deque), 4);
+
+    // the slots freed at either end are reused
+    for (i = 8; i < 12; i++) {
+        assert(wsd_push(&deque, ITEM(i)), 0);
+    }
+    assert(wsd_push(&deque, ITEM(100)), -1);
+    for (i = 2; i < 6; i++) {
+        assert(ITEM_IDX(wsd_steal(&deque)), i);
+    }
+    for (i = 11; i >= 8; i--) {
+        assert(ITEM_IDX(wsd_pop(&deque)), i);
+    }
+    assert(wsd_pop(&deque) == NULL, 1);
+    assert(wsd_steal(&deque) == NULL, 1);
+
+    // the last item goes to the owner if no thief took it
+    assert(wsd_push(&deque, ITEM(12)), 0);
+    assert(ITEM_IDX(wsd_pop(&deque)), 12);
+    assert(wsd_steal(&deque) == NULL, 1);
+    assert(wsd_size(&deque), 0);
+
+    wsd_free(&deque);
+    // freeing twice is harmless
+    wsd_free(&deque);
+
+    // with thieves stealing while the owner pushes and pops, every item is
+    // taken exactly once
+    assert(wsd_init(&deque, 64), 0);
+    for (i = 0; i < N_THIEVES; i++) {
+        assert(pthread_create(&thieves[i], NULL, steal, NULL), 0);
+    }
+    for (i = 0; i < N_ITEMS; i++) {
+        while (wsd_push(&deque, ITEM(i)) == -1) {
+            sched_yield();
+        }
+        if (i % 3 == 0 && (item = wsd_pop(&deque)) != NULL) {
+            taken[ITEM_IDX(item)]++;
+        }
+    }
+    while ((item = wsd_pop(&deque)) != NULL) {
+        taken[ITEM_IDX(item)]++;
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < N_THIEVES; i++) {
+        pthread_join(thieves[i], NULL);
+    }
+    for (i = 0; i < N_ITEMS; i++) {
+        assert(__atomic_load_n(&taken[i], __ATOMIC_RELAXED), 1);
+    }
+    assert(wsd_steal(&deque) == NULL, 1);
+    wsd_free(&deque);
+
+    printf(P_GREEN "All wsdeque tests passed" P_RESET "\n");
+    return 0;
+}
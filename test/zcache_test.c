@@ -0,0 +1,223 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "t_assert.h"
+
+#include "../src/fcache.h"
+#include "../src/zcache.h"
+#include "../src/vprint.h"
+
+
+static char root[] = "/tmp/zcache_test.XXXXXX";
+
+
+static void write_file(const char *path, const char *contents, size_t len) {
+    char fullpath[sizeof(root) + 64];
+    int fd;
+
+    sprintf(fullpath, "%s%s", root, path);
+    fd = open(fullpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1, 1);
+    assert(write(fd, contents, len), (ssize_t) len);
+    close(fd);
+}
+
+static void remove_file(const char *path) {
+    char fullpath[sizeof(root) + 64];
+
+    sprintf(fullpath, "%s%s", root, path);
+    remove(fullpath);
+}
+
+/*
+ * takes path from the file cache, opening it if it is not there
+ */
+static struct fc_file* open_file(struct fcache *cache, const char *path) {
+    struct fc_file *f = fc_lookup(cache, path, strlen(path));
+
+    if (f != NULL) {
+        return f;
+    }
+    return fc_open(cache, path, strlen(path), 0);
+}
+
+/*
+ * true if the copy z decompresses to the len bytes at expected
+ */
+static int decompresses_to(const struct zc_file *z, const char *expected,
+        size_t len) {
+    char *in = malloc(z->size), *out = malloc(len + 1);
+    z_stream zs;
+    int ret;
+
+    assert(pread(z->fd, in, z->size, 0), z->size);
+    memset(&zs, 0, sizeof(z_stream));
+    // detects gzip or zlib headers
+    assert(inflateInit2(&zs, 15 + 32), Z_OK);
+    zs.next_in = (unsigned char *) in;
+    zs.avail_in = z->size;
+    zs.next_out = (unsigned char *) out;
+    zs.avail_out = len + 1;
+    ret = inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == len &&
+        memcmp(out, expected, len) == 0;
+    inflateEnd(&zs);
+    free(in);
+    free(out);
+    return ret;
+}
+
+/*
+ * gives the compressor up to a second to compress f
+ */
+static struct zc_file* wait_compressed(struct zcache *cache,
+        struct fc_file *f, unsigned format) {
+    struct timespec ts = { 0, 10000000 };
+    struct zc_file *z;
+
+    for (int i = 0; i < 100; i++) {
+        z = zc_get(cache, f, format);
+        if (z != NULL) {
+            return z;
+        }
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+    struct fcache files;
+    struct zcache cache;
+    struct fc_file *f;
+    struct zc_file *z, *y;
+    char *text, *noise;
+    size_t text_len = 3 * ZC_CHUNK + 100;
+
+    text = malloc(text_len);
+    for (size_t i = 0; i < text_len; i++) {
+        text[i] = "<p>hello compressed world</p>\n"[i % 30];
+    }
+    noise = malloc(4096);
+    srand(1);
+    for (size_t i = 0; i < 4096; i++) {
+        noise[i] = rand();
+    }
+
+    assert(mkdtemp(root) != NULL, 1);
+    write_file("/small.html", text, 1000);
+    write_file("/tiny.html", text, 10);
+    write_file("/big.html", text, text_len);
+    write_file("/noise.html", noise, 4096);
+
+    assert(fc_init(&files, root, 64, 0), 0);
+    assert(zc_init(&cache, 64, 1 << 20, 6, 100, 8192), 0);
+    assert(((uintptr_t) cache.table.sets) % CACHE_LINE, 0);
+    assert(sizeof(struct sa_set), CACHE_LINE);
+
+    // small files are compressed right away, once for each format
+    f = open_file(&files, "/small.html");
+    z = zc_get(&cache, f, ZC_GZIP);
+    assert(z != NULL, 1);
+    assert(z->size < 1000, 1);
+    assert(decompresses_to(z, text, 1000), 1);
+    y = zc_get(&cache, f, ZC_GZIP);
+    assert(y == z, 1);
+    zc_release(y);
+    y = zc_get(&cache, f, ZC_DEFLATE);
+    assert(y != NULL && y != z, 1);
+    assert(decompresses_to(y, text, 1000), 1);
+    zc_release(y);
+    assert(cache.n_compressed, 2);
+    assert(zc_hits(&cache), 1);
+    fc_release(f);
+
+    // and stay after the file leaves the file cache, as long as it does not
+    // change
+    fc_free(&files);
+    assert(fc_init(&files, root, 64, 0), 0);
+    f = open_file(&files, "/small.html");
+    y = zc_get(&cache, f, ZC_GZIP);
+    assert(y == z, 1);
+    zc_release(y);
+    fc_release(f);
+
+    // files below the minimum size are not compressed, nor are those which
+    // don't get smaller, which are only tried once
+    f = open_file(&files, "/tiny.html");
+    assert(zc_get(&cache, f, ZC_GZIP) == NULL, 1);
+    fc_release(f);
+    f = open_file(&files, "/noise.html");
+    assert(zc_get(&cache, f, ZC_GZIP) == NULL, 1);
+    assert(zc_get(&cache, f, ZC_GZIP) == NULL, 1);
+    assert(cache.n_incompressible, 1);
+    fc_release(f);
+
+    // large files are compressed in the background, in chunks
+    f = open_file(&files, "/big.html");
+    y = wait_compressed(&cache, f, ZC_DEFLATE);
+    assert(y != NULL, 1);
+    assert(cache.n_deferred, 1);
+    assert(decompresses_to(y, text, text_len), 1);
+    zc_release(y);
+    fc_release(f);
+
+    // a new version of a file replaces the copy of the old one, which stays
+    // valid for those still holding it
+    write_file("/small.html", text + 1, 999);
+    fc_free(&files);
+    assert(fc_init(&files, root, 64, 0), 0);
+    f = open_file(&files, "/small.html");
+    y = zc_get(&cache, f, ZC_GZIP);
+    assert(y != NULL && y != z, 1);
+    assert(decompresses_to(y, text + 1, 999), 1);
+    assert(decompresses_to(z, text, 1000), 1);
+    zc_release(z);
+    zc_release(y);
+    fc_release(f);
+
+    zc_free(&cache);
+    assert(cache.table.sets == NULL, 1);
+    // freeing twice is harmless
+    zc_free(&cache);
+
+    // copies which don't fit in the budget are thrown away, and are not
+    // taken for incompressible, so they are tried again
+    assert(zc_init(&cache, 64, 16, 6, 100, 8192), 0);
+    f = open_file(&files, "/small.html");
+    assert(zc_get(&cache, f, ZC_GZIP) == NULL, 1);
+    assert(cache.n_refused, 1);
+    assert(cache.n_bytes, 0);
+    assert(zc_get(&cache, f, ZC_GZIP) == NULL, 1);
+    assert(cache.n_refused, 2);
+    assert(cache.n_incompressible, 0);
+    fc_release(f);
+    zc_free(&cache);
+
+    // the same goes for large files compressed in the background
+    assert(zc_init(&cache, 64, 16, 6, 100, 8192), 0);
+    f = open_file(&files, "/big.html");
+    assert(wait_compressed(&cache, f, ZC_DEFLATE) == NULL, 1);
+    assert(cache.n_refused > 1, 1);
+    assert(cache.n_bytes, 0);
+    fc_release(f);
+    zc_free(&cache);
+    fc_free(&files);
+
+    remove_file("/small.html");
+    remove_file("/tiny.html");
+    remove_file("/big.html");
+    remove_file("/noise.html");
+    rmdir(root);
+    free(text);
+    free(noise);
+
+    printf(P_GREEN "All zcache tests passed" P_RESET "\n");
+    return 0;
+}